@@ -28,6 +28,7 @@
 
 #include "Plugin.h"
 #include "DicomWebServers.h"
+#include "PatternMatcher.h"
 
 #include <Core/Toolbox.h>
 
@@ -85,9 +86,6 @@ namespace OrthancPlugins
   }
 
 
-  static const boost::regex MULTIPART_HEADERS_ENDING("(.*?\r\n)\r\n(.*)");
-  static const boost::regex MULTIPART_HEADERS_LINE(".*?\r\n");
-
   static void ParseMultipartHeaders(bool& hasLength /* out */,
                                     size_t& length /* out */,
                                     std::string& contentType /* out */,
@@ -98,25 +96,31 @@ namespace OrthancPlugins
     hasLength = false;
     contentType = "application/octet-stream";
 
-    // Loop over the HTTP headers of this multipart item
-    boost::cregex_token_iterator it(startHeaders, endHeaders, MULTIPART_HEADERS_LINE, 0);
-    boost::cregex_token_iterator iteratorEnd;
+    // Loop over the HTTP headers of this multipart item, each of them
+    // being terminated by "\r\n"
+    static const PatternMatcher eolMatcher("\r\n");
 
-    for (; it != iteratorEnd; ++it)
+    const char* current = startHeaders;
+    for (;;)
     {
-      const std::string line(*it);
+      const char* eol = eolMatcher.Find(current, endHeaders);
+      if (eol == NULL)
+      {
+        break;
+      }
+
+      const std::string line(current, eol);
+      current = eol + 2;
+
       size_t colon = line.find(':');
-      size_t eol = line.find('\r');
 
       if (colon != std::string::npos &&
-          eol != std::string::npos &&
-          colon < eol &&
-          eol + 2 == line.length())
+          line.find('\r') == std::string::npos)
       {
         std::string key = Orthanc::Toolbox::StripSpaces(line.substr(0, colon));
         Orthanc::Toolbox::ToLowerCase(key);
 
-        const std::string value = Orthanc::Toolbox::StripSpaces(line.substr(colon + 1, eol - colon - 1));
+        const std::string value = Orthanc::Toolbox::StripSpaces(line.substr(colon + 1));
 
         if (key == "content-length")
         {
@@ -143,46 +147,50 @@ namespace OrthancPlugins
   }
 
 
-  static const char* ParseMultipartItem(std::vector<MultipartItem>& result,
+  static const char* ParseMultipartItem(IMultipartHandler& handler,
                                         OrthancPluginContext* context,
                                         const char* start,
                                         const char* end,
-                                        const boost::regex& nextSeparator)
+                                        const PatternMatcher& nextSeparator)
   {
     // Just before "start", it is guaranteed that "--[BOUNDARY]\r\n" is present
 
-    boost::cmatch what;
-    if (!boost::regex_match(start, end, what, MULTIPART_HEADERS_ENDING, boost::match_perl))
+    static const PatternMatcher headersEnding("\r\n\r\n");
+
+    const char* endHeaders = headersEnding.Find(start, end);
+    if (endHeaders == NULL)
     {
       // Cannot find the HTTP headers of this multipart item
       throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
     }
 
-    // Some aliases for more clarity
-    assert(what[1].first == start);
-    const char* startHeaders = what[1].first;
-    const char* endHeaders = what[1].second;
-    const char* startBody = what[2].first;
+    // The headers include the "\r\n" of their last line
+    endHeaders += 2;
+    const char* startBody = endHeaders + 2;
 
     bool hasLength;
     size_t length;
     std::string contentType;
-    ParseMultipartHeaders(hasLength, length, contentType, context, startHeaders, endHeaders);
+    ParseMultipartHeaders(hasLength, length, contentType, context, start, endHeaders);
 
-    boost::cmatch separator;
+    const char* separator;
 
     if (hasLength)
     {
-      if (!boost::regex_match(startBody + length, end, separator, nextSeparator, boost::match_perl) ||
-          startBody + length != separator[1].first)
+      // Fast path: No need to scan the body of the part
+      if (length > static_cast<size_t>(end - startBody) ||
+          !nextSeparator.IsAt(startBody + length, end))
       {
         // Cannot find the separator after skipping the "Content-Length" bytes
         throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
       }
+
+      separator = startBody + length;
     }
     else
     {
-      if (!boost::regex_match(startBody, end, separator, nextSeparator, boost::match_perl))
+      separator = nextSeparator.Find(startBody, end);
+      if (separator == NULL)
       {
         // No more occurrence of the boundary separator
         throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
@@ -191,15 +199,53 @@ namespace OrthancPlugins
 
     MultipartItem item;
     item.data_ = startBody;
-    item.size_ = separator[1].first - startBody;
+    item.size_ = separator - startBody;
     item.contentType_ = contentType;
-    result.push_back(item);
 
-    return separator[1].second;  // Return the end of the separator
+    if (handler.HandlePart(item))
+    {
+      return separator + nextSeparator.GetPattern().size();  // Return the end of the separator
+    }
+    else
+    {
+      return NULL;  // Interrupted by the handler
+    }
   }
 
 
-  void ParseMultipartBody(std::vector<MultipartItem>& result,
+  namespace
+  {
+    class MultipartCollector : public IMultipartHandler
+    {
+    private:
+      std::vector<MultipartItem>&  result_;
+
+    public:
+      explicit MultipartCollector(std::vector<MultipartItem>& result) :
+        result_(result)
+      {
+      }
+
+      virtual bool HandlePart(const MultipartItem& item)
+      {
+        result_.push_back(item);
+        return true;
+      }
+    };
+  }
+
+
+  // Tells whether the boundary separator is followed by "--" or by "\r\n"
+  static bool IsSeparatorEnding(const char* position,
+                                const char* end)
+  {
+    return (position + 2 <= end &&
+            ((position[0] == '-' && position[1] == '-') ||
+             (position[0] == '\r' && position[1] == '\n')));
+  }
+
+
+  void ParseMultipartBody(IMultipartHandler& handler,
                           OrthancPluginContext* context,
                           const char* body,
                           const uint64_t bodySize,
@@ -208,41 +254,75 @@ namespace OrthancPlugins
     // Reference:
     // https://www.w3.org/Protocols/rfc1341/7_2_Multipart.html
 
-    result.clear();
+    if (body == NULL ||
+        boundary.empty())
+    {
+      return;
+    }
 
-    // Look for the first boundary separator in the body (note the "?"
-    // to request non-greedy search)
-    const boost::regex firstSeparator1("--" + boundary + "(--|\r\n).*");
-    const boost::regex firstSeparator2(".*?\r\n--" + boundary + "(--|\r\n).*");
+    const char* end = body + bodySize;
 
-    // Look for the next boundary separator in the body (note the "?"
-    // to request non-greedy search)
-    const boost::regex nextSeparator(".*?(\r\n--" + boundary + ").*");
+    // All the separators but the first one are preceded by "\r\n"
+    const PatternMatcher firstSeparator("--" + boundary);
+    const PatternMatcher nextSeparator("\r\n--" + boundary);
 
-    const char* end = body + bodySize;
+    // Look for the first boundary separator in the body, that is
+    // either at the very beginning of the body or after a preamble
+    const char* current = NULL;
 
-    boost::cmatch what;
-    if (boost::regex_match(body, end, what, firstSeparator1, boost::match_perl | boost::match_single_line) ||
-        boost::regex_match(body, end, what, firstSeparator2, boost::match_perl | boost::match_single_line))
+    if (firstSeparator.IsAt(body, end) &&
+        IsSeparatorEnding(body + firstSeparator.GetPattern().size(), end))
     {
-      const char* current = what[1].first;
-
-      while (current != NULL &&
-             current + 2 < end)
+      current = body + firstSeparator.GetPattern().size();
+    }
+    else
+    {
+      const char* position = body;
+      for (;;)
       {
-        if (current[0] != '\r' ||
-            current[1] != '\n')
+        const char* separator = nextSeparator.Find(position, end);
+        if (separator == NULL)
         {
-          // We reached a separator with a trailing "--", which
-          // means that reading the multipart body is done
           break;
         }
-        else
+
+        position = separator + nextSeparator.GetPattern().size();
+        if (IsSeparatorEnding(position, end))
         {
-          current = ParseMultipartItem(result, context, current + 2, end, nextSeparator);
+          current = position;
+          break;
         }
       }
     }
+
+    while (current != NULL &&
+           current + 2 < end)
+    {
+      if (current[0] != '\r' ||
+          current[1] != '\n')
+      {
+        // We reached a separator with a trailing "--", which
+        // means that reading the multipart body is done
+        break;
+      }
+      else
+      {
+        current = ParseMultipartItem(handler, context, current + 2, end, nextSeparator);
+      }
+    }
+  }
+
+
+  void ParseMultipartBody(std::vector<MultipartItem>& result,
+                          OrthancPluginContext* context,
+                          const char* body,
+                          const uint64_t bodySize,
+                          const std::string& boundary)
+  {
+    result.clear();
+
+    MultipartCollector collector(result);
+    ParseMultipartBody(collector, context, body, bodySize, boundary);
   }
 
 
@@ -292,6 +372,7 @@ namespace OrthancPlugins
   {
     // Assume Latin-1 encoding by default (as in the Orthanc core)
     static Orthanc::Encoding defaultEncoding_ = Orthanc::Encoding_Latin1;
+    static bool isCoreHttpCompressionEnabled_ = true;
     static OrthancConfiguration configuration_;
 
 
@@ -306,6 +387,8 @@ namespace OrthancPlugins
         defaultEncoding_ = Orthanc::StringToEncoding(s.c_str());
       }
 
+      isCoreHttpCompressionEnabled_ = global.GetBooleanValue("HttpCompressionEnabled", true);
+
       OrthancPlugins::OrthancConfiguration servers;
       configuration_.GetSection(servers, "Servers");
       OrthancPlugins::DicomWebServers::GetInstance().Load(servers.GetJson());
@@ -440,5 +523,11 @@ namespace OrthancPlugins
     {
       return defaultEncoding_;
     }
+
+
+    bool IsCoreHttpCompressionEnabled()
+    {
+      return isCoreHttpCompressionEnabled_;
+    }
   }
 }
@@ -25,6 +25,7 @@
 
 #include <orthanc/OrthancCPlugin.h>
 #include <json/value.h>
+#include <boost/noncopyable.hpp>
 
 #if (ORTHANC_PLUGINS_MINIMAL_MAJOR_NUMBER <= 0 && \
      ORTHANC_PLUGINS_MINIMAL_MINOR_NUMBER <= 9 && \
@@ -43,6 +44,19 @@ namespace OrthancPlugins
     std::string   contentType_;
   };
 
+  // Receives the parts of a multipart body as soon as they are
+  // delimited, which avoids accumulating all of them in memory
+  class IMultipartHandler : public boost::noncopyable
+  {
+  public:
+    virtual ~IMultipartHandler()
+    {
+    }
+
+    // Returns "false" to stop the parsing of the multipart body
+    virtual bool HandlePart(const MultipartItem& item) = 0;
+  };
+
   bool LookupHttpHeader(std::string& value,
                         const OrthancPluginHttpRequest* request,
                         const std::string& header);
@@ -51,6 +65,12 @@ namespace OrthancPlugins
                         std::map<std::string, std::string>& attributes,
                         const std::string& header);
 
+  void ParseMultipartBody(IMultipartHandler& handler,
+                          OrthancPluginContext* context,
+                          const char* body,
+                          const uint64_t bodySize,
+                          const std::string& boundary);
+
   void ParseMultipartBody(std::vector<MultipartItem>& result,
                           OrthancPluginContext* context,
                           const char* body,
@@ -94,5 +114,8 @@ namespace OrthancPlugins
     void LogInfo(const std::string& message);
 
     Orthanc::Encoding GetDefaultEncoding();
+
+    // Whether the Orthanc core compresses the HTTP answers by itself
+    bool IsCoreHttpCompressionEnabled();
   }
 }
@@ -23,13 +23,15 @@
 
 #include "Plugin.h"
 #include "ChunkedBuffer.h"
+#include "DictionaryTable.h"
+#include "HttpCompression.h"
+#include "Metrics.h"
 
 #include <Core/Toolbox.h>
 
 #include <gdcmDictEntry.h>
 #include <gdcmStringFilter.h>
 #include <boost/lexical_cast.hpp>
-#include <json/writer.h>
 
 namespace OrthancPlugins
 {
@@ -70,6 +72,13 @@ namespace OrthancPlugins
   {
     if (vr == gdcm::VR::INVALID)
     {
+      const DictionaryTable::Entry* cached = DictionaryTable::GetInstance().Lookup(dictionary, tag);
+      if (cached != NULL)
+      {
+        isSequence = cached->isSequence_;
+        return cached->vr_;
+      }
+
       const gdcm::DictEntry &entry = dictionary.GetDictEntry(tag);
       vr = entry.GetVR();
 
@@ -144,8 +153,32 @@ namespace OrthancPlugins
   }
 
 
+  static void StripSpacesInPlace(std::string& value)
+  {
+    // Same as "MyStripSpaces()", without allocating a new string
+    size_t last = value.length();
+    while (last > 0 &&
+           (isspace(value[last - 1]) ||
+            value[last - 1] == '\0'))
+    {
+      last--;
+    }
+
+    size_t first = 0;
+    while (first < last &&
+           (isspace(value[first]) || 
+            value[first] == '\0'))
+    {
+      first++;
+    }
+
+    value.erase(last);
+    value.erase(0, first);
+  }
+
+
   static bool ConvertDicomStringToUtf8(std::string& result,
-                                       const gdcm::Dict& dictionary,
+                                       const char* vr,
                                        const gdcm::DataElement& element,
                                        const Orthanc::Encoding sourceEncoding)
   {
@@ -155,40 +188,38 @@ namespace OrthancPlugins
       return false;
     }
 
-    bool isSequence;
-    std::string vr = GetVRName(isSequence, dictionary, element);
-
-    if (!isSequence)
+    if (vr[0] != '\0' &&
+        vr[1] != '\0' &&
+        vr[2] == '\0')
     {
-      if (vr == "FL")
-      {
-        ConvertNumberTag<gdcm::VR::FL>(result, element);
-        return true;
-      }
-      else if (vr == "FD")
-      {
-        ConvertNumberTag<gdcm::VR::FD>(result, element);
-        return true;
-      }
-      else if (vr == "SL")
-      {
-        ConvertNumberTag<gdcm::VR::SL>(result, element);
-        return true;
-      }
-      else if (vr == "SS")
+      switch ((vr[0] << 8) | vr[1])
       {
-        ConvertNumberTag<gdcm::VR::SS>(result, element);
-        return true;
-      }
-      else if (vr == "UL")
-      {
-        ConvertNumberTag<gdcm::VR::UL>(result, element);
-        return true;
-      }
-      else if (vr == "US")
-      {
-        ConvertNumberTag<gdcm::VR::US>(result, element);
-        return true;
+        case ('F' << 8) | 'L':
+          ConvertNumberTag<gdcm::VR::FL>(result, element);
+          return true;
+
+        case ('F' << 8) | 'D':
+          ConvertNumberTag<gdcm::VR::FD>(result, element);
+          return true;
+
+        case ('S' << 8) | 'L':
+          ConvertNumberTag<gdcm::VR::SL>(result, element);
+          return true;
+
+        case ('S' << 8) | 'S':
+          ConvertNumberTag<gdcm::VR::SS>(result, element);
+          return true;
+
+        case ('U' << 8) | 'L':
+          ConvertNumberTag<gdcm::VR::UL>(result, element);
+          return true;
+
+        case ('U' << 8) | 'S':
+          ConvertNumberTag<gdcm::VR::US>(result, element);
+          return true;
+
+        default:
+          break;
       }
     }
 
@@ -202,42 +233,212 @@ namespace OrthancPlugins
       result = Orthanc::Toolbox::ConvertToUtf8(tmp, sourceEncoding);
     }
 
-    result = MyStripSpaces(result);
+    StripSpacesInPlace(result);
     return true;
   }
 
 
+  static bool ConvertDicomStringToUtf8(std::string& result,
+                                       const gdcm::Dict& dictionary,
+                                       const gdcm::DataElement& element,
+                                       const Orthanc::Encoding sourceEncoding)
+  {
+    bool isSequence;
+    const char* vr = GetVRName(isSequence, dictionary, element);
+
+    // The numbers are only converted if the element is not a sequence
+    return ConvertDicomStringToUtf8(result, isSequence ? "" : vr, element, sourceEncoding);
+  }
+
+
 
-  void ParsedDicomFile::Setup(const std::string& dicom)
+  MemoryStreamBuffer::MemoryStreamBuffer(const void* data,
+                                         size_t size)
   {
-    // Prepare a memory stream over the DICOM instance
-    std::stringstream stream(dicom);
+    // The buffer is never written, as "overflow()" is not overridden
+    char* begin = const_cast<char*>(reinterpret_cast<const char*>(data));
+    setg(begin, begin, begin + size);
+  }
+
+
+  MemoryStreamBuffer::pos_type MemoryStreamBuffer::seekoff(off_type offset,
+                                                           std::ios_base::seekdir direction,
+                                                           std::ios_base::openmode which)
+  {
+    if (!(which & std::ios_base::in))
+    {
+      return pos_type(off_type(-1));
+    }
+
+    off_type position;
+
+    switch (direction)
+    {
+      case std::ios_base::beg:
+        position = offset;
+        break;
+
+      case std::ios_base::cur:
+        position = (gptr() - eback()) + offset;
+        break;
+
+      case std::ios_base::end:
+        position = (egptr() - eback()) + offset;
+        break;
+
+      default:
+        return pos_type(off_type(-1));
+    }
+
+    if (position < 0 ||
+        position > egptr() - eback())
+    {
+      return pos_type(off_type(-1));
+    }
+
+    setg(eback(), eback() + position, egptr());
+    return pos_type(position);
+  }
+
+
+  MemoryStreamBuffer::pos_type MemoryStreamBuffer::seekpos(pos_type position,
+                                                           std::ios_base::openmode which)
+  {
+    return seekoff(off_type(position), std::ios_base::beg, which);
+  }
 
-    // Parse the DICOM instance using GDCM
-    reader_.SetStream(stream);
 
-    if (!reader_.Read())
+  static void LogParsingError(size_t size)
+  {
+    if (size == 0)
+    {
+      OrthancPlugins::Configuration::LogError("GDCM cannot decode this DICOM instance");
+    }
+    else
     {
       OrthancPlugins::Configuration::LogError("GDCM cannot decode this DICOM instance of length " +
-                                              boost::lexical_cast<std::string>(dicom.size()));
+                                              boost::lexical_cast<std::string>(size));
+    }
+  }
+
+
+  void ParsedDicomFile::ReadStream(std::istream& stream,
+                                   size_t size)
+  {
+    // Parse the DICOM instance using GDCM
+    hasPixelDataOffset_ = false;
+    pixelDataOffset_ = 0;
+    reader_.reset(new gdcm::Reader);
+    reader_->SetStream(stream);
+
+    if (!reader_->Read())
+    {
+      LogParsingError(size);
       throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
     }
   }
 
 
-  ParsedDicomFile::ParsedDicomFile(const OrthancPlugins::MultipartItem& item)
+  void ParsedDicomFile::Setup(std::istream& stream,
+                              size_t size)
   {
-    // TODO Avoid this unnecessary memcpy by defining a stream over the MultipartItem
-    std::string dicom(item.data_, item.data_ + item.size_);
-    Setup(dicom);
+    Metrics::StageTimer timer(Metrics::Stage_Parse);
+    ReadStream(stream, size);
   }
 
 
-  ParsedDicomFile::ParsedDicomFile(const OrthancPlugins::MemoryBuffer& buffer)
+  void ParsedDicomFile::Setup(const void* data,
+                              size_t size)
   {
-    // TODO Avoid this unnecessary memcpy by defining a stream over the MemoryBuffer
-    std::string dicom(buffer.GetData(), buffer.GetData() + buffer.GetSize());
-    Setup(dicom);
+    // Prepare a memory stream over the DICOM instance, without copy
+    MemoryStreamBuffer buffer(data, size);
+    std::istream stream(&buffer);
+    Setup(stream, size);
+  }
+
+
+  void ParsedDicomFile::Setup(const void* data,
+                              size_t size,
+                              const gdcm::Tag& lastTag)
+  {
+    Metrics::StageTimer timer(Metrics::Stage_Parse);
+
+    MemoryStreamBuffer buffer(data, size);
+    std::istream stream(&buffer);
+
+    std::set<gdcm::Tag> skip;
+    if (lastTag == DICOM_TAG_PIXEL_DATA)
+    {
+      skip.insert(DICOM_TAG_PIXEL_DATA);
+    }
+
+    hasPixelDataOffset_ = false;
+    pixelDataOffset_ = 0;
+    reader_.reset(new gdcm::Reader);
+    reader_->SetStream(stream);
+
+    if (!reader_->ReadUpToTag(lastTag, skip))
+    {
+      LogParsingError(size);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    if (lastTag == DICOM_TAG_PIXEL_DATA &&
+        stream.good())
+    {
+      /**
+       * GDCM has stopped right after the header of some element whose
+       * tag is greater or equal to the Pixel Data, without storing
+       * it. Look for the header of the Pixel Data just before the
+       * current position, either with explicit VR (tag, VR, 2
+       * reserved bytes and length) or with implicit VR (tag and
+       * length), in little endian.
+       **/
+      static const char PIXEL_DATA[] = { '\xe0', '\x7f', '\x10', '\x00' };
+
+      const char* bytes = reinterpret_cast<const char*>(data);
+      std::streamoff position = stream.tellg();
+
+      bool found = false;
+      gdcm::VR vr = gdcm::VR::INVALID;
+
+      if (position >= 12 &&
+          static_cast<size_t>(position) <= size &&
+          memcmp(bytes + position - 12, PIXEL_DATA, 4) == 0)
+      {
+        found = true;
+        vr = gdcm::VR::GetVRType(std::string(bytes + position - 8, 2).c_str());
+      }
+      else if (position >= 8 &&
+               static_cast<size_t>(position) <= size &&
+               memcmp(bytes + position - 8, PIXEL_DATA, 4) == 0)
+      {
+        found = true;  // Implicit VR: Use the VR of the dictionary
+      }
+
+      if (found)
+      {
+        gdcm::DataElement element(DICOM_TAG_PIXEL_DATA);
+        if (vr != gdcm::VR::INVALID)
+        {
+          element.SetVR(vr);
+        }
+
+        reader_->GetFile().GetDataSet().Insert(element);
+
+        hasPixelDataOffset_ = true;
+        pixelDataOffset_ = static_cast<size_t>(position);
+      }
+      else
+      {
+        // Cannot locate the Pixel Data (e.g. with deflated or
+        // big-endian transfer syntaxes): Parse the full file, whose
+        // time is already measured by the timer above
+        stream.clear();
+        stream.seekg(0);
+        ReadStream(stream, size);
+      }
+    }
   }
 
 
@@ -341,8 +542,8 @@ namespace OrthancPlugins
 
   std::string FormatTag(const gdcm::Tag& tag)
   {
-    char tmp[16];
-    sprintf(tmp, "%04X%04X", tag.GetGroup(), tag.GetElement());
+    char tmp[9];
+    DictionaryTable::FormatDicomWebKey(tmp, tag);
     return std::string(tmp);
   }
 
@@ -350,6 +551,12 @@ namespace OrthancPlugins
   const char* GetKeyword(const gdcm::Dict& dictionary,
                          const gdcm::Tag& tag)
   {
+    const DictionaryTable::Entry* cached = DictionaryTable::GetInstance().Lookup(dictionary, tag);
+    if (cached != NULL)
+    {
+      return cached->keyword_;
+    }
+
     const gdcm::DictEntry &entry = dictionary.GetDictEntry(tag);
     const char* keyword = entry.GetKeyword();
 
@@ -368,28 +575,28 @@ namespace OrthancPlugins
 
 
 
-  static bool IsBulkData(const std::string& vr)
+  static bool IsBulkData(const char* vr)
   {
     /**
      * Full list of VR (Value Representations) that are admissible for
      * being retrieved as bulk data. We commented out some of them, as
      * they correspond to strings and not to binary data.
      **/
-    return (//vr == "FL" ||
-            //vr == "FD" ||
-            //vr == "IS" ||
-      vr == "LT" ||
-      vr == "OB" ||
-      vr == "OD" ||
-      vr == "OF" ||
-      vr == "OW" ||
-      //vr == "SL" ||
-      //vr == "SS" ||
-      //vr == "ST" ||
-      //vr == "UL" ||
-      vr == "UN" ||
-      //vr == "US" ||
-      vr == "UT");
+    return (//!strcmp(vr, "FL") ||
+            //!strcmp(vr, "FD") ||
+            //!strcmp(vr, "IS") ||
+      !strcmp(vr, "LT") ||
+      !strcmp(vr, "OB") ||
+      !strcmp(vr, "OD") ||
+      !strcmp(vr, "OF") ||
+      !strcmp(vr, "OW") ||
+      //!strcmp(vr, "SL") ||
+      //!strcmp(vr, "SS") ||
+      //!strcmp(vr, "ST") ||
+      //!strcmp(vr, "UL") ||
+      !strcmp(vr, "UN") ||
+      //!strcmp(vr, "US") ||
+      !strcmp(vr, "UT"));
   }
 
 
@@ -449,249 +656,438 @@ namespace OrthancPlugins
   
 
 
-  static void DicomToXmlInternal(pugi::xml_node& target,
-                                 const gdcm::Dict& dictionary,
+  static void AppendJsonString(std::string& target,
+                               const char* value)
+  {
+    // Same escaping as "Json::valueToQuotedString()" in JsonCpp 0.10,
+    // the UTF-8 characters being written as such
+    static const char HEX[] = "0123456789ABCDEF";
+
+    target += '"';
+
+    for (const char* c = value; *c != '\0'; c++)
+    {
+      switch (*c)
+      {
+        case '"':
+          target += "\\\"";
+          break;
+
+        case '\\':
+          target += "\\\\";
+          break;
+
+        case '\b':
+          target += "\\b";
+          break;
+
+        case '\f':
+          target += "\\f";
+          break;
+
+        case '\n':
+          target += "\\n";
+          break;
+
+        case '\r':
+          target += "\\r";
+          break;
+
+        case '\t':
+          target += "\\t";
+          break;
+
+        default:
+          if (*c > 0 && *c <= 0x1F)
+          {
+            target += "\\u00";
+            target += HEX[(*c >> 4) & 0x0f];
+            target += HEX[*c & 0x0f];
+          }
+          else
+          {
+            target += *c;
+          }
+      }
+    }
+
+    target += '"';
+  }
+
+
+  static void AppendXmlText(std::string& target,
+                            const char* value,
+                            bool isAttribute)
+  {
+    // Same escaping as "text_output_escaped()" in pugixml
+    for (const unsigned char* c = reinterpret_cast<const unsigned char*>(value); *c != '\0'; c++)
+    {
+      switch (*c)
+      {
+        case '&':
+          target += "&amp;";
+          break;
+
+        case '<':
+          target += "&lt;";
+          break;
+
+        case '>':
+          target += "&gt;";
+          break;
+
+        case '"':
+          if (isAttribute)
+          {
+            target += "&quot;";
+          }
+          else
+          {
+            target += '"';
+          }
+          break;
+
+        default:
+          if (*c < 32 &&
+              *c != '\t' &&
+              (isAttribute || (*c != '\r' && *c != '\n')))
+          {
+            target += "&#";
+            target += static_cast<char>('0' + *c / 10);
+            target += static_cast<char>('0' + *c % 10);
+            target += ';';
+          }
+          else
+          {
+            target += static_cast<char>(*c);
+          }
+      }
+    }
+  }
+
+
+  static void AppendXmlIndentation(std::string& target,
+                                   unsigned int depth)
+  {
+    target.append(2 * depth, ' ');
+  }
+
+
+  static const char* GetSerializedVRName(bool& isSequence,
+                                         const gdcm::Dict& dictionary,
+                                         const gdcm::DataElement& element,
+                                         const DictionaryTable::Entry* entry)
+  {
+    if (element.GetTag() == DICOM_TAG_RETRIEVE_URL)
+    {
+      // The VR of this attribute has changed from UT to UR.
+      isSequence = false;
+      return "UR";
+    }
+    else if (entry != NULL &&
+             element.GetVR() == gdcm::VR::INVALID)
+    {
+      isSequence = entry->isSequence_;
+      return entry->vr_;
+    }
+    else
+    {
+      return GetVRName(isSequence, dictionary, element);
+    }
+  }
+
+
+  static std::string GetBulkUri(const std::string& bulkUri,
+                                const gdcm::Tag& tag)
+  {
+    char path[16];
+    sprintf(path, "%04x%04x", tag.GetGroup(), tag.GetElement());
+    return bulkUri + std::string(path);
+  }
+
+
+  void DicomWebWriter::WriteJson(std::string& target,
                                  const gdcm::DataSet& dicom,
-                                 const Orthanc::Encoding sourceEncoding,
-                                 const std::string& bulkUri)
+                                 const std::string& bulkUri,
+                                 Orthanc::Encoding encoding)
   {
+    /**
+     * The members of a "Json::Value" object are sorted, which
+     * corresponds to the order of the tags in the dataset, as they are
+     * formatted as upper-case hexadecimal numbers with a fixed width.
+     * The members of each attribute ("BulkDataURI", "Value" and "vr")
+     * are written in the same order as by "Json::FastWriter".
+     **/
+
+    target += '{';
+
+    bool isFirst = true;
+
     for (gdcm::DataSet::ConstIterator it = dicom.Begin();
          it != dicom.End(); ++it)  // "*it" represents a "gdcm::DataElement"
     {
-      char path[16];
-      sprintf(path, "%04x%04x", it->GetTag().GetGroup(), it->GetTag().GetElement());
-
-      pugi::xml_node node = target.append_child("DicomAttribute");
-      node.append_attribute("tag").set_value(FormatTag(it->GetTag()).c_str());
+      const gdcm::Tag& tag = it->GetTag();
+      const DictionaryTable::Entry* entry = DictionaryTable::GetInstance().Lookup(dictionary_, tag);
 
       bool isSequence = false;
-      std::string vr;
-      if (it->GetTag() == DICOM_TAG_RETRIEVE_URL)
-      {
-        // The VR of this attribute has changed from UT to UR.
-        vr = "UR";
-      }
-      else
+      const char* vr = GetSerializedVRName(isSequence, dictionary_, *it, entry);
+
+      if (!isFirst)
       {
-        vr = GetVRName(isSequence, dictionary, *it);
+        target += ',';
       }
 
-      node.append_attribute("vr").set_value(vr.c_str());
+      isFirst = false;
 
-      const char* keyword = GetKeyword(dictionary, it->GetTag());
-      if (keyword != NULL)
+      char key[9];
+      if (entry == NULL)
       {
-        node.append_attribute("keyword").set_value(keyword);
+        DictionaryTable::FormatDicomWebKey(key, tag);
       }
 
+      target += '"';
+      target += (entry == NULL ? key : entry->dicomWebKey_);
+      target += "\":{";
+
       if (isSequence)
       {
+        // Deal with sequences
+        target += "\"Value\":[";
+
         gdcm::SmartPointer<gdcm::SequenceOfItems> seq = it->GetValueAsSQ();
         if (seq.GetPointer() != NULL)
         {
           for (gdcm::SequenceOfItems::SizeType i = 1; i <= seq->GetNumberOfItems(); i++)
           {
-            pugi::xml_node item = node.append_child("Item");
-            std::string number = boost::lexical_cast<std::string>(i);
-            item.append_attribute("number").set_value(number.c_str());
+            if (i != 1)
+            {
+              target += ',';
+            }
 
             std::string childUri;
             if (!bulkUri.empty())
             {
-              childUri = bulkUri + std::string(path) + "/" + number + "/";
+              std::string number = boost::lexical_cast<std::string>(i);
+              childUri = GetBulkUri(bulkUri, tag) + "/" + number + "/";
             }
 
-            DicomToXmlInternal(item, dictionary, seq->GetItem(i).GetNestedDataSet(), sourceEncoding, childUri);
+            WriteJson(target, seq->GetItem(i).GetNestedDataSet(), childUri, encoding);
           }
         }
+
+        target += "],";
       }
       else if (IsBulkData(vr))
       {
-        // Bulk data
+        // Bulk data. If it cannot be accessed, only the VR is written.
         if (!bulkUri.empty())
         {
-          pugi::xml_node value = node.append_child("BulkData");
-          std::string uri = bulkUri + std::string(path);
-          value.append_attribute("uri").set_value(uri.c_str());
+          target += "\"BulkDataURI\":";
+          AppendJsonString(target, GetBulkUri(bulkUri, tag).c_str());
+          target += ',';
         }
       }
       else
       {
         // Deal with other value representations
-        pugi::xml_node value = node.append_child("Value");
-        value.append_attribute("number").set_value("1");
+        target += "\"Value\":[";
 
-        std::string tmp;
-        if (ConvertDicomStringToUtf8(tmp, dictionary, *it, sourceEncoding)) 
+        if (ConvertDicomStringToUtf8(value_, vr, *it, encoding)) 
         {
-          value.append_child(pugi::node_pcdata).set_value(tmp.c_str());
+          // Like "Json::Value", stop at the first NUL character
+          AppendJsonString(target, value_.c_str());
         }
         else
         {
-          value.append_child(pugi::node_pcdata).set_value("");
+          target += "\"\"";
         }
-      }
-    }
-  }
 
+        target += "],";
+      }
 
-  static void DicomToXml(pugi::xml_document& target,
-                         const gdcm::Dict& dictionary,
-                         const gdcm::DataSet& dicom,
-                         const std::string& bulkUriRoot)
-  {
-    pugi::xml_node root = target.append_child("NativeDicomModel");
-    root.append_attribute("xmlns").set_value("http://dicom.nema.org/PS3.19/models/NativeDICOM");
-    root.append_attribute("xsi:schemaLocation").set_value("http://dicom.nema.org/PS3.19/models/NativeDICOM");
-    root.append_attribute("xmlns:xsi").set_value("http://www.w3.org/2001/XMLSchema-instance");
-
-    Orthanc::Encoding encoding = DetectEncoding(dicom);
-    DicomToXmlInternal(root, dictionary, dicom, encoding, bulkUriRoot);
+      target += "\"vr\":";
+      AppendJsonString(target, vr);
+      target += '}';
+    }
 
-    pugi::xml_node decl = target.prepend_child(pugi::node_declaration);
-    decl.append_attribute("version").set_value("1.0");
-    decl.append_attribute("encoding").set_value("utf-8");
+    target += '}';
   }
 
 
-  static void DicomToJsonInternal(Json::Value& target,
-                                  const gdcm::Dict& dictionary,
-                                  const gdcm::DataSet& dicom,
-                                  const std::string& bulkUri,
-                                  Orthanc::Encoding sourceEncoding)
+  void DicomWebWriter::WriteXml(std::string& target,
+                                const gdcm::DataSet& dicom,
+                                const std::string& bulkUri,
+                                Orthanc::Encoding encoding,
+                                unsigned int depth)
   {
-    target = Json::objectValue;
-
+    // Same layout as "pugi::xml_document::save()" with an indentation
+    // of two spaces and "pugi::format_default"
     for (gdcm::DataSet::ConstIterator it = dicom.Begin();
          it != dicom.End(); ++it)  // "*it" represents a "gdcm::DataElement"
     {
-      char path[16];
-      sprintf(path, "%04x%04x", it->GetTag().GetGroup(), it->GetTag().GetElement());
-
-      Json::Value node = Json::objectValue;
+      const gdcm::Tag& tag = it->GetTag();
+      const DictionaryTable::Entry* entry = DictionaryTable::GetInstance().Lookup(dictionary_, tag);
 
       bool isSequence = false;
-      std::string vr;
-      if (it->GetTag() == DICOM_TAG_RETRIEVE_URL)
+      const char* vr = GetSerializedVRName(isSequence, dictionary_, *it, entry);
+
+      AppendXmlIndentation(target, depth);
+
+      char key[9];
+      if (entry == NULL)
       {
-        // The VR of this attribute has changed from UT to UR.
-        vr = "UR";
+        DictionaryTable::FormatDicomWebKey(key, tag);
       }
-      else
+
+      target += "<DicomAttribute tag=\"";
+      target += (entry == NULL ? key : entry->dicomWebKey_);
+      target += "\" vr=\"";
+      AppendXmlText(target, vr, true);
+      target += '"';
+
+      const char* keyword = (entry == NULL ? GetKeyword(dictionary_, tag) : entry->keyword_);
+      if (keyword != NULL)
       {
-        vr = GetVRName(isSequence, dictionary, *it);
+        target += " keyword=\"";
+        AppendXmlText(target, keyword, true);
+        target += '"';
       }
 
-      node["vr"] = vr.c_str();
-
-      bool ok = true;
       if (isSequence)
       {
-        // Deal with sequences
-        node["Value"] = Json::arrayValue;
-
         gdcm::SmartPointer<gdcm::SequenceOfItems> seq = it->GetValueAsSQ();
-        if (seq.GetPointer() != NULL)
+        if (seq.GetPointer() == NULL ||
+            seq->GetNumberOfItems() == 0)
         {
-          for (gdcm::SequenceOfItems::SizeType i = 1; i <= seq->GetNumberOfItems(); i++)
+          target += " />\n";
+          continue;
+        }
+
+        target += ">\n";
+
+        for (gdcm::SequenceOfItems::SizeType i = 1; i <= seq->GetNumberOfItems(); i++)
+        {
+          std::string number = boost::lexical_cast<std::string>(i);
+
+          std::string childUri;
+          if (!bulkUri.empty())
           {
-            Json::Value child;
+            childUri = GetBulkUri(bulkUri, tag) + "/" + number + "/";
+          }
 
-            std::string childUri;
-            if (!bulkUri.empty())
-            {
-              std::string number = boost::lexical_cast<std::string>(i);
-              childUri = bulkUri + std::string(path) + "/" + number + "/";
-            }
+          const gdcm::DataSet& child = seq->GetItem(i).GetNestedDataSet();
+
+          AppendXmlIndentation(target, depth + 1);
+          target += "<Item number=\"" + number + "\"";
 
-            DicomToJsonInternal(child, dictionary, seq->GetItem(i).GetNestedDataSet(), childUri, sourceEncoding);
-            node["Value"].append(child);
+          if (child.Begin() == child.End())
+          {
+            target += " />\n";
+          }
+          else
+          {
+            target += ">\n";
+            WriteXml(target, child, childUri, encoding, depth + 2);
+            AppendXmlIndentation(target, depth + 1);
+            target += "</Item>\n";
           }
         }
-
-        ok = true;
       }
       else if (IsBulkData(vr))
       {
         // Bulk data
-        if (!bulkUri.empty())
+        if (bulkUri.empty())
         {
-          node["BulkDataURI"] = bulkUri + std::string(path);
-          ok = true;
+          target += " />\n";
+          continue;
         }
+
+        target += ">\n";
+        AppendXmlIndentation(target, depth + 1);
+        target += "<BulkData uri=\"";
+        AppendXmlText(target, GetBulkUri(bulkUri, tag).c_str(), true);
+        target += "\" />\n";
       }
       else
       {
         // Deal with other value representations
-        node["Value"] = Json::arrayValue;
+        target += ">\n";
+        AppendXmlIndentation(target, depth + 1);
+        target += "<Value number=\"1\">";
 
-        std::string value;
-        if (ConvertDicomStringToUtf8(value, dictionary, *it, sourceEncoding)) 
+        if (ConvertDicomStringToUtf8(value_, vr, *it, encoding)) 
         {
-          node["Value"].append(value.c_str());
-        }
-        else
-        {
-          node["Value"].append("");
+          // Like pugixml, stop at the first NUL character
+          AppendXmlText(target, value_.c_str(), false);
         }
 
-        ok = true;
+        target += "</Value>\n";
       }
 
-      if (ok)
-      {
-        target[FormatTag(it->GetTag())] = node;
-      }
+      AppendXmlIndentation(target, depth);
+      target += "</DicomAttribute>\n";
     }
   }
 
 
-  static void DicomToJson(Json::Value& target,
-                          const gdcm::Dict& dictionary,
-                          const gdcm::DataSet& dicom,
-                          const std::string& bulkUriRoot)
+  void DicomWebWriter::Write(std::string& target,
+                             const std::string& wadoBase,
+                             const gdcm::DataSet& dicom,
+                             bool isBulkAccessible)
   {
-    Orthanc::Encoding encoding = DetectEncoding(dicom);
-    DicomToJsonInternal(target, dictionary, dicom, bulkUriRoot, encoding);
-  }
+    Metrics::StageTimer timer(Metrics::Stage_Serialize);
 
-
-  void GenerateSingleDicomAnswer(std::string& result,
-                                 const std::string& wadoBase,
-                                 const gdcm::Dict& dictionary,
-                                 const gdcm::DataSet& dicom,
-                                 bool isXml,
-                                 bool isBulkAccessible)
-  {
     std::string bulkUriRoot;
     if (isBulkAccessible)
     {
       bulkUriRoot = GetWadoUrl(wadoBase, dicom) + "bulk/";
     }
 
-    if (isXml)
+    Orthanc::Encoding encoding = DetectEncoding(dicom);
+
+    if (isXml_)
     {
-      pugi::xml_document doc;
-      DicomToXml(doc, dictionary, dicom, bulkUriRoot);
-    
-      ChunkedBufferWriter writer;
-      doc.save(writer, "  ", pugi::format_default, pugi::encoding_utf8);
+      target += ("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+                 "<NativeDicomModel xmlns=\"http://dicom.nema.org/PS3.19/models/NativeDICOM\" "
+                 "xsi:schemaLocation=\"http://dicom.nema.org/PS3.19/models/NativeDICOM\" "
+                 "xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"");
 
-      writer.Flatten(result);
+      if (dicom.Begin() == dicom.End())
+      {
+        target += " />\n";
+      }
+      else
+      {
+        target += ">\n";
+        WriteXml(target, dicom, bulkUriRoot, encoding, 1);
+        target += "</NativeDicomModel>\n";
+      }
     }
     else
     {
-      Json::Value v;
-      DicomToJson(v, dictionary, dicom, bulkUriRoot);
-
-      Json::FastWriter writer;
-      result = writer.write(v); 
+      WriteJson(target, dicom, bulkUriRoot, encoding);
+      target += '\n';
     }
   }
 
 
+  void GenerateSingleDicomAnswer(std::string& result,
+                                 const std::string& wadoBase,
+                                 const gdcm::Dict& dictionary,
+                                 const gdcm::DataSet& dicom,
+                                 bool isXml,
+                                 bool isBulkAccessible)
+  {
+    DicomWebWriter writer(dictionary, isXml);
+
+    result.clear();
+    writer.Write(result, wadoBase, dicom, isBulkAccessible);
+  }
+
+
   void AnswerDicom(OrthancPluginContext* context,
                    OrthancPluginRestOutput* output,
+                   const OrthancPluginHttpRequest* request,
                    const std::string& wadoBase,
                    const gdcm::Dict& dictionary,
                    const gdcm::DataSet& dicom,
@@ -700,8 +1096,14 @@ namespace OrthancPlugins
   {
     std::string answer;
     GenerateSingleDicomAnswer(answer, wadoBase, dictionary, dicom, isXml, isBulkAccessible);
-    OrthancPluginAnswerBuffer(context, output, answer.c_str(), answer.size(), 
-                              isXml ? "application/dicom+xml" : "application/dicom+json");
+    if (isXml)
+    {
+      OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/dicom+xml");
+    }
+    else
+    {
+      HttpCompression::GetInstance().AnswerBuffer(context, output, request, answer, "application/dicom+json");
+    }
   }
 
 
@@ -772,7 +1174,10 @@ namespace OrthancPlugins
     else
     {
       gdcm::Tag tag;
-      dictionary.GetDictEntryByKeyword(key.c_str(), tag);
+      if (!DictionaryTable::GetInstance().LookupKeyword(tag, dictionary, key.c_str()))
+      {
+        dictionary.GetDictEntryByKeyword(key.c_str(), tag);
+      }
 
       if (tag.IsIllegal() || tag.IsPrivate())
       {
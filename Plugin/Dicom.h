@@ -32,6 +32,10 @@
 #include <pugixml.hpp>
 #include <gdcmDict.h>
 #include <list>
+#include <memory>
+#include <istream>
+#include <streambuf>
+#include <boost/noncopyable.hpp>
 
 
 namespace OrthancPlugins
@@ -54,32 +58,122 @@ namespace OrthancPlugins
   static const gdcm::Tag DICOM_TAG_COLUMNS(0x0028, 0x0011);
   static const gdcm::Tag DICOM_TAG_ROWS(0x0028, 0x0010);
   static const gdcm::Tag DICOM_TAG_BITS_ALLOCATED(0x0028, 0x0100);
+  static const gdcm::Tag DICOM_TAG_NUMBER_OF_FRAMES(0x0028, 0x0008);
+  static const gdcm::Tag DICOM_TAG_BITS_STORED(0x0028, 0x0101);
+  static const gdcm::Tag DICOM_TAG_HIGH_BIT(0x0028, 0x0102);
+  static const gdcm::Tag DICOM_TAG_PIXEL_REPRESENTATION(0x0028, 0x0103);
+  static const gdcm::Tag DICOM_TAG_PHOTOMETRIC_INTERPRETATION(0x0028, 0x0004);
+  static const gdcm::Tag DICOM_TAG_PLANAR_CONFIGURATION(0x0028, 0x0006);
+
+  // Read-only stream buffer over a memory area that is owned by the
+  // caller, which allows GDCM to parse a buffer without copying it
+  class MemoryStreamBuffer : public std::streambuf
+  {
+  protected:
+    virtual pos_type seekoff(off_type offset,
+                             std::ios_base::seekdir direction,
+                             std::ios_base::openmode which);
+
+    virtual pos_type seekpos(pos_type position,
+                             std::ios_base::openmode which);
+
+  public:
+    MemoryStreamBuffer(const void* data,
+                       size_t size);
+  };
+
 
   class ParsedDicomFile
   {
   private:
-    gdcm::Reader reader_;
+    std::auto_ptr<gdcm::Reader>  reader_;
+    bool                         hasPixelDataOffset_;
+    size_t                       pixelDataOffset_;
+
+    // Parses the full file, without measuring the time (cf. "Metrics")
+    void ReadStream(std::istream& stream,
+                    size_t size);
+
+    void Setup(std::istream& stream,
+               size_t size);
 
-    void Setup(const std::string& dicom);
+    void Setup(const void* data,
+               size_t size);
+
+    void Setup(const void* data,
+               size_t size,
+               const gdcm::Tag& lastTag);
 
   public:
-    explicit ParsedDicomFile(const OrthancPlugins::MultipartItem& item);
+    explicit ParsedDicomFile(const OrthancPlugins::MultipartItem& item)
+    {
+      Setup(item.data_, item.size_);
+    }
 
-    explicit ParsedDicomFile(const OrthancPlugins::MemoryBuffer& item);
+    explicit ParsedDicomFile(const OrthancPlugins::MemoryBuffer& buffer)
+    {
+      Setup(buffer.GetData(), buffer.GetSize());
+    }
 
     explicit ParsedDicomFile(const std::string& dicom)
     {
-      Setup(dicom);
+      Setup(dicom.empty() ? NULL : dicom.c_str(), dicom.size());
+    }
+
+    ParsedDicomFile(const void* data,
+                    size_t size)
+    {
+      Setup(data, size);
+    }
+
+    // The stream is read from its current position
+    explicit ParsedDicomFile(std::istream& stream)
+    {
+      Setup(stream, 0);
+    }
+
+    /**
+     * Partial parsing, that stops after "lastTag". If "lastTag" is
+     * the Pixel Data, the value of the pixel data is neither read nor
+     * stored: An empty Pixel Data element is inserted instead, so
+     * that its bulk data URI is still available.
+     **/
+    ParsedDicomFile(const OrthancPlugins::MultipartItem& item,
+                    const gdcm::Tag& lastTag)
+    {
+      Setup(item.data_, item.size_, lastTag);
+    }
+
+    ParsedDicomFile(const OrthancPlugins::MemoryBuffer& buffer,
+                    const gdcm::Tag& lastTag)
+    {
+      Setup(buffer.GetData(), buffer.GetSize(), lastTag);
+    }
+
+    ParsedDicomFile(const void* data,
+                    size_t size,
+                    const gdcm::Tag& lastTag)
+    {
+      Setup(data, size, lastTag);
     }
 
     const gdcm::File& GetFile() const
     {
-      return reader_.GetFile();
+      return reader_->GetFile();
     }
 
     const gdcm::DataSet& GetDataSet() const
     {
-      return reader_.GetFile().GetDataSet();
+      return reader_->GetFile().GetDataSet();
+    }
+
+    // Only available after a partial parsing up to the Pixel Data:
+    // Position in the source buffer of the value of the Pixel Data,
+    // right after the header of this element
+    bool LookupPixelDataOffset(size_t& offset) const
+    {
+      offset = pixelDataOffset_;
+      return hasPixelDataOffset_;
     }
 
     bool GetRawTag(std::string& result,
@@ -109,6 +203,52 @@ namespace OrthancPlugins
                         const gdcm::Dict& dictionary,
                         const gdcm::Tag& tag);
 
+  /**
+   * Direct serialization of DICOM datasets as DICOM+JSON or DICOM+XML,
+   * without building a "Json::Value" or a pugixml document. The output
+   * is the same as that of "Json::FastWriter" and of pugixml with its
+   * default formatting. The scratch buffer is reused from one dataset
+   * to the next, so a single writer should be used for one request.
+   **/
+  class DicomWebWriter : public boost::noncopyable
+  {
+  private:
+    const gdcm::Dict&  dictionary_;
+    bool               isXml_;
+    std::string        value_;  // Scratch buffer for the conversion of the values
+
+    void WriteJson(std::string& target,
+                   const gdcm::DataSet& dicom,
+                   const std::string& bulkUri,
+                   Orthanc::Encoding encoding);
+
+    void WriteXml(std::string& target,
+                  const gdcm::DataSet& dicom,
+                  const std::string& bulkUri,
+                  Orthanc::Encoding encoding,
+                  unsigned int depth);
+
+  public:
+    DicomWebWriter(const gdcm::Dict& dictionary,
+                   bool isXml) :
+      dictionary_(dictionary),
+      isXml_(isXml)
+    {
+    }
+
+    bool IsXml() const
+    {
+      return isXml_;
+    }
+
+    // Appends the serialization of one dataset to "target"
+    void Write(std::string& target,
+               const std::string& wadoBase,
+               const gdcm::DataSet& dicom,
+               bool isBulkAccessible);
+  };
+
+
   void GenerateSingleDicomAnswer(std::string& result,
                                  const std::string& wadoBase,
                                  const gdcm::Dict& dictionary,
@@ -118,6 +258,7 @@ namespace OrthancPlugins
 
   void AnswerDicom(OrthancPluginContext* context,
                    OrthancPluginRestOutput* output,
+                   const OrthancPluginHttpRequest* request,
                    const std::string& wadoBase,
                    const gdcm::Dict& dictionary,
                    const gdcm::DataSet& dicom,
@@ -22,6 +22,8 @@
 #include "DicomResults.h"
 
 #include "Dicom.h"
+#include "HttpCompression.h"
+#include "Metrics.h"
 
 #include <Core/Toolbox.h>
 #include <Plugins/Samples/Common/OrthancPluginCppWrapper.h>
@@ -41,9 +43,11 @@ namespace OrthancPlugins
     output_(output),
     wadoBase_(wadoBase),
     dictionary_(dictionary),
+    writer_(dictionary, isXml),
     isFirst_(true),
     isXml_(isXml),
-    isBulkAccessible_(isBulkAccessible)
+    isBulkAccessible_(isBulkAccessible),
+    recorder_(NULL)
   {
     if (isXml_ &&
         OrthancPluginStartMultipartAnswer(context_, output_, "related", "application/dicom+xml") != 0)
@@ -52,7 +56,7 @@ namespace OrthancPlugins
       throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
     }
 
-    jsonWriter_.AddChunk("[\n");
+    body_ = "[\n";
   }
 
 
@@ -60,42 +64,53 @@ namespace OrthancPlugins
   {
     if (isXml_)
     {
-      if (OrthancPluginSendMultipartItem(context_, output_, item.c_str(), item.size()) != 0)
+      if (OrthancPlugins::MeasuredSendMultipartItem(context_, output_, item.c_str(), item.size()) != 0)
       {
         OrthancPlugins::Configuration::LogError("Unable to create a multipart stream of DICOM+XML answers");
         throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
       }
+
+      if (recorder_ != NULL)
+      {
+        recorder_->push_back(item);
+      }
     }
     else
     {
       if (!isFirst_)
       {
-        jsonWriter_.AddChunk(",\n");
+        body_.append(",\n");
       }
 
-      jsonWriter_.AddChunk(item);
+      body_.append(item);
     }
 
     isFirst_ = false;
+    Metrics::SignalInstances(1);
   }
 
 
   void DicomResults::AddInternal(const gdcm::DataSet& dicom)
   {
-    std::string item;
-
     if (isXml_)
     {
-      GenerateSingleDicomAnswer(item, wadoBase_, dictionary_, dicom, true, isBulkAccessible_);
+      item_.clear();
+      writer_.Write(item_, wadoBase_, dicom, isBulkAccessible_);
+      AddInternal(item_);
     }
     else
     {
-      GenerateSingleDicomAnswer(item, wadoBase_, dictionary_, dicom, false, isBulkAccessible_);
-    }
+      // The dataset is directly serialized into the body of the answer
+      if (!isFirst_)
+      {
+        body_.append(",\n");
+      }
 
-    AddInternal(item);
+      writer_.Write(body_, wadoBase_, dicom, isBulkAccessible_);
 
-    isFirst_ = false;
+      isFirst_ = false;
+      Metrics::SignalInstances(1);
+    }
   }
 
 
@@ -408,7 +423,7 @@ namespace OrthancPlugins
   }
 
 
-  void DicomResults::Answer()
+  void DicomResults::Answer(const OrthancPluginHttpRequest* request)
   {
     if (isXml_)
     {
@@ -416,11 +431,23 @@ namespace OrthancPlugins
     }
     else
     {
-      jsonWriter_.AddChunk("]\n");
+      body_.append("]\n");
+
+      /**
+       * The plugin SDK cannot send chunked answers, so the JSON body
+       * is sent at once. It is built in place by "AddInternal()", and
+       * is not copied by the recorder, so that one single copy of the
+       * answer is kept in memory.
+       **/
+      HttpCompression::GetInstance().AnswerBuffer(context_, output_, request, body_, "application/dicom+json");
+
+      if (recorder_ != NULL)
+      {
+        recorder_->push_back(std::string());
+        recorder_->back().swap(body_);
+      }
 
-      std::string answer;
-      jsonWriter_.Flatten(answer);
-      OrthancPluginAnswerBuffer(context_, output_, answer.c_str(), answer.size(), "application/dicom+json");
+      body_.clear();
     }
   }
 }
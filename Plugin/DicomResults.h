@@ -22,12 +22,14 @@
 #pragma once
 
 #include "ChunkedBuffer.h"
+#include "Dicom.h"
 
 #include <orthanc/OrthancCPlugin.h>
 #include <gdcmDataSet.h>
 #include <gdcmDict.h>
 #include <gdcmFile.h>
 #include <json/value.h>
+#include <list>
 
 namespace OrthancPlugins
 {
@@ -38,10 +40,13 @@ namespace OrthancPlugins
     OrthancPluginRestOutput*  output_;
     std::string               wadoBase_;
     const gdcm::Dict&         dictionary_;
-    Orthanc::ChunkedBuffer    jsonWriter_;  // Used for JSON output
+    DicomWebWriter            writer_;
+    std::string               body_;  // Used for JSON output
+    std::string               item_;  // Scratch buffer for XML output
     bool                      isFirst_; 
     bool                      isXml_;
     bool                      isBulkAccessible_;
+    std::list<std::string>*   recorder_;
 
     void AddInternal(const std::string& item);
 
@@ -68,6 +73,21 @@ namespace OrthancPlugins
     void AddFromOrthanc(const Json::Value& dicom,
                         const std::string& wadoUrl);
 
-    void Answer();
+    // Add an item that was already generated by
+    // "GenerateSingleDicomAnswer()" with the same parameters
+    void AddSerialized(const std::string& item)
+    {
+      AddInternal(item);
+    }
+
+    // Keep a copy of what is sent to the HTTP client: The JSON body,
+    // or the successive parts of the multipart XML answer
+    void SetRecorder(std::list<std::string>& recorder)
+    {
+      recorder_ = &recorder;
+    }
+
+    // The request is used to negotiate the compression of JSON answers
+    void Answer(const OrthancPluginHttpRequest* request);
   };
 }
@@ -21,19 +21,36 @@
 
 #include "DicomWebClient.h"
 
+#include "Metrics.h"
 #include "Plugin.h"
 #include "DicomWebServers.h"
+#include "JobsEngine.h"
+#include "MemoryBudget.h"
+#include "ParallelPipeline.h"
 
+#include <algorithm>
 #include <json/reader.h>
 #include <list>
+#include <memory>
 #include <set>
 #include <boost/lexical_cast.hpp>
 
-#include <Core/ChunkedBuffer.h>
 #include <Core/Toolbox.h>
 
 
-static void AddInstance(std::list<std::string>& target,
+namespace
+{
+  struct StowInstance
+  {
+    std::string  id_;
+    size_t       size_;
+    std::string  sopInstanceUid_;  // Only used by the incremental mode
+    std::string  parentSeries_;
+  };
+}
+
+
+static void AddInstance(std::list<StowInstance>& target,
                         const Json::Value& instance)
 {
   if (instance.type() != Json::objectValue ||
@@ -44,7 +61,186 @@ static void AddInstance(std::list<std::string>& target,
   }
   else
   {
-    target.push_back(instance["ID"].asString());
+    StowInstance item;
+    item.id_ = instance["ID"].asString();
+
+    // The size is used to split the instances into batches
+    if (instance.isMember("FileSize") &&
+        instance["FileSize"].isIntegral())
+    {
+      item.size_ = static_cast<size_t>(instance["FileSize"].asUInt64());
+    }
+    else
+    {
+      item.size_ = 0;
+    }
+
+    if (instance.isMember("MainDicomTags") &&
+        instance["MainDicomTags"].type() == Json::objectValue &&
+        instance["MainDicomTags"].isMember("SOPInstanceUID") &&
+        instance["MainDicomTags"]["SOPInstanceUID"].type() == Json::stringValue)
+    {
+      item.sopInstanceUid_ = instance["MainDicomTags"]["SOPInstanceUID"].asString();
+    }
+
+    if (instance.isMember("ParentSeries") &&
+        instance["ParentSeries"].type() == Json::stringValue)
+    {
+      item.parentSeries_ = instance["ParentSeries"].asString();
+    }
+
+    target.push_back(item);
+  }
+}
+
+
+static void SerializeAssociativeArray(Json::Value& target,
+                                      const std::map<std::string, std::string>& source)
+{
+  target = Json::objectValue;
+
+  for (std::map<std::string, std::string>::const_iterator
+         it = source.begin(); it != source.end(); ++it)
+  {
+    target[it->first] = it->second;
+  }
+}
+
+
+// The HTTP headers of the job, adapted to the QIDO-RS requests
+static void GetQidoHeaders(std::map<std::string, std::string>& target,
+                           const std::map<std::string, std::string>& httpHeaders)
+{
+  target = httpHeaders;
+  target.erase("Content-Type");
+  target.erase("Expect");
+  target["Accept"] = "application/dicom+json";
+}
+
+
+// Number of results that are requested per page of QIDO-RS
+static const unsigned int QIDO_PAGE_SIZE = 1000;
+
+
+// In the incremental mode, maximum number of missing instances of one
+// series that are retrieved one by one. Beyond, one single request
+// for the whole series is cheaper, as the duplicates are not stored.
+static const size_t MAX_INCREMENTAL_INSTANCES = 32;
+
+
+// Lists the values of one UID in one page of the answer to a QIDO-RS
+// query to the remote server. Returns "false" if the server does not
+// support QIDO-RS, or if its answer cannot be parsed.
+static bool QueryRemoteUidsPage(std::list<std::string>& target,
+                                const std::string& server,
+                                const std::map<std::string, std::string>& headers,
+                                const std::string& uri,
+                                const std::string& tag)
+{
+  target.clear();
+
+  Json::Value answer;
+
+  try
+  {
+    OrthancPlugins::MemoryBuffer answerBody(OrthancPlugins::Configuration::GetContext());
+    std::map<std::string, std::string> answerHeaders;
+    OrthancPlugins::CallServer(answerBody, answerHeaders, server, OrthancPluginHttpMethod_Get, headers, uri, "");
+
+    if (answerBody.GetSize() == 0)
+    {
+      return true;  // No match ("204 No Content")
+    }
+
+    Json::Reader reader;
+    if (!reader.parse(reinterpret_cast<const char*>(answerBody.GetData()),
+                      reinterpret_cast<const char*>(answerBody.GetData()) + answerBody.GetSize(), answer) ||
+        answer.type() != Json::arrayValue)
+    {
+      return false;
+    }
+  }
+  catch (Orthanc::OrthancException&)
+  {
+    return false;
+  }
+
+  for (Json::Value::ArrayIndex i = 0; i < answer.size(); i++)
+  {
+    if (answer[i].type() != Json::objectValue ||
+        !answer[i].isMember(tag) ||
+        answer[i][tag].type() != Json::objectValue)
+    {
+      return false;
+    }
+
+    const Json::Value& uid = answer[i][tag]["Value"];
+
+    if (uid.type() != Json::arrayValue ||
+        uid.size() != 1 ||
+        uid[0].type() != Json::stringValue)
+    {
+      return false;
+    }
+
+    target.push_back(uid[0].asString());
+  }
+
+  return true;
+}
+
+
+// Lists the values of one UID in the full answer to a QIDO-RS query
+// to the remote server. Many servers cap the number of results of
+// QIDO-RS, so the answer is read page by page until an empty page is
+// received, whatever the size of the previous pages. Returns "false"
+// if the listing cannot be trusted to be complete.
+static bool QueryRemoteUids(std::list<std::string>& target,
+                            const std::string& server,
+                            const std::map<std::string, std::string>& httpHeaders,
+                            const std::string& path,
+                            const std::string& tag)
+{
+  target.clear();
+
+  std::map<std::string, std::string> headers;
+  GetQidoHeaders(headers, httpHeaders);
+
+  std::set<std::string> found;
+
+  for (;;)
+  {
+    std::map<std::string, std::string> arguments;
+    arguments["limit"] = boost::lexical_cast<std::string>(QIDO_PAGE_SIZE);
+    arguments["offset"] = boost::lexical_cast<std::string>(target.size());
+
+    std::string uri;
+    OrthancPlugins::UriEncode(uri, path, arguments);
+
+    std::list<std::string> page;
+    if (!QueryRemoteUidsPage(page, server, headers, uri, tag))
+    {
+      return false;
+    }
+
+    if (page.empty())
+    {
+      return true;
+    }
+
+    for (std::list<std::string>::const_iterator it = page.begin(); it != page.end(); ++it)
+    {
+      if (!found.insert(*it).second)
+      {
+        // The same resource is listed twice: The server ignores the
+        // "offset" argument, so its answer might be truncated
+        OrthancPlugins::Configuration::LogWarning("The QIDO-RS server " + server +
+                                                  " does not support paging over " + path);
+        return false;
+      }
+
+      target.push_back(*it);
+    }
   }
 }
 
@@ -94,14 +290,18 @@ static bool GetSequenceSize(size_t& result,
 
 
 
-static void ParseStowRequest(std::list<std::string>& instances /* out */,
+static void ParseStowRequest(std::list<StowInstance>& instances /* out */,
                              std::map<std::string, std::string>& httpHeaders /* out */,
                              std::map<std::string, std::string>& queryArguments /* out */,
+                             bool& isAsynchronous /* out */,
+                             bool& isIncremental /* out */,
                              const OrthancPluginHttpRequest* request /* in */)
 {
   static const char* RESOURCES = "Resources";
   static const char* HTTP_HEADERS = "HttpHeaders";
   static const char* QUERY_ARGUMENTS = "Arguments";
+  static const char* ASYNCHRONOUS = "Asynchronous";
+  static const char* INCREMENTAL = "Incremental";
 
   OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
 
@@ -121,6 +321,32 @@ static void ParseStowRequest(std::list<std::string>& instances /* out */,
   OrthancPlugins::ParseAssociativeArray(queryArguments, body, QUERY_ARGUMENTS);
   OrthancPlugins::ParseAssociativeArray(httpHeaders, body, HTTP_HEADERS);
 
+  isAsynchronous = false;
+  if (body.isMember(ASYNCHRONOUS))
+  {
+    if (body[ASYNCHRONOUS].type() != Json::booleanValue)
+    {
+      OrthancPlugins::Configuration::LogError("The field \"" + std::string(ASYNCHRONOUS) + 
+                                              "\" of a STOW-RS client request must be a Boolean");
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    isAsynchronous = body[ASYNCHRONOUS].asBool();
+  }
+
+  isIncremental = false;
+  if (body.isMember(INCREMENTAL))
+  {
+    if (body[INCREMENTAL].type() != Json::booleanValue)
+    {
+      OrthancPlugins::Configuration::LogError("The field \"" + std::string(INCREMENTAL) + 
+                                              "\" of a STOW-RS client request must be a Boolean");
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    isIncremental = body[INCREMENTAL].asBool();
+  }
+
   Json::Value& resources = body[RESOURCES];
 
   // Extract information about all the child instances
@@ -139,17 +365,16 @@ static void ParseStowRequest(std::list<std::string>& instances /* out */,
 
     // Test whether this resource is an instance
     Json::Value tmp;
-    if (OrthancPlugins::RestApiGet(tmp, context, "/instances/" + resource, false))
+    if (OrthancPlugins::MeasuredRestApiGet(tmp, context, "/instances/" + resource, false))
     {
       AddInstance(instances, tmp);
     }
-    // This was not an instance, successively try with series/studies/patients
-    else if ((OrthancPlugins::RestApiGet(tmp, context, "/series/" + resource, false) &&
-              OrthancPlugins::RestApiGet(tmp, context, "/series/" + resource + "/instances", false)) ||
-             (OrthancPlugins::RestApiGet(tmp, context, "/studies/" + resource, false) &&
-              OrthancPlugins::RestApiGet(tmp, context, "/studies/" + resource + "/instances", false)) ||
-             (OrthancPlugins::RestApiGet(tmp, context, "/patients/" + resource, false) &&
-              OrthancPlugins::RestApiGet(tmp, context, "/patients/" + resource + "/instances", false)))
+    // This was not an instance, successively try with
+    // series/studies/patients. The list of the child instances is
+    // directly requested, as it fails for resources of another level.
+    else if (OrthancPlugins::MeasuredRestApiGet(tmp, context, "/series/" + resource + "/instances", false) ||
+             OrthancPlugins::MeasuredRestApiGet(tmp, context, "/studies/" + resource + "/instances", false) ||
+             OrthancPlugins::MeasuredRestApiGet(tmp, context, "/patients/" + resource + "/instances", false))
     {
       if (tmp.type() != Json::arrayValue)
       {
@@ -169,269 +394,1276 @@ static void ParseStowRequest(std::list<std::string>& instances /* out */,
 }
 
 
-static void SendStowChunks(const Orthanc::WebServiceParameters& server,
-                           const std::map<std::string, std::string>& httpHeaders,
-                           const std::map<std::string, std::string>& queryArguments,
-                           const std::string& boundary,
-                           Orthanc::ChunkedBuffer& chunks,
-                           size_t& countInstances,
-                           bool force)
+static void CheckStowAnswer(const OrthancPlugins::MemoryBuffer& answerBody,
+                            const std::string& server,
+                            size_t countInstances)
 {
-  unsigned int maxInstances = OrthancPlugins::Configuration::GetUnsignedIntegerValue("StowMaxInstances", 10);
-  size_t maxSize = static_cast<size_t>(OrthancPlugins::Configuration::GetUnsignedIntegerValue("StowMaxSize", 10)) * 1024 * 1024;
+  Json::Value response;
+  Json::Reader reader;
+  bool success = reader.parse(reinterpret_cast<const char*>(answerBody.GetData()),
+                              reinterpret_cast<const char*>(answerBody.GetData()) + answerBody.GetSize(), response);
 
-  if ((force && countInstances > 0) ||
-      (maxInstances != 0 && countInstances >= maxInstances) ||
-      (maxSize != 0 && chunks.GetNumBytes() >= maxSize))
+  if (!success ||
+      response.type() != Json::objectValue ||
+      !response.isMember("00081199"))
   {
-    chunks.AddChunk("\r\n--" + boundary + "--\r\n");
+    OrthancPlugins::Configuration::LogError("Unable to parse STOW-RS JSON response from DICOMweb server " + server);
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+  }
 
-    std::string body;
-    chunks.Flatten(body);
+  size_t size;
+  if (!GetSequenceSize(size, response, "00081199", true, server) ||
+      size != countInstances)
+  {
+    OrthancPlugins::Configuration::LogError("The STOW-RS server was only able to receive " + 
+                                            boost::lexical_cast<std::string>(size) + " instances out of " +
+                                            boost::lexical_cast<std::string>(countInstances));
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+  }
 
-    OrthancPlugins::MemoryBuffer answerBody(OrthancPlugins::Configuration::GetContext());
-    std::map<std::string, std::string> answerHeaders;
+  if (GetSequenceSize(size, response, "00081198", false, server) &&
+      size != 0)
+  {
+    OrthancPlugins::Configuration::LogError("The response from the STOW-RS server contains " + 
+                                            boost::lexical_cast<std::string>(size) + 
+                                            " items in its Failed SOP Sequence (0008,1198) tag");
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);    
+  }
 
-    std::string uri;
-    OrthancPlugins::UriEncode(uri, "studies", queryArguments);
+  if (GetSequenceSize(size, response, "0008119A", false, server) &&
+      size != 0)
+  {
+    OrthancPlugins::Configuration::LogError("The response from the STOW-RS server contains " + 
+                                            boost::lexical_cast<std::string>(size) + 
+                                            " items in its Other Failures Sequence (0008,119A) tag");
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);    
+  }
+}
 
-    OrthancPlugins::CallServer(answerBody, answerHeaders, server, OrthancPluginHttpMethod_Post,
-                               httpHeaders, uri, body);
 
-    Json::Value response;
-    Json::Reader reader;
-    bool success = reader.parse(reinterpret_cast<const char*>((*answerBody)->data),
-                                reinterpret_cast<const char*>((*answerBody)->data) + (*answerBody)->size, response);
-    answerBody.Clear();
+// Bounds the memory that is used by the bodies of all the STOW-RS
+// client requests, whatever the number of jobs and threads. Each
+// batch accounts for its body, for the copy of the latter by the HTTP
+// client of the Orthanc core, and for the buffer of the instance that
+// is being read. The answers of the remote servers are not accounted.
+static OrthancPlugins::MemoryBudget& GetStowMemoryBudget()
+{
+  static OrthancPlugins::MemoryBudget budget(0);
+  return budget;
+}
+
+
+void SetStowClientMaxMemory(size_t maxMemory)
+{
+  GetStowMemoryBudget().SetMaxSize(maxMemory);
+}
+
 
-    if (!success ||
-        response.type() != Json::objectValue ||
-        !response.isMember("00081199"))
+namespace
+{
+  // Progress of one STOW-RS client request, shared by the threads
+  // that send its batches
+  class StowProgress : public boost::noncopyable
+  {
+  private:
+    boost::mutex  mutex_;
+    size_t        countInstances_;
+    size_t        sentInstances_;
+    size_t        skippedInstances_;
+    size_t        countBatches_;
+    size_t        sentBatches_;
+    size_t        retries_;
+    uint64_t      sentBytes_;
+    bool          isCanceled_;
+    std::set<std::string>  sent_;  // Not to be sent again if the job is resumed
+
+  public:
+    explicit StowProgress(size_t countInstances) :
+      countInstances_(countInstances),
+      sentInstances_(0),
+      skippedInstances_(0),
+      countBatches_(0),
+      sentBatches_(0),
+      retries_(0),
+      sentBytes_(0),
+      isCanceled_(false)
     {
-      OrthancPlugins::Configuration::LogError("Unable to parse STOW-RS JSON response from DICOMweb server " + server.GetUrl());
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
     }
 
-    size_t size;
-    if (!GetSequenceSize(size, response, "00081199", true, server.GetUrl()) ||
-        size != countInstances)
+    void SetCountBatches(size_t countBatches)
     {
-      OrthancPlugins::Configuration::LogError("The STOW-RS server was only able to receive " + 
-                                              boost::lexical_cast<std::string>(size) + " instances out of " +
-                                              boost::lexical_cast<std::string>(countInstances));
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+      boost::mutex::scoped_lock lock(mutex_);
+      countBatches_ = countBatches;
     }
 
-    if (GetSequenceSize(size, response, "00081198", false, server.GetUrl()) &&
-        size != 0)
+    void SignalBatchSent(const std::list<std::string>& instances,
+                         size_t countInstances,
+                         size_t countBytes)
     {
-      OrthancPlugins::Configuration::LogError("The response from the STOW-RS server contains " + 
-                                              boost::lexical_cast<std::string>(size) + 
-                                              " items in its Failed SOP Sequence (0008,1198) tag");
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);    
+      boost::mutex::scoped_lock lock(mutex_);
+      sentInstances_ += countInstances;
+      sentBatches_ ++;
+      sentBytes_ += countBytes;
+      sent_.insert(instances.begin(), instances.end());
     }
 
-    if (GetSequenceSize(size, response, "0008119A", false, server.GetUrl()) &&
-        size != 0)
+    // The instances that are already stored by the remote server
+    void SignalSkipped(const std::list<std::string>& instances)
     {
-      OrthancPlugins::Configuration::LogError("The response from the STOW-RS server contains " + 
-                                              boost::lexical_cast<std::string>(size) + 
-                                              " items in its Other Failures Sequence (0008,119A) tag");
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);    
+      boost::mutex::scoped_lock lock(mutex_);
+      skippedInstances_ += instances.size();
+      sent_.insert(instances.begin(), instances.end());
     }
 
-    countInstances = 0;
-  }
-}
+    bool IsSent(const std::string& instance)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return sent_.find(instance) != sent_.end();
+    }
 
+    uint64_t GetSentBytes()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return sentBytes_;
+    }
 
-void StowClient(OrthancPluginRestOutput* output,
-                const char* /*url*/,
-                const OrthancPluginHttpRequest* request)
-{
-  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+    void SignalRetry()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      retries_ ++;
+    }
 
-  if (request->groupsCount != 1)
-  {
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest);
-  }
+    void Cancel()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      isCanceled_ = true;
+    }
 
-  if (request->method != OrthancPluginHttpMethod_Post)
-  {
-    OrthancPluginSendMethodNotAllowed(context, output, "POST");
-    return;
-  }
+    bool IsCanceled()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return isCanceled_;
+    }
 
-  Orthanc::WebServiceParameters server(OrthancPlugins::DicomWebServers::GetInstance().GetServer(request->groups[0]));
+    void Format(Json::Value& target)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      target["CountInstances"] = static_cast<unsigned int>(countInstances_);
+      target["SentInstances"] = static_cast<unsigned int>(sentInstances_);
+      target["SkippedInstances"] = static_cast<unsigned int>(skippedInstances_);
+      target["CountBatches"] = static_cast<unsigned int>(countBatches_);
+      target["SentBatches"] = static_cast<unsigned int>(sentBatches_);
+      target["Retries"] = static_cast<unsigned int>(retries_);
+      target["SentBytes"] = boost::lexical_cast<std::string>(sentBytes_);
+      target["Canceled"] = isCanceled_;
+    }
+  };
 
-  std::string boundary;
 
+  // Parameters that are shared by all the batches of one request
+  struct StowParameters
   {
-    char* uuid = OrthancPluginGenerateUuid(context);
-    try
+    std::string                         serverName_;
+    std::map<std::string, std::string>  httpHeaders_;
+    std::string                         uri_;
+    std::string                         boundary_;
+    unsigned int                        maxRetries_;
+    bool                                isIncremental_;
+  };
+
+
+  // Upload of one batch of instances, in a worker of the pipeline.
+  // The multipart body is written directly into one contiguous
+  // buffer, and it is released once the batch is sent.
+  class StowBatchJob : public OrthancPlugins::ParallelPipeline::IJob
+  {
+  private:
+    const StowParameters&    parameters_;
+    StowProgress&            progress_;
+    std::list<std::string>   instances_;
+    size_t                   expectedSize_;
+    size_t                   largestInstance_;
+
+  public:
+    StowBatchJob(const StowParameters& parameters,
+                 StowProgress& progress) :
+      parameters_(parameters),
+      progress_(progress),
+      expectedSize_(0),
+      largestInstance_(0)
     {
-      boundary.assign(uuid);
     }
-    catch (...)
+
+    void AddInstance(const StowInstance& instance)
     {
-      OrthancPluginFreeString(context, uuid);
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory);
+      instances_.push_back(instance.id_);
+      expectedSize_ += instance.size_;
+      largestInstance_ = std::max(largestInstance_, instance.size_);
     }
 
-    OrthancPluginFreeString(context, uuid);
-  }
+    size_t GetCountInstances() const
+    {
+      return instances_.size();
+    }
 
-  std::string mime = "multipart/related; type=application/dicom; boundary=" + boundary;
+    size_t GetExpectedSize() const
+    {
+      return expectedSize_;
+    }
 
-  std::map<std::string, std::string> queryArguments;
-  std::map<std::string, std::string> httpHeaders;
-  httpHeaders["Accept"] = "application/dicom+json";
-  httpHeaders["Expect"] = "";
-  httpHeaders["Content-Type"] = mime;
+    virtual void Execute()
+    {
+      if (progress_.IsCanceled())
+      {
+        return;
+      }
 
-  std::list<std::string> instances;
-  ParseStowRequest(instances, httpHeaders, queryArguments, request);
+      OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
 
-  OrthancPlugins::Configuration::LogInfo("Sending " + boost::lexical_cast<std::string>(instances.size()) +
-                                         " instances using STOW-RS to DICOMweb server: " + server.GetUrl());
+      const size_t bodySize = expectedSize_ + instances_.size() * (parameters_.boundary_.size() + 128) + 64;
 
-  Orthanc::ChunkedBuffer chunks;
-  size_t countInstances = 0;
+      // Waits until the bodies of the other batches are released if
+      // the memory budget is exhausted. The HTTP client of the Orthanc
+      // core copies the body, hence the factor 2.
+      OrthancPlugins::MemoryBudget::Reservation reservation(GetStowMemoryBudget(),
+                                                            2 * bodySize + largestInstance_);
 
-  for (std::list<std::string>::const_iterator it = instances.begin(); it != instances.end(); ++it)
-  {
-    OrthancPlugins::MemoryBuffer dicom(context);
-    if (dicom.RestApiGet("/instances/" + *it + "/file", false))
-    {
-      chunks.AddChunk("\r\n--" + boundary + "\r\n" +
+      if (progress_.IsCanceled())
+      {
+        return;
+      }
+
+      std::string body;
+      body.reserve(bodySize);
+
+      size_t countInstances = 0;
+
+      for (std::list<std::string>::const_iterator it = instances_.begin(); it != instances_.end(); ++it)
+      {
+        OrthancPlugins::MemoryBuffer dicom(context);
+        if (OrthancPlugins::MeasuredRestApiGet(dicom, "/instances/" + *it + "/file", false))
+        {
+          body.append("\r\n--" + parameters_.boundary_ + "\r\n" +
                       "Content-Type: application/dicom\r\n" +
                       "Content-Length: " + boost::lexical_cast<std::string>(dicom.GetSize()) +
                       "\r\n\r\n");
-      chunks.AddChunk(dicom.GetData(), dicom.GetSize());
-      countInstances ++;
-
-      SendStowChunks(server, httpHeaders, queryArguments, boundary, chunks, countInstances, false);
-    }
-  }
+          body.append(dicom.GetData(), dicom.GetSize());
+          countInstances ++;
+        }
+      }
 
-  SendStowChunks(server, httpHeaders, queryArguments, boundary, chunks, countInstances, true);
+      if (countInstances == 0)
+      {
+        return;
+      }
 
-  std::string answer = "{}\n";
-  OrthancPluginAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
-}
+      body.append("\r\n--" + parameters_.boundary_ + "--\r\n");
 
+      // Only this batch is sent again if the transfer fails
+      for (unsigned int retry = 0; ; retry++)
+      {
+        if (progress_.IsCanceled())
+        {
+          return;
+        }
 
-static bool GetStringValue(std::string& target,
-                           const Json::Value& json,
-                           const std::string& key)
-{
-  if (json.type() != Json::objectValue)
-  {
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
-  }
-  else if (!json.isMember(key))
-  {
-    target.clear();
-    return false;
-  }
-  else if (json[key].type() != Json::stringValue)
-  {
-    OrthancPlugins::Configuration::LogError("The field \"" + key + "\" in a JSON object should be a string");
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
-  }
-  else
-  {
-    target = json[key].asString();
-    return true;
-  }
-}
+        try
+        {
+          OrthancPlugins::MemoryBuffer answerBody(context);
+          std::map<std::string, std::string> answerHeaders;
 
+          OrthancPlugins::CallServer(answerBody, answerHeaders, parameters_.serverName_, OrthancPluginHttpMethod_Post,
+                                     parameters_.httpHeaders_, parameters_.uri_, body);
 
-void GetFromServer(OrthancPluginRestOutput* output,
-                   const char* /*url*/,
-                   const OrthancPluginHttpRequest* request)
-{
-  static const char* URI = "Uri";
-  static const char* HTTP_HEADERS = "HttpHeaders";
-  static const char* GET_ARGUMENTS = "Arguments";
+          CheckStowAnswer(answerBody, parameters_.serverName_, countInstances);
+          progress_.SignalBatchSent(instances_, countInstances, body.size());
+          return;
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          if (retry >= parameters_.maxRetries_)
+          {
+            throw;
+          }
+
+          OrthancPlugins::Configuration::LogWarning("Retrying to send a batch of " +
+                                                    boost::lexical_cast<std::string>(countInstances) +
+                                                    " instances to DICOMweb server " + parameters_.serverName_ +
+                                                    " after error: " + std::string(e.What()));
+          progress_.SignalRetry();
+
+          boost::this_thread::sleep(boost::posix_time::seconds(retry + 1));
+        }
+      }
+    }
+  };
 
-  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
 
-  if (request->method != OrthancPluginHttpMethod_Post)
+  class StowClientJob : public OrthancPlugins::JobsEngine::IJob
   {
-    OrthancPluginSendMethodNotAllowed(context, output, "POST");
-    return;
-  }
+  private:
+    boost::mutex             mutex_;  // Protects "instances_" against "Serialize()"
+    StowParameters           parameters_;
+    std::list<StowInstance>  instances_;
+    StowProgress             progress_;
+    bool                     isBackground_;
+
+  public:
+    StowClientJob(const StowParameters& parameters,
+                  const std::list<StowInstance>& instances) :
+      parameters_(parameters),
+      instances_(instances),
+      progress_(instances.size()),
+      isBackground_(false)
+    {
+    }
 
-  Orthanc::WebServiceParameters server(OrthancPlugins::DicomWebServers::GetInstance().GetServer(request->groups[0]));
+    // To be called if the job is submitted to the jobs engine
+    void SetBackground()
+    {
+      isBackground_ = true;
+    }
 
-  std::string tmp;
-  Json::Value body;
-  Json::Reader reader;
-  if (!reader.parse(request->body, request->body + request->bodySize, body) ||
-      body.type() != Json::objectValue ||
-      !GetStringValue(tmp, body, URI))
-  {
-    OrthancPlugins::Configuration::LogError("A request to the DICOMweb client must provide a JSON object "
-                                            "with the field \"Uri\" containing the URI of interest");
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
-  }
+    virtual const char* GetType() const
+    {
+      return "DicomWebStowClient";
+    }
 
-  std::map<std::string, std::string> getArguments;
-  OrthancPlugins::ParseAssociativeArray(getArguments, body, GET_ARGUMENTS);
+    virtual std::string GetServer() const
+    {
+      return parameters_.serverName_;
+    }
+
+    virtual uint64_t GetTransferredBytes()
+    {
+      return progress_.GetSentBytes();
+    }
+
+    virtual bool Serialize(Json::Value& target)
+    {
+      target = Json::objectValue;
+      target["Server"] = parameters_.serverName_;
+      target["Uri"] = parameters_.uri_;
+      target["Boundary"] = parameters_.boundary_;
+      target["MaxRetries"] = parameters_.maxRetries_;
+      target["Incremental"] = parameters_.isIncremental_;
+      SerializeAssociativeArray(target["HttpHeaders"], parameters_.httpHeaders_);
+
+      // Only the instances that have not been sent yet. This method
+      // is called by the jobs engine from other threads than the one
+      // running "Execute()".
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Json::Value instances = Json::arrayValue;
+      for (std::list<StowInstance>::const_iterator it = instances_.begin(); it != instances_.end(); ++it)
+      {
+        if (!progress_.IsSent(it->id_))
+        {
+          Json::Value instance = Json::objectValue;
+          instance["ID"] = it->id_;
+          instance["FileSize"] = static_cast<Json::UInt64>(it->size_);
+
+          if (!it->sopInstanceUid_.empty())
+          {
+            instance["MainDicomTags"]["SOPInstanceUID"] = it->sopInstanceUid_;
+          }
+
+          if (!it->parentSeries_.empty())
+          {
+            instance["ParentSeries"] = it->parentSeries_;
+          }
+
+          instances.append(instance);
+        }
+      }
+
+      target["Instances"] = instances;
+      return true;
+    }
+
+    static StowClientJob* Unserialize(const Json::Value& source)
+    {
+      if (source.type() != Json::objectValue ||
+          !source.isMember("Server") ||
+          !source.isMember("Uri") ||
+          !source.isMember("Boundary") ||
+          !source.isMember("MaxRetries") ||
+          !source.isMember("Instances") ||
+          source["Server"].type() != Json::stringValue ||
+          source["Uri"].type() != Json::stringValue ||
+          source["Boundary"].type() != Json::stringValue ||
+          !source["MaxRetries"].isIntegral() ||
+          source["Instances"].type() != Json::arrayValue)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+
+      StowParameters parameters;
+      parameters.serverName_ = source["Server"].asString();
+      OrthancPlugins::DicomWebServers::GetInstance().GetServer(parameters.serverName_);  // Check its existence
+      parameters.uri_ = source["Uri"].asString();
+      parameters.boundary_ = source["Boundary"].asString();
+      parameters.maxRetries_ = source["MaxRetries"].asUInt();
+      parameters.isIncremental_ = (source.isMember("Incremental") &&
+                                   source["Incremental"].type() == Json::booleanValue &&
+                                   source["Incremental"].asBool());
+      OrthancPlugins::ParseAssociativeArray(parameters.httpHeaders_, source, "HttpHeaders");
+
+      std::list<StowInstance> instances;
+      for (Json::Value::ArrayIndex i = 0; i < source["Instances"].size(); i++)
+      {
+        AddInstance(instances, source["Instances"][i]);
+      }
+
+      std::auto_ptr<StowClientJob> job(new StowClientJob(parameters, instances));
+      job->SetBackground();
+      return job.release();
+    }
+
+    // Incremental mode: The instances whose SOP Instance UID is
+    // listed by the remote server are not sent. One QIDO-RS query is
+    // issued per study, and all the instances of a study are sent if
+    // this query fails.
+    void SkipRemoteInstances()
+    {
+      OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+      // The remote server is queried without the mutex, on a copy of
+      // the instances: "Execute()" is the only writer of "instances_"
+      std::list<StowInstance> candidates;
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        candidates = instances_;
+      }
+
+      typedef std::map<std::string, std::set<std::string> >  RemoteInstances;
+
+      std::map<std::string, std::string> studies;  // Orthanc ID of a series -> Its Study Instance UID
+      RemoteInstances remote;  // Study Instance UID -> SOP Instance UIDs on the remote server
+      
+      std::list<StowInstance> toSend;
+      std::list<std::string> skipped;
+
+      for (std::list<StowInstance>::const_iterator it = candidates.begin(); it != candidates.end(); ++it)
+      {
+        if (it->sopInstanceUid_.empty() ||
+            it->parentSeries_.empty())
+        {
+          toSend.push_back(*it);
+          continue;
+        }
+
+        std::map<std::string, std::string>::const_iterator study = studies.find(it->parentSeries_);
+        if (study == studies.end())
+        {
+          std::string uid;
+
+          Json::Value tmp;
+          if (OrthancPlugins::MeasuredRestApiGet(tmp, context, "/series/" + it->parentSeries_ + "/study", false) &&
+              tmp.type() == Json::objectValue &&
+              tmp.isMember("MainDicomTags") &&
+              tmp["MainDicomTags"].isMember("StudyInstanceUID") &&
+              tmp["MainDicomTags"]["StudyInstanceUID"].type() == Json::stringValue)
+          {
+            uid = tmp["MainDicomTags"]["StudyInstanceUID"].asString();
+          }
+
+          if (!uid.empty() &&
+              remote.find(uid) == remote.end())
+          {
+            std::list<std::string> uids;
+            if (!QueryRemoteUids(uids, parameters_.serverName_, parameters_.httpHeaders_,
+                                 "studies/" + uid + "/instances", "00080018"))
+            {
+              uids.clear();
+            }
+
+            remote[uid].insert(uids.begin(), uids.end());
+          }
+
+          study = studies.insert(std::make_pair(it->parentSeries_, uid)).first;
+        }
+
+        RemoteInstances::const_iterator found = remote.find(study->second);
+        if (found != remote.end() &&
+            found->second.find(it->sopInstanceUid_) != found->second.end())
+        {
+          skipped.push_back(it->id_);
+        }
+        else
+        {
+          toSend.push_back(*it);
+        }
+      }
+
+      OrthancPlugins::Configuration::LogInfo("Incremental STOW-RS client: " +
+                                             boost::lexical_cast<std::string>(skipped.size()) +
+                                             " instances are already stored by DICOMweb server " +
+                                             parameters_.serverName_);
+
+      // Both updates are seen at once by "Serialize()"
+      boost::mutex::scoped_lock lock(mutex_);
+      instances_.swap(toSend);
+      progress_.SignalSkipped(skipped);
+    }
+
+    virtual void Execute()
+    {
+      if (parameters_.isIncremental_)
+      {
+        SkipRemoteInstances();
+      }
+
+      unsigned int maxInstances = OrthancPlugins::Configuration::GetUnsignedIntegerValue("StowMaxInstances", 10);
+      size_t maxSize = static_cast<size_t>(OrthancPlugins::Configuration::GetUnsignedIntegerValue("StowMaxSize", 10)) * 1024 * 1024;
+      size_t threads = OrthancPlugins::Configuration::GetUnsignedIntegerValue("StowClientThreads", 1);
+
+      // At most "threads" batches are in memory at once
+      OrthancPlugins::ParallelPipeline pipeline(threads, threads);
+
+      std::auto_ptr<StowBatchJob> batch;
+      size_t countBatches = 0;
+
+      for (std::list<StowInstance>::const_iterator it = instances_.begin(); it != instances_.end(); ++it)
+      {
+        if (batch.get() == NULL)
+        {
+          batch.reset(new StowBatchJob(parameters_, progress_));
+        }
+
+        batch->AddInstance(*it);
+
+        if ((maxInstances != 0 && batch->GetCountInstances() >= maxInstances) ||
+            (maxSize != 0 && batch->GetExpectedSize() >= maxSize))
+        {
+          pipeline.Add(batch.release());
+          countBatches++;
+        }
+      }
+
+      if (batch.get() != NULL)
+      {
+        pipeline.Add(batch.release());
+        countBatches++;
+      }
+
+      progress_.SetCountBatches(countBatches);
+
+      for (;;)
+      {
+        std::auto_ptr<OrthancPlugins::ParallelPipeline::IJob> job(pipeline.Dequeue());
+        if (job.get() == NULL)
+        {
+          break;
+        }
+
+        if (isBackground_)
+        {
+          OrthancPlugins::JobsEngine::GetInstance().SignalProgress();
+        }
+      }
+
+      if (progress_.IsCanceled())
+      {
+        OrthancPlugins::Configuration::LogError("The STOW-RS client request to DICOMweb server " +
+                                                parameters_.serverName_ + " was canceled");
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+    }
+
+    virtual void Cancel()
+    {
+      progress_.Cancel();
+    }
+
+    virtual void FormatProgress(Json::Value& target)
+    {
+      progress_.Format(target);
+    }
+  };
+}
+
+
+void StowClient(OrthancPluginRestOutput* output,
+                const char* /*url*/,
+                const OrthancPluginHttpRequest* request)
+{
+  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+  if (request->groupsCount != 1)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest);
+  }
+
+  if (request->method != OrthancPluginHttpMethod_Post)
+  {
+    OrthancPluginSendMethodNotAllowed(context, output, "POST");
+    return;
+  }
+
+  StowParameters parameters;
+  parameters.serverName_ = request->groups[0];
+  OrthancPlugins::DicomWebServers::GetInstance().GetServer(parameters.serverName_);  // Check its existence
+  parameters.maxRetries_ = OrthancPlugins::Configuration::GetUnsignedIntegerValue("StowClientRetries", 0);
+  parameters.isIncremental_ = false;
+
+  {
+    char* uuid = OrthancPluginGenerateUuid(context);
+    try
+    {
+      parameters.boundary_.assign(uuid);
+    }
+    catch (...)
+    {
+      OrthancPluginFreeString(context, uuid);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory);
+    }
+
+    OrthancPluginFreeString(context, uuid);
+  }
+
+  std::string mime = "multipart/related; type=application/dicom; boundary=" + parameters.boundary_;
+
+  std::map<std::string, std::string> queryArguments;
+  parameters.httpHeaders_["Accept"] = "application/dicom+json";
+  parameters.httpHeaders_["Expect"] = "";
+  parameters.httpHeaders_["Content-Type"] = mime;
+
+  bool isAsynchronous;
+  std::list<StowInstance> instances;
+  ParseStowRequest(instances, parameters.httpHeaders_, queryArguments,
+                   isAsynchronous, parameters.isIncremental_, request);
+
+  OrthancPlugins::UriEncode(parameters.uri_, "studies", queryArguments);
+
+  OrthancPlugins::Configuration::LogInfo("Sending " + boost::lexical_cast<std::string>(instances.size()) +
+                                         " instances using STOW-RS to DICOMweb server: " + parameters.serverName_);
+
+  std::auto_ptr<StowClientJob> job(new StowClientJob(parameters, instances));
+
+  std::string answer;
+
+  if (isAsynchronous)
+  {
+    job->SetBackground();
+    std::string id = OrthancPlugins::JobsEngine::GetInstance().Submit(job.release());
+
+    Json::Value result = Json::objectValue;
+    result["ID"] = id;
+    result["Path"] = OrthancPlugins::Configuration::GetRoot() + "jobs/" + id;
+    answer = result.toStyledString();
+  }
+  else
+  {
+    job->Execute();
+    answer = "{}\n";
+  }
+
+  OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+}
+
+
+static bool GetStringValue(std::string& target,
+                           const Json::Value& json,
+                           const std::string& key)
+{
+  if (json.type() != Json::objectValue)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+  }
+  else if (!json.isMember(key))
+  {
+    target.clear();
+    return false;
+  }
+  else if (json[key].type() != Json::stringValue)
+  {
+    OrthancPlugins::Configuration::LogError("The field \"" + key + "\" in a JSON object should be a string");
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+  }
+  else
+  {
+    target = json[key].asString();
+    return true;
+  }
+}
+
+
+void GetFromServer(OrthancPluginRestOutput* output,
+                   const char* /*url*/,
+                   const OrthancPluginHttpRequest* request)
+{
+  static const char* URI = "Uri";
+  static const char* HTTP_HEADERS = "HttpHeaders";
+  static const char* GET_ARGUMENTS = "Arguments";
+
+  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+  if (request->method != OrthancPluginHttpMethod_Post)
+  {
+    OrthancPluginSendMethodNotAllowed(context, output, "POST");
+    return;
+  }
+
+  const std::string server(request->groups[0]);
+  OrthancPlugins::DicomWebServers::GetInstance().GetServer(server);  // Check its existence
+
+  std::string tmp;
+  Json::Value body;
+  Json::Reader reader;
+  if (!reader.parse(request->body, request->body + request->bodySize, body) ||
+      body.type() != Json::objectValue ||
+      !GetStringValue(tmp, body, URI))
+  {
+    OrthancPlugins::Configuration::LogError("A request to the DICOMweb client must provide a JSON object "
+                                            "with the field \"Uri\" containing the URI of interest");
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+  }
+
+  std::map<std::string, std::string> getArguments;
+  OrthancPlugins::ParseAssociativeArray(getArguments, body, GET_ARGUMENTS);
+
+  std::string uri;
+  OrthancPlugins::UriEncode(uri, tmp, getArguments);
+
+  std::map<std::string, std::string> httpHeaders;
+  OrthancPlugins::ParseAssociativeArray(httpHeaders, body, HTTP_HEADERS);
+
+  OrthancPlugins::MemoryBuffer answerBody(context);
+  std::map<std::string, std::string> answerHeaders;
+  OrthancPlugins::CallServer(answerBody, answerHeaders, server, OrthancPluginHttpMethod_Get, httpHeaders, uri, "");
+
+  std::string contentType = "application/octet-stream";
+
+  for (std::map<std::string, std::string>::const_iterator
+         it = answerHeaders.begin(); it != answerHeaders.end(); ++it)
+  {
+    std::string key = it->first;
+    Orthanc::Toolbox::ToLowerCase(key);
+
+    if (key == "content-type")
+    {
+      contentType = it->second;
+    }
+    else if (key == "transfer-encoding")
+    {
+      // Do not forward this header
+    }
+    else
+    {
+      OrthancPluginSetHttpHeader(context, output, it->first.c_str(), it->second.c_str());
+    }
+  }
+
+  OrthancPlugins::MeasuredAnswerBuffer(context, output, 
+                            reinterpret_cast<const char*>(answerBody.GetData()),
+                            answerBody.GetSize(), contentType.c_str());
+}
+
+
+
+namespace
+{
+  // Progress of one WADO-RS Retrieve client request, shared by the
+  // threads that download its series
+  class RetrieveProgress : public boost::noncopyable
+  {
+  private:
+    boost::mutex           mutex_;
+    size_t                 countResources_;
+    size_t                 retrievedResources_;
+    std::set<std::string>  instances_;  // Orthanc identifiers of the stored instances
+    size_t                 skippedInstances_;
+    uint64_t               receivedBytes_;
+    bool                   isCanceled_;
+
+  public:
+    explicit RetrieveProgress(size_t countResources) :
+      countResources_(countResources),
+      retrievedResources_(0),
+      skippedInstances_(0),
+      receivedBytes_(0),
+      isCanceled_(false)
+    {
+    }
+
+    void SignalInstance(const std::string& instance)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      instances_.insert(instance);
+    }
+
+    // The instances that are already stored by Orthanc
+    void SignalSkipped(size_t countInstances)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      skippedInstances_ += countInstances;
+    }
+
+    void SignalReceived(size_t countBytes)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      receivedBytes_ += countBytes;
+    }
+
+    void SignalResourceRetrieved()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      retrievedResources_ ++;
+    }
+
+    size_t GetRetrievedResources()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return retrievedResources_;
+    }
+
+    uint64_t GetReceivedBytes()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return receivedBytes_;
+    }
+
+    void GetInstances(std::set<std::string>& target)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      target = instances_;
+    }
+
+    void Cancel()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      isCanceled_ = true;
+    }
+
+    bool IsCanceled()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return isCanceled_;
+    }
+
+    void Format(Json::Value& target)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      target["CountResources"] = static_cast<unsigned int>(countResources_);
+      target["RetrievedResources"] = static_cast<unsigned int>(retrievedResources_);
+      target["RetrievedInstances"] = static_cast<unsigned int>(instances_.size());
+      target["SkippedInstances"] = static_cast<unsigned int>(skippedInstances_);
+      target["ReceivedBytes"] = boost::lexical_cast<std::string>(receivedBytes_);
+      target["Canceled"] = isCanceled_;
+    }
+  };
+
+
+  // Stores the instances of a WADO-RS answer as soon as they are
+  // delimited in the multipart body
+  class RetrieveHandler : public OrthancPlugins::IMultipartHandler
+  {
+  private:
+    OrthancPluginContext*  context_;
+    RetrieveProgress&      progress_;
+    size_t                 count_;
+
+  public:
+    RetrieveHandler(OrthancPluginContext* context,
+                    RetrieveProgress& progress) :
+      context_(context),
+      progress_(progress),
+      count_(0)
+    {
+    }
+
+    virtual bool HandlePart(const OrthancPlugins::MultipartItem& part)
+    {
+      if (part.contentType_ != "application/dicom")
+      {
+        OrthancPlugins::Configuration::LogError("The remote WADO-RS server has provided a non-DICOM file in its multipart answer");
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);      
+      }
+
+      OrthancPlugins::MemoryBuffer tmp(context_);
+      OrthancPlugins::MeasuredRestApiPost(tmp, "/instances", part.data_, part.size_, false);
+
+      Json::Value result;
+      tmp.ToJson(result);
+
+      if (result.type() != Json::objectValue ||
+          !result.isMember("ID") ||
+          result["ID"].type() != Json::stringValue)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);      
+      }
+      else
+      {
+        progress_.SignalInstance(result["ID"].asString());
+        count_++;
+
+        // Stop parsing the answer if the job is canceled
+        return !progress_.IsCanceled();
+      }
+    }
+
+    size_t GetCount() const
+    {
+      return count_;
+    }
+  };
+}
+
+
+static void RetrieveFromUri(RetrieveProgress& progress,
+                            const std::string& server,
+                            const std::map<std::string, std::string>& httpHeaders,
+                            const std::map<std::string, std::string>& getArguments,
+                            const std::string& tmpUri)
+{
+  static const std::string MULTIPART_RELATED = "multipart/related";
+  static const std::string APPLICATION_DICOM = "application/dicom";
+
+  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+  std::string uri;
+  OrthancPlugins::UriEncode(uri, tmpUri, getArguments);
+
+  OrthancPlugins::MemoryBuffer answerBody(context);
+  std::map<std::string, std::string> answerHeaders;
+  OrthancPlugins::CallServer(answerBody, answerHeaders, server, OrthancPluginHttpMethod_Get, httpHeaders, uri, "");
+  progress.SignalReceived(answerBody.GetSize());
+
+  std::vector<std::string> contentType;
+  for (std::map<std::string, std::string>::const_iterator 
+         it = answerHeaders.begin(); it != answerHeaders.end(); ++it)
+  {
+    std::string s = Orthanc::Toolbox::StripSpaces(it->first);
+    Orthanc::Toolbox::ToLowerCase(s);
+    if (s == "content-type")
+    {
+      Orthanc::Toolbox::TokenizeString(contentType, it->second, ';');
+      break;
+    }
+  }
+
+  if (contentType.empty())
+  {
+    OrthancPlugins::Configuration::LogError("No Content-Type provided by the remote WADO-RS server");
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+  }
+
+  Orthanc::Toolbox::ToLowerCase(contentType[0]);
+  if (Orthanc::Toolbox::StripSpaces(contentType[0]) != MULTIPART_RELATED)
+  {
+    OrthancPlugins::Configuration::LogError("The remote WADO-RS server answers with a \"" + contentType[0] +
+                                            "\" Content-Type, but \"" + MULTIPART_RELATED + "\" is expected");
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+  }
+
+  std::string type, boundary;
+  for (size_t i = 1; i < contentType.size(); i++)
+  {
+    std::vector<std::string> tokens;
+    Orthanc::Toolbox::TokenizeString(tokens, contentType[i], '=');
+
+    if (tokens.size() == 2)
+    {
+      std::string s = Orthanc::Toolbox::StripSpaces(tokens[0]);
+      Orthanc::Toolbox::ToLowerCase(s);
+
+      if (s == "type")
+      {
+        type = Orthanc::Toolbox::StripSpaces(tokens[1]);
+
+        // This covers the case where the content-type is quoted,
+        // which COULD be the case 
+        // cf. https://tools.ietf.org/html/rfc7231#section-3.1.1.1
+        size_t len = type.length();
+        if (len >= 2 &&
+            type[0] == '"' &&
+            type[len - 1] == '"')
+        {
+          type = type.substr(1, len - 2);
+        }
+        
+        Orthanc::Toolbox::ToLowerCase(type);
+      }
+      else if (s == "boundary")
+      {
+        boundary = Orthanc::Toolbox::StripSpaces(tokens[1]);
+      }
+    }
+  }
+
+  if (type != APPLICATION_DICOM)
+  {
+    OrthancPlugins::Configuration::LogError("The remote WADO-RS server answers with a \"" + type +
+                                            "\" multipart Content-Type, but \"" + APPLICATION_DICOM + "\" is expected");
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+  }
+
+  if (boundary.empty())
+  {
+    OrthancPlugins::Configuration::LogError("The remote WADO-RS server does not provide a boundary for its multipart answer");
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+  }
+
+  RetrieveHandler handler(context, progress);
+  OrthancPlugins::ParseMultipartBody(handler, context, 
+                                     reinterpret_cast<const char*>(answerBody.GetData()),
+                                     answerBody.GetSize(), boundary);
+
+  OrthancPlugins::Configuration::LogInfo("The remote WADO-RS server has provided " +
+                                         boost::lexical_cast<std::string>(handler.GetCount()) + 
+                                         " DICOM instances");
+}
+
+
+// Reads the "Number of Study Related Series" of one study on the
+// remote server, if the server reports it
+static bool GetRemoteCountSeries(size_t& target,
+                                 const std::string& server,
+                                 const std::map<std::string, std::string>& httpHeaders,
+                                 const std::string& study)
+{
+  std::map<std::string, std::string> headers;
+  GetQidoHeaders(headers, httpHeaders);
+
+  std::map<std::string, std::string> arguments;
+  arguments["StudyInstanceUID"] = study;
+  arguments["includefield"] = "00201206";
+
+  std::string uri;
+  OrthancPlugins::UriEncode(uri, "studies", arguments);
+
+  Json::Value answer;
+
+  try
+  {
+    OrthancPlugins::MemoryBuffer answerBody(OrthancPlugins::Configuration::GetContext());
+    std::map<std::string, std::string> answerHeaders;
+    OrthancPlugins::CallServer(answerBody, answerHeaders, server, OrthancPluginHttpMethod_Get, headers, uri, "");
+
+    Json::Reader reader;
+    if (answerBody.GetSize() == 0 ||
+        !reader.parse(reinterpret_cast<const char*>(answerBody.GetData()),
+                      reinterpret_cast<const char*>(answerBody.GetData()) + answerBody.GetSize(), answer))
+    {
+      return false;
+    }
+  }
+  catch (Orthanc::OrthancException&)
+  {
+    return false;
+  }
+
+  if (answer.type() != Json::arrayValue ||
+      answer.size() != 1 ||
+      answer[0].type() != Json::objectValue ||
+      !answer[0].isMember("00201206") ||
+      answer[0]["00201206"].type() != Json::objectValue)
+  {
+    return false;
+  }
+
+  // This is an "IS" value, which some servers encode as a string
+  const Json::Value& value = answer[0]["00201206"]["Value"];
+  if (value.type() != Json::arrayValue ||
+      value.size() != 1)
+  {
+    return false;
+  }
+  else if (value[0].isUInt())
+  {
+    target = value[0].asUInt();
+    return true;
+  }
+  else if (value[0].type() == Json::stringValue)
+  {
+    try
+    {
+      target = boost::lexical_cast<size_t>(Orthanc::Toolbox::StripSpaces(value[0].asString()));
+      return true;
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      return false;
+    }
+  }
+  else
+  {
+    return false;
+  }
+}
 
-  std::string uri;
-  OrthancPlugins::UriEncode(uri, tmp, getArguments);
 
-  std::map<std::string, std::string> httpHeaders;
-  OrthancPlugins::ParseAssociativeArray(httpHeaders, body, HTTP_HEADERS);
+// Lists the series of one study on the remote server, using QIDO-RS.
+// Returns "false" if the list might be incomplete, in which case the
+// whole study must be retrieved at once.
+static bool LookupRemoteSeries(std::list<std::string>& target,
+                               const std::string& server,
+                               const std::map<std::string, std::string>& httpHeaders,
+                               const std::string& study)
+{
+  if (!QueryRemoteUids(target, server, httpHeaders, "studies/" + study + "/series", "0020000E") ||
+      target.empty())
+  {
+    return false;
+  }
 
-  OrthancPlugins::MemoryBuffer answerBody(context);
-  std::map<std::string, std::string> answerHeaders;
-  OrthancPlugins::CallServer(answerBody, answerHeaders, server, OrthancPluginHttpMethod_Get, httpHeaders, uri, "");
+  // Cross-check the paged listing against the number of series that
+  // the server reports for the study
+  size_t expected;
+  if (GetRemoteCountSeries(expected, server, httpHeaders, study) &&
+      expected != target.size())
+  {
+    OrthancPlugins::Configuration::LogWarning("The QIDO-RS server " + server + " lists " +
+                                              boost::lexical_cast<std::string>(target.size()) + " series in study " +
+                                              study + " instead of " + boost::lexical_cast<std::string>(expected) +
+                                              ", retrieving the whole study");
+    return false;
+  }
 
-  std::string contentType = "application/octet-stream";
+  return true;
+}
 
-  for (std::map<std::string, std::string>::const_iterator
-         it = answerHeaders.begin(); it != answerHeaders.end(); ++it)
+
+// Tests whether Orthanc already stores an instance, given its SOP Instance UID
+static bool IsLocalInstance(const std::string& sopInstanceUid)
+{
+  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+  char* id = OrthancPluginLookupInstance(context, sopInstanceUid.c_str());
+  if (id == NULL)
   {
-    std::string key = it->first;
-    Orthanc::Toolbox::ToLowerCase(key);
+    return false;
+  }
+  else
+  {
+    OrthancPluginFreeString(context, id);
+    return true;
+  }
+}
 
-    if (key == "content-type")
+
+// Incremental mode: Only retrieves the instances of one series that
+// are not stored by Orthanc yet, as listed by QIDO-RS
+static void RetrieveMissingInstances(RetrieveProgress& progress,
+                                     const std::string& server,
+                                     const std::map<std::string, std::string>& httpHeaders,
+                                     const std::map<std::string, std::string>& getArguments,
+                                     const std::string& study,
+                                     const std::string& series)
+{
+  const std::string uri = "studies/" + study + "/series/" + series;
+
+  std::list<std::string> remote;
+  if (!QueryRemoteUids(remote, server, httpHeaders, uri + "/instances", "00080018"))
+  {
+    // The remote server does not support QIDO-RS: Retrieve the whole series
+    RetrieveFromUri(progress, server, httpHeaders, getArguments, uri);
+    return;
+  }
+
+  std::list<std::string> missing;
+  for (std::list<std::string>::const_iterator it = remote.begin(); it != remote.end(); ++it)
+  {
+    if (!IsLocalInstance(*it))
     {
-      contentType = it->second;
+      missing.push_back(*it);
     }
-    else if (key == "transfer-encoding")
+  }
+
+  if (missing.size() == remote.size() ||
+      missing.size() > MAX_INCREMENTAL_INSTANCES)
+  {
+    // Nothing is stored yet, or too many instances are missing: One
+    // single request for the whole series
+    RetrieveFromUri(progress, server, httpHeaders, getArguments, uri);
+  }
+  else
+  {
+    progress.SignalSkipped(remote.size() - missing.size());
+
+    for (std::list<std::string>::const_iterator it = missing.begin(); it != missing.end(); ++it)
     {
-      // Do not forward this header
+      if (progress.IsCanceled())
+      {
+        // Interrupted: The series is not fully retrieved
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+
+      RetrieveFromUri(progress, server, httpHeaders, getArguments, uri + "/instances/" + *it);
     }
-    else
+  }
+}
+
+
+namespace
+{
+  // Retrieval of one series of a study, in a worker of the pipeline
+  class RetrieveSeriesJob : public OrthancPlugins::ParallelPipeline::IJob
+  {
+  private:
+    RetrieveProgress&                          progress_;
+    const std::string&                         server_;
+    const std::map<std::string, std::string>&  httpHeaders_;
+    const std::map<std::string, std::string>&  getArguments_;
+    std::string                                study_;
+    std::string                                series_;
+    bool                                       isIncremental_;
+
+  public:
+    RetrieveSeriesJob(RetrieveProgress& progress,
+                      const std::string& server,
+                      const std::map<std::string, std::string>& httpHeaders,
+                      const std::map<std::string, std::string>& getArguments,
+                      const std::string& study,
+                      const std::string& series,
+                      bool isIncremental) :
+      progress_(progress),
+      server_(server),
+      httpHeaders_(httpHeaders),
+      getArguments_(getArguments),
+      study_(study),
+      series_(series),
+      isIncremental_(isIncremental)
     {
-      OrthancPluginSetHttpHeader(context, output, it->first.c_str(), it->second.c_str());
     }
-  }
 
-  OrthancPluginAnswerBuffer(context, output, 
-                            reinterpret_cast<const char*>(answerBody.GetData()),
-                            answerBody.GetSize(), contentType.c_str());
-}
+    virtual void Execute()
+    {
+      if (progress_.IsCanceled())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+      else if (isIncremental_)
+      {
+        RetrieveMissingInstances(progress_, server_, httpHeaders_, getArguments_, study_, series_);
+      }
+      else
+      {
+        RetrieveFromUri(progress_, server_, httpHeaders_, getArguments_,
+                        "studies/" + study_ + "/series/" + series_);
+      }
 
+      // The parsing of the answer stops silently on cancellation: The
+      // series might only be partially retrieved
+      if (progress_.IsCanceled())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+    }
+  };
+}
 
 
-static void RetrieveFromServerInternal(std::set<std::string>& instances,
-                                       const Orthanc::WebServiceParameters& server,
-                                       const std::map<std::string, std::string>& httpHeaders,
-                                       const std::map<std::string, std::string>& getArguments,
-                                       const Json::Value& resource)
+static void ParseRetrieveResource(std::string& study,
+                                  std::string& series,
+                                  std::string& instance,
+                                  const Json::Value& resource)
 {
   static const std::string STUDY = "Study";
   static const std::string SERIES = "Series";
   static const std::string INSTANCE = "Instance";
-  static const std::string MULTIPART_RELATED = "multipart/related";
-  static const std::string APPLICATION_DICOM = "application/dicom";
-
-  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
 
   if (resource.type() != Json::objectValue)
   {
@@ -440,7 +1672,6 @@ static void RetrieveFromServerInternal(std::set<std::string>& instances,
     throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
   }
 
-  std::string study, series, instance;
   if (!GetStringValue(study, resource, STUDY) ||
       study.empty())
   {
@@ -459,6 +1690,18 @@ static void RetrieveFromServerInternal(std::set<std::string>& instances,
                                             "WADO-RS Retrieve client, the \"" + SERIES + "\" field is mandatory");
     throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
   }
+}
+
+
+static void RetrieveFromServerInternal(RetrieveProgress& progress,
+                                       const std::string& server,
+                                       const std::map<std::string, std::string>& httpHeaders,
+                                       const std::map<std::string, std::string>& getArguments,
+                                       const Json::Value& resource,
+                                       bool isIncremental)
+{
+  std::string study, series, instance;
+  ParseRetrieveResource(study, series, instance, resource);
 
   std::string tmpUri = "studies/" + study;
   if (!series.empty())
@@ -466,126 +1709,211 @@ static void RetrieveFromServerInternal(std::set<std::string>& instances,
     tmpUri += "/series/" + series;
     if (!instance.empty())
     {
+      if (isIncremental &&
+          IsLocalInstance(instance))
+      {
+        progress.SignalSkipped(1);
+        return;
+      }
+
       tmpUri += "/instances/" + instance;
     }
+    else if (isIncremental)
+    {
+      RetrieveMissingInstances(progress, server, httpHeaders, getArguments, study, series);
+      return;
+    }
   }
+  else
+  {
+    // A study is retrieved series by series, so that the answers of
+    // the remote server that are kept in memory are smaller, and so
+    // that several series can be downloaded at once
+    std::list<std::string> children;
+    if (LookupRemoteSeries(children, server, httpHeaders, study))
+    {
+      size_t threads = OrthancPlugins::Configuration::GetUnsignedIntegerValue("RetrieveClientThreads", 1);
+      OrthancPlugins::ParallelPipeline pipeline(threads, threads);
 
-  std::string uri;
-  OrthancPlugins::UriEncode(uri, tmpUri, getArguments);
+      for (std::list<std::string>::const_iterator it = children.begin(); it != children.end(); ++it)
+      {
+        pipeline.Add(new RetrieveSeriesJob(progress, server, httpHeaders, getArguments, study, *it, isIncremental));
+      }
 
-  OrthancPlugins::MemoryBuffer answerBody(context);
-  std::map<std::string, std::string> answerHeaders;
-  OrthancPlugins::CallServer(answerBody, answerHeaders, server, OrthancPluginHttpMethod_Get, httpHeaders, uri, "");
+      for (;;)
+      {
+        std::auto_ptr<OrthancPlugins::ParallelPipeline::IJob> job(pipeline.Dequeue());
+        if (job.get() == NULL)
+        {
+          break;
+        }
+      }
 
-  std::vector<std::string> contentType;
-  for (std::map<std::string, std::string>::const_iterator 
-         it = answerHeaders.begin(); it != answerHeaders.end(); ++it)
-  {
-    std::string s = Orthanc::Toolbox::StripSpaces(it->first);
-    Orthanc::Toolbox::ToLowerCase(s);
-    if (s == "content-type")
-    {
-      Orthanc::Toolbox::TokenizeString(contentType, it->second, ';');
-      break;
+      return;
     }
-  }
 
-  if (contentType.empty())
-  {
-    OrthancPlugins::Configuration::LogError("No Content-Type provided by the remote WADO-RS server");
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+    // The remote server does not support QIDO-RS, or its listing is
+    // not reliable: Retrieve the whole study at once
   }
 
-  Orthanc::Toolbox::ToLowerCase(contentType[0]);
-  if (Orthanc::Toolbox::StripSpaces(contentType[0]) != MULTIPART_RELATED)
-  {
-    OrthancPlugins::Configuration::LogError("The remote WADO-RS server answers with a \"" + contentType[0] +
-                                            "\" Content-Type, but \"" + MULTIPART_RELATED + "\" is expected");
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
-  }
+  RetrieveFromUri(progress, server, httpHeaders, getArguments, tmpUri);
+}
 
-  std::string type, boundary;
-  for (size_t i = 1; i < contentType.size(); i++)
-  {
-    std::vector<std::string> tokens;
-    Orthanc::Toolbox::TokenizeString(tokens, contentType[i], '=');
 
-    if (tokens.size() == 2)
+namespace
+{
+  class RetrieveClientJob : public OrthancPlugins::JobsEngine::IJob
+  {
+  private:
+    std::string                         serverName_;
+    std::map<std::string, std::string>  httpHeaders_;
+    std::map<std::string, std::string>  getArguments_;
+    Json::Value                         resources_;
+    bool                                isIncremental_;
+    RetrieveProgress                    progress_;
+    bool                                isBackground_;
+
+  public:
+    RetrieveClientJob(const std::string& serverName,
+                      const std::map<std::string, std::string>& httpHeaders,
+                      const std::map<std::string, std::string>& getArguments,
+                      const Json::Value& resources,
+                      bool isIncremental) :
+      serverName_(serverName),
+      httpHeaders_(httpHeaders),
+      getArguments_(getArguments),
+      resources_(resources),
+      isIncremental_(isIncremental),
+      progress_(resources.size()),
+      isBackground_(false)
     {
-      std::string s = Orthanc::Toolbox::StripSpaces(tokens[0]);
-      Orthanc::Toolbox::ToLowerCase(s);
+      OrthancPlugins::DicomWebServers::GetInstance().GetServer(serverName_);  // Check its existence
 
-      if (s == "type")
+      if (resources_.type() != Json::arrayValue)
       {
-        type = Orthanc::Toolbox::StripSpaces(tokens[1]);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
 
-        // This covers the case where the content-type is quoted,
-        // which COULD be the case 
-        // cf. https://tools.ietf.org/html/rfc7231#section-3.1.1.1
-        size_t len = type.length();
-        if (len >= 2 &&
-            type[0] == '"' &&
-            type[len - 1] == '"')
-        {
-          type = type.substr(1, len - 2);
-        }
-        
-        Orthanc::Toolbox::ToLowerCase(type);
+      // Check the resources before the job is started
+      for (Json::Value::ArrayIndex i = 0; i < resources_.size(); i++)
+      {
+        std::string study, series, instance;
+        ParseRetrieveResource(study, series, instance, resources_[i]);
       }
-      else if (s == "boundary")
+    }
+
+    // To be called if the job is submitted to the jobs engine
+    void SetBackground()
+    {
+      isBackground_ = true;
+    }
+
+    virtual const char* GetType() const
+    {
+      return "DicomWebRetrieveClient";
+    }
+
+    virtual std::string GetServer() const
+    {
+      return serverName_;
+    }
+
+    void CheckCanceled()
+    {
+      if (progress_.IsCanceled())
       {
-        boundary = Orthanc::Toolbox::StripSpaces(tokens[1]);
+        OrthancPlugins::Configuration::LogError("The WADO-RS Retrieve client request to DICOMweb server " +
+                                                serverName_ + " was canceled");
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
       }
     }
-  }
 
-  if (type != APPLICATION_DICOM)
-  {
-    OrthancPlugins::Configuration::LogError("The remote WADO-RS server answers with a \"" + type +
-                                            "\" multipart Content-Type, but \"" + APPLICATION_DICOM + "\" is expected");
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
-  }
+    virtual void Execute()
+    {
+      // The resources are retrieved one after the other, so that the
+      // count of the retrieved resources tells where to resume
+      for (Json::Value::ArrayIndex i = 0; i < resources_.size(); i++)
+      {
+        CheckCanceled();
 
-  if (boundary.empty())
-  {
-    OrthancPlugins::Configuration::LogError("The remote WADO-RS server does not provide a boundary for its multipart answer");
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
-  }
+        RetrieveFromServerInternal(progress_, serverName_, httpHeaders_, getArguments_, resources_[i], isIncremental_);
 
-  std::vector<OrthancPlugins::MultipartItem> parts;
-  OrthancPlugins::ParseMultipartBody(parts, context, 
-                                     reinterpret_cast<const char*>(answerBody.GetData()),
-                                     answerBody.GetSize(), boundary);
+        // A resource whose download was interrupted must not be
+        // counted as retrieved, so that it is resumed entirely
+        CheckCanceled();
 
-  OrthancPlugins::Configuration::LogInfo("The remote WADO-RS server has provided " +
-                                         boost::lexical_cast<std::string>(parts.size()) + 
-                                         " DICOM instances");
+        progress_.SignalResourceRetrieved();
 
-  for (size_t i = 0; i < parts.size(); i++)
-  {
-    if (parts[i].contentType_ != APPLICATION_DICOM)
+        if (isBackground_)
+        {
+          OrthancPlugins::JobsEngine::GetInstance().SignalProgress();
+        }
+      }
+    }
+
+    virtual void Cancel()
+    {
+      progress_.Cancel();
+    }
+
+    virtual void FormatProgress(Json::Value& target)
+    {
+      progress_.Format(target);
+    }
+
+    virtual uint64_t GetTransferredBytes()
     {
-      OrthancPlugins::Configuration::LogError("The remote WADO-RS server has provided a non-DICOM file in its multipart answer");
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);      
+      return progress_.GetReceivedBytes();
     }
 
-    OrthancPlugins::MemoryBuffer tmp(context);
-    tmp.RestApiPost("/instances", parts[i].data_, parts[i].size_, false);
+    virtual bool Serialize(Json::Value& target)
+    {
+      target = Json::objectValue;
+      target["Server"] = serverName_;
+      target["Incremental"] = isIncremental_;
+      SerializeAssociativeArray(target["HttpHeaders"], httpHeaders_);
+      SerializeAssociativeArray(target["Arguments"], getArguments_);
+
+      // Only the resources that have not been retrieved yet
+      Json::Value resources = Json::arrayValue;
+      for (Json::Value::ArrayIndex i = progress_.GetRetrievedResources(); i < resources_.size(); i++)
+      {
+        resources.append(resources_[i]);
+      }
 
-    Json::Value result;
-    tmp.ToJson(result);
+      target["Resources"] = resources;
+      return true;
+    }
 
-    if (result.type() != Json::objectValue ||
-        !result.isMember("ID") ||
-        result["ID"].type() != Json::stringValue)
+    void GetInstances(std::set<std::string>& target)
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);      
+      progress_.GetInstances(target);
     }
-    else
+
+    static RetrieveClientJob* Unserialize(const Json::Value& source)
     {
-      instances.insert(result["ID"].asString());
+      if (source.type() != Json::objectValue ||
+          !source.isMember("Server") ||
+          !source.isMember("Resources") ||
+          source["Server"].type() != Json::stringValue)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+
+      std::map<std::string, std::string> httpHeaders, getArguments;
+      OrthancPlugins::ParseAssociativeArray(httpHeaders, source, "HttpHeaders");
+      OrthancPlugins::ParseAssociativeArray(getArguments, source, "Arguments");
+
+      bool isIncremental = (source.isMember("Incremental") &&
+                            source["Incremental"].type() == Json::booleanValue &&
+                            source["Incremental"].asBool());
+
+      std::auto_ptr<RetrieveClientJob> job(new RetrieveClientJob(source["Server"].asString(), httpHeaders,
+                                                                 getArguments, source["Resources"], isIncremental));
+      job->SetBackground();
+      return job.release();
     }
-  }
+  };
 }
 
 
@@ -597,6 +1925,8 @@ void RetrieveFromServer(OrthancPluginRestOutput* output,
   static const std::string RESOURCES("Resources");
   static const char* HTTP_HEADERS = "HttpHeaders";
   static const std::string GET_ARGUMENTS = "Arguments";
+  static const std::string ASYNCHRONOUS = "Asynchronous";
+  static const std::string INCREMENTAL = "Incremental";
 
   OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
 
@@ -606,8 +1936,6 @@ void RetrieveFromServer(OrthancPluginRestOutput* output,
     return;
   }
 
-  Orthanc::WebServiceParameters server(OrthancPlugins::DicomWebServers::GetInstance().GetServer(request->groups[0]));
-
   Json::Value body;
   Json::Reader reader;
   if (!reader.parse(request->body, request->body + request->bodySize, body) ||
@@ -626,22 +1954,83 @@ void RetrieveFromServer(OrthancPluginRestOutput* output,
   std::map<std::string, std::string> getArguments;
   OrthancPlugins::ParseAssociativeArray(getArguments, body, GET_ARGUMENTS);
 
+  bool isAsynchronous = false;
+  if (body.isMember(ASYNCHRONOUS))
+  {
+    if (body[ASYNCHRONOUS].type() != Json::booleanValue)
+    {
+      OrthancPlugins::Configuration::LogError("The field \"" + ASYNCHRONOUS + 
+                                              "\" of a WADO-RS Retrieve client request must be a Boolean");
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    isAsynchronous = body[ASYNCHRONOUS].asBool();
+  }
 
-  std::set<std::string> instances;
-  for (Json::Value::ArrayIndex i = 0; i < body[RESOURCES].size(); i++)
+  bool isIncremental = false;
+  if (body.isMember(INCREMENTAL))
   {
-    RetrieveFromServerInternal(instances, server, httpHeaders, getArguments, body[RESOURCES][i]);
+    if (body[INCREMENTAL].type() != Json::booleanValue)
+    {
+      OrthancPlugins::Configuration::LogError("The field \"" + INCREMENTAL + 
+                                              "\" of a WADO-RS Retrieve client request must be a Boolean");
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    isIncremental = body[INCREMENTAL].asBool();
   }
 
-  Json::Value status = Json::objectValue;
-  status["Instances"] = Json::arrayValue;
-  
-  for (std::set<std::string>::const_iterator
-         it = instances.begin(); it != instances.end(); ++it)
+  std::auto_ptr<RetrieveClientJob> job(new RetrieveClientJob(request->groups[0], httpHeaders,
+                                                             getArguments, body[RESOURCES], isIncremental));
+
+  std::string answer;
+
+  if (isAsynchronous)
+  {
+    job->SetBackground();
+    std::string id = OrthancPlugins::JobsEngine::GetInstance().Submit(job.release());
+
+    Json::Value result = Json::objectValue;
+    result["ID"] = id;
+    result["Path"] = OrthancPlugins::Configuration::GetRoot() + "jobs/" + id;
+    answer = result.toStyledString();
+  }
+  else
   {
-    status["Instances"].append(*it);
+    job->Execute();
+
+    std::set<std::string> instances;
+    job->GetInstances(instances);
+
+    Json::Value status = Json::objectValue;
+    status["Instances"] = Json::arrayValue;
+  
+    for (std::set<std::string>::const_iterator
+           it = instances.begin(); it != instances.end(); ++it)
+    {
+      status["Instances"].append(*it);
+    }
+
+    answer = status.toStyledString();
   }
 
-  std::string s = status.toStyledString();
-  OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
+  OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+}
+
+
+OrthancPlugins::JobsEngine::IJob* UnserializeDicomWebClientJob(const std::string& type,
+                                                               const Json::Value& serialized)
+{
+  if (type == "DicomWebStowClient")
+  {
+    return StowClientJob::Unserialize(serialized);
+  }
+  else if (type == "DicomWebRetrieveClient")
+  {
+    return RetrieveClientJob::Unserialize(serialized);
+  }
+  else
+  {
+    return NULL;
+  }
 }
@@ -22,6 +22,7 @@
 #pragma once
 
 #include "Configuration.h"
+#include "JobsEngine.h"
 
 
 void StowClient(OrthancPluginRestOutput* output,
@@ -35,3 +36,14 @@ void GetFromServer(OrthancPluginRestOutput* output,
 void RetrieveFromServer(OrthancPluginRestOutput* output,
                         const char* /*url*/,
                         const OrthancPluginHttpRequest* request);
+
+// Maximum total memory used to build and send the bodies of the
+// outgoing STOW-RS requests (0 means no limit). A single batch that
+// is larger than this budget is still sent, but only once no other
+// batch is in memory.
+void SetStowClientMaxMemory(size_t maxMemory);
+
+// Recreates the jobs of the DICOMweb client that were stored by
+// "OrthancPlugins::JobsEngine", in order to resume them
+OrthancPlugins::JobsEngine::IJob* UnserializeDicomWebClientJob(const std::string& type,
+                                                               const Json::Value& serialized);
@@ -33,12 +33,42 @@ namespace OrthancPlugins
     {
       delete it->second;
     }
+
+    servers_.clear();
+  }
+
+
+  static unsigned int GetServerSetting(Json::Value& server,
+                                       const std::string& key,
+                                       unsigned int defaultValue)
+  {
+    // The settings that are specific to the DICOMweb plugin are
+    // removed, before the entry is parsed by the Orthanc framework
+    if (server.type() != Json::objectValue ||
+        !server.isMember(key))
+    {
+      return defaultValue;
+    }
+
+    Json::Value value = server[key];
+    server.removeMember(key);
+
+    if (value.isConvertibleTo(Json::uintValue))
+    {
+      return value.asUInt();
+    }
+    else
+    {
+      OrthancPlugins::Configuration::LogError("The \"" + key + "\" setting of a DICOMweb server "
+                                              "must be a positive integer");
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
   }
 
 
   void DicomWebServers::Load(const Json::Value& servers)
   {
-    boost::mutex::scoped_lock lock(mutex_);
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
 
     Clear();
 
@@ -56,10 +86,14 @@ namespace OrthancPlugins
 
         for (size_t i = 0; i < members.size(); i++)
         {
-          std::auto_ptr<Orthanc::WebServiceParameters> parameters(new Orthanc::WebServiceParameters);
-          parameters->FromJson(servers[members[i]]);
+          Json::Value entry = servers[members[i]];
+
+          std::auto_ptr<Server> server(new Server);
+          server->timeout_ = GetServerSetting(entry, "Timeout", 0);
+          server->maxConnections_ = GetServerSetting(entry, "MaxConnections", 0);
+          server->parameters_.FromJson(entry);
 
-          servers_[members[i]] = parameters.release();
+          servers_[members[i]] = server.release();
         }
       }
     }
@@ -87,7 +121,25 @@ namespace OrthancPlugins
 
   Orthanc::WebServiceParameters DicomWebServers::GetServer(const std::string& name)
   {
-    boost::mutex::scoped_lock lock(mutex_);
+    return LookupServer(name).parameters_;
+  }
+
+
+  void DicomWebServers::ListServers(std::list<std::string>& servers)
+  {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+    servers.clear();
+    for (Servers::const_iterator it = servers_.begin(); it != servers_.end(); ++it)
+    {
+      servers.push_back(it->first);
+    }
+  }
+
+
+  DicomWebServers::Server& DicomWebServers::LookupServer(const std::string& name)
+  {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
     Servers::const_iterator server = servers_.find(name);
 
     if (server == servers_.end() ||
@@ -103,15 +155,30 @@ namespace OrthancPlugins
   }
 
 
-  void DicomWebServers::ListServers(std::list<std::string>& servers)
+  DicomWebServers::Connection::Connection(const std::string& serverName) :
+    server_(GetInstance().LookupServer(serverName))
   {
-    boost::mutex::scoped_lock lock(mutex_);
+    boost::mutex::scoped_lock lock(server_.connectionsMutex_);
 
-    servers.clear();
-    for (Servers::const_iterator it = servers_.begin(); it != servers_.end(); ++it)
+    while (server_.maxConnections_ != 0 &&
+           server_.activeConnections_ >= server_.maxConnections_)
     {
-      servers.push_back(it->first);
+      server_.connectionReleased_.wait(lock);
     }
+
+    server_.activeConnections_++;
+  }
+
+
+  DicomWebServers::Connection::~Connection()
+  {
+    {
+      boost::mutex::scoped_lock lock(server_.connectionsMutex_);
+      assert(server_.activeConnections_ > 0);
+      server_.activeConnections_--;
+    }
+
+    server_.connectionReleased_.notify_one();
   }
 
 
@@ -131,7 +198,7 @@ namespace OrthancPlugins
 
   void CallServer(OrthancPlugins::MemoryBuffer& answerBody /* out */,
                   std::map<std::string, std::string>& answerHeaders /* out */,
-                  const Orthanc::WebServiceParameters& server,
+                  const std::string& serverName,
                   OrthancPluginHttpMethod method,
                   const std::map<std::string, std::string>& httpHeaders,
                   const std::string& uri,
@@ -140,6 +207,10 @@ namespace OrthancPlugins
     answerBody.Clear();
     answerHeaders.clear();
 
+    // Waits for a free slot if too many requests are pending on this server
+    DicomWebServers::Connection connection(serverName);
+    const Orthanc::WebServiceParameters& server = connection.GetParameters();
+
     std::string url = server.GetUrl();
     assert(!url.empty() && url[url.size() - 1] == '/');
 
@@ -196,7 +267,7 @@ namespace OrthancPlugins
       bodyContent, bodySize,
       ConvertToCString(server.GetUsername()), /* Authentication */
       ConvertToCString(server.GetPassword()), 
-      0,                                      /* Timeout */
+      connection.GetTimeout(),                /* Timeout */
       ConvertToCString(server.GetCertificateFile()),
       ConvertToCString(server.GetCertificateKeyFile()),
       ConvertToCString(server.GetCertificateKeyPassword()),
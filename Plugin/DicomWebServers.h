@@ -25,7 +25,10 @@
 
 #include <list>
 #include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include <json/value.h>
 
 namespace OrthancPlugins
@@ -33,18 +36,62 @@ namespace OrthancPlugins
   class DicomWebServers
   {
   private:
-    typedef std::map<std::string, Orthanc::WebServiceParameters*>  Servers;
+    struct Server : public boost::noncopyable
+    {
+      Orthanc::WebServiceParameters  parameters_;
+      unsigned int                   timeout_;
+      unsigned int                   maxConnections_;  // 0 means no limit
+      unsigned int                   activeConnections_;
+      boost::mutex                   connectionsMutex_;
+      boost::condition_variable      connectionReleased_;
+
+      Server() :
+        timeout_(0),
+        maxConnections_(0),
+        activeConnections_(0)
+      {
+      }
+    };
+
+    typedef std::map<std::string, Server*>  Servers;
 
-    boost::mutex  mutex_;
-    Servers       servers_;
+    // The servers are only modified by "Load()", while the plugin
+    // is initialized: The readers do not have to serialize
+    boost::shared_mutex  mutex_;
+    Servers              servers_;
 
     void Clear();
 
+    Server& LookupServer(const std::string& name);
+
     DicomWebServers()  // Forbidden (singleton pattern)
     {
     }
 
   public:
+    // Reservation of one of the simultaneous HTTP requests to some
+    // server, whose count is bounded by its "MaxConnections" setting
+    class Connection : public boost::noncopyable
+    {
+    private:
+      Server&  server_;
+
+    public:
+      explicit Connection(const std::string& serverName);
+
+      ~Connection();
+
+      const Orthanc::WebServiceParameters& GetParameters() const
+      {
+        return server_.parameters_;
+      }
+
+      unsigned int GetTimeout() const
+      {
+        return server_.timeout_;
+      }
+    };
+
     void Load(const Json::Value& configuration);
 
     ~DicomWebServers()
@@ -62,7 +109,7 @@ namespace OrthancPlugins
 
   void CallServer(OrthancPlugins::MemoryBuffer& answerBody /* out */,
                   std::map<std::string, std::string>& answerHeaders /* out */,
-                  const Orthanc::WebServiceParameters& server,
+                  const std::string& serverName,
                   OrthancPluginHttpMethod method,
                   const std::map<std::string, std::string>& httpHeaders,
                   const std::string& uri,
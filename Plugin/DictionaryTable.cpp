@@ -0,0 +1,204 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "DictionaryTable.h"
+
+#include "Dicom.h"
+
+#include <gdcmDictEntry.h>
+
+#include <algorithm>
+#include <string.h>
+
+namespace OrthancPlugins
+{
+  static const char UPPER_HEX[] = "0123456789ABCDEF";
+  static const char LOWER_HEX[] = "0123456789abcdef";
+
+
+  static void FormatHex(char* target,
+                        uint16_t value,
+                        const char* digits)
+  {
+    target[0] = digits[(value >> 12) & 0x0f];
+    target[1] = digits[(value >> 8) & 0x0f];
+    target[2] = digits[(value >> 4) & 0x0f];
+    target[3] = digits[value & 0x0f];
+  }
+
+
+  struct DictionaryTable::TagComparator
+  {
+    bool operator() (const Entry& a,
+                     uint32_t b) const
+    {
+      return a.tag_ < b;
+    }
+
+    bool operator() (const Entry& a,
+                     const Entry& b) const
+    {
+      return a.tag_ < b.tag_;
+    }
+  };
+
+
+  struct DictionaryTable::KeywordComparator
+  {
+    const std::vector<Entry>&  entries_;
+
+    KeywordComparator(const std::vector<Entry>& entries) :
+      entries_(entries)
+    {
+    }
+
+    bool operator() (size_t a,
+                     size_t b) const
+    {
+      return strcmp(entries_[a].keyword_, entries_[b].keyword_) < 0;
+    }
+
+    bool operator() (size_t a,
+                     const char* b) const
+    {
+      return strcmp(entries_[a].keyword_, b) < 0;
+    }
+  };
+
+
+  void DictionaryTable::FormatDicomWebKey(char (&target)[9],
+                                          const gdcm::Tag& tag)
+  {
+    FormatHex(target, tag.GetGroup(), UPPER_HEX);
+    FormatHex(target + 4, tag.GetElement(), UPPER_HEX);
+    target[8] = '\0';
+  }
+
+
+  void DictionaryTable::FormatOrthancKey(char (&target)[10],
+                                         const gdcm::Tag& tag)
+  {
+    FormatHex(target, tag.GetGroup(), LOWER_HEX);
+    target[4] = ',';
+    FormatHex(target + 5, tag.GetElement(), LOWER_HEX);
+    target[9] = '\0';
+  }
+
+
+  DictionaryTable& DictionaryTable::GetInstance()
+  {
+    static DictionaryTable singleton;
+    return singleton;
+  }
+
+
+  void DictionaryTable::Setup(const gdcm::Dict& dictionary)
+  {
+    // The table is disabled while it is built, so that "GetVRName()"
+    // and "GetKeyword()" directly query the GDCM dictionary
+    dictionary_ = NULL;
+    entries_.clear();
+    keywords_.clear();
+
+    for (gdcm::Dict::ConstIterator it = dictionary.Begin(); it != dictionary.End(); ++it)
+    {
+      const gdcm::Tag& tag = it->first;
+
+      Entry entry;
+      entry.tag_ = GetKey(tag);
+      entry.keyword_ = GetKeyword(dictionary, tag);
+      entry.vr_ = GetVRName(entry.isSequence_, dictionary, tag);
+      FormatDicomWebKey(entry.dicomWebKey_, tag);
+      FormatOrthancKey(entry.orthancKey_, tag);
+
+      entries_.push_back(entry);
+    }
+
+    // The "std::map" of GDCM is already sorted, but this is cheap
+    std::sort(entries_.begin(), entries_.end(), TagComparator());
+
+    for (size_t i = 0; i < entries_.size(); i++)
+    {
+      if (entries_[i].keyword_ != NULL)
+      {
+        keywords_.push_back(i);
+      }
+    }
+
+    // Stable, so that a keyword that is shared by several tags is
+    // resolved to the first one, as by "gdcm::Dict"
+    std::stable_sort(keywords_.begin(), keywords_.end(), KeywordComparator(entries_));
+
+    dictionary_ = &dictionary;
+  }
+
+
+  const DictionaryTable::Entry* DictionaryTable::Lookup(const gdcm::Dict& dictionary,
+                                                        const gdcm::Tag& tag) const
+  {
+    if (dictionary_ != &dictionary)
+    {
+      return NULL;
+    }
+
+    const uint32_t key = GetKey(tag);
+
+    std::vector<Entry>::const_iterator found =
+      std::lower_bound(entries_.begin(), entries_.end(), key, TagComparator());
+
+    if (found == entries_.end() ||
+        found->tag_ != key)
+    {
+      return NULL;
+    }
+    else
+    {
+      return &(*found);
+    }
+  }
+
+
+  bool DictionaryTable::LookupKeyword(gdcm::Tag& tag,
+                                      const gdcm::Dict& dictionary,
+                                      const char* keyword) const
+  {
+    if (dictionary_ != &dictionary)
+    {
+      return false;
+    }
+
+    std::vector<size_t>::const_iterator found =
+      std::lower_bound(keywords_.begin(), keywords_.end(), keyword, KeywordComparator(entries_));
+
+    if (found == keywords_.end() ||
+        strcmp(entries_[*found].keyword_, keyword) != 0)
+    {
+      return false;
+    }
+    else
+    {
+      tag = gdcm::Tag(static_cast<uint16_t>(entries_[*found].tag_ >> 16),
+                      static_cast<uint16_t>(entries_[*found].tag_ & 0xffff));
+      return true;
+    }
+  }
+}
@@ -0,0 +1,96 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <gdcmDict.h>
+#include <gdcmTag.h>
+
+#include <stdint.h>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace OrthancPlugins
+{
+  /**
+   * Flat copy of the GDCM dictionary, built once at the startup of
+   * the plugin, that gives the keyword, the VR and the formatted keys
+   * of each tag by a binary search in one sorted array. This avoids
+   * querying "gdcm::Dict" and formatting the tags with "sprintf()"
+   * for each attribute that is serialized or matched.
+   **/
+  class DictionaryTable : public boost::noncopyable
+  {
+  public:
+    struct Entry
+    {
+      uint32_t     tag_;            // Group in the 16 most significant bits
+      const char*  keyword_;        // NULL if none, owned by the GDCM dictionary
+      const char*  vr_;             // Same as "GetVRName()"
+      bool         isSequence_;
+      char         dicomWebKey_[9];   // "GGGGEEEE", upper-case
+      char         orthancKey_[10];   // "gggg,eeee", lower-case
+    };
+
+  private:
+    const gdcm::Dict*    dictionary_;
+    std::vector<Entry>   entries_;   // Sorted by tag
+    std::vector<size_t>  keywords_;  // Indices in "entries_", sorted by keyword
+
+    struct TagComparator;
+    struct KeywordComparator;
+
+    DictionaryTable() :  // Forbidden (singleton pattern)
+      dictionary_(NULL)
+    {
+    }
+
+  public:
+    static DictionaryTable& GetInstance();
+
+    // Must be called before the REST callbacks are registered, as
+    // the table is read without locking
+    void Setup(const gdcm::Dict& dictionary);
+
+    static uint32_t GetKey(const gdcm::Tag& tag)
+    {
+      return (static_cast<uint32_t>(tag.GetGroup()) << 16) | tag.GetElement();
+    }
+
+    // Returns NULL if the tag is not in the table, or if the table was
+    // not built from this dictionary
+    const Entry* Lookup(const gdcm::Dict& dictionary,
+                        const gdcm::Tag& tag) const;
+
+    // Returns "false" if the keyword is unknown, or if the table was
+    // not built from this dictionary
+    bool LookupKeyword(gdcm::Tag& tag,
+                       const gdcm::Dict& dictionary,
+                       const char* keyword) const;
+
+    static void FormatDicomWebKey(char (&target)[9],
+                                  const gdcm::Tag& tag);
+
+    static void FormatOrthancKey(char (&target)[10],
+                                 const gdcm::Tag& tag);
+  };
+}
@@ -0,0 +1,388 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "FrameCache.h"
+
+#include "Configuration.h"
+#include "Metrics.h"
+
+#include <cassert>
+#include <fstream>
+#include <list>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+namespace OrthancPlugins
+{
+  static const char* const FRAME_EXTENSION = ".frame";
+  static const char* const TEMPORARY_EXTENSION = ".tmp";
+
+
+  static bool ReadFile(std::string& content,
+                       const std::string& path)
+  {
+    std::ifstream f(path.c_str(), std::ios::in | std::ios::binary);
+    if (!f.good())
+    {
+      return false;
+    }
+
+    f.seekg(0, std::ios::end);
+    std::streamsize size = f.tellg();
+    f.seekg(0, std::ios::beg);
+
+    if (size < 0)
+    {
+      return false;
+    }
+
+    content.resize(static_cast<size_t>(size));
+    if (size > 0)
+    {
+      f.read(&content[0], size);
+    }
+
+    return f.good();
+  }
+
+
+  static bool WriteFile(const std::string& path,
+                        const char* content,
+                        size_t size)
+  {
+    std::ofstream f(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!f.good())
+    {
+      return false;
+    }
+
+    if (size > 0)
+    {
+      f.write(content, size);
+    }
+
+    f.close();
+    return f.good();
+  }
+
+
+  static void RemoveFile(const std::string& path)
+  {
+    boost::system::error_code error;
+    boost::filesystem::remove(path, error);  // Ignore the errors
+  }
+
+
+  std::string FrameCache::GetKey(const std::string& instanceId,
+                                 unsigned int frame,
+                                 const std::string& transferSyntax)
+  {
+    // The key is also used as a filename: Orthanc identifiers and
+    // transfer syntax UIDs are made of hexadecimal digits, dashes,
+    // digits and dots
+    return instanceId + "_" + boost::lexical_cast<std::string>(frame) + "_" + transferSyntax;
+  }
+
+
+  std::string FrameCache::GetPath(const std::string& key) const
+  {
+    return (boost::filesystem::path(directory_) / (key + FRAME_EXTENSION)).string();
+  }
+
+
+  void FrameCache::RemoveInternal(const std::string& key)
+  {
+    // The mutex must be locked by the caller
+    if (index_.Contains(key))
+    {
+      size_t size = index_.Invalidate(key);
+      assert(currentSize_ >= size);
+      currentSize_ -= size;
+      keys_.erase(key);
+
+      RemoveFile(GetPath(key));
+    }
+  }
+
+
+  void FrameCache::ClearInternal()
+  {
+    // The mutex must be locked by the caller
+    while (!index_.IsEmpty())
+    {
+      RemoveInternal(index_.GetOldest());
+    }
+
+    assert(keys_.empty() &&
+           currentSize_ == 0);
+  }
+
+
+  FrameCache& FrameCache::GetInstance()
+  {
+    static FrameCache singleton;
+    return singleton;
+  }
+
+
+  void FrameCache::Setup(const std::string& directory,
+                         size_t maxSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    ClearInternal();
+
+    directory_ = directory;
+    maxSize_ = maxSize;
+
+    if (maxSize_ != 0)
+    {
+      try
+      {
+        boost::filesystem::create_directories(directory_);
+
+        // The index of the cache is not persisted, so the files of the
+        // former executions of Orthanc cannot be used
+        std::list<boost::filesystem::path> toRemove;
+
+        for (boost::filesystem::directory_iterator it(directory_);
+             it != boost::filesystem::directory_iterator(); ++it)
+        {
+          if (boost::filesystem::is_regular_file(it->status()) &&
+              (it->path().extension() == FRAME_EXTENSION ||
+               it->path().extension() == TEMPORARY_EXTENSION))
+          {
+            toRemove.push_back(it->path());
+          }
+        }
+
+        for (std::list<boost::filesystem::path>::const_iterator
+               it = toRemove.begin(); it != toRemove.end(); ++it)
+        {
+          RemoveFile(it->string());
+        }
+      }
+      catch (boost::filesystem::filesystem_error&)
+      {
+        OrthancPlugins::Configuration::LogError("Cannot use this folder for the cache of the frames: " + directory_);
+        maxSize_ = 0;
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_DirectoryExpected);
+      }
+    }
+  }
+
+
+  bool FrameCache::IsEnabled()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return maxSize_ != 0;
+  }
+
+
+  bool FrameCache::Lookup(std::string& frame,
+                          const std::string& instanceId,
+                          unsigned int frameIndex,
+                          const std::string& transferSyntax)
+  {
+    const std::string key = GetKey(instanceId, frameIndex, transferSyntax);
+    std::string path;
+    uint64_t generation;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Keys::const_iterator found = keys_.find(key);
+      if (found == keys_.end())
+      {
+        misses_++;
+        return false;
+      }
+
+      assert(index_.Contains(key));
+      index_.MakeMostRecent(key);
+      path = GetPath(key);
+      generation = found->second;
+    }
+
+    // The file is read with the mutex unlocked. It might have been
+    // removed in the meantime, which is handled as a cache miss.
+    bool success = ReadFile(frame, path);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (success)
+    {
+      hits_++;
+    }
+    else
+    {
+      misses_++;
+
+      // Only remove the entry that was read, not a newer one that
+      // would have been stored concurrently by another thread
+      Keys::const_iterator found = keys_.find(key);
+      if (found != keys_.end() &&
+          found->second == generation)
+      {
+        RemoveInternal(key);
+      }
+    }
+
+    return success;
+  }
+
+
+  void FrameCache::Store(const std::string& instanceId,
+                         unsigned int frameIndex,
+                         const std::string& transferSyntax,
+                         const char* frame,
+                         size_t size)
+  {
+    const std::string key = GetKey(instanceId, frameIndex, transferSyntax);
+    std::string path, temporary;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (maxSize_ == 0 ||
+          size > maxSize_ ||
+          index_.Contains(key))
+      {
+        return;
+      }
+
+      path = GetPath(key);
+      temporary = (boost::filesystem::path(directory_) /
+                   boost::filesystem::unique_path(std::string("%%%%-%%%%-%%%%-%%%%") + TEMPORARY_EXTENSION)).string();
+    }
+
+    // The file is written with the mutex unlocked, then renamed
+    if (!WriteFile(temporary, frame, size))
+    {
+      OrthancPlugins::Configuration::LogWarning("Cannot write to the cache of the frames: " + temporary);
+      RemoveFile(temporary);
+      return;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (maxSize_ == 0 ||
+        index_.Contains(key))  // Concurrently stored by another thread
+    {
+      RemoveFile(temporary);
+      return;
+    }
+
+    boost::system::error_code error;
+    boost::filesystem::rename(temporary, path, error);
+    if (error)
+    {
+      RemoveFile(temporary);
+      return;
+    }
+
+    index_.Add(key, size);
+    keys_[key] = generation_++;
+    currentSize_ += size;
+
+    while (currentSize_ > maxSize_)
+    {
+      RemoveInternal(index_.GetOldest());
+    }
+  }
+
+
+  void FrameCache::SignalChange(OrthancPluginChangeType changeType,
+                                OrthancPluginResourceType resourceType,
+                                const char* resourceId)
+  {
+    if (changeType == OrthancPluginChangeType_Deleted &&
+        resourceType == OrthancPluginResourceType_Instance)
+    {
+      const std::string prefix = std::string(resourceId) + "_";
+
+      boost::mutex::scoped_lock lock(mutex_);
+
+      std::list<std::string> toRemove;
+      for (Keys::const_iterator it = keys_.lower_bound(prefix);
+           it != keys_.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+      {
+        toRemove.push_back(it->first);
+      }
+
+      for (std::list<std::string>::const_iterator
+             it = toRemove.begin(); it != toRemove.end(); ++it)
+      {
+        RemoveInternal(*it);
+      }
+    }
+  }
+
+
+  void FrameCache::Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    ClearInternal();
+  }
+
+
+  void FrameCache::GetStatistics(Json::Value& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target = Json::objectValue;
+    target["Enabled"] = (maxSize_ != 0);
+    target["MaximumSize"] = static_cast<Json::UInt64>(maxSize_);
+    target["CurrentSize"] = static_cast<Json::UInt64>(currentSize_);
+    target["Count"] = static_cast<Json::UInt64>(keys_.size());
+    target["Hits"] = static_cast<Json::UInt64>(hits_);
+    target["Misses"] = static_cast<Json::UInt64>(misses_);
+  }
+
+
+  void GetFrameCacheStatistics(OrthancPluginRestOutput* output,
+                               const char* url,
+                               const OrthancPluginHttpRequest* request)
+  {
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    if (request->method == OrthancPluginHttpMethod_Get)
+    {
+      Json::Value statistics;
+      FrameCache::GetInstance().GetStatistics(statistics);
+
+      std::string answer = statistics.toStyledString();
+      OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+    }
+    else if (request->method == OrthancPluginHttpMethod_Delete)
+    {
+      FrameCache::GetInstance().Clear();
+
+      std::string answer = "{}";
+      OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+    }
+    else
+    {
+      OrthancPluginSendMethodNotAllowed(context, output, "GET,DELETE");
+    }
+  }
+}
@@ -0,0 +1,113 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <Core/Cache/LeastRecentlyUsedIndex.h>
+
+#include <orthanc/OrthancCPlugin.h>
+#include <json/value.h>
+
+#include <map>
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace OrthancPlugins
+{
+  // Disk-backed cache of the frames that were transcoded by WADO-RS
+  // RetrieveFrames, indexed by the Orthanc identifier of the
+  // instance, the index of the frame and the target transfer
+  // syntax. Each frame is stored as one file in a dedicated folder.
+  class FrameCache : public boost::noncopyable
+  {
+  private:
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, size_t>  Index;  // The payload is the size
+
+    // Sorted, to find the frames of one instance. The value is the
+    // generation of the stored file, which tells whether some entry
+    // has been replaced while the mutex was unlocked.
+    typedef std::map<std::string, uint64_t>  Keys;
+
+    boost::mutex  mutex_;
+    std::string   directory_;
+    size_t        maxSize_;
+    size_t        currentSize_;
+    Index         index_;
+    Keys          keys_;
+    uint64_t      generation_;
+    uint64_t      hits_;
+    uint64_t      misses_;
+
+    static std::string GetKey(const std::string& instanceId,
+                              unsigned int frame,
+                              const std::string& transferSyntax);
+
+    std::string GetPath(const std::string& key) const;
+
+    void RemoveInternal(const std::string& key);
+
+    void ClearInternal();
+
+    FrameCache() :  // Forbidden (singleton pattern)
+      maxSize_(0),
+      currentSize_(0),
+      generation_(0),
+      hits_(0),
+      misses_(0)
+    {
+    }
+
+  public:
+    static FrameCache& GetInstance();
+
+    // Removes the frames that were stored by former executions
+    void Setup(const std::string& directory,
+               size_t maxSize);
+
+    bool IsEnabled();
+
+    bool Lookup(std::string& frame,
+                const std::string& instanceId,
+                unsigned int frameIndex,
+                const std::string& transferSyntax);
+
+    void Store(const std::string& instanceId,
+               unsigned int frameIndex,
+               const std::string& transferSyntax,
+               const char* frame,
+               size_t size);
+
+    // Called from the Orthanc change callback: Must not use the REST API
+    void SignalChange(OrthancPluginChangeType changeType,
+                      OrthancPluginResourceType resourceType,
+                      const char* resourceId);
+
+    void Clear();
+
+    void GetStatistics(Json::Value& target);
+  };
+
+
+  void GetFrameCacheStatistics(OrthancPluginRestOutput* output,
+                               const char* url,
+                               const OrthancPluginHttpRequest* request);
+}
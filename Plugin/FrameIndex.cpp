@@ -0,0 +1,547 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "FrameIndex.h"
+
+#include "Dicom.h"
+
+#include <Core/OrthancException.h>
+
+#include <sstream>
+#include <string.h>
+#include <boost/lexical_cast.hpp>
+
+namespace OrthancPlugins
+{
+  // The first line of the attachment identifies the version of its format
+  static const char* const FRAME_INDEX_HEADER = "DICOMweb-frames-1\n";
+
+  // Size of the header of the items of an encapsulated Pixel Data
+  static const size_t ITEM_HEADER_SIZE = 8;
+
+  static const uint32_t UNDEFINED_LENGTH = 0xffffffffu;
+
+
+  static uint16_t ReadUInt16(const uint8_t* p)
+  {
+    // Little endian
+    return static_cast<uint16_t>(p[0]) | (static_cast<uint16_t>(p[1]) << 8);
+  }
+
+
+  static uint32_t ReadUInt32(const uint8_t* p)
+  {
+    // Little endian
+    return (static_cast<uint32_t>(p[0]) |
+            (static_cast<uint32_t>(p[1]) << 8) |
+            (static_cast<uint32_t>(p[2]) << 16) |
+            (static_cast<uint32_t>(p[3]) << 24));
+  }
+
+
+  static bool ReadItemHeader(uint16_t& element,
+                             uint32_t& length,
+                             const uint8_t* dicom,
+                             size_t size,
+                             size_t position)
+  {
+    if (position + ITEM_HEADER_SIZE > size ||
+        ReadUInt16(dicom + position) != 0xfffe)
+    {
+      return false;
+    }
+
+    element = ReadUInt16(dicom + position + 2);
+    length = ReadUInt32(dicom + position + 4);
+    return true;
+  }
+
+
+  static bool GetPositiveInteger(int& result,
+                                 const ParsedDicomFile& dicom,
+                                 const gdcm::Dict& dictionary,
+                                 const gdcm::Tag& tag)
+  {
+    return (dicom.GetDataSet().FindDataElement(tag) &&
+            dicom.GetIntegerTag(result, dictionary, tag) &&
+            result > 0);
+  }
+
+
+  static bool IsFrameStart(const char* data,
+                           size_t size)
+  {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+
+    return (size >= 2 &&
+            p[0] == 0xff &&
+            (p[1] == 0xd8 ||    // JPEG and JPEG-LS: Start Of Image
+             p[1] == 0x4f));    // JPEG 2000 codestream: Start Of Codestream
+  }
+
+
+  static bool IsFrameEnd(const char* data,
+                         size_t size)
+  {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+
+    // End Of Image (JPEG, JPEG-LS) or End Of Codestream (JPEG 2000),
+    // possibly followed by one padding byte to get an even length
+    if (size > 0 &&
+        p[size - 1] == 0x00)
+    {
+      size--;
+    }
+
+    return (size >= 2 &&
+            p[size - 2] == 0xff &&
+            p[size - 1] == 0xd9);
+  }
+
+
+  void FrameIndex::Clear()
+  {
+    transferSyntax_.clear();
+    fragments_.clear();
+    firstFragment_.clear();
+  }
+
+
+  bool FrameIndex::ComputeEncapsulated(const uint8_t* dicom,
+                                       size_t size,
+                                       size_t pixelDataOffset,
+                                       size_t countFrames)
+  {
+    size_t position = pixelDataOffset;
+
+    // The first item is the Basic Offset Table
+    uint16_t element;
+    uint32_t length;
+    if (!ReadItemHeader(element, length, dicom, size, position) ||
+        element != 0xe000 ||
+        length % 4 != 0 ||
+        position + ITEM_HEADER_SIZE + length > size)
+    {
+      return false;
+    }
+
+    std::vector<uint32_t> offsetTable(length / 4);
+    for (size_t i = 0; i < offsetTable.size(); i++)
+    {
+      offsetTable[i] = ReadUInt32(dicom + position + ITEM_HEADER_SIZE + 4 * i);
+    }
+
+    position += ITEM_HEADER_SIZE + length;
+
+    // The next items are the fragments, up to the sequence delimiter
+    std::vector<const char*> data;
+    std::vector<size_t> sizes;
+
+    for (;;)
+    {
+      if (!ReadItemHeader(element, length, dicom, size, position))
+      {
+        return false;
+      }
+      else if (element == 0xe0dd)
+      {
+        break;
+      }
+      else if (element != 0xe000 ||
+               length == UNDEFINED_LENGTH ||
+               position + ITEM_HEADER_SIZE + length > size)
+      {
+        return false;
+      }
+
+      Fragment fragment;
+      fragment.offset_ = position + ITEM_HEADER_SIZE;
+      fragment.size_ = length;
+      fragments_.push_back(fragment);
+      data.push_back(reinterpret_cast<const char*>(dicom) + fragment.offset_);
+      sizes.push_back(length);
+
+      position += ITEM_HEADER_SIZE + length;
+    }
+
+    return GroupFragments(firstFragment_, offsetTable, data, sizes, countFrames);
+  }
+
+
+  bool FrameIndex::Compute(const gdcm::Dict& dictionary,
+                           const void* dicom,
+                           size_t size)
+  {
+    Clear();
+
+    // Only parse the header, up to the Pixel Data
+    ParsedDicomFile parsed(dicom, size, DICOM_TAG_PIXEL_DATA);
+
+    size_t offset;
+    if (!parsed.LookupPixelDataOffset(offset) ||
+        offset < 4 ||
+        offset > size)
+    {
+      // No pixel data, or transfer syntax that is neither little
+      // endian nor uncompressed (e.g. deflated)
+      return false;
+    }
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(dicom);
+    const uint32_t length = ReadUInt32(bytes + offset - 4);
+
+    const bool hasNumberOfFrames = parsed.GetDataSet().FindDataElement(DICOM_TAG_NUMBER_OF_FRAMES);
+
+    int countFrames = 1;
+    if (hasNumberOfFrames &&
+        !GetPositiveInteger(countFrames, parsed, dictionary, DICOM_TAG_NUMBER_OF_FRAMES))
+    {
+      return false;
+    }
+
+    bool success;
+
+    if (length == UNDEFINED_LENGTH)
+    {
+      success = ComputeEncapsulated(bytes, size, offset, static_cast<size_t>(countFrames));
+    }
+    else
+    {
+      int width, height, bits, samplesPerPixel;
+
+      if (offset + length > size ||
+          !GetPositiveInteger(height, parsed, dictionary, DICOM_TAG_ROWS) ||
+          !GetPositiveInteger(width, parsed, dictionary, DICOM_TAG_COLUMNS) ||
+          !GetPositiveInteger(bits, parsed, dictionary, DICOM_TAG_BITS_ALLOCATED) ||
+          !GetPositiveInteger(samplesPerPixel, parsed, dictionary, DICOM_TAG_SAMPLES_PER_PIXEL) ||
+          bits % 8 != 0)
+      {
+        return false;
+      }
+
+      const size_t frameSize = (static_cast<size_t>(height) * static_cast<size_t>(width) *
+                                static_cast<size_t>(bits / 8) * static_cast<size_t>(samplesPerPixel));
+
+      if (!hasNumberOfFrames)
+      {
+        // Same behavior as "AnswerFrames()"
+        countFrames = static_cast<int>(length / frameSize);
+      }
+
+      success = (countFrames > 0 &&
+                 static_cast<size_t>(countFrames) * frameSize <= length);
+
+      if (success)
+      {
+        for (int i = 0; i < countFrames; i++)
+        {
+          Fragment fragment;
+          fragment.offset_ = offset + static_cast<size_t>(i) * frameSize;
+          fragment.size_ = frameSize;
+          fragments_.push_back(fragment);
+          firstFragment_.push_back(i);
+        }
+
+        firstFragment_.push_back(fragments_.size());
+      }
+    }
+
+    if (success)
+    {
+      transferSyntax_ = parsed.GetFile().GetHeader().GetDataSetTransferSyntax().GetString();
+    }
+    else
+    {
+      Clear();
+    }
+
+    return success;
+  }
+
+
+  void FrameIndex::GetFrame(const char*& data,
+                            size_t& size,
+                            std::string& buffer,
+                            const void* dicom,
+                            size_t dicomSize,
+                            size_t frame) const
+  {
+    if (frame >= GetFramesCount())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    const size_t start = firstFragment_[frame];
+    const size_t end = firstFragment_[frame + 1];
+
+    size = 0;
+    for (size_t i = start; i < end; i++)
+    {
+      if (fragments_[i].offset_ + fragments_[i].size_ > dicomSize)
+      {
+        // The index does not correspond to this DICOM file
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+      }
+
+      size += fragments_[i].size_;
+    }
+
+    const char* source = reinterpret_cast<const char*>(dicom);
+
+    if (end == start + 1)
+    {
+      data = source + fragments_[start].offset_;
+    }
+    else
+    {
+      buffer.clear();
+      buffer.reserve(size);
+
+      for (size_t i = start; i < end; i++)
+      {
+        buffer.append(source + fragments_[i].offset_, fragments_[i].size_);
+      }
+
+      data = buffer.c_str();
+    }
+  }
+
+
+  void FrameIndex::Serialize(std::string& target) const
+  {
+    // One line per frame, containing the offset and the size of its fragments
+    std::string s = FRAME_INDEX_HEADER + transferSyntax_ + "\n";
+
+    for (size_t frame = 0; frame < GetFramesCount(); frame++)
+    {
+      for (size_t i = firstFragment_[frame]; i < firstFragment_[frame + 1]; i++)
+      {
+        if (i != firstFragment_[frame])
+        {
+          s += " ";
+        }
+
+        s += (boost::lexical_cast<std::string>(fragments_[i].offset_) + " " +
+              boost::lexical_cast<std::string>(fragments_[i].size_));
+      }
+
+      s += "\n";
+    }
+
+    target.swap(s);
+  }
+
+
+  bool FrameIndex::Unserialize(const std::string& source)
+  {
+    Clear();
+
+    const size_t headerSize = strlen(FRAME_INDEX_HEADER);
+    if (source.size() < headerSize ||
+        source.compare(0, headerSize, FRAME_INDEX_HEADER) != 0)
+    {
+      return false;
+    }
+
+    std::istringstream stream(source.substr(headerSize));
+
+    if (!std::getline(stream, transferSyntax_) ||
+        transferSyntax_.empty())
+    {
+      Clear();
+      return false;
+    }
+
+    std::string line;
+    while (std::getline(stream, line))
+    {
+      std::istringstream fragments(line);
+
+      firstFragment_.push_back(fragments_.size());
+
+      Fragment fragment;
+      while (fragments >> fragment.offset_)
+      {
+        if (!(fragments >> fragment.size_))
+        {
+          Clear();
+          return false;
+        }
+
+        fragments_.push_back(fragment);
+      }
+
+      if (!fragments.eof() ||
+          fragments_.size() == firstFragment_.back())
+      {
+        // Parse error, or frame without fragment
+        Clear();
+        return false;
+      }
+    }
+
+    if (firstFragment_.empty())
+    {
+      Clear();
+      return false;
+    }
+
+    firstFragment_.push_back(fragments_.size());
+    return true;
+  }
+
+
+  bool FrameIndex::GroupFragments(std::vector<size_t>& firstFragment,
+                                  const std::vector<uint32_t>& offsetTable,
+                                  const std::vector<const char*>& fragmentData,
+                                  const std::vector<size_t>& fragmentSizes,
+                                  size_t countFrames)
+  {
+    firstFragment.clear();
+
+    if (fragmentData.size() != fragmentSizes.size())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    if (countFrames == 0 ||
+        fragmentSizes.size() < countFrames)
+    {
+      return false;
+    }
+
+    if (!offsetTable.empty())
+    {
+      /**
+       * The Basic Offset Table contains the position of the item of
+       * the first fragment of each frame, relative to the item of the
+       * first fragment. Each offset must fall on an item boundary.
+       **/
+      if (offsetTable.size() != countFrames ||
+          offsetTable[0] != 0)
+      {
+        return false;
+      }
+
+      size_t position = 0;
+      for (size_t i = 0; i < fragmentSizes.size() && firstFragment.size() < countFrames; i++)
+      {
+        const size_t expected = offsetTable[firstFragment.size()];
+
+        if (position == expected)
+        {
+          firstFragment.push_back(i);
+        }
+        else if (position > expected)
+        {
+          firstFragment.clear();
+          return false;
+        }
+
+        position += ITEM_HEADER_SIZE + fragmentSizes[i];
+      }
+
+      if (firstFragment.size() != countFrames)
+      {
+        firstFragment.clear();
+        return false;
+      }
+    }
+    else if (countFrames == 1)
+    {
+      // All the fragments belong to the single frame
+      firstFragment.push_back(0);
+    }
+    else if (fragmentSizes.size() == countFrames)
+    {
+      // One fragment per frame
+      for (size_t i = 0; i < countFrames; i++)
+      {
+        firstFragment.push_back(i);
+      }
+    }
+    else
+    {
+      // Empty Basic Offset Table: Look for the markers that delimit
+      // the compressed frames
+      firstFragment.push_back(0);
+
+      for (size_t i = 1; i < fragmentSizes.size(); i++)
+      {
+        if (IsFrameEnd(fragmentData[i - 1], fragmentSizes[i - 1]) &&
+            IsFrameStart(fragmentData[i], fragmentSizes[i]))
+        {
+          firstFragment.push_back(i);
+        }
+      }
+
+      if (firstFragment.size() != countFrames)
+      {
+        firstFragment.clear();
+        return false;
+      }
+    }
+
+    firstFragment.push_back(fragmentSizes.size());
+    return true;
+  }
+
+
+  bool FrameIndex::GroupFragments(std::vector<size_t>& firstFragment,
+                                  const gdcm::SequenceOfFragments& fragments,
+                                  size_t countFrames)
+  {
+    std::vector<uint32_t> offsetTable;
+
+    const gdcm::ByteValue* table = fragments.GetTable().GetByteValue();
+    if (table != NULL &&
+        table->GetPointer() != NULL)
+    {
+      const uint8_t* p = reinterpret_cast<const uint8_t*>(table->GetPointer());
+
+      offsetTable.resize(table->GetLength() / 4);
+      for (size_t i = 0; i < offsetTable.size(); i++)
+      {
+        offsetTable[i] = ReadUInt32(p + 4 * i);
+      }
+    }
+
+    std::vector<const char*> data(fragments.GetNumberOfFragments());
+    std::vector<size_t> sizes(fragments.GetNumberOfFragments());
+
+    for (size_t i = 0; i < data.size(); i++)
+    {
+      const gdcm::ByteValue* value = fragments.GetFragment(i).GetByteValue();
+      if (value == NULL)
+      {
+        data[i] = NULL;
+        sizes[i] = 0;
+      }
+      else
+      {
+        data[i] = value->GetPointer();
+        sizes[i] = value->GetLength();
+      }
+    }
+
+    return GroupFragments(firstFragment, offsetTable, data, sizes, countFrames);
+  }
+}
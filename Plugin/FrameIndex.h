@@ -0,0 +1,115 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <gdcmDict.h>
+#include <gdcmSequenceOfFragments.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace OrthancPlugins
+{
+  // Location of the frames of one DICOM instance inside its file, so
+  // that WADO-RS RetrieveFrames can extract one frame without parsing
+  // the instance. With native transfer syntaxes, each frame is one
+  // fragment. With encapsulated transfer syntaxes, one frame is made
+  // of one or several consecutive fragments of the Pixel Data.
+  class FrameIndex : public boost::noncopyable
+  {
+  public:
+    struct Fragment
+    {
+      size_t  offset_;   // Position of the fragment in the DICOM file
+      size_t  size_;
+    };
+
+  private:
+    std::string            transferSyntax_;
+    std::vector<Fragment>  fragments_;
+    std::vector<size_t>    firstFragment_;  // One item per frame, plus the end of the last frame
+
+    bool ComputeEncapsulated(const uint8_t* dicom,
+                             size_t size,
+                             size_t pixelDataOffset,
+                             size_t countFrames);
+
+  public:
+    void Clear();
+
+    // Returns "false" if the instance has no pixel data, or if the
+    // layout of its frames cannot be determined without decoding it
+    bool Compute(const gdcm::Dict& dictionary,
+                 const void* dicom,
+                 size_t size);
+
+    // UID of the transfer syntax of the indexed instance
+    const std::string& GetTransferSyntax() const
+    {
+      return transferSyntax_;
+    }
+
+    size_t GetFramesCount() const
+    {
+      return firstFragment_.empty() ? 0 : firstFragment_.size() - 1;
+    }
+
+    // Returns the content of one frame of the indexed DICOM file. If
+    // the frame is made of one single fragment, "data" directly
+    // points into "dicom". Otherwise, the fragments are concatenated
+    // into "buffer".
+    void GetFrame(const char*& data,
+                  size_t& size,
+                  std::string& buffer,
+                  const void* dicom,
+                  size_t dicomSize,
+                  size_t frame) const;
+
+    void Serialize(std::string& target) const;
+
+    bool Unserialize(const std::string& source);
+
+    /**
+     * Assign the fragments of an encapsulated Pixel Data to frames,
+     * given the Basic Offset Table (possibly empty) and the content
+     * of each fragment. If the table is empty and the number of
+     * fragments differs from the number of frames, a new frame is
+     * assumed to start at each fragment that begins with a JPEG,
+     * JPEG-LS or JPEG 2000 start marker, right after a fragment that
+     * ends with an end-of-image marker. On success, "firstFragment"
+     * contains the index of the first fragment of each frame,
+     * followed by the number of fragments.
+     **/
+    static bool GroupFragments(std::vector<size_t>& firstFragment,
+                               const std::vector<uint32_t>& offsetTable,
+                               const std::vector<const char*>& fragmentData,
+                               const std::vector<size_t>& fragmentSizes,
+                               size_t countFrames);
+
+    // Same as above, for a Pixel Data that was parsed by GDCM
+    static bool GroupFragments(std::vector<size_t>& firstFragment,
+                               const gdcm::SequenceOfFragments& fragments,
+                               size_t countFrames);
+  };
+}
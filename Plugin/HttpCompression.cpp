@@ -0,0 +1,204 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "HttpCompression.h"
+
+#include "Configuration.h"
+#include "Metrics.h"
+
+#include <Core/Compression/GzipCompressor.h>
+#include <Core/Compression/ZlibCompressor.h>
+#include <Core/OrthancException.h>
+#include <Core/Toolbox.h>
+
+#include <stdlib.h>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/lexical_cast.hpp>
+
+namespace OrthancPlugins
+{
+  HttpCompression& HttpCompression::GetInstance()
+  {
+    static HttpCompression singleton;
+    return singleton;
+  }
+
+
+  void HttpCompression::Setup(unsigned int level,
+                              size_t minimumSize)
+  {
+    if (level > 9)
+    {
+      OrthancPlugins::Configuration::LogError("The compression level must be between 0 and 9, found: " +
+                                              boost::lexical_cast<std::string>(level));
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    level_ = level;
+    minimumSize_ = minimumSize;
+  }
+
+
+  HttpCompression::Encoding HttpCompression::ParseAcceptEncoding(const std::string& header)
+  {
+    // Choose the accepted encoding with the highest quality value,
+    // preferring gzip over deflate in the case of a tie
+    std::vector<std::string> tokens;
+    Orthanc::Toolbox::TokenizeString(tokens, header, ',');
+
+    Encoding best = Encoding_Identity;
+    double bestQuality = 0;
+
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+      std::string coding = tokens[i];
+      double quality = 1;
+
+      size_t semicolon = coding.find(';');
+      if (semicolon != std::string::npos)
+      {
+        std::string parameter = Orthanc::Toolbox::StripSpaces(coding.substr(semicolon + 1));
+        coding = coding.substr(0, semicolon);
+
+        if (parameter.size() > 2 &&
+            (parameter[0] == 'q' || parameter[0] == 'Q') &&
+            parameter[1] == '=')
+        {
+          quality = atof(parameter.c_str() + 2);
+        }
+      }
+
+      coding = Orthanc::Toolbox::StripSpaces(coding);
+
+      Encoding encoding;
+      if (boost::iequals(coding, "gzip") ||
+          boost::iequals(coding, "x-gzip") ||
+          coding == "*")
+      {
+        encoding = Encoding_Gzip;
+      }
+      else if (boost::iequals(coding, "deflate"))
+      {
+        encoding = Encoding_Deflate;
+      }
+      else
+      {
+        continue;
+      }
+
+      if (quality > bestQuality ||
+          (quality == bestQuality &&
+           quality > 0 &&
+           encoding == Encoding_Gzip))
+      {
+        best = encoding;
+        bestQuality = quality;
+      }
+    }
+
+    return best;
+  }
+
+
+  bool HttpCompression::Compress(std::string& target,
+                                 Encoding encoding,
+                                 const std::string& body) const
+  {
+    if (level_ == 0 ||
+        body.size() < minimumSize_)
+    {
+      return false;
+    }
+
+    switch (encoding)
+    {
+      case Encoding_Identity:
+        return false;
+
+      case Encoding_Gzip:
+      {
+        Orthanc::GzipCompressor compressor;
+        compressor.SetCompressionLevel(static_cast<uint8_t>(level_));
+        compressor.SetPrefixWithUncompressedSize(false);
+        compressor.Compress(target, body.empty() ? NULL : body.c_str(), body.size());
+        break;
+      }
+
+      case Encoding_Deflate:
+      {
+        // The "deflate" content coding corresponds to the zlib format
+        Orthanc::ZlibCompressor compressor;
+        compressor.SetCompressionLevel(static_cast<uint8_t>(level_));
+        compressor.SetPrefixWithUncompressedSize(false);
+        compressor.Compress(target, body.empty() ? NULL : body.c_str(), body.size());
+        break;
+      }
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    // There is no point in sending a compressed answer that is larger
+    return (target.size() < body.size());
+  }
+
+
+  void HttpCompression::AnswerBuffer(OrthancPluginContext* context,
+                                     OrthancPluginRestOutput* output,
+                                     const OrthancPluginHttpRequest* request,
+                                     const std::string& body,
+                                     const char* mimeType,
+                                     const std::string* gzipped) const
+  {
+    if (level_ != 0)
+    {
+      OrthancPluginSetHttpHeader(context, output, "Vary", "Accept-Encoding");
+
+      std::string header;
+      if (request != NULL &&
+          LookupHttpHeader(header, request, "accept-encoding"))
+      {
+        Encoding encoding = ParseAcceptEncoding(header);
+
+        if (encoding == Encoding_Gzip &&
+            gzipped != NULL &&
+            !gzipped->empty())
+        {
+          OrthancPluginSetHttpHeader(context, output, "Content-Encoding", "gzip");
+          OrthancPlugins::MeasuredAnswerBuffer(context, output, gzipped->c_str(), gzipped->size(), mimeType);
+          return;
+        }
+
+        std::string compressed;
+        if (Compress(compressed, encoding, body))
+        {
+          OrthancPluginSetHttpHeader(context, output, "Content-Encoding",
+                                     encoding == Encoding_Gzip ? "gzip" : "deflate");
+          OrthancPlugins::MeasuredAnswerBuffer(context, output, compressed.c_str(), compressed.size(), mimeType);
+          return;
+        }
+      }
+    }
+
+    OrthancPlugins::MeasuredAnswerBuffer(context, output, body.c_str(), body.size(), mimeType);
+  }
+}
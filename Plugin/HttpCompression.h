@@ -0,0 +1,85 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <string>
+#include <boost/noncopyable.hpp>
+
+namespace OrthancPlugins
+{
+  // Compression of the DICOM+JSON answers according to the
+  // "Accept-Encoding" header of the HTTP request. This is only active
+  // if the HTTP compression of the Orthanc core is disabled, as the
+  // core would otherwise compress the answers a second time.
+  class HttpCompression : public boost::noncopyable
+  {
+  public:
+    enum Encoding
+    {
+      Encoding_Identity,
+      Encoding_Gzip,
+      Encoding_Deflate
+    };
+
+  private:
+    unsigned int  level_;    // 0 if the compression is disabled
+    size_t        minimumSize_;
+
+    HttpCompression() :  // Forbidden (singleton pattern)
+      level_(0),
+      minimumSize_(0)
+    {
+    }
+
+  public:
+    static HttpCompression& GetInstance();
+
+    // Must be called before the REST callbacks are registered, as
+    // the parameters are read without locking
+    void Setup(unsigned int level,
+               size_t minimumSize);
+
+    bool IsEnabled() const
+    {
+      return level_ != 0;
+    }
+
+    static Encoding ParseAcceptEncoding(const std::string& header);
+
+    // Returns "false" if the answer must be sent uncompressed
+    bool Compress(std::string& target,
+                  Encoding encoding,
+                  const std::string& body) const;
+
+    // "gzipped" is an optional version of "body" that was previously
+    // compressed with gzip, and that is sent as such if possible
+    void AnswerBuffer(OrthancPluginContext* context,
+                      OrthancPluginRestOutput* output,
+                      const OrthancPluginHttpRequest* request,
+                      const std::string& body,
+                      const char* mimeType,
+                      const std::string* gzipped = NULL) const;
+  };
+}
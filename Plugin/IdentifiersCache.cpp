@@ -0,0 +1,266 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "IdentifiersCache.h"
+
+#include "Configuration.h"
+#include "Metrics.h"
+
+#include <Plugins/Samples/Common/OrthancPluginCppWrapper.h>
+
+namespace OrthancPlugins
+{
+  namespace
+  {
+    class IsChildOfStudy
+    {
+    private:
+      const std::string&  studyId_;
+
+    public:
+      explicit IsChildOfStudy(const std::string& studyId) :
+        studyId_(studyId)
+      {
+      }
+
+      template <typename Payload>
+      bool operator() (const Payload& payload) const
+      {
+        return payload.studyId_ == studyId_;
+      }
+    };
+
+
+    class IsChildOfSeries
+    {
+    private:
+      const std::string&  seriesId_;
+
+    public:
+      explicit IsChildOfSeries(const std::string& seriesId) :
+        seriesId_(seriesId)
+      {
+      }
+
+      bool operator() (const IdentifiersCache::Instance& instance) const
+      {
+        return instance.seriesId_ == seriesId_;
+      }
+    };
+  }
+
+
+  static bool LookupIdentifier(std::string& target,
+                               char* (*func) (OrthancPluginContext*, const char*),
+                               const std::string& uid)
+  {
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    char* tmp = func(context, uid.c_str());
+
+    if (tmp == NULL)
+    {
+      return false;
+    }
+    else
+    {
+      target.assign(tmp);
+      OrthancPluginFreeString(context, tmp);
+      return true;
+    }
+  }
+
+
+  IdentifiersCache& IdentifiersCache::GetInstance()
+  {
+    static IdentifiersCache singleton;
+    return singleton;
+  }
+
+
+  void IdentifiersCache::SetMaximumSize(size_t maxSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    studies_.SetMaximumSize(maxSize);
+    series_.SetMaximumSize(maxSize);
+    instances_.SetMaximumSize(maxSize);
+  }
+
+
+  bool IdentifiersCache::LocateStudy(Study& target,
+                                     const std::string& studyUid)
+  {
+    uint64_t generation;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (studies_.Lookup(target, studyUid))
+      {
+        return true;
+      }
+
+      generation = generation_;
+    }
+
+    if (!LookupIdentifier(target.studyId_, OrthancPluginLookupStudy, studyUid))
+    {
+      return false;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (generation == generation_)  // Not stored if a deletion has occurred in the meantime
+    {
+      studies_.Store(studyUid, target);
+    }
+
+    return true;
+  }
+
+
+  bool IdentifiersCache::LocateSeries(Series& target,
+                                      const std::string& seriesUid)
+  {
+    uint64_t generation;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (series_.Lookup(target, seriesUid))
+      {
+        return true;
+      }
+
+      generation = generation_;
+    }
+
+    if (!LookupIdentifier(target.seriesId_, OrthancPluginLookupSeries, seriesUid))
+    {
+      return false;
+    }
+
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    Json::Value study;
+    if (!OrthancPlugins::MeasuredRestApiGet(study, context, "/series/" + target.seriesId_ + "/study", false))
+    {
+      return false;
+    }
+
+    target.studyId_ = study["ID"].asString();
+    target.studyUid_ = study["MainDicomTags"]["StudyInstanceUID"].asString();
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (generation == generation_)  // Not stored if a deletion has occurred in the meantime
+    {
+      series_.Store(seriesUid, target);
+    }
+
+    return true;
+  }
+
+
+  bool IdentifiersCache::LocateInstance(Instance& target,
+                                        const std::string& sopInstanceUid)
+  {
+    uint64_t generation;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (instances_.Lookup(target, sopInstanceUid))
+      {
+        return true;
+      }
+
+      generation = generation_;
+    }
+
+    if (!LookupIdentifier(target.instanceId_, OrthancPluginLookupInstance, sopInstanceUid))
+    {
+      return false;
+    }
+
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    Json::Value study, series;
+    if (!OrthancPlugins::MeasuredRestApiGet(series, context, "/instances/" + target.instanceId_ + "/series", false) ||
+        !OrthancPlugins::MeasuredRestApiGet(study, context, "/instances/" + target.instanceId_ + "/study", false))
+    {
+      return false;
+    }
+
+    target.seriesId_ = series["ID"].asString();
+    target.seriesUid_ = series["MainDicomTags"]["SeriesInstanceUID"].asString();
+    target.studyId_ = study["ID"].asString();
+    target.studyUid_ = study["MainDicomTags"]["StudyInstanceUID"].asString();
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (generation == generation_)  // Not stored if a deletion has occurred in the meantime
+    {
+      instances_.Store(sopInstanceUid, target);
+    }
+
+    return true;
+  }
+
+
+  void IdentifiersCache::SignalChange(OrthancPluginChangeType changeType,
+                                      OrthancPluginResourceType resourceType,
+                                      const char* resourceId)
+  {
+    if (changeType != OrthancPluginChangeType_Deleted)
+    {
+      return;
+    }
+
+    const std::string id(resourceId);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    generation_++;
+
+    switch (resourceType)
+    {
+      case OrthancPluginResourceType_Instance:
+        instances_.RemoveByOrthancId(id);
+        break;
+
+      case OrthancPluginResourceType_Series:
+        series_.RemoveByOrthancId(id);
+        instances_.RemoveIf(IsChildOfSeries(id));
+        break;
+
+      case OrthancPluginResourceType_Study:
+        studies_.RemoveByOrthancId(id);
+        series_.RemoveIf(IsChildOfStudy(id));
+        instances_.RemoveIf(IsChildOfStudy(id));
+        break;
+
+      default:
+        // The patients are not indexed
+        studies_.Clear();
+        series_.Clear();
+        instances_.Clear();
+        break;
+    }
+  }
+}
@@ -0,0 +1,234 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <Core/Cache/LeastRecentlyUsedIndex.h>
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace OrthancPlugins
+{
+  // Cache mapping the DICOM identifiers (UIDs) of the studies, series
+  // and instances to their Orthanc identifiers, together with their
+  // parents. As the hierarchy of a stored resource never changes,
+  // the entries only have to be invalidated on deletions.
+  class IdentifiersCache : public boost::noncopyable
+  {
+  public:
+    struct Study
+    {
+      std::string  studyId_;
+    };
+
+    struct Series
+    {
+      std::string  seriesId_;
+      std::string  studyId_;
+      std::string  studyUid_;
+    };
+
+    struct Instance
+    {
+      std::string  instanceId_;
+      std::string  seriesId_;
+      std::string  studyId_;
+      std::string  seriesUid_;
+      std::string  studyUid_;
+    };
+
+  private:
+    // Bounded map from one UID to the information about the resource
+    template <typename Payload>
+    class Level : public boost::noncopyable
+    {
+    private:
+      typedef std::map<std::string, Payload>      Content;
+      typedef std::map<std::string, std::string>  Reverse;
+
+      size_t                                        maxSize_;
+      Content                                       content_;
+      Reverse                                       reverse_;  // Orthanc identifier -> UID
+      Orthanc::LeastRecentlyUsedIndex<std::string>  index_;
+
+    public:
+      Level() :
+        maxSize_(0)
+      {
+      }
+
+      void SetMaximumSize(size_t maxSize)
+      {
+        maxSize_ = maxSize;
+        Clear();
+      }
+
+      void Clear()
+      {
+        content_.clear();
+        reverse_.clear();
+
+        while (!index_.IsEmpty())
+        {
+          index_.RemoveOldest();
+        }
+      }
+
+      bool Lookup(Payload& payload,
+                  const std::string& uid)
+      {
+        typename Content::const_iterator found = content_.find(uid);
+        if (found == content_.end())
+        {
+          return false;
+        }
+        else
+        {
+          index_.MakeMostRecent(uid);
+          payload = found->second;
+          return true;
+        }
+      }
+
+      void RemoveByUid(const std::string& uid)
+      {
+        typename Content::iterator found = content_.find(uid);
+        if (found != content_.end())
+        {
+          reverse_.erase(GetOrthancId(found->second));
+          index_.Invalidate(uid);
+          content_.erase(found);
+        }
+      }
+
+      void RemoveByOrthancId(const std::string& id)
+      {
+        Reverse::const_iterator found = reverse_.find(id);
+        if (found != reverse_.end())
+        {
+          std::string uid = found->second;
+          RemoveByUid(uid);
+        }
+      }
+
+      // Remove the entries that are children of some Orthanc resource
+      template <typename Predicate>
+      void RemoveIf(const Predicate& predicate)
+      {
+        std::list<std::string> toRemove;
+
+        for (typename Content::const_iterator it = content_.begin(); it != content_.end(); ++it)
+        {
+          if (predicate(it->second))
+          {
+            toRemove.push_back(it->first);
+          }
+        }
+
+        for (std::list<std::string>::const_iterator it = toRemove.begin(); it != toRemove.end(); ++it)
+        {
+          RemoveByUid(*it);
+        }
+      }
+
+      void Store(const std::string& uid,
+                 const Payload& payload)
+      {
+        if (maxSize_ == 0)
+        {
+          return;
+        }
+
+        RemoveByUid(uid);
+
+        while (content_.size() >= maxSize_)
+        {
+          std::string oldest = index_.RemoveOldest();
+          reverse_.erase(GetOrthancId(content_[oldest]));
+          content_.erase(oldest);
+        }
+
+        content_[uid] = payload;
+        reverse_[GetOrthancId(payload)] = uid;
+        index_.Add(uid);
+      }
+
+      size_t GetSize() const
+      {
+        return content_.size();
+      }
+    };
+
+    static const std::string& GetOrthancId(const Study& study)
+    {
+      return study.studyId_;
+    }
+
+    static const std::string& GetOrthancId(const Series& series)
+    {
+      return series.seriesId_;
+    }
+
+    static const std::string& GetOrthancId(const Instance& instance)
+    {
+      return instance.instanceId_;
+    }
+
+    boost::mutex     mutex_;
+    uint64_t         generation_;  // Incremented on each deletion
+    Level<Study>     studies_;
+    Level<Series>    series_;
+    Level<Instance>  instances_;
+
+    IdentifiersCache() :  // Forbidden (singleton pattern)
+      generation_(0)
+    {
+    }
+
+  public:
+    static IdentifiersCache& GetInstance();
+
+    void SetMaximumSize(size_t maxSize);
+
+    // The "Locate" methods return "false" if the resource is not
+    // stored by Orthanc. They do not check the parent UIDs, which is
+    // up to the caller.
+    bool LocateStudy(Study& target,
+                     const std::string& studyUid);
+
+    bool LocateSeries(Series& target,
+                      const std::string& seriesUid);
+
+    bool LocateInstance(Instance& target,
+                        const std::string& sopInstanceUid);
+
+    // Called from the Orthanc change callback: Must not use the REST API
+    void SignalChange(OrthancPluginChangeType changeType,
+                      OrthancPluginResourceType resourceType,
+                      const char* resourceId);
+  };
+}
@@ -0,0 +1,697 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "JobsEngine.h"
+
+#include "Configuration.h"
+#include "Metrics.h"
+
+#include <Plugins/Samples/Common/OrthancPluginCppWrapper.h>
+
+#include <cassert>
+#include <memory>
+#include <json/reader.h>
+#include <json/writer.h>
+#include <boost/lexical_cast.hpp>
+
+namespace OrthancPlugins
+{
+  // Number of completed jobs whose status remains available
+  static const size_t MAX_COMPLETED_JOBS = 100;
+
+  // Minimum delay between two writes of the progress of the jobs
+  static const long SAVE_PERIOD_SECONDS = 10;
+
+
+  void JobsEngine::Format(Json::Value& target,
+                          const std::string& id,
+                          const Descriptor& descriptor)
+  {
+    target = Json::objectValue;
+    target["ID"] = id;
+    target["Type"] = descriptor.job_->GetType();
+    target["CreationTime"] = boost::posix_time::to_iso_string(descriptor.creationTime_);
+
+    if (!descriptor.server_.empty())
+    {
+      target["Server"] = descriptor.server_;
+    }
+
+    switch (descriptor.state_)
+    {
+      case State_Pending:
+        target["State"] = "Pending";
+        break;
+
+      case State_Running:
+        target["State"] = "Running";
+        break;
+
+      case State_Success:
+        target["State"] = "Success";
+        break;
+
+      case State_Failure:
+        target["State"] = "Failure";
+        target["ErrorDescription"] = descriptor.error_;
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    if (!descriptor.startTime_.is_not_a_date_time())
+    {
+      target["StartTime"] = boost::posix_time::to_iso_string(descriptor.startTime_);
+    }
+
+    if (descriptor.state_ == State_Success ||
+        descriptor.state_ == State_Failure)
+    {
+      target["CompletionTime"] = boost::posix_time::to_iso_string(descriptor.completionTime_);
+    }
+
+    Json::Value progress = Json::objectValue;
+    descriptor.job_->FormatProgress(progress);
+    target["Progress"] = progress;
+
+    const uint64_t bytes = descriptor.job_->GetTransferredBytes();
+    target["TransferredBytes"] = boost::lexical_cast<std::string>(bytes);
+
+    if (!descriptor.startTime_.is_not_a_date_time())
+    {
+      boost::posix_time::ptime end = (descriptor.state_ == State_Running ?
+                                      boost::posix_time::microsec_clock::universal_time() :
+                                      descriptor.completionTime_);
+
+      double seconds = static_cast<double>((end - descriptor.startTime_).total_milliseconds()) / 1000.0;
+      target["BytesPerSecond"] = (seconds > 0 ? static_cast<double>(bytes) / seconds : 0.0);
+    }
+  }
+
+
+  void JobsEngine::RemoveOldestCompleted()
+  {
+    // The mutex must be locked by the caller
+    std::string id = completed_.front();
+    completed_.pop_front();
+
+    Jobs::iterator found = jobs_.find(id);
+    if (found != jobs_.end())
+    {
+      delete found->second->job_;
+      delete found->second;
+      jobs_.erase(found);
+    }
+  }
+
+
+  bool JobsEngine::DequeuePending(std::string& id,
+                                  Descriptor*& descriptor)
+  {
+    // The mutex must be locked by the caller. The first pending job
+    // whose server has not reached its limit is selected.
+    for (std::list<std::string>::iterator it = pending_.begin(); it != pending_.end(); ++it)
+    {
+      Jobs::iterator found = jobs_.find(*it);
+      if (found == jobs_.end())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      const std::string& server = found->second->server_;
+      if (maxPerServer_ == 0 ||
+          server.empty() ||
+          runningPerServer_[server] < maxPerServer_)
+      {
+        id = *it;
+        descriptor = found->second;
+        pending_.erase(it);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+
+  void JobsEngine::Enqueue(const std::string& id,
+                           IJob* job)
+  {
+    // The mutex must be locked by the caller
+    std::auto_ptr<IJob> protection(job);
+
+    if (jobs_.find(id) != jobs_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    std::auto_ptr<Descriptor> descriptor(new Descriptor);
+    descriptor->job_ = protection.release();
+    descriptor->server_ = job->GetServer();
+    descriptor->state_ = State_Pending;
+    descriptor->creationTime_ = boost::posix_time::microsec_clock::universal_time();
+
+    jobs_[id] = descriptor.release();
+    pending_.push_back(id);
+    condition_.notify_one();
+  }
+
+
+  void JobsEngine::SaveState()
+  {
+    if (property_ < 0)
+    {
+      return;
+    }
+
+    // Serializes the writes, so that an older state cannot overwrite
+    // a newer one
+    boost::mutex::scoped_lock saveLock(saveMutex_);
+
+    Json::Value state = Json::objectValue;
+    state["Jobs"] = Json::arrayValue;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      // The running jobs are resumed first, then the pending jobs in
+      // the order of their submission
+      std::list<std::string> ids;
+      for (Jobs::const_iterator it = jobs_.begin(); it != jobs_.end(); ++it)
+      {
+        if (it->second->state_ == State_Running)
+        {
+          ids.push_back(it->first);
+        }
+      }
+
+      ids.insert(ids.end(), pending_.begin(), pending_.end());
+
+      for (std::list<std::string>::const_iterator it = ids.begin(); it != ids.end(); ++it)
+      {
+        IJob& job = *jobs_[*it]->job_;
+
+        Json::Value content;
+        if (job.Serialize(content))
+        {
+          Json::Value item = Json::objectValue;
+          item["ID"] = *it;
+          item["Type"] = job.GetType();
+          item["Content"] = content;
+          state["Jobs"].append(item);
+        }
+      }
+
+      lastSave_ = boost::posix_time::microsec_clock::universal_time();
+    }
+
+    Json::FastWriter writer;
+    std::string s = writer.write(state);
+
+    if (OrthancPluginSetGlobalProperty(OrthancPlugins::Configuration::GetContext(),
+                                       property_, s.c_str()) != OrthancPluginErrorCode_Success)
+    {
+      OrthancPlugins::Configuration::LogWarning("Cannot store the DICOMweb jobs in the global property " +
+                                                boost::lexical_cast<std::string>(property_));
+    }
+  }
+
+
+  void JobsEngine::LoadState(Unserializer unserializer)
+  {
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    std::string s;
+
+    {
+      char* value = OrthancPluginGetGlobalProperty(context, property_, "");
+      if (value == NULL)
+      {
+        return;
+      }
+
+      s.assign(value);
+      OrthancPluginFreeString(context, value);
+    }
+
+    Json::Value state;
+    Json::Reader reader;
+    if (s.empty() ||
+        !reader.parse(s, state) ||
+        state.type() != Json::objectValue ||
+        !state.isMember("Jobs") ||
+        state["Jobs"].type() != Json::arrayValue)
+    {
+      return;
+    }
+
+    const Json::Value& jobs = state["Jobs"];
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (Json::Value::ArrayIndex i = 0; i < jobs.size(); i++)
+    {
+      if (jobs[i].type() != Json::objectValue ||
+          !jobs[i].isMember("ID") ||
+          !jobs[i].isMember("Type") ||
+          !jobs[i].isMember("Content") ||
+          jobs[i]["ID"].type() != Json::stringValue ||
+          jobs[i]["Type"].type() != Json::stringValue)
+      {
+        continue;
+      }
+
+      const std::string id = jobs[i]["ID"].asString();
+
+      try
+      {
+        IJob* job = unserializer(jobs[i]["Type"].asString(), jobs[i]["Content"]);
+        if (job == NULL)
+        {
+          OrthancPlugins::Configuration::LogWarning("Cannot resume DICOMweb job " + id + " of unknown type: " +
+                                                    jobs[i]["Type"].asString());
+        }
+        else
+        {
+          Enqueue(id, job);
+          OrthancPlugins::Configuration::LogWarning("Resuming DICOMweb job " + id + " of type: " + job->GetType());
+        }
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        OrthancPlugins::Configuration::LogError("Cannot resume DICOMweb job " + id + ": " + std::string(e.What()));
+      }
+    }
+  }
+
+
+  void JobsEngine::Worker(JobsEngine* that)
+  {
+    for (;;)
+    {
+      std::string id;
+      Descriptor* descriptor = NULL;
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        while (!that->done_ &&
+               !that->DequeuePending(id, descriptor))
+        {
+          that->condition_.wait(lock);
+        }
+
+        if (that->done_)
+        {
+          return;
+        }
+
+        descriptor->state_ = State_Running;
+        descriptor->startTime_ = boost::posix_time::microsec_clock::universal_time();
+
+        if (!descriptor->server_.empty())
+        {
+          that->runningPerServer_[descriptor->server_]++;
+        }
+      }
+
+      State state = State_Success;
+      std::string error;
+
+      try
+      {
+        descriptor->job_->Execute();
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        state = State_Failure;
+        error = e.What();
+      }
+      catch (...)
+      {
+        state = State_Failure;
+        error = "Native exception";
+      }
+
+      bool save;
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        if (!descriptor->server_.empty())
+        {
+          assert(that->runningPerServer_[descriptor->server_] > 0);
+          that->runningPerServer_[descriptor->server_]--;
+        }
+
+        if (that->done_ &&
+            state == State_Failure)
+        {
+          // Interrupted by the shutdown of Orthanc: The job remains
+          // stored in the database, and will be resumed
+          return;
+        }
+
+        descriptor->state_ = state;
+        descriptor->error_ = error;
+        descriptor->completionTime_ = boost::posix_time::microsec_clock::universal_time();
+        that->completed_.push_back(id);
+
+        // Another job of the same server may now be started
+        that->condition_.notify_all();
+
+        save = !that->done_;
+      }
+
+      if (state == State_Success)
+      {
+        OrthancPlugins::Configuration::LogInfo("DICOMweb job " + id + " has succeeded");
+      }
+      else
+      {
+        OrthancPlugins::Configuration::LogError("DICOMweb job " + id + " has failed: " + error);
+      }
+
+      if (save)
+      {
+        that->SaveState();
+      }
+    }
+  }
+
+
+  JobsEngine& JobsEngine::GetInstance()
+  {
+    static JobsEngine singleton;
+    return singleton;
+  }
+
+
+  void JobsEngine::Start(unsigned int threads,
+                         unsigned int maxPerServer,
+                         int32_t property,
+                         Unserializer unserializer)
+  {
+    if (threads == 0)
+    {
+      threads = 1;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (!workers_.empty() ||
+          done_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+
+      maxPerServer_ = maxPerServer;
+      property_ = property;
+    }
+
+    if (property_ >= 0 &&
+        unserializer != NULL)
+    {
+      LoadState(unserializer);
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (unsigned int i = 0; i < threads; i++)
+    {
+      workers_.push_back(new boost::thread(Worker, this));
+    }
+  }
+
+
+  std::string JobsEngine::Submit(IJob* job)
+  {
+    std::auto_ptr<IJob> protection(job);
+
+    if (job == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+    }
+
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    std::string id;
+
+    {
+      char* uuid = OrthancPluginGenerateUuid(context);
+      if (uuid == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory);
+      }
+
+      id.assign(uuid);
+      OrthancPluginFreeString(context, uuid);
+    }
+
+    const std::string type = job->GetType();
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (done_ ||
+          workers_.empty())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+
+      while (completed_.size() > MAX_COMPLETED_JOBS)
+      {
+        RemoveOldestCompleted();
+      }
+
+      Enqueue(id, protection.release());
+    }
+
+    OrthancPlugins::Configuration::LogInfo("New DICOMweb job " + id + " of type: " + type);
+
+    SaveState();
+
+    return id;
+  }
+
+
+  bool JobsEngine::GetJob(Json::Value& target,
+                          const std::string& id)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Jobs::const_iterator found = jobs_.find(id);
+    if (found == jobs_.end())
+    {
+      return false;
+    }
+    else
+    {
+      Format(target, id, *found->second);
+      return true;
+    }
+  }
+
+
+  void JobsEngine::ListJobs(Json::Value& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target = Json::arrayValue;
+    for (Jobs::const_iterator it = jobs_.begin(); it != jobs_.end(); ++it)
+    {
+      target.append(it->first);
+    }
+  }
+
+
+  bool JobsEngine::Cancel(const std::string& id)
+  {
+    bool save = false;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Jobs::const_iterator found = jobs_.find(id);
+      if (found == jobs_.end())
+      {
+        return false;
+      }
+
+      Descriptor& descriptor = *found->second;
+
+      if (descriptor.state_ == State_Running)
+      {
+        descriptor.job_->Cancel();
+      }
+      else if (descriptor.state_ == State_Pending)
+      {
+        pending_.remove(id);
+        descriptor.state_ = State_Failure;
+        descriptor.error_ = "Canceled before being started";
+        descriptor.completionTime_ = boost::posix_time::microsec_clock::universal_time();
+        completed_.push_back(id);
+        save = true;
+      }
+    }
+
+    if (save)
+    {
+      SaveState();
+    }
+
+    return true;
+  }
+
+
+  void JobsEngine::SignalProgress()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (done_ ||
+          property_ < 0 ||
+          (!lastSave_.is_not_a_date_time() &&
+           boost::posix_time::microsec_clock::universal_time() - lastSave_ <
+           boost::posix_time::seconds(SAVE_PERIOD_SECONDS)))
+      {
+        return;
+      }
+    }
+
+    SaveState();
+  }
+
+
+  void JobsEngine::Finalize()
+  {
+    std::vector<boost::thread*> workers;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+
+      for (Jobs::iterator it = jobs_.begin(); it != jobs_.end(); ++it)
+      {
+        if (it->second->state_ == State_Running)
+        {
+          it->second->job_->Cancel();
+        }
+      }
+
+      workers.swap(workers_);
+    }
+
+    condition_.notify_all();
+
+    // The mutex must be unlocked, as the workers lock it on completion
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+      if (workers[i]->joinable())
+      {
+        workers[i]->join();
+      }
+
+      delete workers[i];
+    }
+
+    // The workers do not save the state once the shutdown has begun:
+    // Store the jobs that have been interrupted, and forget those
+    // that have completed in the meantime
+    SaveState();
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (Jobs::iterator it = jobs_.begin(); it != jobs_.end(); ++it)
+    {
+      delete it->second->job_;
+      delete it->second;
+    }
+
+    jobs_.clear();
+    pending_.clear();
+    completed_.clear();
+    runningPerServer_.clear();
+  }
+
+
+  void ServeJobs(OrthancPluginRestOutput* output,
+                 const char* url,
+                 const OrthancPluginHttpRequest* request)
+  {
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    if (request->groupsCount == 0)
+    {
+      if (request->method != OrthancPluginHttpMethod_Get)
+      {
+        OrthancPluginSendMethodNotAllowed(context, output, "GET");
+        return;
+      }
+
+      Json::Value jobs;
+      JobsEngine::GetInstance().ListJobs(jobs);
+
+      std::string answer = jobs.toStyledString();
+      OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+    }
+    else if (request->groupsCount == 1)
+    {
+      const std::string id(request->groups[0]);
+
+      if (request->method == OrthancPluginHttpMethod_Get)
+      {
+        Json::Value job;
+        if (JobsEngine::GetInstance().GetJob(job, id))
+        {
+          std::string answer = job.toStyledString();
+          OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+        }
+        else
+        {
+          OrthancPluginSendHttpStatusCode(context, output, 404);
+        }
+      }
+      else if (request->method == OrthancPluginHttpMethod_Delete)
+      {
+        if (JobsEngine::GetInstance().Cancel(id))
+        {
+          std::string answer = "{}";
+          OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+        }
+        else
+        {
+          OrthancPluginSendHttpStatusCode(context, output, 404);
+        }
+      }
+      else
+      {
+        OrthancPluginSendMethodNotAllowed(context, output, "GET,DELETE");
+      }
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest);
+    }
+  }
+}
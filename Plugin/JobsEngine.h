@@ -0,0 +1,179 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <orthanc/OrthancCPlugin.h>
+#include <json/value.h>
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+namespace OrthancPlugins
+{
+  // Registry of the long-running operations of the DICOMweb client
+  // that are executed in background, so that they do not hold one
+  // HTTP thread of Orthanc during their whole duration. The plugin
+  // SDK does not give access to the jobs engine of the Orthanc core.
+  // The jobs are queued, then run by a fixed pool of threads, with a
+  // limit on the number of jobs that target the same server. The
+  // jobs that are not completed are stored as a global property of
+  // the Orthanc database, and are resumed when the plugin restarts.
+  class JobsEngine : public boost::noncopyable
+  {
+  public:
+    class IJob : public boost::noncopyable
+    {
+    public:
+      virtual ~IJob()
+      {
+      }
+
+      virtual const char* GetType() const = 0;
+
+      // Name of the remote server, to limit the number of jobs that
+      // run concurrently against it (empty if not applicable)
+      virtual std::string GetServer() const = 0;
+
+      // Executed by a worker thread, throws an exception on failure
+      virtual void Execute() = 0;
+
+      // The methods below are called from other threads while
+      // "Execute()" is running
+      virtual void Cancel() = 0;
+
+      virtual void FormatProgress(Json::Value& target) = 0;
+
+      virtual uint64_t GetTransferredBytes() = 0;
+
+      // Describes the work that remains to be done, so that the job
+      // can be resumed after a restart. Returns "false" if the job
+      // cannot be resumed.
+      virtual bool Serialize(Json::Value& target) = 0;
+    };
+
+    // Recreates a job from the output of "IJob::Serialize()", or
+    // returns NULL if the type is unknown
+    typedef IJob* (*Unserializer) (const std::string& type,
+                                   const Json::Value& serialized);
+
+  private:
+    enum State
+    {
+      State_Pending,
+      State_Running,
+      State_Success,
+      State_Failure
+    };
+
+    struct Descriptor
+    {
+      IJob*                     job_;
+      std::string               server_;
+      State                     state_;
+      std::string               error_;
+      boost::posix_time::ptime  creationTime_;
+      boost::posix_time::ptime  startTime_;
+      boost::posix_time::ptime  completionTime_;
+    };
+
+    typedef std::map<std::string, Descriptor*>  Jobs;
+
+    boost::mutex                 mutex_;
+    boost::condition_variable    condition_;
+    Jobs                         jobs_;
+    std::list<std::string>       pending_;     // Oldest first
+    std::list<std::string>       completed_;   // Oldest first
+    std::map<std::string, unsigned int>  runningPerServer_;
+    std::vector<boost::thread*>  workers_;
+    unsigned int                 maxPerServer_;  // 0 means no limit
+    bool                         done_;
+
+    boost::mutex                 saveMutex_;
+    int32_t                      property_;    // Negative if the jobs are not persisted
+    boost::posix_time::ptime     lastSave_;
+
+    void Format(Json::Value& target,
+                const std::string& id,
+                const Descriptor& descriptor);
+
+    void RemoveOldestCompleted();
+
+    bool DequeuePending(std::string& id,
+                        Descriptor*& descriptor);
+
+    void Enqueue(const std::string& id,
+                 IJob* job);
+
+    void SaveState();
+
+    void LoadState(Unserializer unserializer);
+
+    static void Worker(JobsEngine* that);
+
+    JobsEngine() :  // Forbidden (singleton pattern)
+      maxPerServer_(0),
+      done_(false),
+      property_(-1)
+    {
+    }
+
+  public:
+    static JobsEngine& GetInstance();
+
+    // Starts the workers, then resumes the jobs that were not
+    // completed by the former execution, if "property" is not negative
+    void Start(unsigned int threads,
+               unsigned int maxPerServer,
+               int32_t property,
+               Unserializer unserializer);
+
+    // Takes the ownership of the job, and returns its identifier
+    std::string Submit(IJob* job);
+
+    bool GetJob(Json::Value& target,
+                const std::string& id);
+
+    void ListJobs(Json::Value& target);
+
+    bool Cancel(const std::string& id);
+
+    // Can be called by the running jobs to store their progress, so
+    // that less work is repeated if Orthanc restarts. This is
+    // throttled to one write to the database every few seconds.
+    void SignalProgress();
+
+    // Cancels the running jobs and waits for the workers to stop. The
+    // jobs that were not completed are resumed by the next execution.
+    void Finalize();
+  };
+
+
+  void ServeJobs(OrthancPluginRestOutput* output,
+                 const char* url,
+                 const OrthancPluginHttpRequest* request);
+}
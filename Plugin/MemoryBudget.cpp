@@ -0,0 +1,78 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "MemoryBudget.h"
+
+namespace OrthancPlugins
+{
+  MemoryBudget::Reservation::Reservation(MemoryBudget& budget,
+                                         size_t size) :
+    budget_(budget),
+    size_(size)
+  {
+    boost::mutex::scoped_lock lock(budget_.mutex_);
+
+    while (budget_.maxSize_ != 0 &&
+           budget_.usedSize_ != 0 &&
+           budget_.usedSize_ + size_ > budget_.maxSize_)
+    {
+      budget_.released_.wait(lock);
+    }
+
+    budget_.usedSize_ += size_;
+  }
+
+
+  MemoryBudget::Reservation::~Reservation()
+  {
+    {
+      boost::mutex::scoped_lock lock(budget_.mutex_);
+      budget_.usedSize_ -= size_;
+    }
+
+    budget_.released_.notify_all();
+  }
+
+
+  void MemoryBudget::SetMaxSize(size_t maxSize)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      maxSize_ = maxSize;
+    }
+
+    released_.notify_all();
+  }
+
+
+  size_t MemoryBudget::GetMaxSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return maxSize_;
+  }
+
+
+  size_t MemoryBudget::GetUsedSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return usedSize_;
+  }
+}
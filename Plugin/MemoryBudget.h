@@ -0,0 +1,74 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace OrthancPlugins
+{
+  // Bound on the total size of the buffers that are simultaneously
+  // allocated by the threads of one module. A reservation waits until
+  // enough memory is released by the other threads. A reservation
+  // that exceeds the budget is granted once no other reservation is
+  // active, so that it cannot wait forever.
+  class MemoryBudget : public boost::noncopyable
+  {
+  private:
+    boost::mutex               mutex_;
+    boost::condition_variable  released_;
+    size_t                     maxSize_;  // 0 means no limit
+    size_t                     usedSize_;
+
+  public:
+    class Reservation : public boost::noncopyable
+    {
+    private:
+      MemoryBudget&  budget_;
+      size_t         size_;
+
+    public:
+      Reservation(MemoryBudget& budget,
+                  size_t size);
+
+      ~Reservation();
+
+      size_t GetSize() const
+      {
+        return size_;
+      }
+    };
+
+    explicit MemoryBudget(size_t maxSize) :
+      maxSize_(maxSize),
+      usedSize_(0)
+    {
+    }
+
+    void SetMaxSize(size_t maxSize);
+
+    size_t GetMaxSize();
+
+    size_t GetUsedSize();
+  };
+}
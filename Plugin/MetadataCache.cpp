@@ -0,0 +1,248 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "MetadataCache.h"
+
+#include "Configuration.h"
+#include "Dicom.h"
+#include "Metrics.h"
+
+#include <Plugins/Samples/Common/OrthancPluginCppWrapper.h>
+
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/lexical_cast.hpp>
+#include <string.h>
+
+
+namespace OrthancPlugins
+{
+  // The first line of the attachment identifies the version of its
+  // format. It must be changed whenever "GenerateSingleDicomAnswer()"
+  // changes its output, so that the stale attachments are recomputed.
+  static const char* const METADATA_HEADER = "DICOMweb-metadata-1\n";
+
+  // The WADO base URL depends on the HTTP request (cf. the "Host"
+  // header), so a placeholder is stored in the bulk data URIs
+  static const char* const WADO_BASE_PLACEHOLDER = "dicomweb-base:/";
+
+  // Maximum number of instances waiting for the background
+  // computation. Beyond, the new instances are not precomputed, as
+  // their metadata is anyway computed on their first access.
+  static const size_t MAX_QUEUED_INSTANCES = 10000;
+
+
+  bool MetadataCache::Compute(std::string& target,
+                              const std::string& instanceId)
+  {
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    OrthancPlugins::MemoryBuffer content(context);
+    if (!OrthancPlugins::MeasuredRestApiGet(content, "/instances/" + instanceId + "/file", false))
+    {
+      return false;
+    }
+
+    // The pixel data is only reported through its bulk data URI
+    OrthancPlugins::ParsedDicomFile dicom(content, DICOM_TAG_PIXEL_DATA);
+    GenerateSingleDicomAnswer(target, WADO_BASE_PLACEHOLDER, *dictionary_,
+                              dicom.GetDataSet(), false /* JSON */, true);
+    return true;
+  }
+
+
+  void MetadataCache::Store(const std::string& instanceId,
+                            const std::string& metadata)
+  {
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    std::string body = METADATA_HEADER + metadata;
+
+    OrthancPlugins::MemoryBuffer answer(context);
+    if (!OrthancPlugins::MeasuredRestApiPut(answer, "/instances/" + instanceId + "/attachments/" + attachment_, body, false))
+    {
+      OrthancPlugins::Configuration::LogWarning("Cannot store the DICOMweb metadata of instance " + instanceId);
+    }
+  }
+
+
+  void MetadataCache::Worker(MetadataCache* that)
+  {
+    for (;;)
+    {
+      std::string instanceId;
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        while (that->queue_.empty() &&
+               !that->done_)
+        {
+          that->condition_.wait(lock);
+        }
+
+        if (that->done_)
+        {
+          return;
+        }
+
+        instanceId = that->queue_.front();
+        that->queue_.pop_front();
+      }
+
+      try
+      {
+        std::string metadata;
+        if (that->Compute(metadata, instanceId))
+        {
+          that->Store(instanceId, metadata);
+        }
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        OrthancPlugins::Configuration::LogError("Cannot compute the DICOMweb metadata of instance " +
+                                                instanceId + ": " + std::string(e.What()));
+      }
+      catch (...)
+      {
+        OrthancPlugins::Configuration::LogError("Cannot compute the DICOMweb metadata of instance " + instanceId);
+      }
+    }
+  }
+
+
+  MetadataCache& MetadataCache::GetInstance()
+  {
+    static MetadataCache singleton;
+    return singleton;
+  }
+
+
+  void MetadataCache::Start(const gdcm::Dict& dictionary,
+                            unsigned int attachment)
+  {
+    if (worker_.get() != NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    // Cf. "IsUserContentType()" in the Orthanc core
+    if (attachment < 1024 ||
+        attachment > 65535)
+    {
+      OrthancPlugins::Configuration::LogError("The attachment for the DICOMweb metadata must be "
+                                              "between 1024 and 65535: " +
+                                              boost::lexical_cast<std::string>(attachment));
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    dictionary_ = &dictionary;
+    attachment_ = boost::lexical_cast<std::string>(attachment);
+    done_ = false;
+    worker_.reset(new boost::thread(Worker, this));
+  }
+
+
+  void MetadataCache::Stop()
+  {
+    if (worker_.get() != NULL)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        done_ = true;
+      }
+
+      condition_.notify_all();
+
+      if (worker_->joinable())
+      {
+        worker_->join();
+      }
+
+      worker_.reset(NULL);
+    }
+  }
+
+
+  void MetadataCache::SignalChange(OrthancPluginChangeType changeType,
+                                   OrthancPluginResourceType resourceType,
+                                   const char* resourceId)
+  {
+    if (IsEnabled() &&
+        changeType == OrthancPluginChangeType_NewInstance &&
+        resourceType == OrthancPluginResourceType_Instance)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (queue_.size() >= MAX_QUEUED_INSTANCES)
+        {
+          OrthancPlugins::Configuration::LogInfo("Too many instances are waiting for their DICOMweb metadata, "
+                                                 "it will be computed on the first access to instance " +
+                                                 std::string(resourceId));
+          return;
+        }
+
+        queue_.push_back(resourceId);
+      }
+
+      condition_.notify_one();
+    }
+  }
+
+
+  bool MetadataCache::GetInstanceMetadata(std::string& target,
+                                          const std::string& instanceId,
+                                          const std::string& wadoBase)
+  {
+    if (!IsEnabled())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    const size_t headerSize = strlen(METADATA_HEADER);
+
+    OrthancPlugins::MemoryBuffer attachment(context);
+    if (OrthancPlugins::MeasuredRestApiGet(attachment, "/instances/" + instanceId + "/attachments/" + attachment_ + "/data", false) &&
+        attachment.GetSize() >= headerSize &&
+        memcmp(attachment.GetData(), METADATA_HEADER, headerSize) == 0)
+    {
+      target.assign(attachment.GetData() + headerSize, attachment.GetSize() - headerSize);
+    }
+    else
+    {
+      // Not computed yet (e.g. instance received before the plugin
+      // was installed), or stored with a former version of the plugin
+      if (!Compute(target, instanceId))
+      {
+        return false;
+      }
+
+      Store(instanceId, target);
+    }
+
+    boost::replace_all(target,
+                       "\"BulkDataURI\":\"" + std::string(WADO_BASE_PLACEHOLDER),
+                       "\"BulkDataURI\":\"" + wadoBase);
+    return true;
+  }
+}
@@ -0,0 +1,88 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <orthanc/OrthancCPlugin.h>
+#include <gdcmDict.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+namespace OrthancPlugins
+{
+  // Storage of the DICOM+JSON metadata of each instance as an Orthanc
+  // attachment, so that the WADO-RS metadata routes do not have to
+  // parse the DICOM files. The metadata is computed in background
+  // when the instance is received, or on its first access.
+  class MetadataCache : public boost::noncopyable
+  {
+  private:
+    boost::mutex                  mutex_;
+    boost::condition_variable     condition_;
+    std::deque<std::string>       queue_;
+    bool                          done_;
+    std::auto_ptr<boost::thread>  worker_;
+    const gdcm::Dict*             dictionary_;
+    std::string                   attachment_;
+
+    bool Compute(std::string& target,
+                 const std::string& instanceId);
+
+    void Store(const std::string& instanceId,
+               const std::string& metadata);
+
+    static void Worker(MetadataCache* that);
+
+    MetadataCache() :  // Forbidden (singleton pattern)
+      done_(false),
+      dictionary_(NULL)
+    {
+    }
+
+  public:
+    static MetadataCache& GetInstance();
+
+    void Start(const gdcm::Dict& dictionary,
+               unsigned int attachment);
+
+    void Stop();
+
+    bool IsEnabled() const
+    {
+      return dictionary_ != NULL;
+    }
+
+    // Called from the Orthanc change callback: Must not use the REST API
+    void SignalChange(OrthancPluginChangeType changeType,
+                      OrthancPluginResourceType resourceType,
+                      const char* resourceId);
+
+    // Get the DICOM+JSON metadata of one instance, as generated by
+    // "GenerateSingleDicomAnswer()" for the given WADO base URL
+    bool GetInstanceMetadata(std::string& target,
+                             const std::string& instanceId,
+                             const std::string& wadoBase);
+  };
+}
@@ -0,0 +1,741 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "Metrics.h"
+
+#include "Configuration.h"
+
+#include <cassert>
+#include <cstdio>
+#include <exception>
+#include <boost/thread/tss.hpp>
+
+
+namespace OrthancPlugins
+{
+  static const double LATENCY_BOUNDS[] = {
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60
+  };
+
+  static const double INSTANCES_BOUNDS[] = {
+    0, 1, 10, 100, 1000, 10000
+  };
+
+  static const double REST_API_BOUNDS[] = {
+    0, 1, 2, 5, 10, 20, 50, 100, 1000
+  };
+
+  static const double QUANTILES[] = {
+    0.5, 0.95, 0.99
+  };
+
+
+  static std::string FormatDouble(double value)
+  {
+    char buffer[64];
+    sprintf(buffer, "%.9g", value);
+    return buffer;
+  }
+
+
+  static double GetElapsedSeconds(const boost::posix_time::ptime& start)
+  {
+    boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - start;
+    return static_cast<double>(elapsed.total_microseconds()) / 1000000.0;
+  }
+
+
+  static const char* GetStageLabel(Metrics::Stage stage)
+  {
+    switch (stage)
+    {
+      case Metrics::Stage_RestApi:
+        return "rest-api";
+
+      case Metrics::Stage_Parse:
+        return "parse";
+
+      case Metrics::Stage_Transcode:
+        return "transcode";
+
+      case Metrics::Stage_Serialize:
+        return "serialize";
+
+      case Metrics::Stage_Send:
+        return "send";
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  static const char* GetMethodLabel(OrthancPluginHttpMethod method)
+  {
+    switch (method)
+    {
+      case OrthancPluginHttpMethod_Get:
+        return "GET";
+
+      case OrthancPluginHttpMethod_Post:
+        return "POST";
+
+      case OrthancPluginHttpMethod_Put:
+        return "PUT";
+
+      case OrthancPluginHttpMethod_Delete:
+        return "DELETE";
+
+      default:
+        return "";
+    }
+  }
+
+
+  static std::string FormatLabels(const std::string& route,
+                                  OrthancPluginHttpMethod method)
+  {
+    std::string escaped;
+    escaped.reserve(route.size());
+
+    for (size_t i = 0; i < route.size(); i++)
+    {
+      if (route[i] == '\\' ||
+          route[i] == '"')
+      {
+        escaped.push_back('\\');
+      }
+
+      if (route[i] == '\n')
+      {
+        escaped.append("\\n");
+      }
+      else
+      {
+        escaped.push_back(route[i]);
+      }
+    }
+
+    return "route=\"" + escaped + "\",method=\"" + GetMethodLabel(method) + "\"";
+  }
+
+
+  static void FormatHeader(std::string& target,
+                           const std::string& name,
+                           const std::string& type,
+                           const std::string& help)
+  {
+    target.append("# HELP " + name + " " + help + "\n");
+    target.append("# TYPE " + name + " " + type + "\n");
+  }
+
+
+  MetricsHistogram::MetricsHistogram(const double* bounds,
+                                     size_t countBounds) :
+    bounds_(bounds),
+    countBounds_(countBounds),
+    buckets_(countBounds + 1, 0),
+    count_(0),
+    sum_(0)
+  {
+  }
+
+
+  void MetricsHistogram::Add(double value)
+  {
+    size_t i = 0;
+    while (i < countBounds_ &&
+           value > bounds_[i])
+    {
+      i++;
+    }
+
+    buckets_[i]++;
+    count_++;
+    sum_ += value;
+  }
+
+
+  double MetricsHistogram::EstimateQuantile(double quantile) const
+  {
+    if (count_ == 0)
+    {
+      return 0;
+    }
+
+    const double rank = quantile * static_cast<double>(count_);
+
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < countBounds_; i++)
+    {
+      if (static_cast<double>(cumulative + buckets_[i]) >= rank &&
+          buckets_[i] != 0)
+      {
+        double lower = (i == 0 ? 0 : bounds_[i - 1]);
+        double upper = bounds_[i];
+        if (lower > upper)
+        {
+          lower = upper;
+        }
+
+        return lower + (upper - lower) * (rank - static_cast<double>(cumulative)) / static_cast<double>(buckets_[i]);
+      }
+
+      cumulative += buckets_[i];
+    }
+
+    // The quantile is in the "+Inf" bucket
+    return (countBounds_ == 0 ? 0 : bounds_[countBounds_ - 1]);
+  }
+
+
+  void MetricsHistogram::Format(std::string& target,
+                                const std::string& name,
+                                const std::string& labels) const
+  {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < countBounds_; i++)
+    {
+      cumulative += buckets_[i];
+      target.append(name + "_bucket{" + labels + ",le=\"" + FormatDouble(bounds_[i]) + "\"} " +
+                    boost::lexical_cast<std::string>(cumulative) + "\n");
+    }
+
+    target.append(name + "_bucket{" + labels + ",le=\"+Inf\"} " + boost::lexical_cast<std::string>(count_) + "\n");
+    target.append(name + "_sum{" + labels + "} " + FormatDouble(sum_) + "\n");
+    target.append(name + "_count{" + labels + "} " + boost::lexical_cast<std::string>(count_) + "\n");
+  }
+
+
+  // The request that is served by each thread. The requests are
+  // owned by the REST callbacks, so they are not deleted here.
+  static void NoCleanup(Metrics::Request*)
+  {
+  }
+
+  static boost::thread_specific_ptr<Metrics::Request>  currentRequest_(NoCleanup);
+
+
+  Metrics::Counters::Counters() :
+    bytesSent_(0),
+    instances_(0)
+  {
+    for (size_t i = 0; i < Stage_Count; i++)
+    {
+      stageCalls_[i] = 0;
+      stageSeconds_[i] = 0;
+    }
+  }
+
+
+  void Metrics::Counters::Add(const Counters& other)
+  {
+    bytesSent_ += other.bytesSent_;
+    instances_ += other.instances_;
+
+    for (size_t i = 0; i < Stage_Count; i++)
+    {
+      stageCalls_[i] += other.stageCalls_[i];
+      stageSeconds_[i] += other.stageSeconds_[i];
+    }
+  }
+
+
+  Metrics::Route::Route() :
+    errors_(0),
+    latency_(LATENCY_BOUNDS, sizeof(LATENCY_BOUNDS) / sizeof(double)),
+    instances_(INSTANCES_BOUNDS, sizeof(INSTANCES_BOUNDS) / sizeof(double)),
+    restApiCalls_(REST_API_BOUNDS, sizeof(REST_API_BOUNDS) / sizeof(double))
+  {
+  }
+
+
+  Metrics::Request::Request(const std::string& route,
+                            OrthancPluginHttpMethod method) :
+    route_(route),
+    method_(method),
+    start_(boost::posix_time::microsec_clock::universal_time()),
+    previous_(currentRequest_.get())
+  {
+    currentRequest_.reset(this);
+  }
+
+
+  Metrics::Request::~Request()
+  {
+    currentRequest_.reset(previous_);
+
+    try
+    {
+      // The REST callbacks report their errors by throwing exceptions
+      Metrics::GetInstance().Record(*this, std::uncaught_exception());
+    }
+    catch (...)
+    {
+      // Ignore the errors in destructors
+    }
+  }
+
+
+  Metrics::Scope::Scope(Request* request) :
+    previous_(currentRequest_.get())
+  {
+    currentRequest_.reset(request);
+  }
+
+
+  Metrics::Scope::~Scope()
+  {
+    currentRequest_.reset(previous_);
+  }
+
+
+  Metrics::StageTimer::StageTimer(Stage stage) :
+    stage_(stage)
+  {
+    if (Metrics::GetInstance().IsEnabled())
+    {
+      start_ = boost::posix_time::microsec_clock::universal_time();
+    }
+  }
+
+
+  Metrics::StageTimer::~StageTimer()
+  {
+    if (!start_.is_not_a_date_time())
+    {
+      Counters counters;
+      counters.stageCalls_[stage_] = 1;
+      counters.stageSeconds_[stage_] = GetElapsedSeconds(start_);
+      AddToCurrent(counters);
+    }
+  }
+
+
+  void Metrics::AddToCurrent(const Counters& counters)
+  {
+    Request* request = currentRequest_.get();
+
+    if (request == NULL)
+    {
+      Metrics& that = GetInstance();
+      boost::mutex::scoped_lock lock(that.mutex_);
+      that.background_.Add(counters);
+    }
+    else
+    {
+      boost::mutex::scoped_lock lock(request->mutex_);
+      request->counters_.Add(counters);
+    }
+  }
+
+
+  void Metrics::Record(Request& request,
+                       bool isError)
+  {
+    const double seconds = GetElapsedSeconds(request.start_);
+
+    Counters counters;
+
+    {
+      // Some worker might still be attached to the request
+      boost::mutex::scoped_lock lock(request.mutex_);
+      counters = request.counters_;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    const RouteKey key(request.route_, request.method_);
+
+    Routes::iterator found = routes_.find(key);
+    if (found == routes_.end())
+    {
+      found = routes_.insert(std::make_pair(key, new Route)).first;
+    }
+
+    Route& route = *found->second;
+
+    if (isError)
+    {
+      route.errors_++;
+    }
+
+    route.latency_.Add(seconds);
+    route.instances_.Add(static_cast<double>(counters.instances_));
+    route.restApiCalls_.Add(static_cast<double>(counters.stageCalls_[Stage_RestApi]));
+    route.counters_.Add(counters);
+  }
+
+
+  Metrics::~Metrics()
+  {
+    for (Routes::iterator it = routes_.begin(); it != routes_.end(); ++it)
+    {
+      assert(it->second != NULL);
+      delete it->second;
+    }
+  }
+
+
+  Metrics& Metrics::GetInstance()
+  {
+    static Metrics singleton;
+    return singleton;
+  }
+
+
+  Metrics::Request* Metrics::GetCurrentRequest()
+  {
+    return currentRequest_.get();
+  }
+
+
+  void Metrics::SignalInstances(size_t count)
+  {
+    if (GetInstance().IsEnabled())
+    {
+      Counters counters;
+      counters.instances_ = count;
+      AddToCurrent(counters);
+    }
+  }
+
+
+  void Metrics::SignalBytesSent(size_t size)
+  {
+    if (GetInstance().IsEnabled())
+    {
+      Counters counters;
+      counters.bytesSent_ = size;
+      AddToCurrent(counters);
+    }
+  }
+
+
+  std::string Metrics::GetRouteLabel(const std::string& uri)
+  {
+    // Each group of the regular expression is replaced by "*"
+    std::string label;
+    label.reserve(uri.size());
+
+    unsigned int depth = 0;
+    for (size_t i = 0; i < uri.size(); i++)
+    {
+      if (uri[i] == '(')
+      {
+        if (depth == 0)
+        {
+          label.push_back('*');
+        }
+
+        depth++;
+      }
+      else if (uri[i] == ')' &&
+               depth > 0)
+      {
+        depth--;
+      }
+      else if (depth == 0)
+      {
+        label.push_back(uri[i]);
+      }
+    }
+
+    return label;
+  }
+
+
+  void Metrics::Format(std::string& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target.clear();
+
+    FormatHeader(target, "dicomweb_requests_total", "counter", "Number of requests to each route");
+    for (Routes::const_iterator it = routes_.begin(); it != routes_.end(); ++it)
+    {
+      target.append("dicomweb_requests_total{" + FormatLabels(it->first.first, it->first.second) + "} " +
+                    boost::lexical_cast<std::string>(it->second->latency_.GetCount()) + "\n");
+    }
+
+    FormatHeader(target, "dicomweb_request_errors_total", "counter", "Number of requests that have failed");
+    for (Routes::const_iterator it = routes_.begin(); it != routes_.end(); ++it)
+    {
+      target.append("dicomweb_request_errors_total{" + FormatLabels(it->first.first, it->first.second) + "} " +
+                    boost::lexical_cast<std::string>(it->second->errors_) + "\n");
+    }
+
+    FormatHeader(target, "dicomweb_request_duration_seconds", "histogram", "Latency of the requests");
+    for (Routes::const_iterator it = routes_.begin(); it != routes_.end(); ++it)
+    {
+      it->second->latency_.Format(target, "dicomweb_request_duration_seconds",
+                                  FormatLabels(it->first.first, it->first.second));
+    }
+
+    FormatHeader(target, "dicomweb_request_duration_quantile_seconds", "gauge",
+                 "Quantiles of the latency of the requests, estimated from the histogram");
+    for (Routes::const_iterator it = routes_.begin(); it != routes_.end(); ++it)
+    {
+      for (size_t i = 0; i < sizeof(QUANTILES) / sizeof(double); i++)
+      {
+        target.append("dicomweb_request_duration_quantile_seconds{" +
+                      FormatLabels(it->first.first, it->first.second) +
+                      ",quantile=\"" + FormatDouble(QUANTILES[i]) + "\"} " +
+                      FormatDouble(it->second->latency_.EstimateQuantile(QUANTILES[i])) + "\n");
+      }
+    }
+
+    FormatHeader(target, "dicomweb_request_instances", "histogram",
+                 "Number of DICOM instances or datasets in each answer, or stored by each STOW-RS request");
+    for (Routes::const_iterator it = routes_.begin(); it != routes_.end(); ++it)
+    {
+      it->second->instances_.Format(target, "dicomweb_request_instances",
+                                    FormatLabels(it->first.first, it->first.second));
+    }
+
+    FormatHeader(target, "dicomweb_request_rest_api_calls", "histogram",
+                 "Number of calls to the REST API of Orthanc issued by each request");
+    for (Routes::const_iterator it = routes_.begin(); it != routes_.end(); ++it)
+    {
+      it->second->restApiCalls_.Format(target, "dicomweb_request_rest_api_calls",
+                                       FormatLabels(it->first.first, it->first.second));
+    }
+
+    // The measures that are not related to any request (such as the
+    // jobs of the DICOMweb client) have an empty route and method
+    FormatHeader(target, "dicomweb_sent_bytes_total", "counter", "Size of the answers sent to the Orthanc core");
+    for (Routes::const_iterator it = routes_.begin(); it != routes_.end(); ++it)
+    {
+      target.append("dicomweb_sent_bytes_total{" + FormatLabels(it->first.first, it->first.second) + "} " +
+                    boost::lexical_cast<std::string>(it->second->counters_.bytesSent_) + "\n");
+    }
+
+    target.append("dicomweb_sent_bytes_total{" + FormatLabels("", static_cast<OrthancPluginHttpMethod>(0)) + "} " +
+                  boost::lexical_cast<std::string>(background_.bytesSent_) + "\n");
+
+    FormatHeader(target, "dicomweb_stage_seconds_total", "counter", "Time spent in each stage of the processing");
+    for (size_t stage = 0; stage < Stage_Count; stage++)
+    {
+      const std::string label = std::string(",stage=\"") + GetStageLabel(static_cast<Stage>(stage)) + "\"";
+
+      for (Routes::const_iterator it = routes_.begin(); it != routes_.end(); ++it)
+      {
+        target.append("dicomweb_stage_seconds_total{" + FormatLabels(it->first.first, it->first.second) + label + "} " +
+                      FormatDouble(it->second->counters_.stageSeconds_[stage]) + "\n");
+      }
+
+      target.append("dicomweb_stage_seconds_total{" + FormatLabels("", static_cast<OrthancPluginHttpMethod>(0)) +
+                    label + "} " + FormatDouble(background_.stageSeconds_[stage]) + "\n");
+    }
+
+    FormatHeader(target, "dicomweb_stage_calls_total", "counter", "Number of times each stage was entered");
+    for (size_t stage = 0; stage < Stage_Count; stage++)
+    {
+      const std::string label = std::string(",stage=\"") + GetStageLabel(static_cast<Stage>(stage)) + "\"";
+
+      for (Routes::const_iterator it = routes_.begin(); it != routes_.end(); ++it)
+      {
+        target.append("dicomweb_stage_calls_total{" + FormatLabels(it->first.first, it->first.second) + label + "} " +
+                      boost::lexical_cast<std::string>(it->second->counters_.stageCalls_[stage]) + "\n");
+      }
+
+      target.append("dicomweb_stage_calls_total{" + FormatLabels("", static_cast<OrthancPluginHttpMethod>(0)) +
+                    label + "} " + boost::lexical_cast<std::string>(background_.stageCalls_[stage]) + "\n");
+    }
+  }
+
+
+  void MetricsRoutes::Register(const std::string& uri)
+  {
+    Pattern pattern;
+    pattern.groups_ = 0;
+    pattern.regex_ = boost::regex(uri);
+    pattern.label_ = Metrics::GetRouteLabel(uri);
+
+    for (size_t i = 0; i < uri.size(); i++)
+    {
+      if (uri[i] == '(')
+      {
+        pattern.groups_++;
+      }
+    }
+
+    patterns_.push_back(pattern);
+  }
+
+
+  const std::string& MetricsRoutes::GetLabel(const char* url,
+                                             const OrthancPluginHttpRequest* request) const
+  {
+    const Pattern* candidate = NULL;
+    size_t count = 0;
+
+    for (std::list<Pattern>::const_iterator it = patterns_.begin(); it != patterns_.end(); ++it)
+    {
+      if (it->groups_ == request->groupsCount)
+      {
+        candidate = &(*it);
+        count++;
+      }
+    }
+
+    if (count == 1)
+    {
+      return candidate->label_;
+    }
+
+    for (std::list<Pattern>::const_iterator it = patterns_.begin(); it != patterns_.end(); ++it)
+    {
+      if (boost::regex_match(url, it->regex_))
+      {
+        return it->label_;
+      }
+    }
+
+    if (patterns_.empty())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      return patterns_.front().label_;
+    }
+  }
+
+
+  bool MeasuredRestApiGet(Json::Value& result,
+                          OrthancPluginContext* context,
+                          const std::string& uri,
+                          bool applyPlugins)
+  {
+    Metrics::StageTimer timer(Metrics::Stage_RestApi);
+    return RestApiGet(result, context, uri, applyPlugins);
+  }
+
+
+  bool MeasuredRestApiGetString(std::string& result,
+                                OrthancPluginContext* context,
+                                const std::string& uri,
+                                bool applyPlugins)
+  {
+    Metrics::StageTimer timer(Metrics::Stage_RestApi);
+    return RestApiGetString(result, context, uri, applyPlugins);
+  }
+
+
+  bool MeasuredRestApiPost(Json::Value& result,
+                           OrthancPluginContext* context,
+                           const std::string& uri,
+                           const std::string& body,
+                           bool applyPlugins)
+  {
+    Metrics::StageTimer timer(Metrics::Stage_RestApi);
+    return RestApiPost(result, context, uri, body, applyPlugins);
+  }
+
+
+  bool MeasuredRestApiGet(MemoryBuffer& result,
+                          const std::string& uri,
+                          bool applyPlugins)
+  {
+    Metrics::StageTimer timer(Metrics::Stage_RestApi);
+    return result.RestApiGet(uri, applyPlugins);
+  }
+
+
+  bool MeasuredRestApiPost(MemoryBuffer& result,
+                           const std::string& uri,
+                           const char* body,
+                           size_t bodySize,
+                           bool applyPlugins)
+  {
+    Metrics::StageTimer timer(Metrics::Stage_RestApi);
+    return result.RestApiPost(uri, body, bodySize, applyPlugins);
+  }
+
+
+  bool MeasuredRestApiPut(MemoryBuffer& result,
+                          const std::string& uri,
+                          const std::string& body,
+                          bool applyPlugins)
+  {
+    Metrics::StageTimer timer(Metrics::Stage_RestApi);
+    return result.RestApiPut(uri, body, applyPlugins);
+  }
+
+
+  void MeasuredAnswerBuffer(OrthancPluginContext* context,
+                            OrthancPluginRestOutput* output,
+                            const char* answer,
+                            uint32_t answerSize,
+                            const char* mimeType)
+  {
+    Metrics::SignalBytesSent(answerSize);
+    Metrics::StageTimer timer(Metrics::Stage_Send);
+    OrthancPluginAnswerBuffer(context, output, answer, answerSize, mimeType);
+  }
+
+
+  OrthancPluginErrorCode MeasuredSendMultipartItem(OrthancPluginContext* context,
+                                                   OrthancPluginRestOutput* output,
+                                                   const char* answer,
+                                                   uint32_t answerSize)
+  {
+    Metrics::SignalBytesSent(answerSize);
+    Metrics::StageTimer timer(Metrics::Stage_Send);
+    return OrthancPluginSendMultipartItem(context, output, answer, answerSize);
+  }
+
+
+#if HAS_SEND_MULTIPART_ITEM_2 == 1
+  OrthancPluginErrorCode MeasuredSendMultipartItem2(OrthancPluginContext* context,
+                                                    OrthancPluginRestOutput* output,
+                                                    const char* answer,
+                                                    uint32_t answerSize,
+                                                    uint32_t headersCount,
+                                                    const char* const* headersKeys,
+                                                    const char* const* headersValues)
+  {
+    Metrics::SignalBytesSent(answerSize);
+    Metrics::StageTimer timer(Metrics::Stage_Send);
+    return OrthancPluginSendMultipartItem2(context, output, answer, answerSize,
+                                           headersCount, headersKeys, headersValues);
+  }
+#endif
+
+
+  void ServeMetrics(OrthancPluginRestOutput* output,
+                    const char* url,
+                    const OrthancPluginHttpRequest* request)
+  {
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    if (request->method != OrthancPluginHttpMethod_Get)
+    {
+      OrthancPluginSendMethodNotAllowed(context, output, "GET");
+      return;
+    }
+
+    std::string answer;
+    Metrics::GetInstance().Format(answer);
+    MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "text/plain; version=0.0.4");
+  }
+}
@@ -0,0 +1,333 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "Configuration.h"
+
+#include <Plugins/Samples/Common/OrthancPluginCppWrapper.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/regex.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace OrthancPlugins
+{
+  // Cumulative histogram with fixed upper bounds, as in Prometheus
+  class MetricsHistogram
+  {
+  private:
+    const double*          bounds_;  // Sorted, without the "+Inf" bound
+    size_t                 countBounds_;
+    std::vector<uint64_t>  buckets_;  // Not cumulative, one more item for "+Inf"
+    uint64_t               count_;
+    double                 sum_;
+
+  public:
+    MetricsHistogram(const double* bounds,
+                     size_t countBounds);
+
+    void Add(double value);
+
+    uint64_t GetCount() const
+    {
+      return count_;
+    }
+
+    // Linear interpolation inside the bucket that contains the
+    // quantile, as the "histogram_quantile()" function of Prometheus
+    double EstimateQuantile(double quantile) const;
+
+    // Appends the "_bucket", "_sum" and "_count" samples
+    void Format(std::string& target,
+                const std::string& name,
+                const std::string& labels) const;
+  };
+
+
+  // Instrumentation of the DICOMweb routes: Count, latency, bytes sent
+  // and instances of the requests, and time spent in each stage of
+  // their processing. The measures are attached to the thread that
+  // serves the request, and to the workers of "WorkerPool" that
+  // execute its jobs. They are exported in the Prometheus text format.
+  class Metrics : public boost::noncopyable
+  {
+  public:
+    enum Stage
+    {
+      Stage_RestApi,     // Calls to the REST API and to the storage area of Orthanc
+      Stage_Parse,       // Parsing of DICOM instances by GDCM
+      Stage_Transcode,   // Decoding, encoding and change of transfer syntax of the images
+      Stage_Serialize,   // Writing of DICOM+JSON and DICOM+XML
+      Stage_Send,        // Transmission of the answers to the Orthanc core
+      Stage_Count        // Not a stage: The number of stages
+    };
+
+  private:
+    struct Counters
+    {
+      uint64_t  bytesSent_;
+      uint64_t  instances_;
+      uint64_t  stageCalls_[Stage_Count];
+      double    stageSeconds_[Stage_Count];
+
+      Counters();
+
+      void Add(const Counters& other);
+    };
+
+  public:
+    // Measures one call to a route. Until it is destroyed, the
+    // measures of the current thread are added to this request.
+    class Request : public boost::noncopyable
+    {
+      friend class Metrics;
+
+    private:
+      boost::mutex              mutex_;  // The workers of "WorkerPool" share the counters
+      const std::string&        route_;
+      OrthancPluginHttpMethod   method_;
+      boost::posix_time::ptime  start_;
+      Counters                  counters_;
+      Request*                  previous_;
+
+    public:
+      Request(const std::string& route,
+              OrthancPluginHttpMethod method);
+
+      ~Request();
+    };
+
+    // Attaches the measures of the current thread to another request
+    // (possibly NULL), typically in a worker thread
+    class Scope : public boost::noncopyable
+    {
+    private:
+      Request*  previous_;
+
+    public:
+      explicit Scope(Request* request);
+
+      ~Scope();
+    };
+
+    // Measures the time spent by the current thread in one stage
+    class StageTimer : public boost::noncopyable
+    {
+    private:
+      Stage                     stage_;
+      boost::posix_time::ptime  start_;
+
+    public:
+      explicit StageTimer(Stage stage);
+
+      ~StageTimer();
+    };
+
+  private:
+    struct Route
+    {
+      uint64_t          errors_;
+      MetricsHistogram  latency_;
+      MetricsHistogram  instances_;
+      MetricsHistogram  restApiCalls_;
+      Counters          counters_;
+
+      Route();
+    };
+
+    typedef std::pair<std::string, OrthancPluginHttpMethod>  RouteKey;
+    typedef std::map<RouteKey, Route*>                        Routes;
+
+    boost::mutex   mutex_;
+    bool           enabled_;
+    Routes         routes_;
+    Counters       background_;  // Measures that are not related to any request
+
+    static void AddToCurrent(const Counters& counters);
+
+    void Record(Request& request,
+                bool isError);
+
+    Metrics() :  // Forbidden (singleton pattern)
+      enabled_(false)
+    {
+    }
+
+  public:
+    ~Metrics();
+
+    static Metrics& GetInstance();
+
+    // Must be called before the REST callbacks are registered. The
+    // calls to the services of the Orthanc core are only measured if
+    // they go through the "Measured...()" wrappers below.
+    void Enable()
+    {
+      enabled_ = true;
+    }
+
+    bool IsEnabled() const
+    {
+      return enabled_;
+    }
+
+    static Request* GetCurrentRequest();
+
+    static void SignalInstances(size_t count);
+
+    static void SignalBytesSent(size_t size);
+
+    // Label of a route, given the regular expression of its URI
+    static std::string GetRouteLabel(const std::string& uri);
+
+    void Format(std::string& target);
+  };
+
+
+  // Labels of the URIs that are served by one REST callback. As the
+  // REST callbacks are not told which of their URIs has matched, the
+  // label is chosen by the number of groups of the request, and if
+  // this is ambiguous, by matching the regular expressions again.
+  class MetricsRoutes : public boost::noncopyable
+  {
+  private:
+    struct Pattern
+    {
+      uint32_t      groups_;
+      boost::regex  regex_;
+      std::string   label_;
+    };
+
+    std::list<Pattern>  patterns_;  // Only modified before the REST callbacks are registered
+
+  public:
+    void Register(const std::string& uri);
+
+    const std::string& GetLabel(const char* url,
+                                const OrthancPluginHttpRequest* request) const;
+  };
+
+
+  // Wraps a REST callback, so that its requests are measured
+  template <RestCallback Callback>
+  class InstrumentedRoute
+  {
+  public:
+    static MetricsRoutes routes_;
+
+    static void Handle(OrthancPluginRestOutput* output,
+                       const char* url,
+                       const OrthancPluginHttpRequest* request)
+    {
+      if (Metrics::GetInstance().IsEnabled())
+      {
+        Metrics::Request measure(routes_.GetLabel(url, request), request->method);
+        Callback(output, url, request);
+      }
+      else
+      {
+        Callback(output, url, request);
+      }
+    }
+  };
+
+  template <RestCallback Callback>
+  MetricsRoutes InstrumentedRoute<Callback>::routes_;
+
+
+  // Same as "RegisterRestCallback()", with the measures of the
+  // requests, that are labeled by the URI pattern that has matched
+  template <RestCallback Callback>
+  void RegisterInstrumentedRestCallback(OrthancPluginContext* context,
+                                        const std::string& uri,
+                                        bool isThreadSafe)
+  {
+    InstrumentedRoute<Callback>::routes_.Register(uri);
+    RegisterRestCallback< InstrumentedRoute<Callback>::Handle >(context, uri, isThreadSafe);
+  }
+
+
+  // Wrappers of the services of the Orthanc core, that measure the
+  // calls to the REST API and the transmission of the answers
+  bool MeasuredRestApiGet(Json::Value& result,
+                          OrthancPluginContext* context,
+                          const std::string& uri,
+                          bool applyPlugins);
+
+  bool MeasuredRestApiGetString(std::string& result,
+                                OrthancPluginContext* context,
+                                const std::string& uri,
+                                bool applyPlugins);
+
+  bool MeasuredRestApiPost(Json::Value& result,
+                           OrthancPluginContext* context,
+                           const std::string& uri,
+                           const std::string& body,
+                           bool applyPlugins);
+
+  bool MeasuredRestApiGet(MemoryBuffer& result,
+                          const std::string& uri,
+                          bool applyPlugins);
+
+  bool MeasuredRestApiPost(MemoryBuffer& result,
+                           const std::string& uri,
+                           const char* body,
+                           size_t bodySize,
+                           bool applyPlugins);
+
+  bool MeasuredRestApiPut(MemoryBuffer& result,
+                          const std::string& uri,
+                          const std::string& body,
+                          bool applyPlugins);
+
+  void MeasuredAnswerBuffer(OrthancPluginContext* context,
+                            OrthancPluginRestOutput* output,
+                            const char* answer,
+                            uint32_t answerSize,
+                            const char* mimeType);
+
+  OrthancPluginErrorCode MeasuredSendMultipartItem(OrthancPluginContext* context,
+                                                   OrthancPluginRestOutput* output,
+                                                   const char* answer,
+                                                   uint32_t answerSize);
+
+#if HAS_SEND_MULTIPART_ITEM_2 == 1
+  OrthancPluginErrorCode MeasuredSendMultipartItem2(OrthancPluginContext* context,
+                                                    OrthancPluginRestOutput* output,
+                                                    const char* answer,
+                                                    uint32_t answerSize,
+                                                    uint32_t headersCount,
+                                                    const char* const* headersKeys,
+                                                    const char* const* headersValues);
+#endif
+
+
+  void ServeMetrics(OrthancPluginRestOutput* output,
+                    const char* url,
+                    const OrthancPluginHttpRequest* request);
+}
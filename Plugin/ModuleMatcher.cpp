@@ -0,0 +1,562 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ModuleMatcher.h"
+
+#include "Configuration.h"
+#include "DictionaryTable.h"
+#include "Metrics.h"
+
+#include <Core/Toolbox.h>
+
+#include <set>
+#include <stdio.h>
+#include <boost/lexical_cast.hpp>
+#include <json/writer.h>
+
+
+namespace OrthancPlugins
+{
+  std::string FormatOrthancTag(const gdcm::Tag& tag)
+  {
+    char b[10];
+    OrthancPlugins::DictionaryTable::FormatOrthancKey(b, tag);
+    return std::string(b);
+  }
+
+
+  std::string GetOrthancTag(const Json::Value& source,
+                            const gdcm::Tag& tag,
+                            const std::string& defaultValue)
+  {
+    // The key is formatted into a stack buffer, which avoids
+    // allocating a string for the lookups below
+    char s[10];
+    OrthancPlugins::DictionaryTable::FormatOrthancKey(s, tag);
+
+    if (!source.isMember(s))
+    {
+      return defaultValue;
+    }
+
+    const Json::Value& item = source[s];
+    if (item.type() != Json::objectValue ||
+        !item.isMember("Value") ||
+        !item.isMember("Type"))
+    {
+      return defaultValue;
+    }
+
+    const Json::Value& value = item["Value"];
+    if (item["Type"] == "String" &&
+        value.type() == Json::stringValue)
+    {
+      return value.asString();
+    }
+    else
+    {
+      return defaultValue;
+    }
+  }
+
+
+  static void AddResultAttributesForLevel(std::list<gdcm::Tag>& result,
+                                          QueryLevel level)
+  {
+    switch (level)
+    {
+      case QueryLevel_Study:
+        // http://medical.nema.org/medical/dicom/current/output/html/part18.html#table_6.7.1-2
+        result.push_back(gdcm::Tag(0x0008, 0x0005));  // Specific Character Set
+        result.push_back(gdcm::Tag(0x0008, 0x0020));  // Study Date
+        result.push_back(gdcm::Tag(0x0008, 0x0030));  // Study Time
+        result.push_back(gdcm::Tag(0x0008, 0x0050));  // Accession Number
+        result.push_back(gdcm::Tag(0x0008, 0x0056));  // Instance Availability
+        //result.push_back(gdcm::Tag(0x0008, 0x0061));  // Modalities in Study  => SPECIAL CASE
+        result.push_back(gdcm::Tag(0x0008, 0x0090));  // Referring Physician's Name
+        result.push_back(gdcm::Tag(0x0008, 0x0201));  // Timezone Offset From UTC
+        //result.push_back(gdcm::Tag(0x0008, 0x1190));  // Retrieve URL  => SPECIAL CASE
+        result.push_back(gdcm::Tag(0x0010, 0x0010));  // Patient's Name
+        result.push_back(gdcm::Tag(0x0010, 0x0020));  // Patient ID
+        result.push_back(gdcm::Tag(0x0010, 0x0030));  // Patient's Birth Date
+        result.push_back(gdcm::Tag(0x0010, 0x0040));  // Patient's Sex
+        result.push_back(gdcm::Tag(0x0020, 0x000D));  // Study Instance UID
+        result.push_back(gdcm::Tag(0x0020, 0x0010));  // Study ID
+        //result.push_back(gdcm::Tag(0x0020, 0x1206));  // Number of Study Related Series  => SPECIAL CASE
+        //result.push_back(gdcm::Tag(0x0020, 0x1208));  // Number of Study Related Instances  => SPECIAL CASE
+        break;
+
+      case QueryLevel_Series:
+        // http://medical.nema.org/medical/dicom/current/output/html/part18.html#table_6.7.1-2a
+        result.push_back(gdcm::Tag(0x0008, 0x0005));  // Specific Character Set
+        result.push_back(gdcm::Tag(0x0008, 0x0060));  // Modality
+        result.push_back(gdcm::Tag(0x0008, 0x0201));  // Timezone Offset From UTC
+        result.push_back(gdcm::Tag(0x0008, 0x103E));  // Series Description
+        //result.push_back(gdcm::Tag(0x0008, 0x1190));  // Retrieve URL  => SPECIAL CASE
+        result.push_back(gdcm::Tag(0x0020, 0x000E));  // Series Instance UID
+        result.push_back(gdcm::Tag(0x0020, 0x0011));  // Series Number
+        //result.push_back(gdcm::Tag(0x0020, 0x1209));  // Number of Series Related Instances  => SPECIAL CASE
+        result.push_back(gdcm::Tag(0x0040, 0x0244));  // Performed Procedure Step Start Date
+        result.push_back(gdcm::Tag(0x0040, 0x0245));  // Performed Procedure Step Start Time
+        result.push_back(gdcm::Tag(0x0040, 0x0275));  // Request Attribute Sequence
+        break;
+
+      case QueryLevel_Instance:
+        // http://medical.nema.org/medical/dicom/current/output/html/part18.html#table_6.7.1-2b
+        result.push_back(gdcm::Tag(0x0008, 0x0005));  // Specific Character Set
+        result.push_back(gdcm::Tag(0x0008, 0x0016));  // SOP Class UID
+        result.push_back(gdcm::Tag(0x0008, 0x0018));  // SOP Instance UID
+        result.push_back(gdcm::Tag(0x0008, 0x0056));  // Instance Availability
+        result.push_back(gdcm::Tag(0x0008, 0x0201));  // Timezone Offset From UTC
+        result.push_back(gdcm::Tag(0x0008, 0x1190));  // Retrieve URL
+        result.push_back(gdcm::Tag(0x0020, 0x0013));  // Instance Number
+        result.push_back(gdcm::Tag(0x0028, 0x0010));  // Rows
+        result.push_back(gdcm::Tag(0x0028, 0x0011));  // Columns
+        result.push_back(gdcm::Tag(0x0028, 0x0100));  // Bits Allocated
+        result.push_back(gdcm::Tag(0x0028, 0x0008));  // Number of Frames
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+  }
+
+
+  ModuleMatcher::ModuleMatcher(const gdcm::Dict& dictionary,
+                               const OrthancPluginHttpRequest* request) :
+    fuzzy_(false),
+    offset_(0),
+    limit_(0),
+    includeAllFields_(false)
+  {
+    std::string args;
+    
+    for (uint32_t i = 0; i < request->getCount; i++)
+    {
+      std::string key(request->getKeys[i]);
+      std::string value(request->getValues[i]);
+      args += " [" + key + "=" + value + "]";
+
+      if (key == "limit")
+      {
+        limit_ = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (key == "offset")
+      {
+        offset_ = boost::lexical_cast<unsigned int>(value);
+      }
+      else if (key == "continuation")
+      {
+        continuation_ = value;
+      }
+      else if (key == "fuzzymatching")
+      {
+        if (value == "true")
+        {
+          fuzzy_ = true;
+        }
+        else if (value == "false")
+        {
+          fuzzy_ = false;
+        }
+        else
+        {
+          OrthancPlugins::Configuration::LogError("Not a proper value for fuzzy matching (true or false): " + value);
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest);
+        }
+      }
+      else if (key == "includefield")
+      {
+        if (value == "all")
+        {
+          includeAllFields_ = true;
+        }
+        else
+        {
+          // Split a comma-separated list of tags
+          std::vector<std::string> tags;
+          Orthanc::Toolbox::TokenizeString(tags, value, ',');
+          for (size_t i = 0; i < tags.size(); i++)
+          {
+            includeFields_.push_back(OrthancPlugins::ParseTag(dictionary, tags[i]));
+          }
+        }
+      }
+      else
+      {
+        filters_[OrthancPlugins::ParseTag(dictionary, key)] = value;
+      }
+    }
+
+    OrthancPlugins::Configuration::LogInfo("Arguments of QIDO-RS request:" + args);
+  }
+
+
+  void ModuleMatcher::FormatQuery(Json::Value& target,
+                                  QueryLevel level) const
+  {
+    target = Json::objectValue;
+    target["Level"] = static_cast<int>(level);
+    target["Fuzzy"] = fuzzy_;
+    target["Filters"] = Json::objectValue;
+
+    for (Filters::const_iterator it = filters_.begin(); 
+         it != filters_.end(); ++it)
+    {
+      target["Filters"][FormatOrthancTag(it->first)] = it->second;
+    }
+  }
+
+
+  void ModuleMatcher::FormatCacheKey(std::string& target,
+                                     QueryLevel level,
+                                     const std::string& wadoBase,
+                                     bool isXml) const
+  {
+    Json::Value key;
+    FormatQuery(key, level);
+    key["WadoBase"] = wadoBase;
+    key["Xml"] = isXml;
+    key["Limit"] = limit_;
+    key["Offset"] = offset_;
+    key["IncludeAllFields"] = includeAllFields_;
+
+    std::set<std::string> fields;
+    for (std::list<gdcm::Tag>::const_iterator it = includeFields_.begin();
+         it != includeFields_.end(); ++it)
+    {
+      fields.insert(FormatOrthancTag(*it));
+    }
+
+    key["IncludeFields"] = Json::arrayValue;
+    for (std::set<std::string>::const_iterator it = fields.begin(); it != fields.end(); ++it)
+    {
+      key["IncludeFields"].append(*it);
+    }
+
+    Json::FastWriter writer;
+    target = writer.write(key);
+  }
+
+
+  void ModuleMatcher::FormatContinuationKey(std::string& target,
+                                            QueryLevel level) const
+  {
+    Json::Value key;
+    FormatQuery(key, level);
+
+    Json::FastWriter writer;
+    target = writer.write(key);
+  }
+
+
+  bool ModuleMatcher::IsOffsetHandledByOrthanc()
+  {
+    return OrthancPlugins::CheckMinimalOrthancVersion(
+      OrthancPlugins::Configuration::GetContext(), 1, 3, 0);
+  }
+
+
+  void ModuleMatcher::Print(std::ostream& out) const 
+  {
+    for (Filters::const_iterator it = filters_.begin(); 
+         it != filters_.end(); ++it)
+    {
+      printf("Filter [%04x,%04x] = [%s]\n", it->first.GetGroup(), it->first.GetElement(), it->second.c_str());
+    }
+  }
+
+
+  void ModuleMatcher::ConvertToOrthanc(Json::Value& result,
+                                       QueryLevel level) const
+  {
+    // One more resource than the limit is requested, in order to
+    // detect whether additional results are available
+    ConvertToOrthanc(result, level, offset_, (limit_ == 0 ? 0 : limit_ + 1));
+  }
+
+
+  void ModuleMatcher::ConvertToOrthanc(Json::Value& result,
+                                       QueryLevel level,
+                                       unsigned int offset,
+                                       unsigned int count) const
+  {
+    result = Json::objectValue;
+
+    switch (level)
+    {
+      case QueryLevel_Study:
+        result["Level"] = "Study";
+        break;
+
+      case QueryLevel_Series:
+        result["Level"] = "Series";
+        break;
+
+      case QueryLevel_Instance:
+        result["Level"] = "Instance";
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    // Expanding the studies and the series directly provides their
+    // children, which avoids one REST call per resource later on
+    result["Expand"] = (level != QueryLevel_Instance);
+    result["CaseSensitive"] = OrthancPlugins::Configuration::GetBooleanValue("QidoCaseSensitive", true);
+    result["Query"] = Json::objectValue;
+
+    if (IsOffsetHandledByOrthanc())
+    {
+      result["Limit"] = count;
+      result["Since"] = offset;
+    }
+    else
+    {
+      // "Since" is only available if the Orthanc core version is
+      // >= 1.3.0: The offset will be applied by the plugin, but
+      // still before any per-resource processing
+      result["Limit"] = (count == 0 ? 0 : offset + count);
+    }
+    
+    for (Filters::const_iterator it = filters_.begin(); 
+         it != filters_.end(); ++it)
+    {
+      result["Query"][FormatOrthancTag(it->first)] = it->second;
+    }
+  }
+
+
+  void ModuleMatcher::ComputeDerivedTags(Filters& target,
+                                         QueryLevel level,
+                                         const std::string& resource) const
+  {
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    target.clear();
+
+    switch (level)
+    {
+      case QueryLevel_Study:
+      {
+        Json::Value series, instances;
+        if (OrthancPlugins::MeasuredRestApiGet(series, context, "/studies/" + resource + "/series?expand", false) &&
+            OrthancPlugins::MeasuredRestApiGet(instances, context, "/studies/" + resource + "/instances", false))
+        {
+          // Number of Study Related Series
+          target[gdcm::Tag(0x0020, 0x1206)] = boost::lexical_cast<std::string>(series.size());
+
+          // Number of Study Related Instances
+          target[gdcm::Tag(0x0020, 0x1208)] = boost::lexical_cast<std::string>(instances.size());
+
+          // Collect the Modality of all the child series
+          std::set<std::string> modalities;
+          for (Json::Value::ArrayIndex i = 0; i < series.size(); i++)
+          {
+            if (series[i].isMember("MainDicomTags") &&
+                series[i]["MainDicomTags"].isMember("Modality"))
+            {
+              modalities.insert(series[i]["MainDicomTags"]["Modality"].asString());
+            }
+          }
+
+          std::string s;
+          for (std::set<std::string>::const_iterator 
+                 it = modalities.begin(); it != modalities.end(); ++it)
+          {
+            if (!s.empty())
+            {
+              s += "\\";
+            }
+
+            s += *it;
+          }
+
+          target[gdcm::Tag(0x0008, 0x0061)] = s;  // Modalities in Study
+        }
+        else
+        {
+          target[gdcm::Tag(0x0008, 0x0061)] = "";   // Modalities in Study
+          target[gdcm::Tag(0x0020, 0x1206)] = "0";  // Number of Study Related Series
+          target[gdcm::Tag(0x0020, 0x1208)] = "0";  // Number of Study Related Instances
+        }
+
+        break;
+      }
+
+      case QueryLevel_Series:
+      {
+        Json::Value instances;
+        if (OrthancPlugins::MeasuredRestApiGet(instances, context, "/series/" + resource + "/instances", false))
+        {
+          // Number of Series Related Instances
+          target[gdcm::Tag(0x0020, 0x1209)] = boost::lexical_cast<std::string>(instances.size());
+        }
+        else
+        {
+          target[gdcm::Tag(0x0020, 0x1209)] = "0";  // Number of Series Related Instances
+        }
+
+        break;
+      }
+
+      default:
+        break;
+    }
+  }                              
+
+
+  void ModuleMatcher::ExtractFields(gdcm::DataSet& result,
+                                    const OrthancPlugins::ParsedDicomFile& dicom,
+                                    const std::string& wadoBase,
+                                    QueryLevel level) const
+  {
+    std::list<gdcm::Tag> fields = includeFields_;
+
+    // The list of attributes for this query level
+    AddResultAttributesForLevel(fields, level);
+
+    // All other attributes passed as query keys
+    for (Filters::const_iterator it = filters_.begin();
+         it != filters_.end(); ++it)
+    {
+      fields.push_back(it->first);
+    }
+
+    // For instances and series, add all Study-level attributes if
+    // {StudyInstanceUID} is not specified.
+    if ((level == QueryLevel_Instance  || level == QueryLevel_Series) 
+        && filters_.find(OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID) == filters_.end()
+      )
+    {
+      AddResultAttributesForLevel(fields, QueryLevel_Study);
+    }
+
+    // For instances, add all Series-level attributes if
+    // {SeriesInstanceUID} is not specified.
+    if (level == QueryLevel_Instance
+        && filters_.find(OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID) == filters_.end()
+      )
+    {
+      AddResultAttributesForLevel(fields, QueryLevel_Series);
+    }
+
+    // Copy all the required fields to the target
+    for (std::list<gdcm::Tag>::const_iterator
+           it = fields.begin(); it != fields.end(); ++it)
+    {
+      if (dicom.GetDataSet().FindDataElement(*it))
+      {
+        const gdcm::DataElement& element = dicom.GetDataSet().GetDataElement(*it);
+        result.Replace(element);
+      }
+    }
+
+    // Set the retrieve URL for WADO-RS
+    std::string url = (wadoBase + "studies/" + 
+                       dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID, "", true));
+
+    if (level == QueryLevel_Series || level == QueryLevel_Instance)
+    {
+      url += "/series/" + dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID, "", true);
+    }
+
+    if (level == QueryLevel_Instance)
+    {
+      url += "/instances/" + dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_SOP_INSTANCE_UID, "", true);
+    }
+  
+    gdcm::DataElement element(OrthancPlugins::DICOM_TAG_RETRIEVE_URL);
+    element.SetByteValue(url.c_str(), url.size());
+    result.Replace(element);
+  }
+
+
+  void ModuleMatcher::ExtractFields(Json::Value& result,
+                                    const Json::Value& source,
+                                    const std::string& wadoBase,
+                                    QueryLevel level) const
+  {
+    result = Json::objectValue;
+    std::list<gdcm::Tag> fields = includeFields_;
+
+    // The list of attributes for this query level
+    AddResultAttributesForLevel(fields, level);
+
+    // All other attributes passed as query keys
+    for (Filters::const_iterator it = filters_.begin();
+         it != filters_.end(); ++it)
+    {
+      fields.push_back(it->first);
+    }
+
+    // For instances and series, add all Study-level attributes if
+    // {StudyInstanceUID} is not specified.
+    if ((level == QueryLevel_Instance  || level == QueryLevel_Series) 
+        && filters_.find(OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID) == filters_.end()
+      )
+    {
+      AddResultAttributesForLevel(fields, QueryLevel_Study);
+    }
+
+    // For instances, add all Series-level attributes if
+    // {SeriesInstanceUID} is not specified.
+    if (level == QueryLevel_Instance
+        && filters_.find(OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID) == filters_.end()
+      )
+    {
+      AddResultAttributesForLevel(fields, QueryLevel_Series);
+    }
+
+    // Copy all the required fields to the target
+    for (std::list<gdcm::Tag>::const_iterator
+           it = fields.begin(); it != fields.end(); ++it)
+    {
+      std::string tag = FormatOrthancTag(*it);
+      if (source.isMember(tag))
+      {
+        result[tag] = source[tag];
+      }
+    }
+
+    // Set the retrieve URL for WADO-RS
+    std::string url = (wadoBase + "studies/" + 
+                       GetOrthancTag(source, OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID, ""));
+
+    if (level == QueryLevel_Series || level == QueryLevel_Instance)
+    {
+      url += "/series/" + GetOrthancTag(source, OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID, "");
+    }
+
+    if (level == QueryLevel_Instance)
+    {
+      url += "/instances/" + GetOrthancTag(source, OrthancPlugins::DICOM_TAG_SOP_INSTANCE_UID, "");
+    }
+  
+    Json::Value tmp = Json::objectValue;
+    tmp["Name"] = "RetrieveURL";
+    tmp["Type"] = "String";
+    tmp["Value"] = url;
+
+    result[FormatOrthancTag(OrthancPlugins::DICOM_TAG_RETRIEVE_URL)] = tmp;
+  }
+}
@@ -0,0 +1,152 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "Dicom.h"
+
+#include <orthanc/OrthancCPlugin.h>
+#include <json/value.h>
+#include <gdcmDataSet.h>
+#include <gdcmDict.h>
+#include <gdcmTag.h>
+
+#include <list>
+#include <map>
+#include <ostream>
+#include <string>
+
+namespace OrthancPlugins
+{
+  enum QueryLevel
+  {
+    QueryLevel_Study,
+    QueryLevel_Series,
+    QueryLevel_Instance
+  };
+
+
+  // Formats a tag as a key of the JSON answers of the Orthanc REST API
+  std::string FormatOrthancTag(const gdcm::Tag& tag);
+
+  // Reads a string tag from the "?simplify=false" JSON of Orthanc
+  std::string GetOrthancTag(const Json::Value& source,
+                            const gdcm::Tag& tag,
+                            const std::string& defaultValue);
+
+
+  // Arguments of a QIDO-RS request (filters, paging and included
+  // fields), that are converted to a "/tools/find" lookup, and that
+  // select the attributes to be returned for each matching resource
+  class ModuleMatcher
+  {
+  public:
+    typedef std::map<gdcm::Tag, std::string>  Filters;
+
+  private:
+    bool                  fuzzy_;
+    unsigned int          offset_;
+    unsigned int          limit_;
+    std::list<gdcm::Tag>  includeFields_;
+    bool                  includeAllFields_;
+    Filters               filters_;
+    std::string           continuation_;
+
+    void FormatQuery(Json::Value& target,
+                     QueryLevel level) const;
+
+  public:
+    ModuleMatcher(const gdcm::Dict& dictionary,
+                  const OrthancPluginHttpRequest* request);
+
+    unsigned int GetLimit() const
+    {
+      return limit_;
+    }
+
+    unsigned int GetOffset() const
+    {
+      return offset_;
+    }
+
+    const std::string& GetContinuation() const
+    {
+      return continuation_;
+    }
+
+    bool IsFuzzy() const
+    {
+      return fuzzy_;
+    }
+
+    const Filters& GetFilters() const
+    {
+      return filters_;
+    }
+
+    // Canonical representation of the query, to be used as the key
+    // of the QIDO-RS cache
+    void FormatCacheKey(std::string& target,
+                        QueryLevel level,
+                        const std::string& wadoBase,
+                        bool isXml) const;
+
+    // Canonical representation of the filters of the query, ignoring
+    // the paging arguments, that must be the same for all the pages
+    // of a continuation
+    void FormatContinuationKey(std::string& target,
+                               QueryLevel level) const;
+
+    static bool IsOffsetHandledByOrthanc();
+
+    void AddFilter(const gdcm::Tag& tag,
+                   const std::string& constraint)
+    {
+      filters_[tag] = constraint;
+    }
+
+    void Print(std::ostream& out) const;
+
+    void ConvertToOrthanc(Json::Value& result,
+                          QueryLevel level) const;
+
+    // Variant with explicit paging, where "count" is the number of
+    // resources to be returned by Orthanc (0 means no limit)
+    void ConvertToOrthanc(Json::Value& result,
+                          QueryLevel level,
+                          unsigned int offset,
+                          unsigned int count) const;
+
+    void ComputeDerivedTags(Filters& target,
+                            QueryLevel level,
+                            const std::string& resource) const;
+
+    void ExtractFields(gdcm::DataSet& result,
+                       const ParsedDicomFile& dicom,
+                       const std::string& wadoBase,
+                       QueryLevel level) const;
+
+    void ExtractFields(Json::Value& result,
+                       const Json::Value& source,
+                       const std::string& wadoBase,
+                       QueryLevel level) const;
+  };
+}
@@ -0,0 +1,211 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ParallelPipeline.h"
+
+#include <Core/OrthancException.h>
+
+#include <memory>
+
+namespace OrthancPlugins
+{
+  bool ParallelPipeline::IsJobAvailable() const
+  {
+    return (nextExecuted_ < jobs_.size() &&
+            nextExecuted_ < nextConsumed_ + lookahead_);
+  }
+
+
+  void ParallelPipeline::Worker(ParallelPipeline* that,
+                                Metrics::Request* request)
+  {
+    Metrics::Scope scope(request);
+
+    for (;;)
+    {
+      size_t index;
+      IJob* job = NULL;
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        while (!that->done_ &&
+               !that->IsJobAvailable())
+        {
+          that->jobAvailable_.wait(lock);
+        }
+
+        if (that->done_)
+        {
+          return;
+        }
+
+        index = that->nextExecuted_++;
+        job = that->jobs_[index];
+        that->status_[index] = Status_Running;
+      }
+
+      Status status = Status_Success;
+      Orthanc::ErrorCode error = Orthanc::ErrorCode_Success;
+
+      try
+      {
+        job->Execute();
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        status = Status_Failure;
+        error = e.GetErrorCode();
+      }
+      catch (...)
+      {
+        status = Status_Failure;
+        error = Orthanc::ErrorCode_InternalError;
+      }
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+        that->status_[index] = status;
+        that->errors_[index] = error;
+      }
+
+      that->jobFinished_.notify_all();
+    }
+  }
+
+
+  ParallelPipeline::ParallelPipeline(size_t countThreads,
+                                     size_t lookahead) :
+    lookahead_(lookahead),
+    nextExecuted_(0),
+    nextConsumed_(0),
+    done_(false)
+  {
+    if (lookahead_ < countThreads)
+    {
+      lookahead_ = countThreads;
+    }
+
+    if (lookahead_ == 0)
+    {
+      lookahead_ = 1;
+    }
+
+    threads_.resize(countThreads);
+    for (size_t i = 0; i < countThreads; i++)
+    {
+      threads_[i] = new boost::thread(Worker, this, Metrics::GetCurrentRequest());
+    }
+  }
+
+
+  ParallelPipeline::~ParallelPipeline()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+    }
+
+    jobAvailable_.notify_all();
+
+    for (size_t i = 0; i < threads_.size(); i++)
+    {
+      if (threads_[i]->joinable())
+      {
+        threads_[i]->join();
+      }
+
+      delete threads_[i];
+    }
+
+    // The jobs that were not consumed are still owned by the pipeline
+    for (size_t i = nextConsumed_; i < jobs_.size(); i++)
+    {
+      delete jobs_[i];
+    }
+  }
+
+
+  void ParallelPipeline::Add(IJob* job)
+  {
+    if (job == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      jobs_.push_back(job);
+      status_.push_back(Status_Pending);
+      errors_.push_back(Orthanc::ErrorCode_Success);
+    }
+
+    jobAvailable_.notify_one();
+  }
+
+
+  ParallelPipeline::IJob* ParallelPipeline::Dequeue()
+  {
+    std::auto_ptr<IJob> job;
+    Orthanc::ErrorCode error;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (nextConsumed_ == jobs_.size())
+      {
+        return NULL;
+      }
+
+      if (threads_.empty())
+      {
+        // Sequential mode: Execute the job in the calling thread
+        job.reset(jobs_[nextConsumed_]);
+        nextConsumed_++;
+        nextExecuted_ = nextConsumed_;
+        lock.unlock();
+
+        job->Execute();
+        return job.release();
+      }
+
+      while (status_[nextConsumed_] == Status_Pending ||
+             status_[nextConsumed_] == Status_Running)
+      {
+        jobFinished_.wait(lock);
+      }
+
+      job.reset(jobs_[nextConsumed_]);
+      error = errors_[nextConsumed_];
+      nextConsumed_++;
+    }
+
+    // One slot has been released in the lookahead window
+    jobAvailable_.notify_one();
+
+    if (error != Orthanc::ErrorCode_Success)
+    {
+      throw Orthanc::OrthancException(error);
+    }
+
+    return job.release();
+  }
+}
@@ -0,0 +1,97 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "Metrics.h"
+
+#include <Core/Enumerations.h>
+
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+namespace OrthancPlugins
+{
+  // Bounded pool of threads that executes a sequence of jobs ahead
+  // of the caller, which consumes the results in the order of
+  // submission. At most "lookahead" jobs are pending, or executed but
+  // not consumed yet, which bounds the memory usage.
+  class ParallelPipeline : public boost::noncopyable
+  {
+  public:
+    class IJob : public boost::noncopyable
+    {
+    public:
+      virtual ~IJob()
+      {
+      }
+
+      // Called from one of the worker threads
+      virtual void Execute() = 0;
+    };
+
+  private:
+    enum Status
+    {
+      Status_Pending,
+      Status_Running,
+      Status_Success,
+      Status_Failure
+    };
+
+    boost::mutex                  mutex_;
+    boost::condition_variable     jobAvailable_;
+    boost::condition_variable     jobFinished_;
+    std::vector<IJob*>            jobs_;
+    std::vector<Status>           status_;
+    std::vector<Orthanc::ErrorCode>  errors_;
+    size_t                        lookahead_;
+    size_t                        nextExecuted_;
+    size_t                        nextConsumed_;
+    bool                          done_;
+    std::vector<boost::thread*>   threads_;
+
+    bool IsJobAvailable() const;
+
+    // The measures of the workers are added to the request that
+    // created the pipeline, if any
+    static void Worker(ParallelPipeline* that,
+                       Metrics::Request* request);
+
+  public:
+    // If "countThreads" is zero, the jobs are executed sequentially
+    // by the consumer.
+    ParallelPipeline(size_t countThreads,
+                     size_t lookahead);
+
+    ~ParallelPipeline();
+
+    // Takes the ownership of the job
+    void Add(IJob* job);
+
+    // Waits for the next job to be executed, and returns it to the
+    // caller, which becomes its owner. Returns NULL once all the
+    // jobs have been consumed. The exceptions raised by the job are
+    // reported here.
+    IJob* Dequeue();
+  };
+}
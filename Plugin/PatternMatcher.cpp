@@ -0,0 +1,90 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PatternMatcher.h"
+
+#include <Core/OrthancException.h>
+
+#include <stdint.h>
+#include <string.h>
+
+namespace OrthancPlugins
+{
+  PatternMatcher::PatternMatcher(const std::string& pattern) :
+    pattern_(pattern),
+    skip_(256, pattern.size())
+  {
+    if (pattern.empty())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    // Distance from the last occurrence of each byte to the end of
+    // the pattern, the last byte of the pattern being excluded
+    for (size_t i = 0; i + 1 < pattern.size(); i++)
+    {
+      skip_[static_cast<uint8_t>(pattern[i])] = pattern.size() - 1 - i;
+    }
+  }
+
+
+  const char* PatternMatcher::Find(const char* start,
+                                   const char* end) const
+  {
+    const size_t size = pattern_.size();
+
+    if (start == NULL ||
+        end < start ||
+        static_cast<size_t>(end - start) < size)
+    {
+      return NULL;
+    }
+
+    const char* pattern = pattern_.c_str();
+    const char last = pattern[size - 1];
+    const char* limit = end - size;
+
+    for (const char* current = start; current <= limit; )
+    {
+      const char c = current[size - 1];
+
+      if (c == last &&
+          memcmp(current, pattern, size - 1) == 0)
+      {
+        return current;
+      }
+
+      current += skip_[static_cast<uint8_t>(c)];
+    }
+
+    return NULL;
+  }
+
+
+  bool PatternMatcher::IsAt(const char* position,
+                            const char* end) const
+  {
+    return (position != NULL &&
+            position <= end &&
+            static_cast<size_t>(end - position) >= pattern_.size() &&
+            memcmp(position, pattern_.c_str(), pattern_.size()) == 0);
+  }
+}
@@ -0,0 +1,56 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace OrthancPlugins
+{
+  // Linear-time search of a fixed pattern in a memory buffer, using
+  // the Boyer-Moore-Horspool algorithm. This is used to look for the
+  // boundaries of multipart bodies, that can be several GB large.
+  class PatternMatcher : public boost::noncopyable
+  {
+  private:
+    std::string          pattern_;
+    std::vector<size_t>  skip_;
+
+  public:
+    explicit PatternMatcher(const std::string& pattern);
+
+    const std::string& GetPattern() const
+    {
+      return pattern_;
+    }
+
+    // Returns a pointer to the first occurrence of the pattern in
+    // [start, end), or NULL if there is no such occurrence
+    const char* Find(const char* start,
+                     const char* end) const;
+
+    // Tells whether the pattern occurs exactly at "position"
+    bool IsAt(const char* position,
+              const char* end) const;
+  };
+}
@@ -28,6 +28,17 @@
 #include "WadoUri.h"
 #include "Configuration.h"
 #include "DicomWebServers.h"
+#include "DictionaryTable.h"
+#include "FrameCache.h"
+#include "HttpCompression.h"
+#include "IdentifiersCache.h"
+#include "JobsEngine.h"
+#include "MetadataCache.h"
+#include "Metrics.h"
+#include "QidoCache.h"
+#include "RenderedCache.h"
+#include "SeriesPrefetcher.h"
+#include "WorkerPool.h"
 
 #include <Plugins/Samples/Common/OrthancPluginCppWrapper.h>
 #include <Core/Toolbox.h>
@@ -130,7 +141,7 @@ void ListServers(OrthancPluginRestOutput* output,
       }
 
       std::string answer = result.toStyledString();
-      OrthancPluginAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+      OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
     }
     else // if expand is not present, keep backward compatibility and return an array of server names
     {
@@ -141,7 +152,7 @@ void ListServers(OrthancPluginRestOutput* output,
       }
 
       std::string answer = json.toStyledString();
-      OrthancPluginAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+      OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
     }
   }
 }
@@ -167,7 +178,34 @@ void ListServerOperations(OrthancPluginRestOutput* output,
     json.append("stow");
 
     std::string answer = json.toStyledString(); 
-    OrthancPluginAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+    OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+  }
+}
+
+
+static OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeType,
+                                               OrthancPluginResourceType resourceType,
+                                               const char* resourceId)
+{
+  try
+  {
+    OrthancPlugins::QidoCache::GetInstance().SignalChange(changeType, resourceType, resourceId);
+    OrthancPlugins::IdentifiersCache::GetInstance().SignalChange(changeType, resourceType, resourceId);
+    OrthancPlugins::MetadataCache::GetInstance().SignalChange(changeType, resourceType, resourceId);
+    OrthancPlugins::FrameCache::GetInstance().SignalChange(changeType, resourceType, resourceId);
+    OrthancPlugins::RenderedCache::GetInstance().SignalChange(changeType, resourceType, resourceId);
+    OrthancPlugins::SeriesPrefetcher::GetInstance().SignalChange(changeType, resourceType, resourceId);
+    return OrthancPluginErrorCode_Success;
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    OrthancPlugins::Configuration::LogError("Exception while processing a change in the DICOMweb plugin: " + 
+                                            std::string(e.What()));
+    return OrthancPluginErrorCode_Plugin;
+  }
+  catch (...)
+  {
+    return OrthancPluginErrorCode_Plugin;
   }
 }
 
@@ -209,6 +247,35 @@ extern "C"
 
       // Initialize GDCM
       dictionary_ = &gdcm::Global::GetInstance().GetDicts().GetPublicDict();
+      OrthancPlugins::DictionaryTable::GetInstance().Setup(*dictionary_);
+
+      // Cache of the UIDs that are resolved by WADO-RS and WADO-URI (0 to disable)
+      OrthancPlugins::IdentifiersCache::GetInstance().SetMaximumSize(
+        OrthancPlugins::Configuration::GetUnsignedIntegerValue("IdentifiersCacheSize", 10000));
+
+      // Cache of the images rendered by WADO-RS and WADO-URI (its size is expressed in MB, 0 to disable)
+      OrthancPlugins::RenderedCache::GetInstance().SetMaximumSize(
+        static_cast<size_t>(OrthancPlugins::Configuration::GetUnsignedIntegerValue("RenderedCacheSize", 16)) * 1024 * 1024);
+
+      // Compression of the DICOM+JSON answers (level from 1 to 9, 0 to disable)
+      unsigned int compressionLevel = OrthancPlugins::Configuration::GetUnsignedIntegerValue("CompressionLevel", 6);
+      if (compressionLevel != 0 &&
+          OrthancPlugins::Configuration::IsCoreHttpCompressionEnabled())
+      {
+        OrthancPlugins::Configuration::LogInfo("The answers of the DICOMweb plugin are compressed by the "
+                                               "Orthanc core, as \"HttpCompressionEnabled\" is true");
+        compressionLevel = 0;
+      }
+
+      OrthancPlugins::HttpCompression::GetInstance().Setup(
+        compressionLevel, OrthancPlugins::Configuration::GetUnsignedIntegerValue("CompressionMinimumSize", 1024));
+
+      // Latency and throughput of the DICOMweb routes, which must be
+      // enabled before the REST callbacks are registered
+      if (OrthancPlugins::Configuration::GetBooleanValue("EnableMetrics", true))
+      {
+        OrthancPlugins::Metrics::GetInstance().Enable();
+      }
 
       // Configure the DICOMweb callbacks
       if (OrthancPlugins::Configuration::GetBooleanValue("Enable", true))
@@ -218,40 +285,118 @@ extern "C"
 
         OrthancPlugins::Configuration::LogWarning("URI to the DICOMweb REST API: " + root);
 
-        OrthancPlugins::RegisterRestCallback<SearchForInstances>(context, root + "instances", true);
-        OrthancPlugins::RegisterRestCallback<SearchForSeries>(context, root + "series", true);    
-        OrthancPlugins::RegisterRestCallback<SwitchStudies>(context, root + "studies", true);
-        OrthancPlugins::RegisterRestCallback<SwitchStudy>(context, root + "studies/([^/]*)", true);
-        OrthancPlugins::RegisterRestCallback<SearchForInstances>(context, root + "studies/([^/]*)/instances", true);    
-        OrthancPlugins::RegisterRestCallback<RetrieveStudyMetadata>(context, root + "studies/([^/]*)/metadata", true);
-        OrthancPlugins::RegisterRestCallback<SearchForSeries>(context, root + "studies/([^/]*)/series", true);    
-        OrthancPlugins::RegisterRestCallback<RetrieveDicomSeries>(context, root + "studies/([^/]*)/series/([^/]*)", true);
-        OrthancPlugins::RegisterRestCallback<SearchForInstances>(context, root + "studies/([^/]*)/series/([^/]*)/instances", true);    
-        OrthancPlugins::RegisterRestCallback<RetrieveDicomInstance>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)", true);
-        OrthancPlugins::RegisterRestCallback<RetrieveBulkData>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)/bulk/(.*)", true);
-        OrthancPlugins::RegisterRestCallback<RetrieveInstanceMetadata>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)/metadata", true);
-        OrthancPlugins::RegisterRestCallback<RetrieveSeriesMetadata>(context, root + "studies/([^/]*)/series/([^/]*)/metadata", true);
-        OrthancPlugins::RegisterRestCallback<RetrieveFrames>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)/frames", true);
-        OrthancPlugins::RegisterRestCallback<RetrieveFrames>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)/frames/([^/]*)", true);
-
-        OrthancPlugins::RegisterRestCallback<ListServers>(context, root + "servers", true);
-        OrthancPlugins::RegisterRestCallback<ListServerOperations>(context, root + "servers/([^/]*)", true);
-        OrthancPlugins::RegisterRestCallback<StowClient>(context, root + "servers/([^/]*)/stow", true);
-        OrthancPlugins::RegisterRestCallback<GetFromServer>(context, root + "servers/([^/]*)/get", true);
-        OrthancPlugins::RegisterRestCallback<RetrieveFromServer>(context, root + "servers/([^/]*)/retrieve", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<SearchForInstances>(context, root + "instances", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<SearchForSeries>(context, root + "series", true);    
+        OrthancPlugins::RegisterInstrumentedRestCallback<SwitchStudies>(context, root + "studies", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<SwitchStudy>(context, root + "studies/([^/]*)", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<SearchForInstances>(context, root + "studies/([^/]*)/instances", true);    
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveStudyMetadata>(context, root + "studies/([^/]*)/metadata", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<SearchForSeries>(context, root + "studies/([^/]*)/series", true);    
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveDicomSeries>(context, root + "studies/([^/]*)/series/([^/]*)", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<SearchForInstances>(context, root + "studies/([^/]*)/series/([^/]*)/instances", true);    
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveDicomInstance>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveBulkData>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)/bulk/(.*)", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveInstanceMetadata>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)/metadata", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveSeriesMetadata>(context, root + "studies/([^/]*)/series/([^/]*)/metadata", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveFrames>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)/frames", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveFrames>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)/frames/([^/]*)", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveStudyThumbnail>(context, root + "studies/([^/]*)/thumbnail", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveSeriesThumbnail>(context, root + "studies/([^/]*)/series/([^/]*)/thumbnail", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveInstanceRendered>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)/rendered", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveInstanceThumbnail>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)/thumbnail", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveFramesRendered>(context, root + "studies/([^/]*)/series/([^/]*)/instances/([^/]*)/frames/([^/]*)/rendered", true);
+
+        OrthancPlugins::RegisterInstrumentedRestCallback<ListServers>(context, root + "servers", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<ListServerOperations>(context, root + "servers/([^/]*)", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<StowClient>(context, root + "servers/([^/]*)/stow", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<GetFromServer>(context, root + "servers/([^/]*)/get", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<RetrieveFromServer>(context, root + "servers/([^/]*)/retrieve", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<OrthancPlugins::ServeJobs>(context, root + "jobs", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<OrthancPlugins::ServeJobs>(context, root + "jobs/([^/]*)", true);
+
+        // Queue of the asynchronous client requests, whose state is
+        // stored as a global property to resume them after a restart
+        {
+          int32_t property = -1;
+          if (OrthancPlugins::Configuration::GetBooleanValue("PersistJobs", true))
+          {
+            property = static_cast<int32_t>(
+              OrthancPlugins::Configuration::GetUnsignedIntegerValue("JobsGlobalProperty", 4302));
+          }
+
+          OrthancPlugins::JobsEngine::GetInstance().Start(
+            OrthancPlugins::Configuration::GetUnsignedIntegerValue("JobsThreads", 2),
+            OrthancPlugins::Configuration::GetUnsignedIntegerValue("JobsMaxPerServer", 1),
+            property, UnserializeDicomWebClientJob);
+        }
+
+        // Memory used by the bodies of the outgoing STOW-RS requests (in MB, 0 for no limit)
+        SetStowClientMaxMemory(static_cast<size_t>(
+          OrthancPlugins::Configuration::GetUnsignedIntegerValue("StowClientMaxMemory", 256)) * 1024 * 1024);
+
+        // Cache of the QIDO-RS answers (its size is expressed in MB, 0 to disable)
+        unsigned int qidoCacheSize = OrthancPlugins::Configuration::GetUnsignedIntegerValue("QidoCacheSize", 0);
+        OrthancPlugins::QidoCache::GetInstance().Setup(*dictionary_, static_cast<size_t>(qidoCacheSize) * 1024 * 1024);
+        OrthancPlugins::RegisterInstrumentedRestCallback<OrthancPlugins::GetQidoCacheStatistics>(context, root + "qido-cache", true);
+
+        // Pre-computed DICOM+JSON metadata, stored as an attachment
+        if (OrthancPlugins::Configuration::GetBooleanValue("EnableMetadataCache", false))
+        {
+          OrthancPlugins::MetadataCache::GetInstance().Start(
+            *dictionary_, OrthancPlugins::Configuration::GetUnsignedIntegerValue("MetadataCacheAttachment", 4301));
+        }
+
+        // Location of the frames of each instance, stored as an attachment
+        if (OrthancPlugins::Configuration::GetBooleanValue("EnableFrameIndex", false))
+        {
+          EnableFrameIndex(OrthancPlugins::Configuration::GetUnsignedIntegerValue("FrameIndexAttachment", 4302));
+        }
+
+        // Disk cache of the transcoded frames (its size is expressed in MB, 0 to disable)
+        unsigned int frameCacheSize = OrthancPlugins::Configuration::GetUnsignedIntegerValue("FrameCacheSize", 0);
+        if (frameCacheSize != 0)
+        {
+          OrthancPlugins::FrameCache::GetInstance().Setup(
+            OrthancPlugins::Configuration::GetStringValue("FrameCacheDirectory", "OrthancDicomWebFrames"),
+            static_cast<size_t>(frameCacheSize) * 1024 * 1024);
+        }
+
+        OrthancPlugins::RegisterInstrumentedRestCallback<OrthancPlugins::GetFrameCacheStatistics>(context, root + "frame-cache", true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<OrthancPlugins::GetRenderedCacheStatistics>(context, root + "rendered-cache", true);
+
+        // Background download of the next instances of the accessed
+        // series (0 to disable), into a memory cache whose size is
+        // expressed in MB
+        OrthancPlugins::SeriesPrefetcher::GetInstance().Start(
+          OrthancPlugins::Configuration::GetUnsignedIntegerValue("PrefetchThreads", 2),
+          OrthancPlugins::Configuration::GetUnsignedIntegerValue("PrefetchDepth", 0),
+          static_cast<size_t>(OrthancPlugins::Configuration::GetUnsignedIntegerValue("PrefetchCacheSize", 256)) * 1024 * 1024);
+        OrthancPlugins::RegisterInstrumentedRestCallback<OrthancPlugins::GetPrefetchStatistics>(context, root + "prefetch", true);
+
+        if (OrthancPlugins::Metrics::GetInstance().IsEnabled())
+        {
+          // Not measured itself, in the Prometheus text format
+          OrthancPlugins::RegisterRestCallback<OrthancPlugins::ServeMetrics>(context, root + "metrics", true);
+        }
+
+        // Threads that are shared by all the requests to decode the frames (0 to disable)
+        OrthancPlugins::WorkerPool::GetInstance().Start(
+          OrthancPlugins::Configuration::GetUnsignedIntegerValue("RetrieveFramesThreads", 4));
       }
       else
       {
         OrthancPlugins::Configuration::LogWarning("DICOMweb support is disabled");
       }
 
+      OrthancPluginRegisterOnChangeCallback(context, OnChangeCallback);
+
       // Configure the WADO callback
       if (OrthancPlugins::Configuration::GetBooleanValue("EnableWado", true))
       {
         std::string wado = OrthancPlugins::Configuration::GetWadoRoot();
         OrthancPlugins::Configuration::LogWarning("URI to the WADO-URI API: " + wado);
 
-        OrthancPlugins::RegisterRestCallback<WadoUriCallback>(context, wado, true);
+        OrthancPlugins::RegisterInstrumentedRestCallback<WadoUriCallback>(context, wado, true);
       }
       else
       {
@@ -276,6 +421,10 @@ extern "C"
 
   ORTHANC_PLUGINS_API void OrthancPluginFinalize()
   {
+    OrthancPlugins::JobsEngine::GetInstance().Finalize();
+    OrthancPlugins::MetadataCache::GetInstance().Stop();
+    OrthancPlugins::SeriesPrefetcher::GetInstance().Stop();
+    OrthancPlugins::WorkerPool::GetInstance().Stop();
   }
 
 
@@ -0,0 +1,568 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "QidoCache.h"
+
+#include "Configuration.h"
+#include "Dicom.h"
+#include "HttpCompression.h"
+#include "Metrics.h"
+
+#include <Core/Toolbox.h>
+#include <Plugins/Samples/Common/OrthancPluginCppWrapper.h>
+
+#include <gdcmDictEntry.h>
+#include <cassert>
+#include <memory>
+
+namespace OrthancPlugins
+{
+  // Maximum number of studies whose changes are pending. Beyond this
+  // limit (e.g. during a bulk STOW-RS), the whole cache is cleared,
+  // which is cheaper than evaluating each study through the REST API.
+  static const size_t MAX_CHANGED_STUDIES = 64;
+
+
+  static bool MatchWildcard(const std::string& pattern,
+                            const std::string& value)
+  {
+    size_t p = 0, v = 0;
+    size_t star = std::string::npos, mark = 0;
+
+    while (v < value.size())
+    {
+      if (p < pattern.size() &&
+          (pattern[p] == '?' || pattern[p] == value[v]))
+      {
+        p++;
+        v++;
+      }
+      else if (p < pattern.size() &&
+               pattern[p] == '*')
+      {
+        star = p++;
+        mark = v;
+      }
+      else if (star != std::string::npos)
+      {
+        p = star + 1;
+        v = ++mark;
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    while (p < pattern.size() &&
+           pattern[p] == '*')
+    {
+      p++;
+    }
+
+    return p == pattern.size();
+  }
+
+
+  // Tells whether the value of a main DICOM tag might match a QIDO-RS
+  // constraint. In case of doubt, "true" is returned, as a spurious
+  // invalidation is harmless, contrarily to a stale answer.
+  static bool MightMatchConstraint(const std::string& constraint,
+                                   const std::string& value,
+                                   const gdcm::VR& vr)
+  {
+    if (constraint.empty())
+    {
+      return true;  // Universal matching
+    }
+
+    std::string lowerValue;
+    Orthanc::Toolbox::ToLowerCase(lowerValue, value);
+
+    std::vector<std::string> alternatives;
+    Orthanc::Toolbox::TokenizeString(alternatives, constraint, '\\');
+
+    for (size_t i = 0; i < alternatives.size(); i++)
+    {
+      const std::string& alternative = alternatives[i];
+      size_t dash = alternative.find('-');
+
+      if (dash != std::string::npos &&
+          (vr == gdcm::VR::DA || vr == gdcm::VR::TM || vr == gdcm::VR::DT))
+      {
+        if (vr != gdcm::VR::DA)
+        {
+          return true;  // Ranges of times are not evaluated
+        }
+
+        std::string lower = alternative.substr(0, dash);
+        std::string upper = alternative.substr(dash + 1);
+
+        if ((lower.empty() || value >= lower) &&
+            (upper.empty() || value <= upper))
+        {
+          return true;
+        }
+      }
+      else
+      {
+        // The comparison is case-insensitive, which is a superset of
+        // the case-sensitive matching
+        std::string pattern;
+        Orthanc::Toolbox::ToLowerCase(pattern, alternative);
+
+        if (MatchWildcard(pattern, lowerValue))
+        {
+          return true;
+        }
+      }
+    }
+
+    return false;
+  }
+
+
+  static void ExtractStudyTags(std::map<std::string, std::string>& target,
+                               const Json::Value& source)
+  {
+    if (source.type() == Json::objectValue)
+    {
+      Json::Value::Members members = source.getMemberNames();
+      for (size_t i = 0; i < members.size(); i++)
+      {
+        if (source[members[i]].type() == Json::stringValue)
+        {
+          target[members[i]] = source[members[i]].asString();
+        }
+      }
+    }
+  }
+
+
+  size_t QidoCache::GetEntrySize(const std::string& key,
+                                 const Entry& entry)
+  {
+    size_t size = key.size();
+
+    for (std::list<std::string>::const_iterator
+           it = entry.items_.begin(); it != entry.items_.end(); ++it)
+    {
+      size += it->size();
+    }
+
+    return size + entry.gzipped_.size();
+  }
+
+
+  void QidoCache::RemoveInternal(const std::string& key)
+  {
+    Content::iterator found = content_.find(key);
+    if (found != content_.end())
+    {
+      size_t size = GetEntrySize(key, *found->second);
+      assert(currentSize_ >= size);
+      currentSize_ -= size;
+
+      index_.Invalidate(key);
+      content_.erase(found);
+    }
+  }
+
+
+  bool QidoCache::IsAffectedByNewInstance(const Entry& entry,
+                                          const std::string& studyUid,
+                                          const std::map<std::string, std::string>& studyTags) const
+  {
+    if (entry.studies_.find(studyUid) != entry.studies_.end())
+    {
+      return true;  // The study is part of the cached answer
+    }
+
+    Filters::const_iterator scope = entry.filters_.find(DICOM_TAG_STUDY_INSTANCE_UID);
+    if (scope != entry.filters_.end() &&
+        scope->second.find_first_of("*?\\") == std::string::npos)
+    {
+      // The query is restricted to one single study
+      return scope->second == studyUid;
+    }
+
+    if (entry.level_ != OrthancPluginResourceType_Study ||
+        entry.isFuzzy_ ||
+        dictionary_ == NULL)
+    {
+      // Only the study-level queries are evaluated against the main
+      // DICOM tags of the modified study
+      return true;
+    }
+
+    for (Filters::const_iterator it = entry.filters_.begin();
+         it != entry.filters_.end(); ++it)
+    {
+      const char* keyword = GetKeyword(*dictionary_, it->first);
+      if (keyword == NULL)
+      {
+        return true;
+      }
+
+      std::map<std::string, std::string>::const_iterator value = studyTags.find(keyword);
+      if (value == studyTags.end())
+      {
+        return true;  // Not a main DICOM tag, or a derived tag
+      }
+
+      if (!MightMatchConstraint(it->second, value->second,
+                                dictionary_->GetDictEntry(it->first).GetVR()))
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+
+  void QidoCache::ProcessChangedStudies()
+  {
+    // Prevent concurrent lookups from reading stale entries while
+    // the pending changes are being processed
+    boost::mutex::scoped_lock processing(processingMutex_);
+
+    std::set<std::string> changed;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      changed.swap(changedStudies_);
+    }
+
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    for (std::set<std::string>::const_iterator
+           study = changed.begin(); study != changed.end(); ++study)
+    {
+      Json::Value info;
+      bool ok = (OrthancPlugins::MeasuredRestApiGet(info, context, "/studies/" + *study, false) &&
+                 info.type() == Json::objectValue &&
+                 info.isMember("MainDicomTags") &&
+                 info["MainDicomTags"].isMember("StudyInstanceUID"));
+
+      std::map<std::string, std::string> tags;
+      std::string studyUid;
+
+      if (ok)
+      {
+        ExtractStudyTags(tags, info["PatientMainDicomTags"]);
+        ExtractStudyTags(tags, info["MainDicomTags"]);
+        studyUid = info["MainDicomTags"]["StudyInstanceUID"].asString();
+      }
+
+      boost::mutex::scoped_lock lock(mutex_);
+
+      std::list<std::string> toRemove;
+      for (Content::const_iterator it = content_.begin(); it != content_.end(); ++it)
+      {
+        if (!ok ||  // The study has been removed in the meantime
+            IsAffectedByNewInstance(*it->second, studyUid, tags))
+        {
+          toRemove.push_back(it->first);
+        }
+      }
+
+      for (std::list<std::string>::const_iterator
+             it = toRemove.begin(); it != toRemove.end(); ++it)
+      {
+        RemoveInternal(*it);
+        invalidations_++;
+      }
+    }
+  }
+
+
+  QidoCache& QidoCache::GetInstance()
+  {
+    static QidoCache singleton;
+    return singleton;
+  }
+
+
+  void QidoCache::Setup(const gdcm::Dict& dictionary,
+                        size_t maxSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    dictionary_ = &dictionary;
+    maxSize_ = maxSize;
+
+    content_.clear();
+    while (!index_.IsEmpty())
+    {
+      index_.RemoveOldest();
+    }
+
+    currentSize_ = 0;
+  }
+
+
+  bool QidoCache::IsEnabled()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return maxSize_ != 0;
+  }
+
+
+  uint64_t QidoCache::GetGeneration()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return generation_;
+  }
+
+
+  bool QidoCache::Answer(OrthancPluginContext* context,
+                         OrthancPluginRestOutput* output,
+                         const OrthancPluginHttpRequest* request,
+                         const std::string& key)
+  {
+    ProcessChangedStudies();
+
+    EntryPointer entry;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Content::const_iterator found = content_.find(key);
+      if (found == content_.end())
+      {
+        misses_++;
+        return false;
+      }
+
+      hits_++;
+      index_.MakeMostRecent(key);
+      entry = found->second;
+    }
+
+    // The answer is sent outside of the mutex, as the entry is
+    // shared, and is never modified once it is stored
+
+    if (entry->hasMore_)
+    {
+      OrthancPluginSetHttpHeader(context, output, "Warning",
+                                 "299 Orthanc: There are additional results that can be requested");
+    }
+
+    if (entry->isXml_)
+    {
+      if (OrthancPluginStartMultipartAnswer(context, output, "related", "application/dicom+xml") != 0)
+      {
+        OrthancPlugins::Configuration::LogError("Unable to create a multipart stream of DICOM+XML answers");
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+      }
+
+      for (std::list<std::string>::const_iterator
+             it = entry->items_.begin(); it != entry->items_.end(); ++it)
+      {
+        if (OrthancPlugins::MeasuredSendMultipartItem(context, output, it->c_str(), it->size()) != 0)
+        {
+          OrthancPlugins::Configuration::LogError("Unable to create a multipart stream of DICOM+XML answers");
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+        }
+      }
+    }
+    else
+    {
+      if (entry->items_.size() != 1)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      const std::string& body = entry->items_.front();
+      HttpCompression::GetInstance().AnswerBuffer(context, output, request, body,
+                                                  "application/dicom+json", &entry->gzipped_);
+    }
+
+    return true;
+  }
+
+
+  void QidoCache::Store(const std::string& key,
+                        uint64_t generation,
+                        const Entry& entry)
+  {
+    std::auto_ptr<Entry> copy(new Entry(entry));
+
+    if (!copy->isXml_ &&
+        copy->items_.size() == 1 &&
+        HttpCompression::GetInstance().IsEnabled())
+    {
+      // Compress the JSON body once for all, outside of the mutex, so
+      // that the next hits can be served without compressing again
+      if (!HttpCompression::GetInstance().Compress(copy->gzipped_, HttpCompression::Encoding_Gzip,
+                                                   copy->items_.front()))
+      {
+        copy->gzipped_.clear();
+      }
+    }
+
+    size_t size = GetEntrySize(key, *copy);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (maxSize_ == 0 ||
+        size > maxSize_ ||
+        generation != generation_)  // Some change has occurred while computing the answer
+    {
+      return;
+    }
+
+    RemoveInternal(key);
+
+    content_[key] = EntryPointer(copy.release());
+    index_.Add(key);
+    currentSize_ += size;
+
+    while (currentSize_ > maxSize_)
+    {
+      std::string oldest = index_.GetOldest();
+      RemoveInternal(oldest);
+    }
+  }
+
+
+  void QidoCache::SignalChange(OrthancPluginChangeType changeType,
+                               OrthancPluginResourceType resourceType,
+                               const char* resourceId)
+  {
+    if (changeType == OrthancPluginChangeType_NewChildInstance &&
+        resourceType == OrthancPluginResourceType_Study)
+    {
+      // The matching of the study will be evaluated by the next
+      // lookup, as the REST API cannot be used in this callback
+      boost::mutex::scoped_lock lock(mutex_);
+      generation_++;
+
+      if (maxSize_ != 0)
+      {
+        changedStudies_.insert(resourceId);
+
+        if (changedStudies_.size() > MAX_CHANGED_STUDIES)
+        {
+          invalidations_ += content_.size();
+          ClearInternal();
+        }
+      }
+    }
+    else if (changeType == OrthancPluginChangeType_Deleted)
+    {
+      // A deletion cannot make a resource match a query: Only the
+      // answers that contain the resource are modified, plus the
+      // answers whose derived tags (number of children) or whose
+      // page boundaries could change
+      boost::mutex::scoped_lock lock(mutex_);
+      generation_++;
+
+      std::list<std::string> toRemove;
+      for (Content::const_iterator it = content_.begin(); it != content_.end(); ++it)
+      {
+        const Entry& entry = *it->second;
+
+        if (entry.level_ != resourceType ||
+            entry.isPaged_ ||
+            entry.resources_.find(resourceId) != entry.resources_.end())
+        {
+          toRemove.push_back(it->first);
+        }
+      }
+
+      for (std::list<std::string>::const_iterator
+             it = toRemove.begin(); it != toRemove.end(); ++it)
+      {
+        RemoveInternal(*it);
+        invalidations_++;
+      }
+    }
+  }
+
+
+  void QidoCache::ClearInternal()
+  {
+    // The mutex must be locked by the caller
+    changedStudies_.clear();
+    content_.clear();
+
+    while (!index_.IsEmpty())
+    {
+      index_.RemoveOldest();
+    }
+
+    currentSize_ = 0;
+  }
+
+
+  void QidoCache::Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    generation_++;
+    ClearInternal();
+  }
+
+
+  void QidoCache::GetStatistics(Json::Value& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target = Json::objectValue;
+    target["Enabled"] = (maxSize_ != 0);
+    target["MaximumSize"] = static_cast<Json::UInt64>(maxSize_);
+    target["CurrentSize"] = static_cast<Json::UInt64>(currentSize_);
+    target["Count"] = static_cast<Json::UInt64>(content_.size());
+    target["Hits"] = static_cast<Json::UInt64>(hits_);
+    target["Misses"] = static_cast<Json::UInt64>(misses_);
+    target["Invalidations"] = static_cast<Json::UInt64>(invalidations_);
+  }
+
+
+  void GetQidoCacheStatistics(OrthancPluginRestOutput* output,
+                              const char* url,
+                              const OrthancPluginHttpRequest* request)
+  {
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    if (request->method == OrthancPluginHttpMethod_Get)
+    {
+      Json::Value statistics;
+      QidoCache::GetInstance().GetStatistics(statistics);
+
+      std::string answer = statistics.toStyledString();
+      OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+    }
+    else if (request->method == OrthancPluginHttpMethod_Delete)
+    {
+      QidoCache::GetInstance().Clear();
+
+      std::string answer = "{}";
+      OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+    }
+    else
+    {
+      OrthancPluginSendMethodNotAllowed(context, output, "GET,DELETE");
+    }
+  }
+}
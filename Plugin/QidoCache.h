@@ -0,0 +1,149 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <Core/Cache/LeastRecentlyUsedIndex.h>
+
+#include <orthanc/OrthancCPlugin.h>
+#include <gdcmDict.h>
+#include <gdcmTag.h>
+#include <json/value.h>
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace OrthancPlugins
+{
+  // Cache of the serialized answers to QIDO-RS queries. The entries
+  // are invalidated by the changes that are reported by the Orthanc
+  // core, and that could modify the answer to the cached query.
+  class QidoCache : public boost::noncopyable
+  {
+  public:
+    typedef std::map<gdcm::Tag, std::string>  Filters;
+
+    struct Entry
+    {
+      OrthancPluginResourceType  level_;
+      Filters                    filters_;
+      bool                       isFuzzy_;
+      bool                       isXml_;
+      bool                       hasMore_;  // The answer was truncated by "limit"
+      bool                       isPaged_;  // Either "offset" or "limit" has cut the answer
+      std::list<std::string>     items_;    // The JSON body, or the successive XML parts
+      std::string                gzipped_;  // The JSON body compressed with gzip, if worth it
+      std::set<std::string>      studies_;    // StudyInstanceUID of the returned resources
+      std::set<std::string>      resources_;  // Orthanc identifiers of the returned resources
+
+      Entry() :
+        level_(OrthancPluginResourceType_Study),
+        isFuzzy_(false),
+        isXml_(false),
+        hasMore_(false),
+        isPaged_(false)
+      {
+      }
+    };
+
+  private:
+    typedef boost::shared_ptr<const Entry>                EntryPointer;
+    typedef std::map<std::string, EntryPointer>           Content;
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string>  Index;
+
+    boost::mutex            mutex_;
+    boost::mutex            processingMutex_;
+    const gdcm::Dict*       dictionary_;
+    size_t                  maxSize_;
+    size_t                  currentSize_;
+    Content                 content_;
+    Index                   index_;
+    uint64_t                generation_;
+    std::set<std::string>   changedStudies_;  // Each study is only processed once
+    uint64_t                hits_;
+    uint64_t                misses_;
+    uint64_t                invalidations_;
+
+    static size_t GetEntrySize(const std::string& key,
+                               const Entry& entry);
+
+    void RemoveInternal(const std::string& key);
+
+    void ClearInternal();
+
+    bool IsAffectedByNewInstance(const Entry& entry,
+                                 const std::string& studyUid,
+                                 const std::map<std::string, std::string>& studyTags) const;
+
+    void ProcessChangedStudies();
+
+    QidoCache() :  // Forbidden (singleton pattern)
+      dictionary_(NULL),
+      maxSize_(0),
+      currentSize_(0),
+      generation_(0),
+      hits_(0),
+      misses_(0),
+      invalidations_(0)
+    {
+    }
+
+  public:
+    static QidoCache& GetInstance();
+
+    void Setup(const gdcm::Dict& dictionary,
+               size_t maxSize);
+
+    bool IsEnabled();
+
+    // To be read before computing an answer that will be stored in
+    // the cache, in order to detect concurrent changes
+    uint64_t GetGeneration();
+
+    bool Answer(OrthancPluginContext* context,
+                OrthancPluginRestOutput* output,
+                const OrthancPluginHttpRequest* request,
+                const std::string& key);
+
+    void Store(const std::string& key,
+               uint64_t generation,
+               const Entry& entry);
+
+    // Called from the Orthanc change callback: Must not use the REST API
+    void SignalChange(OrthancPluginChangeType changeType,
+                      OrthancPluginResourceType resourceType,
+                      const char* resourceId);
+
+    void Clear();
+
+    void GetStatistics(Json::Value& target);
+  };
+
+
+  void GetQidoCacheStatistics(OrthancPluginRestOutput* output,
+                              const char* url,
+                              const OrthancPluginHttpRequest* request);
+}
@@ -21,11 +21,15 @@
 
 #include "QidoRs.h"
 
+#include "Metrics.h"
 #include "Plugin.h"
 #include "StowRs.h"  // For IsXmlExpected()
 #include "Dicom.h"
 #include "DicomResults.h"
+#include "DictionaryTable.h"
 #include "Configuration.h"
+#include "ModuleMatcher.h"
+#include "QidoCache.h"
 
 #include <Core/Toolbox.h>
 
@@ -39,542 +43,628 @@
 #include <gdcmDictEntry.h>
 #include <boost/regex.hpp>
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <ctime>
 
 
 namespace
 {
-  static std::string FormatOrthancTag(const gdcm::Tag& tag)
+  struct MatchedResource
   {
-    char b[16];
-    sprintf(b, "%04x,%04x", tag.GetGroup(), tag.GetElement());
-    return std::string(b);
-  }
+    std::string                             resource_;     // Orthanc ID of the matched resource
+    std::string                             instance_;     // Orthanc ID of one of its child instances
+    OrthancPlugins::ModuleMatcher::Filters  derivedTags_;
+  };
 
+  typedef std::list<MatchedResource>  MatchedResources;
 
-  static std::string GetOrthancTag(const Json::Value& source,
-                                   const gdcm::Tag& tag,
-                                   const std::string& defaultValue)
+
+  // Summary of the child series of one study
+  struct StudyChildren
   {
-    std::string s = FormatOrthancTag(tag);
-      
-    if (source.isMember(s) &&
-        source[s].type() == Json::objectValue &&
-        source[s].isMember("Value") &&
-        source[s].isMember("Type") &&
-        source[s]["Type"] == "String" &&
-        source[s]["Value"].type() == Json::stringValue)
-    {
-      return source[s]["Value"].asString();
-    }
-    else
+    size_t                 countSeries_;
+    size_t                 countInstances_;
+    std::set<std::string>  modalities_;
+    std::string            instance_;
+
+    StudyChildren() :
+      countSeries_(0),
+      countInstances_(0)
     {
-      return defaultValue;
     }
-  }
-
-
-  enum QueryLevel
-  {
-    QueryLevel_Study,
-    QueryLevel_Series,
-    QueryLevel_Instance
   };
+}
 
 
-  class ModuleMatcher
+namespace
+{
+  // Position of the paged QIDO-RS queries in the answers of
+  // "/tools/find", as Orthanc has no native cursor. Each page is
+  // retrieved by a bounded lookup starting at this position.
+  class QidoContinuations : public boost::noncopyable
   {
-  public:
-    typedef std::map<gdcm::Tag, std::string>  Filters;
-
   private:
-    bool                  fuzzy_;
-    unsigned int          offset_;
-    unsigned int          limit_;
-    std::list<gdcm::Tag>  includeFields_;
-    bool                  includeAllFields_;
-    Filters               filters_;
+    struct Cursor
+    {
+      std::string   query_;      // Canonical filters of the query
+      unsigned int  position_;   // Index of the next resource to be returned
+      std::string   last_;       // Orthanc ID of the last resource that was returned
+      time_t        lastUse_;
+    };
 
+    typedef std::map<std::string, Cursor*>  Cursors;
 
-    static void AddResultAttributesForLevel(std::list<gdcm::Tag>& result,
-                                            QueryLevel level)
-    {
-      switch (level)
-      {
-        case QueryLevel_Study:
-          // http://medical.nema.org/medical/dicom/current/output/html/part18.html#table_6.7.1-2
-          result.push_back(gdcm::Tag(0x0008, 0x0005));  // Specific Character Set
-          result.push_back(gdcm::Tag(0x0008, 0x0020));  // Study Date
-          result.push_back(gdcm::Tag(0x0008, 0x0030));  // Study Time
-          result.push_back(gdcm::Tag(0x0008, 0x0050));  // Accession Number
-          result.push_back(gdcm::Tag(0x0008, 0x0056));  // Instance Availability
-          //result.push_back(gdcm::Tag(0x0008, 0x0061));  // Modalities in Study  => SPECIAL CASE
-          result.push_back(gdcm::Tag(0x0008, 0x0090));  // Referring Physician's Name
-          result.push_back(gdcm::Tag(0x0008, 0x0201));  // Timezone Offset From UTC
-          //result.push_back(gdcm::Tag(0x0008, 0x1190));  // Retrieve URL  => SPECIAL CASE
-          result.push_back(gdcm::Tag(0x0010, 0x0010));  // Patient's Name
-          result.push_back(gdcm::Tag(0x0010, 0x0020));  // Patient ID
-          result.push_back(gdcm::Tag(0x0010, 0x0030));  // Patient's Birth Date
-          result.push_back(gdcm::Tag(0x0010, 0x0040));  // Patient's Sex
-          result.push_back(gdcm::Tag(0x0020, 0x000D));  // Study Instance UID
-          result.push_back(gdcm::Tag(0x0020, 0x0010));  // Study ID
-          //result.push_back(gdcm::Tag(0x0020, 0x1206));  // Number of Study Related Series  => SPECIAL CASE
-          //result.push_back(gdcm::Tag(0x0020, 0x1208));  // Number of Study Related Instances  => SPECIAL CASE
-          break;
-
-        case QueryLevel_Series:
-          // http://medical.nema.org/medical/dicom/current/output/html/part18.html#table_6.7.1-2a
-          result.push_back(gdcm::Tag(0x0008, 0x0005));  // Specific Character Set
-          result.push_back(gdcm::Tag(0x0008, 0x0060));  // Modality
-          result.push_back(gdcm::Tag(0x0008, 0x0201));  // Timezone Offset From UTC
-          result.push_back(gdcm::Tag(0x0008, 0x103E));  // Series Description
-          //result.push_back(gdcm::Tag(0x0008, 0x1190));  // Retrieve URL  => SPECIAL CASE
-          result.push_back(gdcm::Tag(0x0020, 0x000E));  // Series Instance UID
-          result.push_back(gdcm::Tag(0x0020, 0x0011));  // Series Number
-          //result.push_back(gdcm::Tag(0x0020, 0x1209));  // Number of Series Related Instances  => SPECIAL CASE
-          result.push_back(gdcm::Tag(0x0040, 0x0244));  // Performed Procedure Step Start Date
-          result.push_back(gdcm::Tag(0x0040, 0x0245));  // Performed Procedure Step Start Time
-          result.push_back(gdcm::Tag(0x0040, 0x0275));  // Request Attribute Sequence
-          break;
-
-        case QueryLevel_Instance:
-          // http://medical.nema.org/medical/dicom/current/output/html/part18.html#table_6.7.1-2b
-          result.push_back(gdcm::Tag(0x0008, 0x0005));  // Specific Character Set
-          result.push_back(gdcm::Tag(0x0008, 0x0016));  // SOP Class UID
-          result.push_back(gdcm::Tag(0x0008, 0x0018));  // SOP Instance UID
-          result.push_back(gdcm::Tag(0x0008, 0x0056));  // Instance Availability
-          result.push_back(gdcm::Tag(0x0008, 0x0201));  // Timezone Offset From UTC
-          result.push_back(gdcm::Tag(0x0008, 0x1190));  // Retrieve URL
-          result.push_back(gdcm::Tag(0x0020, 0x0013));  // Instance Number
-          result.push_back(gdcm::Tag(0x0028, 0x0010));  // Rows
-          result.push_back(gdcm::Tag(0x0028, 0x0011));  // Columns
-          result.push_back(gdcm::Tag(0x0028, 0x0100));  // Bits Allocated
-          result.push_back(gdcm::Tag(0x0028, 0x0008));  // Number of Frames
-          break;
-
-        default:
-          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
-      }
-    }
+    static const size_t  MAX_CURSORS = 256;
 
+    boost::mutex  mutex_;
+    Cursors       cursors_;
 
-  public:
-    explicit ModuleMatcher(const OrthancPluginHttpRequest* request) :
-      fuzzy_(false),
-      offset_(0),
-      limit_(0),
-      includeAllFields_(false)
-    {
-      std::string args;
-      
-      for (uint32_t i = 0; i < request->getCount; i++)
-      {
-        std::string key(request->getKeys[i]);
-        std::string value(request->getValues[i]);
-        args += " [" + key + "=" + value + "]";
+    void RemoveExpired(unsigned int timeout)
+    {
+      time_t now = time(NULL);
 
-        if (key == "limit")
-        {
-          limit_ = boost::lexical_cast<unsigned int>(value);
-        }
-        else if (key == "offset")
-        {
-          offset_ = boost::lexical_cast<unsigned int>(value);
-        }
-        else if (key == "fuzzymatching")
+      Cursors::iterator it = cursors_.begin();
+      while (it != cursors_.end())
+      {
+        if (now - it->second->lastUse_ > static_cast<time_t>(timeout))
         {
-          if (value == "true")
-          {
-            fuzzy_ = true;
-          }
-          else if (value == "false")
-          {
-            fuzzy_ = false;
-          }
-          else
-          {
-            OrthancPlugins::Configuration::LogError("Not a proper value for fuzzy matching (true or false): " + value);
-            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest);
-          }
+          delete it->second;
+          cursors_.erase(it++);
         }
-        else if (key == "includefield")
+        else
         {
-          if (value == "all")
-          {
-            includeAllFields_ = true;
-          }
-          else
-          {
-            // Split a comma-separated list of tags
-            std::vector<std::string> tags;
-            Orthanc::Toolbox::TokenizeString(tags, value, ',');
-            for (size_t i = 0; i < tags.size(); i++)
-            {
-              includeFields_.push_back(OrthancPlugins::ParseTag(*dictionary_, tags[i]));
-            }
-          }
+          ++it;
         }
-        else
+      }
+    }
+
+    void RemoveOldest()
+    {
+      Cursors::iterator oldest = cursors_.end();
+
+      for (Cursors::iterator it = cursors_.begin(); it != cursors_.end(); ++it)
+      {
+        if (oldest == cursors_.end() ||
+            it->second->lastUse_ < oldest->second->lastUse_)
         {
-          filters_[OrthancPlugins::ParseTag(*dictionary_, key)] = value;
+          oldest = it;
         }
       }
 
-      OrthancPlugins::Configuration::LogInfo("Arguments of QIDO-RS request:" + args);
+      if (oldest != cursors_.end())
+      {
+        delete oldest->second;
+        cursors_.erase(oldest);
+      }
     }
 
-    unsigned int GetLimit() const
+    QidoContinuations()
     {
-      return limit_;
     }
 
-    unsigned int GetOffset() const
+  public:
+    ~QidoContinuations()
     {
-      return offset_;
+      for (Cursors::iterator it = cursors_.begin(); it != cursors_.end(); ++it)
+      {
+        delete it->second;
+      }
     }
 
-    void AddFilter(const gdcm::Tag& tag,
-                   const std::string& constraint)
+    static QidoContinuations& GetInstance()
     {
-      filters_[tag] = constraint;
+      static QidoContinuations singleton;
+      return singleton;
     }
 
-    void Print(std::ostream& out) const 
+    static bool IsEnabled()
     {
-      for (Filters::const_iterator it = filters_.begin(); 
-           it != filters_.end(); ++it)
-      {
-        printf("Filter [%04x,%04x] = [%s]\n", it->first.GetGroup(), it->first.GetElement(), it->second.c_str());
-      }
+      return OrthancPlugins::Configuration::GetBooleanValue("QidoContinuation", false);
     }
 
-    void ConvertToOrthanc(Json::Value& result,
-                          QueryLevel level) const
+    static unsigned int GetTimeout()
     {
-      result = Json::objectValue;
-
-      switch (level)
-      {
-        case QueryLevel_Study:
-          result["Level"] = "Study";
-          break;
+      return OrthancPlugins::Configuration::GetUnsignedIntegerValue("QidoContinuationTimeout", 60);
+    }
 
-        case QueryLevel_Series:
-          result["Level"] = "Series";
-          break;
+    std::string Create(const std::string& query,
+                       unsigned int position,
+                       const std::string& last)
+    {
+      std::auto_ptr<Cursor> cursor(new Cursor);
+      cursor->query_ = query;
+      cursor->position_ = position;
+      cursor->last_ = last;
+      cursor->lastUse_ = time(NULL);
 
-        case QueryLevel_Instance:
-          result["Level"] = "Instance";
-          break;
+      std::string token;
 
-        default:
+      {
+        char* uuid = OrthancPluginGenerateUuid(OrthancPlugins::Configuration::GetContext());
+        if (uuid == NULL)
+        {
           throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+
+        token.assign(uuid);
+        OrthancPluginFreeString(OrthancPlugins::Configuration::GetContext(), uuid);
       }
 
-      result["Expand"] = false;
-      result["CaseSensitive"] = OrthancPlugins::Configuration::GetBooleanValue("QidoCaseSensitive", true);
-      result["Query"] = Json::objectValue;
-      result["Limit"] = limit_;
-      result["Since"] = offset_;
+      boost::mutex::scoped_lock lock(mutex_);
 
-      if (offset_ != 0 &&
-          !OrthancPlugins::CheckMinimalOrthancVersion(
-            OrthancPlugins::Configuration::GetContext(), 1, 3, 0))
-      {
-        OrthancPlugins::Configuration::LogError(
-          "QIDO-RS request with \"offset\" argument: "
-          "Only available if the Orthanc core version is >= 1.3.0");
-      }
-      
-      for (Filters::const_iterator it = filters_.begin(); 
-           it != filters_.end(); ++it)
+      RemoveExpired(GetTimeout());
+
+      while (cursors_.size() >= MAX_CURSORS)
       {
-        result["Query"][FormatOrthancTag(it->first)] = it->second;
+        RemoveOldest();
       }
-    }
 
+      cursors_[token] = cursor.release();
+      return token;
+    }
 
-    void ComputeDerivedTags(Filters& target,
-                            QueryLevel level,
-                            const std::string& resource) const
+    // Returns "false" iff the token is unknown, has expired, or was
+    // created by a query with other filters
+    bool Lookup(unsigned int& position,
+                std::string& last,
+                const std::string& token,
+                const std::string& query)
     {
-      OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+      boost::mutex::scoped_lock lock(mutex_);
 
-      target.clear();
+      RemoveExpired(GetTimeout());
 
-      switch (level)
+      Cursors::const_iterator found = cursors_.find(token);
+      if (found == cursors_.end() ||
+          found->second->query_ != query)
       {
-        case QueryLevel_Study:
-        {
-          Json::Value series, instances;
-          if (OrthancPlugins::RestApiGet(series, context, "/studies/" + resource + "/series?expand", false) &&
-              OrthancPlugins::RestApiGet(instances, context, "/studies/" + resource + "/instances", false))
-          {
-            // Number of Study Related Series
-            target[gdcm::Tag(0x0020, 0x1206)] = boost::lexical_cast<std::string>(series.size());
-
-            // Number of Study Related Instances
-            target[gdcm::Tag(0x0020, 0x1208)] = boost::lexical_cast<std::string>(instances.size());
-
-            // Collect the Modality of all the child series
-            std::set<std::string> modalities;
-            for (Json::Value::ArrayIndex i = 0; i < series.size(); i++)
-            {
-              if (series[i].isMember("MainDicomTags") &&
-                  series[i]["MainDicomTags"].isMember("Modality"))
-              {
-                modalities.insert(series[i]["MainDicomTags"]["Modality"].asString());
-              }
-            }
-
-            std::string s;
-            for (std::set<std::string>::const_iterator 
-                   it = modalities.begin(); it != modalities.end(); ++it)
-            {
-              if (!s.empty())
-              {
-                s += "\\";
-              }
-
-              s += *it;
-            }
-
-            target[gdcm::Tag(0x0008, 0x0061)] = s;  // Modalities in Study
-          }
-          else
-          {
-            target[gdcm::Tag(0x0008, 0x0061)] = "";   // Modalities in Study
-            target[gdcm::Tag(0x0020, 0x1206)] = "0";  // Number of Study Related Series
-            target[gdcm::Tag(0x0020, 0x1208)] = "0";  // Number of Study Related Instances
-          }
+        return false;
+      }
 
-          break;
-        }
+      position = found->second->position_;
+      last = found->second->last_;
+      return true;
+    }
 
-        case QueryLevel_Series:
-        {
-          Json::Value instances;
-          if (OrthancPlugins::RestApiGet(instances, context, "/series/" + resource + "/instances", false))
-          {
-            // Number of Series Related Instances
-            target[gdcm::Tag(0x0020, 0x1209)] = boost::lexical_cast<std::string>(instances.size());
-          }
-          else
-          {
-            target[gdcm::Tag(0x0020, 0x1209)] = "0";  // Number of Series Related Instances
-          }
+    void Advance(const std::string& token,
+                 unsigned int position,
+                 const std::string& last)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
 
-          break;
-        }
+      Cursors::iterator found = cursors_.find(token);
+      if (found != cursors_.end())
+      {
+        found->second->position_ = position;
+        found->second->last_ = last;
+        found->second->lastUse_ = time(NULL);
+      }
+    }
 
-        default:
-          break;
+    void Remove(const std::string& token)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Cursors::iterator found = cursors_.find(token);
+      if (found != cursors_.end())
+      {
+        delete found->second;
+        cursors_.erase(found);
       }
-    }                              
+    }
+  };
+}
 
 
-    void ExtractFields(gdcm::DataSet& result,
-                       const OrthancPlugins::ParsedDicomFile& dicom,
-                       const std::string& wadoBase,
-                       QueryLevel level) const
+static std::string JoinMultipleValues(const std::set<std::string>& values)
+{
+  std::string s;
+  for (std::set<std::string>::const_iterator
+         it = values.begin(); it != values.end(); ++it)
+  {
+    if (!s.empty())
     {
-      std::list<gdcm::Tag> fields = includeFields_;
+      s += "\\";
+    }
 
-      // The list of attributes for this query level
-      AddResultAttributesForLevel(fields, level);
+    s += *it;
+  }
 
-      // All other attributes passed as query keys
-      for (Filters::const_iterator it = filters_.begin();
-           it != filters_.end(); ++it)
-      {
-        fields.push_back(it->first);
-      }
+  return s;
+}
 
-      // For instances and series, add all Study-level attributes if
-      // {StudyInstanceUID} is not specified.
-      if ((level == QueryLevel_Instance  || level == QueryLevel_Series) 
-          && filters_.find(OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID) == filters_.end()
-        )
-      {
-        AddResultAttributesForLevel(fields, QueryLevel_Study);
-      }
 
-      // For instances, add all Series-level attributes if
-      // {SeriesInstanceUID} is not specified.
-      if (level == QueryLevel_Instance
-          && filters_.find(OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID) == filters_.end()
-        )
-      {
-        AddResultAttributesForLevel(fields, QueryLevel_Series);
-      }
+static bool LookupChildInstance(std::string& instance,
+                                const std::string& resource,
+                                OrthancPlugins::QueryLevel level)
+{
+  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+  std::string root = (level == OrthancPlugins::QueryLevel_Study ? "/studies/" : "/series/");
 
-      // Copy all the required fields to the target
-      for (std::list<gdcm::Tag>::const_iterator
-             it = fields.begin(); it != fields.end(); ++it)
-      {
-        if (dicom.GetDataSet().FindDataElement(*it))
-        {
-          const gdcm::DataElement& element = dicom.GetDataSet().GetDataElement(*it);
-          result.Replace(element);
-        }
-      }
+  Json::Value tmp;
+  if (OrthancPlugins::MeasuredRestApiGet(tmp, context, root + resource + "/instances", false) &&
+      tmp.type() == Json::arrayValue &&
+      tmp.size() > 0)
+  {
+    instance = tmp[0]["ID"].asString();
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
 
-      // Set the retrieve URL for WADO-RS
-      std::string url = (wadoBase + "studies/" + 
-                         dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID, "", true));
 
-      if (level == QueryLevel_Series || level == QueryLevel_Instance)
-      {
-        url += "/series/" + dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID, "", true);
-      }
+static void ResolveStudies(MatchedResources& target,
+                           const OrthancPlugins::ModuleMatcher& matcher,
+                           const Json::Value& studies /* expanded answer of "/tools/find" */)
+{
+  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
 
-      if (level == QueryLevel_Instance)
-      {
-        url += "/instances/" + dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_SOP_INSTANCE_UID, "", true);
-      }
-    
-      gdcm::DataElement element(OrthancPlugins::DICOM_TAG_RETRIEVE_URL);
-      element.SetByteValue(url.c_str(), url.size());
-      result.Replace(element);
+  // Retrieve the child series of all the studies of the page at once,
+  // thanks to a list of UIDs in a single series-level lookup
+  std::string uids;
+  size_t expectedSeries = 0;
+
+  for (Json::Value::ArrayIndex i = 0; i < studies.size(); i++)
+  {
+    if (!uids.empty())
+    {
+      uids += "\\";
     }
 
+    uids += studies[i]["MainDicomTags"]["StudyInstanceUID"].asString();
 
-    void ExtractFields(Json::Value& result,
-                       const Json::Value& source,
-                       const std::string& wadoBase,
-                       QueryLevel level) const
+    if (studies[i]["Series"].type() == Json::arrayValue)
     {
-      result = Json::objectValue;
-      std::list<gdcm::Tag> fields = includeFields_;
+      expectedSeries += studies[i]["Series"].size();
+    }
+  }
 
-      // The list of attributes for this query level
-      AddResultAttributesForLevel(fields, level);
+  std::map<std::string, StudyChildren>  children;
 
-      // All other attributes passed as query keys
-      for (Filters::const_iterator it = filters_.begin();
-           it != filters_.end(); ++it)
+  if (!uids.empty())
+  {
+    Json::Value find = Json::objectValue;
+    find["Level"] = "Series";
+    find["Expand"] = true;
+    find["CaseSensitive"] = true;
+    find["Query"] = Json::objectValue;
+    find["Query"][OrthancPlugins::FormatOrthancTag(OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID)] = uids;
+
+    // The core might still truncate the answer below this limit
+    // (cf. "LimitFindResults"), which is detected below
+    find["Limit"] = static_cast<unsigned int>(expectedSeries);
+
+    Json::FastWriter writer;
+    Json::Value series;
+    if (OrthancPlugins::MeasuredRestApiPost(series, context, "/tools/find", writer.write(find), false) &&
+        series.type() == Json::arrayValue)
+    {
+      for (Json::Value::ArrayIndex i = 0; i < series.size(); i++)
       {
-        fields.push_back(it->first);
-      }
+        const Json::Value& instances = series[i]["Instances"];
+        StudyChildren& summary = children[series[i]["ParentStudy"].asString()];
 
-      // For instances and series, add all Study-level attributes if
-      // {StudyInstanceUID} is not specified.
-      if ((level == QueryLevel_Instance  || level == QueryLevel_Series) 
-          && filters_.find(OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID) == filters_.end()
-        )
-      {
-        AddResultAttributesForLevel(fields, QueryLevel_Study);
-      }
+        summary.countSeries_ += 1;
 
-      // For instances, add all Series-level attributes if
-      // {SeriesInstanceUID} is not specified.
-      if (level == QueryLevel_Instance
-          && filters_.find(OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID) == filters_.end()
-        )
-      {
-        AddResultAttributesForLevel(fields, QueryLevel_Series);
-      }
+        if (instances.type() == Json::arrayValue)
+        {
+          summary.countInstances_ += instances.size();
 
-      // Copy all the required fields to the target
-      for (std::list<gdcm::Tag>::const_iterator
-             it = fields.begin(); it != fields.end(); ++it)
-      {
-        std::string tag = FormatOrthancTag(*it);
-        if (source.isMember(tag))
+          if (summary.instance_.empty() &&
+              instances.size() > 0)
+          {
+            summary.instance_ = instances[0].asString();
+          }
+        }
+
+        if (series[i]["MainDicomTags"].isMember("Modality"))
         {
-          result[tag] = source[tag];
+          summary.modalities_.insert(series[i]["MainDicomTags"]["Modality"].asString());
         }
       }
+    }
+  }
 
-      // Set the retrieve URL for WADO-RS
-      std::string url = (wadoBase + "studies/" + 
-                         GetOrthancTag(source, OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID, ""));
+  for (Json::Value::ArrayIndex i = 0; i < studies.size(); i++)
+  {
+    MatchedResource resource;
+    resource.resource_ = studies[i]["ID"].asString();
+
+    // The batched lookup is only used if it has returned all the
+    // child series of the study, as listed in its "Series" field
+    std::map<std::string, StudyChildren>::const_iterator found = children.find(resource.resource_);
+    if (found != children.end() &&
+        !found->second.instance_.empty() &&
+        studies[i]["Series"].type() == Json::arrayValue &&
+        found->second.countSeries_ == studies[i]["Series"].size())
+    {
+      const StudyChildren& summary = found->second;
+      resource.instance_ = summary.instance_;
+      resource.derivedTags_[gdcm::Tag(0x0008, 0x0061)] = JoinMultipleValues(summary.modalities_);  // Modalities in Study
+      resource.derivedTags_[gdcm::Tag(0x0020, 0x1206)] = boost::lexical_cast<std::string>(summary.countSeries_);  // Number of Study Related Series
+      resource.derivedTags_[gdcm::Tag(0x0020, 0x1208)] = boost::lexical_cast<std::string>(summary.countInstances_);  // Number of Study Related Instances
+      target.push_back(resource);
+    }
+    else if (LookupChildInstance(resource.instance_, resource.resource_, OrthancPlugins::QueryLevel_Study))
+    {
+      // Fallback if this study was not found by the batched lookup,
+      // or if the answer of the latter was truncated
+      matcher.ComputeDerivedTags(resource.derivedTags_, OrthancPlugins::QueryLevel_Study, resource.resource_);
+      target.push_back(resource);
+    }
+  }
+}
 
-      if (level == QueryLevel_Series || level == QueryLevel_Instance)
-      {
-        url += "/series/" + GetOrthancTag(source, OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID, "");
-      }
 
-      if (level == QueryLevel_Instance)
-      {
-        url += "/instances/" + GetOrthancTag(source, OrthancPlugins::DICOM_TAG_SOP_INSTANCE_UID, "");
-      }
-    
-      Json::Value tmp = Json::objectValue;
-      tmp["Name"] = "RetrieveURL";
-      tmp["Type"] = "String";
-      tmp["Value"] = url;
+static void ResolveSeries(MatchedResources& target,
+                          const Json::Value& series /* expanded answer of "/tools/find" */)
+{
+  for (Json::Value::ArrayIndex i = 0; i < series.size(); i++)
+  {
+    const Json::Value& instances = series[i]["Instances"];
 
-      result[FormatOrthancTag(OrthancPlugins::DICOM_TAG_RETRIEVE_URL)] = tmp;
+    if (instances.type() == Json::arrayValue &&
+        instances.size() > 0)
+    {
+      MatchedResource resource;
+      resource.resource_ = series[i]["ID"].asString();
+      resource.instance_ = instances[0].asString();
+
+      // Number of Series Related Instances
+      resource.derivedTags_[gdcm::Tag(0x0020, 0x1209)] = boost::lexical_cast<std::string>(instances.size());
+      target.push_back(resource);
     }
-  };
+  }
 }
 
 
+static void ExtractPage(Json::Value& page,
+                        bool& hasMore,
+                        const Json::Value& resources,
+                        unsigned int skip,
+                        unsigned int limit)
+{
+  page = Json::arrayValue;
+  hasMore = false;
+
+  for (Json::Value::ArrayIndex i = skip; i < resources.size(); i++)
+  {
+    if (limit != 0 &&
+        page.size() == limit)
+    {
+      hasMore = true;
+      break;
+    }
+
+    page.append(resources[i]);
+  }
+}
+
+
+static std::string GetResourceId(const Json::Value& resource)
+{
+  // The instances are not expanded by "/tools/find"
+  if (resource.type() == Json::stringValue)
+  {
+    return resource.asString();
+  }
+  else
+  {
+    return resource["ID"].asString();
+  }
+}
+
 
 static void ApplyMatcher(OrthancPluginRestOutput* output,
                          const OrthancPluginHttpRequest* request,
-                         const ModuleMatcher& matcher,
-                         QueryLevel level)
+                         const OrthancPlugins::ModuleMatcher& matcher,
+                         OrthancPlugins::QueryLevel level)
 {
   OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
 
-  Json::Value find;
-  matcher.ConvertToOrthanc(find, level);
+  const std::string wadoBase = OrthancPlugins::Configuration::GetBaseUrl(request);
+  const bool isXml = IsXmlExpected(request);
 
-  Json::FastWriter writer;
-  std::string body = writer.write(find);
-  
-  Json::Value resources;
-  if (!OrthancPlugins::RestApiPost(resources, context, "/tools/find", body, false) ||
-      resources.type() != Json::arrayValue)
+  // The continuations are not cached, as their tokens are unique
+  OrthancPlugins::QidoCache& cache = OrthancPlugins::QidoCache::GetInstance();
+  bool useCache = (cache.IsEnabled() && 
+                   matcher.GetContinuation().empty());
+
+  std::string cacheKey;
+  uint64_t generation = 0;
+
+  if (useCache)
   {
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    matcher.FormatCacheKey(cacheKey, level, wadoBase, isXml);
+    generation = cache.GetGeneration();
+
+    if (cache.Answer(context, output, request, cacheKey))
+    {
+      return;
+    }
   }
 
-  typedef std::list< std::pair<std::string, std::string> > ResourcesAndInstances;
+  Json::Value page;
+  bool hasMore = false;
+  std::string continuation;
 
-  ResourcesAndInstances resourcesAndInstances;
-  std::string root = (level == QueryLevel_Study ? "/studies/" : "/series/");
-    
-  for (Json::Value::ArrayIndex i = 0; i < resources.size(); i++)
   {
-    const std::string resource = resources[i].asString();
+    QidoContinuations& continuations = QidoContinuations::GetInstance();
+
+    std::string query;
+    if (QidoContinuations::IsEnabled() ||
+        !matcher.GetContinuation().empty())
+    {
+      matcher.FormatContinuationKey(query, level);
+    }
 
-    if (level == QueryLevel_Study ||
-        level == QueryLevel_Series)
+    Json::Value find;
+    unsigned int first;  // Index of the first resource of the page
+    std::string last;    // Last resource of the previous page, if continuation
+
+    if (matcher.GetContinuation().empty())
+    {
+      matcher.ConvertToOrthanc(find, level);
+      first = matcher.GetOffset();
+    }
+    else
     {
-      // Find one child instance of this resource
-      Json::Value tmp;
-      if (OrthancPlugins::RestApiGet(tmp, context, root + resource + "/instances", false) &&
-          tmp.type() == Json::arrayValue &&
-          tmp.size() > 0)
+      if (!continuations.Lookup(first, last, matcher.GetContinuation(), query) ||
+          first == 0)
       {
-        resourcesAndInstances.push_back(std::make_pair(resource, tmp[0]["ID"].asString()));
+        OrthancPlugins::Configuration::LogError("Unknown or expired QIDO-RS continuation: " +
+                                                matcher.GetContinuation());
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
       }
+
+      // The lookup starts at the last resource of the previous page,
+      // in order to detect whether the matching resources have changed
+      matcher.ConvertToOrthanc(find, level, first - 1,
+                               matcher.GetLimit() == 0 ? 0 : matcher.GetLimit() + 2);
     }
-    else
+
+    Json::FastWriter writer;
+    std::string body = writer.write(find);
+  
+    Json::Value resources;
+    if (!OrthancPlugins::MeasuredRestApiPost(resources, context, "/tools/find", body, false) ||
+        resources.type() != Json::arrayValue)
     {
-      resourcesAndInstances.push_back(std::make_pair(resource, resource));
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    // Index of the first resource returned by "/tools/find"
+    unsigned int start = 0;
+    if (OrthancPlugins::ModuleMatcher::IsOffsetHandledByOrthanc())
+    {
+      start = (last.empty() ? first : first - 1);
+    }
+
+    if (!last.empty() &&
+        (resources.size() < first - start ||
+         GetResourceId(resources[first - start - 1]) != last))
+    {
+      // Some resources have been added or removed before the position
+      // of the continuation, whose next page is thus unknown
+      continuations.Remove(matcher.GetContinuation());
+      OrthancPlugins::Configuration::LogError("The resources matching the QIDO-RS continuation " +
+                                              matcher.GetContinuation() + " have changed");
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+    }
+
+    // Cut the page before any per-resource processing
+    ExtractPage(page, hasMore, resources, first - start, matcher.GetLimit());
+
+    if (hasMore &&
+        QidoContinuations::IsEnabled())
+    {
+      unsigned int next = first + page.size();
+      last = GetResourceId(page[page.size() - 1]);
+
+      if (matcher.GetContinuation().empty())
+      {
+        continuation = continuations.Create(query, next, last);
+      }
+      else
+      {
+        continuations.Advance(matcher.GetContinuation(), next, last);
+        continuation = matcher.GetContinuation();
+      }
+    }
+    else if (!matcher.GetContinuation().empty())
+    {
+      // The last page of the continuation has been returned
+      continuations.Remove(matcher.GetContinuation());
     }
   }
-  
-  std::string wadoBase = OrthancPlugins::Configuration::GetBaseUrl(request);
 
-  OrthancPlugins::DicomResults results(context, output, wadoBase, *dictionary_, IsXmlExpected(request), true);
+  // The derived tags are only computed for the current page of results
+  MatchedResources matched;
+
+  switch (level)
+  {
+    case OrthancPlugins::QueryLevel_Study:
+      ResolveStudies(matched, matcher, page);
+      break;
+
+    case OrthancPlugins::QueryLevel_Series:
+      ResolveSeries(matched, page);
+      break;
+
+    case OrthancPlugins::QueryLevel_Instance:
+      for (Json::Value::ArrayIndex i = 0; i < page.size(); i++)
+      {
+        MatchedResource resource;
+        resource.resource_ = page[i].asString();
+        resource.instance_ = resource.resource_;
+        matched.push_back(resource);
+      }
+      break;
+
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+  }
+
+  if (hasMore)
+  {
+    // http://dicom.nema.org/medical/dicom/current/output/html/part18.html#sect_6.7.1.2.1
+    OrthancPluginSetHttpHeader(context, output, "Warning",
+                               "299 Orthanc: There are additional results that can be requested");
+  }
+
+  if (!continuation.empty())
+  {
+    OrthancPluginSetHttpHeader(context, output, "X-Continuation", continuation.c_str());
+    useCache = false;
+  }
+
+  OrthancPlugins::QidoCache::Entry entry;
+
+  OrthancPlugins::DicomResults results(context, output, wadoBase, *dictionary_, isXml, true);
+
+  if (useCache)
+  {
+    switch (level)
+    {
+      case OrthancPlugins::QueryLevel_Study:
+        entry.level_ = OrthancPluginResourceType_Study;
+        break;
+
+      case OrthancPlugins::QueryLevel_Series:
+        entry.level_ = OrthancPluginResourceType_Series;
+        break;
+
+      case OrthancPlugins::QueryLevel_Instance:
+        entry.level_ = OrthancPluginResourceType_Instance;
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    entry.filters_ = matcher.GetFilters();
+    entry.isFuzzy_ = matcher.IsFuzzy();
+    entry.isXml_ = isXml;
+    entry.hasMore_ = hasMore;
+    entry.isPaged_ = (hasMore || matcher.GetOffset() != 0);
+
+    results.SetRecorder(entry.items_);
+  }
 
 #if 0
   // Implementation up to version 0.2 of the plugin. Each instance is
   // downloaded and decoded using GDCM, which slows down things
   // wrt. the new implementation below that directly uses the Orthanc
   // pre-computed JSON summary.
-  for (ResourcesAndInstances::const_iterator
-         it = resourcesAndInstances.begin(); it != resourcesAndInstances.end(); ++it)
+  for (MatchedResources::const_iterator
+         it = matched.begin(); it != matched.end(); ++it)
   {
-    ModuleMatcher::Filters derivedTags;
-    matcher.ComputeDerivedTags(derivedTags, level, it->first);
-
     std::string file;
-    if (OrthancPlugins::RestApiGetString(file, context, "/instances/" + it->second + "/file", false))
+    if (OrthancPlugins::MeasuredRestApiGetString(file, context, "/instances/" + it->instance_ + "/file", false))
     {
       OrthancPlugins::ParsedDicomFile dicom(file);
 
@@ -582,11 +672,8 @@ static void ApplyMatcher(OrthancPluginRestOutput* output,
       matcher.ExtractFields(*result, dicom, wadoBase, level);
 
       // Inject the derived tags
-      ModuleMatcher::Filters derivedTags;
-      matcher.ComputeDerivedTags(derivedTags, level, it->first);
-
-      for (ModuleMatcher::Filters::const_iterator
-             tag = derivedTags.begin(); tag != derivedTags.end(); ++tag)
+      for (OrthancPlugins::ModuleMatcher::Filters::const_iterator
+             tag = it->derivedTags_.begin(); tag != it->derivedTags_.end(); ++tag)
       {
         gdcm::DataElement element(tag->first);
         element.SetByteValue(tag->second.c_str(), tag->second.size());
@@ -599,33 +686,37 @@ static void ApplyMatcher(OrthancPluginRestOutput* output,
 
 #else
   // Fix of issue #13
-  for (ResourcesAndInstances::const_iterator
-         it = resourcesAndInstances.begin(); it != resourcesAndInstances.end(); ++it)
+  for (MatchedResources::const_iterator
+         it = matched.begin(); it != matched.end(); ++it)
   {
     Json::Value tags;
-    if (OrthancPlugins::RestApiGet(tags, context, "/instances/" + it->second + "/tags", false))
+    if (OrthancPlugins::MeasuredRestApiGet(tags, context, "/instances/" + it->instance_ + "/tags", false))
     {
       std::string wadoUrl = OrthancPlugins::Configuration::GetWadoUrl(
         wadoBase, 
-        GetOrthancTag(tags, OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID, ""),
-        GetOrthancTag(tags, OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID, ""),
-        GetOrthancTag(tags, OrthancPlugins::DICOM_TAG_SOP_INSTANCE_UID, ""));
+        OrthancPlugins::GetOrthancTag(tags, OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID, ""),
+        OrthancPlugins::GetOrthancTag(tags, OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID, ""),
+        OrthancPlugins::GetOrthancTag(tags, OrthancPlugins::DICOM_TAG_SOP_INSTANCE_UID, ""));
+
+      if (useCache)
+      {
+        entry.studies_.insert(OrthancPlugins::GetOrthancTag(tags, OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID, ""));
+        entry.resources_.insert(it->resource_);
+        entry.resources_.insert(it->instance_);
+      }
 
       Json::Value result;
       matcher.ExtractFields(result, tags, wadoBase, level);
 
       // Inject the derived tags
-      ModuleMatcher::Filters derivedTags;
-      matcher.ComputeDerivedTags(derivedTags, level, it->first);
-
-      for (ModuleMatcher::Filters::const_iterator
-             tag = derivedTags.begin(); tag != derivedTags.end(); ++tag)
+      for (OrthancPlugins::ModuleMatcher::Filters::const_iterator
+             tag = it->derivedTags_.begin(); tag != it->derivedTags_.end(); ++tag)
       {
         Json::Value tmp = Json::objectValue;
         tmp["Name"] = OrthancPlugins::GetKeyword(*dictionary_, tag->first);
         tmp["Type"] = "String";
         tmp["Value"] = tag->second;
-        result[FormatOrthancTag(tag->first)] = tmp;
+        result[OrthancPlugins::FormatOrthancTag(tag->first)] = tmp;
       }
 
       results.AddFromOrthanc(result, wadoUrl);
@@ -633,7 +724,12 @@ static void ApplyMatcher(OrthancPluginRestOutput* output,
   }
 #endif
 
-  results.Answer();
+  results.Answer(request);
+
+  if (useCache)
+  {
+    cache.Store(cacheKey, generation, entry);
+  }
 }
 
 
@@ -648,8 +744,8 @@ void SearchForStudies(OrthancPluginRestOutput* output,
   }
   else
   {
-    ModuleMatcher matcher(request);
-    ApplyMatcher(output, request, matcher, QueryLevel_Study);
+    OrthancPlugins::ModuleMatcher matcher(*dictionary_, request);
+    ApplyMatcher(output, request, matcher, OrthancPlugins::QueryLevel_Study);
   }
 }
 
@@ -664,7 +760,7 @@ void SearchForSeries(OrthancPluginRestOutput* output,
   }
   else
   {
-    ModuleMatcher matcher(request);
+    OrthancPlugins::ModuleMatcher matcher(*dictionary_, request);
 
     if (request->groupsCount == 1)
     {
@@ -672,7 +768,7 @@ void SearchForSeries(OrthancPluginRestOutput* output,
       matcher.AddFilter(OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID, request->groups[0]);
     }
 
-    ApplyMatcher(output, request, matcher, QueryLevel_Series);
+    ApplyMatcher(output, request, matcher, OrthancPlugins::QueryLevel_Series);
   }
 }
 
@@ -687,7 +783,7 @@ void SearchForInstances(OrthancPluginRestOutput* output,
   }
   else
   {
-    ModuleMatcher matcher(request);
+    OrthancPlugins::ModuleMatcher matcher(*dictionary_, request);
 
     if (request->groupsCount == 1 || request->groupsCount == 2)
     {
@@ -701,6 +797,6 @@ void SearchForInstances(OrthancPluginRestOutput* output,
       matcher.AddFilter(OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID, request->groups[1]);
     }
 
-    ApplyMatcher(output, request, matcher, QueryLevel_Instance);
+    ApplyMatcher(output, request, matcher, OrthancPlugins::QueryLevel_Instance);
   }
 }
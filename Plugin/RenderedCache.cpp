@@ -0,0 +1,205 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "RenderedCache.h"
+
+#include "Configuration.h"
+#include "Metrics.h"
+
+#include <list>
+#include <boost/lexical_cast.hpp>
+
+
+namespace OrthancPlugins
+{
+  std::string RenderedCache::GetKey(const std::string& instanceId,
+                                    unsigned int frame,
+                                    const std::string& parameters)
+  {
+    return instanceId + "_" + boost::lexical_cast<std::string>(frame) + "_" + parameters;
+  }
+
+
+  void RenderedCache::RemoveInternal(const std::string& key)
+  {
+    // The mutex must be locked by the caller
+    Content::iterator found = content_.find(key);
+    if (found != content_.end())
+    {
+      currentSize_ -= key.size() + found->second.size();
+      content_.erase(found);
+      index_.Invalidate(key);
+    }
+  }
+
+
+  RenderedCache& RenderedCache::GetInstance()
+  {
+    static RenderedCache singleton;
+    return singleton;
+  }
+
+
+  void RenderedCache::SetMaximumSize(size_t maxSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    maxSize_ = maxSize;
+
+    while (currentSize_ > maxSize_)
+    {
+      RemoveInternal(index_.GetOldest());
+    }
+  }
+
+
+  bool RenderedCache::Lookup(std::string& image,
+                             const std::string& instanceId,
+                             unsigned int frame,
+                             const std::string& parameters)
+  {
+    const std::string key = GetKey(instanceId, frame, parameters);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Content::const_iterator found = content_.find(key);
+    if (found == content_.end())
+    {
+      misses_++;
+      return false;
+    }
+    else
+    {
+      hits_++;
+      index_.MakeMostRecent(key);
+      image = found->second;
+      return true;
+    }
+  }
+
+
+  void RenderedCache::Store(const std::string& instanceId,
+                            unsigned int frame,
+                            const std::string& parameters,
+                            const std::string& image)
+  {
+    const std::string key = GetKey(instanceId, frame, parameters);
+    const size_t size = key.size() + image.size();
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (size > maxSize_ ||
+        content_.find(key) != content_.end())
+    {
+      return;
+    }
+
+    content_[key] = image;
+    index_.Add(key);
+    currentSize_ += size;
+
+    while (currentSize_ > maxSize_)
+    {
+      RemoveInternal(index_.GetOldest());
+    }
+  }
+
+
+  void RenderedCache::SignalChange(OrthancPluginChangeType changeType,
+                                   OrthancPluginResourceType resourceType,
+                                   const char* resourceId)
+  {
+    if (changeType == OrthancPluginChangeType_Deleted &&
+        resourceType == OrthancPluginResourceType_Instance)
+    {
+      const std::string prefix = std::string(resourceId) + "_";
+
+      boost::mutex::scoped_lock lock(mutex_);
+
+      std::list<std::string> toRemove;
+      for (Content::const_iterator it = content_.lower_bound(prefix);
+           it != content_.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+      {
+        toRemove.push_back(it->first);
+      }
+
+      for (std::list<std::string>::const_iterator
+             it = toRemove.begin(); it != toRemove.end(); ++it)
+      {
+        RemoveInternal(*it);
+      }
+    }
+  }
+
+
+  void RenderedCache::Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    while (!index_.IsEmpty())
+    {
+      RemoveInternal(index_.GetOldest());
+    }
+  }
+
+
+  void RenderedCache::GetStatistics(Json::Value& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target = Json::objectValue;
+    target["Enabled"] = (maxSize_ != 0);
+    target["MaximumSize"] = static_cast<Json::UInt64>(maxSize_);
+    target["CurrentSize"] = static_cast<Json::UInt64>(currentSize_);
+    target["Count"] = static_cast<Json::UInt64>(content_.size());
+    target["Hits"] = static_cast<Json::UInt64>(hits_);
+    target["Misses"] = static_cast<Json::UInt64>(misses_);
+  }
+
+
+  void GetRenderedCacheStatistics(OrthancPluginRestOutput* output,
+                                  const char* url,
+                                  const OrthancPluginHttpRequest* request)
+  {
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    if (request->method == OrthancPluginHttpMethod_Get)
+    {
+      Json::Value statistics;
+      RenderedCache::GetInstance().GetStatistics(statistics);
+
+      std::string answer = statistics.toStyledString();
+      OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+    }
+    else if (request->method == OrthancPluginHttpMethod_Delete)
+    {
+      RenderedCache::GetInstance().Clear();
+
+      std::string answer = "{}";
+      OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+    }
+    else
+    {
+      OrthancPluginSendMethodNotAllowed(context, output, "GET,DELETE");
+    }
+  }
+}
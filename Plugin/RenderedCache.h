@@ -0,0 +1,98 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <Core/Cache/LeastRecentlyUsedIndex.h>
+
+#include <orthanc/OrthancCPlugin.h>
+#include <json/value.h>
+
+#include <map>
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace OrthancPlugins
+{
+  // Memory cache of the rendered images (WADO-RS "/rendered" and
+  // "/thumbnail", WADO-URI), indexed by the Orthanc identifier of the
+  // instance, the index of the frame and the rendering parameters
+  class RenderedCache : public boost::noncopyable
+  {
+  private:
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string>  Index;
+    typedef std::map<std::string, std::string>            Content;  // Sorted, to find the images of one instance
+
+    boost::mutex  mutex_;
+    size_t        maxSize_;
+    size_t        currentSize_;
+    Content       content_;
+    Index         index_;
+    uint64_t      hits_;
+    uint64_t      misses_;
+
+    static std::string GetKey(const std::string& instanceId,
+                              unsigned int frame,
+                              const std::string& parameters);
+
+    void RemoveInternal(const std::string& key);
+
+    RenderedCache() :  // Forbidden (singleton pattern)
+      maxSize_(0),
+      currentSize_(0),
+      hits_(0),
+      misses_(0)
+    {
+    }
+
+  public:
+    static RenderedCache& GetInstance();
+
+    void SetMaximumSize(size_t maxSize);
+
+    // "parameters" is the key of the rendering parameters
+    bool Lookup(std::string& image,
+                const std::string& instanceId,
+                unsigned int frame,
+                const std::string& parameters);
+
+    void Store(const std::string& instanceId,
+               unsigned int frame,
+               const std::string& parameters,
+               const std::string& image);
+
+    // Called from the Orthanc change callback: Must not use the REST API
+    void SignalChange(OrthancPluginChangeType changeType,
+                      OrthancPluginResourceType resourceType,
+                      const char* resourceId);
+
+    void Clear();
+
+    void GetStatistics(Json::Value& target);
+  };
+
+
+  void GetRenderedCacheStatistics(OrthancPluginRestOutput* output,
+                                  const char* url,
+                                  const OrthancPluginHttpRequest* request);
+}
@@ -0,0 +1,527 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "Rendering.h"
+
+#include "Dicom.h"
+#include "Metrics.h"
+
+#include <Core/OrthancException.h>
+
+#include <algorithm>
+#include <boost/lexical_cast.hpp>
+
+
+namespace OrthancPlugins
+{
+  static const gdcm::Tag DICOM_TAG_WINDOW_CENTER(0x0028, 0x1050);
+  static const gdcm::Tag DICOM_TAG_WINDOW_WIDTH(0x0028, 0x1051);
+  static const gdcm::Tag DICOM_TAG_RESCALE_INTERCEPT(0x0028, 0x1052);
+  static const gdcm::Tag DICOM_TAG_RESCALE_SLOPE(0x0028, 0x1053);
+
+
+  RenderingParameters::RenderingParameters() :
+    isPng_(false),
+    quality_(90),
+    viewportWidth_(0),
+    viewportHeight_(0),
+    hasWindowing_(false),
+    windowCenter_(0),
+    windowWidth_(0)
+  {
+  }
+
+
+  void RenderingParameters::SetQuality(unsigned int quality)
+  {
+    if (quality < 1 ||
+        quality > 100)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    quality_ = quality;
+  }
+
+
+  void RenderingParameters::SetViewport(unsigned int width,
+                                        unsigned int height)
+  {
+    if (width == 0 &&
+        height == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    viewportWidth_ = width;
+    viewportHeight_ = height;
+  }
+
+
+  void RenderingParameters::SetWindowing(float center,
+                                         float width)
+  {
+    if (width <= 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    hasWindowing_ = true;
+    windowCenter_ = center;
+    windowWidth_ = width;
+  }
+
+
+  const char* RenderingParameters::GetMimeType() const
+  {
+    return isPng_ ? "image/png" : "image/jpeg";
+  }
+
+
+  std::string RenderingParameters::GetKey() const
+  {
+    std::string key = (isPng_ ? "png" : "jpeg" + boost::lexical_cast<std::string>(quality_));
+
+    key += "_" + boost::lexical_cast<std::string>(viewportWidth_) + "x" + 
+      boost::lexical_cast<std::string>(viewportHeight_);
+
+    if (hasWindowing_)
+    {
+      key += "_" + boost::lexical_cast<std::string>(windowCenter_) + "_" + 
+        boost::lexical_cast<std::string>(windowWidth_);
+    }
+
+    return key;
+  }
+
+
+  void ComputeRenderedSize(unsigned int& targetWidth,
+                           unsigned int& targetHeight,
+                           unsigned int width,
+                           unsigned int height,
+                           unsigned int viewportWidth,
+                           unsigned int viewportHeight)
+  {
+    if ((viewportWidth == 0 && viewportHeight == 0) ||
+        width == 0 ||
+        height == 0)
+    {
+      targetWidth = width;
+      targetHeight = height;
+    }
+    else if (viewportHeight == 0 ||
+             (viewportWidth != 0 &&
+              static_cast<uint64_t>(width) * viewportHeight >= 
+              static_cast<uint64_t>(height) * viewportWidth))
+    {
+      // The width is the limiting dimension
+      targetWidth = viewportWidth;
+      targetHeight = static_cast<unsigned int>(
+        (static_cast<uint64_t>(height) * viewportWidth + width / 2) / width);
+    }
+    else
+    {
+      targetHeight = viewportHeight;
+      targetWidth = static_cast<unsigned int>(
+        (static_cast<uint64_t>(width) * viewportHeight + height / 2) / height);
+    }
+
+    if (targetWidth == 0)
+    {
+      targetWidth = 1;
+    }
+
+    if (targetHeight == 0)
+    {
+      targetHeight = 1;
+    }
+  }
+
+
+  void ResizeImage(std::vector<uint8_t>& target,
+                   unsigned int targetWidth,
+                   unsigned int targetHeight,
+                   const uint8_t* source,
+                   unsigned int width,
+                   unsigned int height,
+                   unsigned int pitch,
+                   unsigned int channels)
+  {
+    if (targetWidth == 0 ||
+        targetHeight == 0 ||
+        width == 0 ||
+        height == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    target.resize(static_cast<size_t>(targetWidth) * targetHeight * channels);
+
+    std::vector<unsigned int> sums(channels);
+
+    for (unsigned int y = 0; y < targetHeight; y++)
+    {
+      // Range of the source lines that are covered by this line,
+      // with at least one line if the image is enlarged
+      unsigned int y0 = static_cast<unsigned int>(static_cast<uint64_t>(y) * height / targetHeight);
+      unsigned int y1 = static_cast<unsigned int>(static_cast<uint64_t>(y + 1) * height / targetHeight);
+      y1 = std::max(y1, y0 + 1);
+
+      for (unsigned int x = 0; x < targetWidth; x++)
+      {
+        unsigned int x0 = static_cast<unsigned int>(static_cast<uint64_t>(x) * width / targetWidth);
+        unsigned int x1 = static_cast<unsigned int>(static_cast<uint64_t>(x + 1) * width / targetWidth);
+        x1 = std::max(x1, x0 + 1);
+
+        std::fill(sums.begin(), sums.end(), 0);
+
+        for (unsigned int i = y0; i < y1; i++)
+        {
+          const uint8_t* p = source + static_cast<size_t>(i) * pitch + x0 * channels;
+          for (unsigned int j = x0; j < x1; j++)
+          {
+            for (unsigned int c = 0; c < channels; c++, p++)
+            {
+              sums[c] += *p;
+            }
+          }
+        }
+
+        const unsigned int count = (y1 - y0) * (x1 - x0);
+        uint8_t* q = &target[(static_cast<size_t>(y) * targetWidth + x) * channels];
+        for (unsigned int c = 0; c < channels; c++)
+        {
+          q[c] = static_cast<uint8_t>((sums[c] + count / 2) / count);
+        }
+      }
+    }
+  }
+
+
+  namespace
+  {
+    class DecodedImage : public boost::noncopyable
+    {
+    private:
+      OrthancPluginContext*  context_;
+      OrthancPluginImage*    image_;
+
+    public:
+      DecodedImage(OrthancPluginContext* context,
+                   const void* dicom,
+                   size_t size,
+                   unsigned int frame) :
+        context_(context)
+      {
+        Metrics::StageTimer timer(Metrics::Stage_Transcode);
+
+        image_ = OrthancPluginDecodeDicomImage(context, dicom, static_cast<uint32_t>(size), frame);
+        if (image_ == NULL)
+        {
+          OrthancPlugins::Configuration::LogError("Cannot decode frame " + boost::lexical_cast<std::string>(frame + 1) +
+                                                  " of a DICOM instance for rendering");
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+      }
+
+      ~DecodedImage()
+      {
+        OrthancPluginFreeImage(context_, image_);
+      }
+
+      OrthancPluginPixelFormat GetFormat() const
+      {
+        return OrthancPluginGetImagePixelFormat(context_, image_);
+      }
+
+      unsigned int GetWidth() const
+      {
+        return OrthancPluginGetImageWidth(context_, image_);
+      }
+
+      unsigned int GetHeight() const
+      {
+        return OrthancPluginGetImageHeight(context_, image_);
+      }
+
+      unsigned int GetPitch() const
+      {
+        return OrthancPluginGetImagePitch(context_, image_);
+      }
+
+      const uint8_t* GetBuffer() const
+      {
+        return reinterpret_cast<const uint8_t*>(OrthancPluginGetImageBuffer(context_, image_));
+      }
+    };
+  }
+
+
+  static bool GetFloatTag(float& result,
+                          const ParsedDicomFile& header,
+                          const gdcm::Dict& dictionary,
+                          const gdcm::Tag& tag)
+  {
+    std::string value;
+    if (!header.GetDataSet().FindDataElement(tag) ||
+        !header.GetStringTag(value, dictionary, tag, true))
+    {
+      return false;
+    }
+
+    // Only keep the first value of multi-valued tags
+    size_t separator = value.find('\\');
+    if (separator != std::string::npos)
+    {
+      value.resize(separator);
+    }
+
+    try
+    {
+      result = boost::lexical_cast<float>(value);
+      return true;
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      return false;
+    }
+  }
+
+
+  template <typename T>
+  static void ApplyWindowing(std::vector<uint8_t>& target,
+                             const uint8_t* source,
+                             unsigned int width,
+                             unsigned int height,
+                             unsigned int pitch,
+                             float slope,
+                             float intercept,
+                             bool hasWindowing,
+                             float center,
+                             float windowWidth,
+                             bool invert)
+  {
+    if (!hasWindowing)
+    {
+      // Stretch the range of the values of the frame
+      T minValue = 0, maxValue = 0;
+
+      for (unsigned int y = 0; y < height; y++)
+      {
+        const T* p = reinterpret_cast<const T*>(source + static_cast<size_t>(y) * pitch);
+        for (unsigned int x = 0; x < width; x++, p++)
+        {
+          if ((x == 0 && y == 0) || *p < minValue)
+          {
+            minValue = *p;
+          }
+
+          if ((x == 0 && y == 0) || *p > maxValue)
+          {
+            maxValue = *p;
+          }
+        }
+      }
+
+      float a = static_cast<float>(minValue) * slope + intercept;
+      float b = static_cast<float>(maxValue) * slope + intercept;
+      center = (a + b) / 2.0f;
+      windowWidth = std::max(1.0f, (a > b ? a - b : b - a) + 1.0f);
+    }
+
+    // Linear function of PS3.3 C.11.2.1.2.1
+    const float low = center - 0.5f - (windowWidth - 1.0f) / 2.0f;
+    const float scale = (windowWidth > 1.0f ? 255.0f / (windowWidth - 1.0f) : 255.0f);
+
+    target.resize(static_cast<size_t>(width) * height);
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+      const T* p = reinterpret_cast<const T*>(source + static_cast<size_t>(y) * pitch);
+      uint8_t* q = &target[static_cast<size_t>(y) * width];
+
+      for (unsigned int x = 0; x < width; x++, p++, q++)
+      {
+        float v = (static_cast<float>(*p) * slope + intercept - low) * scale;
+        uint8_t value = (v <= 0.0f ? 0 : (v >= 255.0f ? 255 : static_cast<uint8_t>(v + 0.5f)));
+        *q = (invert ? 255 - value : value);
+      }
+    }
+  }
+
+
+  void RenderFrame(std::string& target,
+                   const gdcm::Dict& dictionary,
+                   const void* dicom,
+                   size_t size,
+                   unsigned int frame,
+                   const RenderingParameters& parameters)
+  {
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    // Only the header is needed for the windowing
+    ParsedDicomFile header(dicom, size, DICOM_TAG_PIXEL_DATA);
+
+    int countFrames = 1;
+    if (header.GetDataSet().FindDataElement(DICOM_TAG_NUMBER_OF_FRAMES) &&
+        !header.GetIntegerTag(countFrames, dictionary, DICOM_TAG_NUMBER_OF_FRAMES))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    if (countFrames <= 0 ||
+        frame >= static_cast<unsigned int>(countFrames))
+    {
+      OrthancPlugins::Configuration::LogError("Trying to render frame number " + boost::lexical_cast<std::string>(frame + 1) + 
+                                              " of an image with " + boost::lexical_cast<std::string>(countFrames) + " frames");
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    DecodedImage image(context, dicom, size, frame);
+
+    const unsigned int width = image.GetWidth();
+    const unsigned int height = image.GetHeight();
+
+    std::vector<uint8_t> pixels;
+    const uint8_t* buffer = image.GetBuffer();
+    unsigned int pitch = image.GetPitch();
+    unsigned int channels = 1;
+
+    switch (image.GetFormat())
+    {
+      case OrthancPluginPixelFormat_Grayscale8:
+      case OrthancPluginPixelFormat_Grayscale16:
+      case OrthancPluginPixelFormat_SignedGrayscale16:
+      {
+        float slope = 1, intercept = 0;
+        if (!GetFloatTag(slope, header, dictionary, DICOM_TAG_RESCALE_SLOPE) ||
+            slope == 0)
+        {
+          slope = 1;
+        }
+
+        GetFloatTag(intercept, header, dictionary, DICOM_TAG_RESCALE_INTERCEPT);
+
+        bool hasWindowing = parameters.HasWindowing();
+        float center = parameters.GetWindowCenter();
+        float windowWidth = parameters.GetWindowWidth();
+
+        if (!hasWindowing &&
+            GetFloatTag(center, header, dictionary, DICOM_TAG_WINDOW_CENTER) &&
+            GetFloatTag(windowWidth, header, dictionary, DICOM_TAG_WINDOW_WIDTH) &&
+            windowWidth > 0)
+        {
+          hasWindowing = true;
+        }
+
+        std::string photometric;
+        bool invert = (header.GetDataSet().FindDataElement(DICOM_TAG_PHOTOMETRIC_INTERPRETATION) &&
+                       header.GetStringTag(photometric, dictionary, DICOM_TAG_PHOTOMETRIC_INTERPRETATION, true) &&
+                       photometric == "MONOCHROME1");
+
+        if (image.GetFormat() == OrthancPluginPixelFormat_Grayscale8 &&
+            !hasWindowing &&
+            !invert &&
+            slope == 1 &&
+            intercept == 0)
+        {
+          // Already ready for rendering
+        }
+        else
+        {
+          switch (image.GetFormat())
+          {
+            case OrthancPluginPixelFormat_Grayscale8:
+              ApplyWindowing<uint8_t>(pixels, buffer, width, height, pitch, slope, intercept,
+                                      hasWindowing, center, windowWidth, invert);
+              break;
+
+            case OrthancPluginPixelFormat_Grayscale16:
+              ApplyWindowing<uint16_t>(pixels, buffer, width, height, pitch, slope, intercept,
+                                       hasWindowing, center, windowWidth, invert);
+              break;
+
+            default:
+              ApplyWindowing<int16_t>(pixels, buffer, width, height, pitch, slope, intercept,
+                                      hasWindowing, center, windowWidth, invert);
+              break;
+          }
+
+          buffer = &pixels[0];
+          pitch = width;
+        }
+
+        break;
+      }
+
+      case OrthancPluginPixelFormat_RGB24:
+        channels = 3;
+        break;
+
+      default:
+        OrthancPlugins::Configuration::LogError("Unsupported pixel format for the rendering of a DICOM instance");
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented);
+    }
+
+    unsigned int targetWidth, targetHeight;
+    ComputeRenderedSize(targetWidth, targetHeight, width, height,
+                        parameters.GetViewportWidth(), parameters.GetViewportHeight());
+
+    std::vector<uint8_t> resized;
+    if (targetWidth != width ||
+        targetHeight != height)
+    {
+      ResizeImage(resized, targetWidth, targetHeight, buffer, width, height, pitch, channels);
+      buffer = &resized[0];
+      pitch = targetWidth * channels;
+    }
+
+    const OrthancPluginPixelFormat format = (channels == 1 ?
+                                             OrthancPluginPixelFormat_Grayscale8 :
+                                             OrthancPluginPixelFormat_RGB24);
+
+    OrthancPluginMemoryBuffer encoded;
+    OrthancPluginErrorCode code;
+
+    {
+      Metrics::StageTimer timer(Metrics::Stage_Transcode);
+
+      if (parameters.IsPng())
+      {
+        code = OrthancPluginCompressPngImage(context, &encoded, format, targetWidth, targetHeight, pitch, buffer);
+      }
+      else
+      {
+        code = OrthancPluginCompressJpegImage(context, &encoded, format, targetWidth, targetHeight, pitch, buffer,
+                                              static_cast<uint8_t>(parameters.GetQuality()));
+      }
+    }
+
+    if (code != OrthancPluginErrorCode_Success)
+    {
+      throw Orthanc::OrthancException(static_cast<Orthanc::ErrorCode>(code));
+    }
+
+    target.assign(reinterpret_cast<const char*>(encoded.data), encoded.size);
+    OrthancPluginFreeMemoryBuffer(context, &encoded);
+  }
+}
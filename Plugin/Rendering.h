@@ -0,0 +1,136 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <gdcmDict.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace OrthancPlugins
+{
+  // Parameters of the rendering of one frame as a consumer image, as
+  // used by WADO-RS "/rendered" and "/thumbnail" and by WADO-URI
+  class RenderingParameters
+  {
+  private:
+    bool          isPng_;
+    unsigned int  quality_;
+    unsigned int  viewportWidth_;   // 0 to keep the size of the frame
+    unsigned int  viewportHeight_;
+    bool          hasWindowing_;
+    float         windowCenter_;
+    float         windowWidth_;
+
+  public:
+    // JPEG with quality 90, same size as the frame, windowing of the instance
+    RenderingParameters();
+
+    void SetPng(bool isPng)
+    {
+      isPng_ = isPng;
+    }
+
+    bool IsPng() const
+    {
+      return isPng_;
+    }
+
+    // Only applicable to JPEG, between 1 and 100
+    void SetQuality(unsigned int quality);
+
+    unsigned int GetQuality() const
+    {
+      return quality_;
+    }
+
+    // The rendered image fits inside the viewport, keeping the aspect
+    // ratio. One of the dimensions can be zero to leave it unbounded.
+    void SetViewport(unsigned int width,
+                     unsigned int height);
+
+    unsigned int GetViewportWidth() const
+    {
+      return viewportWidth_;
+    }
+
+    unsigned int GetViewportHeight() const
+    {
+      return viewportHeight_;
+    }
+
+    // Linear windowing, expressed after the modality rescale
+    void SetWindowing(float center,
+                      float width);
+
+    bool HasWindowing() const
+    {
+      return hasWindowing_;
+    }
+
+    float GetWindowCenter() const
+    {
+      return windowCenter_;
+    }
+
+    float GetWindowWidth() const
+    {
+      return windowWidth_;
+    }
+
+    const char* GetMimeType() const;
+
+    // Identifies the rendered image in a cache
+    std::string GetKey() const;
+  };
+
+
+  // Size of the rendered image, given the size of the frame and the viewport
+  void ComputeRenderedSize(unsigned int& targetWidth,
+                           unsigned int& targetHeight,
+                           unsigned int width,
+                           unsigned int height,
+                           unsigned int viewportWidth,
+                           unsigned int viewportHeight);
+
+  // Each target pixel is the average of the source pixels it covers,
+  // which avoids aliasing in the thumbnails
+  void ResizeImage(std::vector<uint8_t>& target,
+                   unsigned int targetWidth,
+                   unsigned int targetHeight,
+                   const uint8_t* source,
+                   unsigned int width,
+                   unsigned int height,
+                   unsigned int pitch,
+                   unsigned int channels);
+
+  // Decodes one frame of a DICOM file, then directly encodes it as
+  // JPEG or PNG after the windowing and the resizing
+  void RenderFrame(std::string& target,
+                   const gdcm::Dict& dictionary,
+                   const void* dicom,
+                   size_t size,
+                   unsigned int frame,
+                   const RenderingParameters& parameters);
+}
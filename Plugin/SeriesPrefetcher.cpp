@@ -0,0 +1,618 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "SeriesPrefetcher.h"
+
+#include "Configuration.h"
+#include "Metrics.h"
+
+#include <Plugins/Samples/Common/OrthancPluginCppWrapper.h>
+
+#include <algorithm>
+#include <cassert>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+namespace OrthancPlugins
+{
+  // Number of series whose ordered list of instances is kept in memory
+  static const size_t MAX_SERIES = 64;
+
+
+  void SeriesPrefetcher::EnqueueInternal(const std::string& client,
+                                         const Task& task)
+  {
+    // The mutex must be locked by the caller
+    std::deque<Task>& queue = queues_[client];
+
+    if (queue.empty())
+    {
+      clients_.push_back(client);
+    }
+
+    // At most "depth" tasks are pending for each client: The oldest
+    // ones are dropped, as the client has moved on in the meantime
+    if (queue.size() >= depth_)
+    {
+      if (queue.front().seriesId_.empty())
+      {
+        pending_.erase(queue.front().instanceId_);
+      }
+
+      queue.pop_front();
+    }
+
+    queue.push_back(task);
+
+    if (task.seriesId_.empty())
+    {
+      pending_.insert(task.instanceId_);
+    }
+
+    taskAvailable_.notify_one();
+  }
+
+
+  void SeriesPrefetcher::ScheduleInternal(const std::string& client,
+                                          const std::string& seriesId,
+                                          const std::string& instanceId)
+  {
+    // The mutex must be locked by the caller
+    Series::const_iterator found = series_.find(seriesId);
+
+    if (found == series_.end())
+    {
+      // The instances of the series must be listed first. If this
+      // client is already waiting for this listing, only update the
+      // instance after which the series is prefetched.
+      Queues::iterator queue = queues_.find(client);
+      if (queue != queues_.end())
+      {
+        for (std::deque<Task>::iterator it = queue->second.begin(); it != queue->second.end(); ++it)
+        {
+          if (it->seriesId_ == seriesId)
+          {
+            it->instanceId_ = instanceId;
+            return;
+          }
+        }
+      }
+
+      Task task;
+      task.seriesId_ = seriesId;
+      task.instanceId_ = instanceId;
+      EnqueueInternal(client, task);
+      return;
+    }
+
+    seriesIndex_.MakeMostRecent(seriesId);
+
+    const std::vector<std::string>& instances = found->second;
+
+    size_t start = 0;
+    if (!instanceId.empty())
+    {
+      // Unknown instances (e.g. received after the listing) start no prefetching
+      start = std::find(instances.begin(), instances.end(), instanceId) - instances.begin() + 1;
+    }
+
+    for (size_t i = start; i < instances.size() && i < start + depth_; i++)
+    {
+      const std::string& id = instances[i];
+
+      if (files_.find(id) == files_.end() &&
+          pending_.find(id) == pending_.end())
+      {
+        Task task;
+        task.instanceId_ = id;
+        EnqueueInternal(client, task);
+      }
+    }
+  }
+
+
+  void SeriesPrefetcher::RemoveInternal(const std::string& instanceId)
+  {
+    // The mutex must be locked by the caller
+    Files::iterator found = files_.find(instanceId);
+    if (found != files_.end())
+    {
+      size_t size = index_.Invalidate(instanceId);
+      assert(currentSize_ >= size);
+      currentSize_ -= size;
+      files_.erase(found);
+    }
+  }
+
+
+  void SeriesPrefetcher::ClearInternal()
+  {
+    // The mutex must be locked by the caller
+    while (!index_.IsEmpty())
+    {
+      RemoveInternal(index_.GetOldest());
+    }
+
+    while (!seriesIndex_.IsEmpty())
+    {
+      series_.erase(seriesIndex_.RemoveOldest());
+    }
+
+    assert(files_.empty() &&
+           series_.empty() &&
+           currentSize_ == 0);
+  }
+
+
+  bool SeriesPrefetcher::DequeueInternal(std::string& client,
+                                         Task& task)
+  {
+    // The mutex must be locked by the caller
+    while (!clients_.empty())
+    {
+      client = clients_.front();
+      clients_.pop_front();
+
+      Queues::iterator queue = queues_.find(client);
+      assert(queue != queues_.end() &&
+             !queue->second.empty());
+
+      task = queue->second.front();
+      queue->second.pop_front();
+
+      if (queue->second.empty())
+      {
+        queues_.erase(queue);
+      }
+      else
+      {
+        clients_.push_back(client);  // Round-robin between the clients
+      }
+
+      if (!task.seriesId_.empty())
+      {
+        return true;
+      }
+      else if (pending_.find(task.instanceId_) != pending_.end())
+      {
+        running_.insert(task.instanceId_);
+        return true;
+      }
+
+      // Otherwise, the instance was cancelled by a cache miss: Skip it
+    }
+
+    return false;
+  }
+
+
+  void SeriesPrefetcher::ListSeries(std::vector<std::string>& instances,
+                                    const std::string& seriesId)
+  {
+    instances.clear();
+
+    Json::Value answer;
+    if (!OrthancPlugins::MeasuredRestApiGet(answer, OrthancPlugins::Configuration::GetContext(),
+                                    "/series/" + seriesId + "/instances", false) ||
+        answer.type() != Json::arrayValue)
+    {
+      return;
+    }
+
+    // Sort the instances by their index in the series, then by their
+    // instance number, which is the order in which viewers scroll
+    std::vector<std::pair<std::pair<int, int>, std::string> > sorted;
+    sorted.reserve(answer.size());
+
+    for (Json::Value::ArrayIndex i = 0; i < answer.size(); i++)
+    {
+      if (answer[i].type() == Json::objectValue &&
+          answer[i].isMember("ID"))
+      {
+        int index = 0;
+        if (answer[i].isMember("IndexInSeries") &&
+            answer[i]["IndexInSeries"].isInt())
+        {
+          index = answer[i]["IndexInSeries"].asInt();
+        }
+
+        int number = 0;
+        if (answer[i].isMember("MainDicomTags") &&
+            answer[i]["MainDicomTags"].isMember("InstanceNumber"))
+        {
+          try
+          {
+            number = boost::lexical_cast<int>(answer[i]["MainDicomTags"]["InstanceNumber"].asString());
+          }
+          catch (boost::bad_lexical_cast&)
+          {
+          }
+        }
+
+        sorted.push_back(std::make_pair(std::make_pair(index, number), answer[i]["ID"].asString()));
+      }
+    }
+
+    std::stable_sort(sorted.begin(), sorted.end());
+
+    instances.reserve(sorted.size());
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+      instances.push_back(sorted[i].second);
+    }
+  }
+
+
+  void SeriesPrefetcher::Download(const std::string& instanceId)
+  {
+    Content content;
+
+    try
+    {
+      OrthancPlugins::MemoryBuffer buffer(OrthancPlugins::Configuration::GetContext());
+      if (OrthancPlugins::MeasuredRestApiGet(buffer, "/instances/" + instanceId + "/file", false))
+      {
+        content.reset(new std::string(buffer.GetData(), buffer.GetSize()));
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      OrthancPlugins::Configuration::LogWarning("Cannot prefetch instance " + instanceId + ": " + std::string(e.What()));
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      running_.erase(instanceId);
+      pending_.erase(instanceId);
+
+      // The file of an instance that was deleted during its download
+      // must not be served anymore
+      const bool isDeleted = (deleted_.erase(instanceId) > 0);
+
+      if (!isDeleted &&
+          content.get() != NULL &&
+          content->size() <= maxSize_ &&
+          files_.find(instanceId) == files_.end())
+      {
+        files_[instanceId] = content;
+        index_.Add(instanceId, content->size());
+        currentSize_ += content->size();
+        prefetched_++;
+
+        while (currentSize_ > maxSize_)
+        {
+          RemoveInternal(index_.GetOldest());
+        }
+      }
+    }
+
+    downloadFinished_.notify_all();
+  }
+
+
+  void SeriesPrefetcher::Worker(SeriesPrefetcher* that)
+  {
+    for (;;)
+    {
+      std::string client;
+      Task task;
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        while (!that->done_ &&
+               !that->DequeueInternal(client, task))
+        {
+          that->taskAvailable_.wait(lock);
+        }
+
+        if (that->done_)
+        {
+          return;
+        }
+      }
+
+      if (task.seriesId_.empty())
+      {
+        that->Download(task.instanceId_);
+      }
+      else
+      {
+        std::vector<std::string> instances;
+
+        try
+        {
+          that->ListSeries(instances, task.seriesId_);
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          OrthancPlugins::Configuration::LogWarning("Cannot list the instances of series " + 
+                                                    task.seriesId_ + ": " + std::string(e.What()));
+        }
+
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        // The listing is stored even if it failed, so that the series
+        // is not listed over and over again
+        that->series_[task.seriesId_].swap(instances);
+
+        if (that->seriesIndex_.Contains(task.seriesId_))
+        {
+          that->seriesIndex_.MakeMostRecent(task.seriesId_);
+        }
+        else
+        {
+          that->seriesIndex_.Add(task.seriesId_);
+
+          while (that->seriesIndex_.GetSize() > MAX_SERIES)
+          {
+            that->series_.erase(that->seriesIndex_.RemoveOldest());
+          }
+        }
+
+        that->ScheduleInternal(client, task.seriesId_, task.instanceId_);
+      }
+    }
+  }
+
+
+  SeriesPrefetcher& SeriesPrefetcher::GetInstance()
+  {
+    static SeriesPrefetcher singleton;
+    return singleton;
+  }
+
+
+  void SeriesPrefetcher::Start(unsigned int threads,
+                               unsigned int depth,
+                               size_t maxSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (!threads_.empty())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    if (threads == 0 ||
+        depth == 0 ||
+        maxSize == 0)
+    {
+      return;  // Disabled
+    }
+
+    done_ = false;
+    depth_ = depth;
+    maxSize_ = maxSize;
+
+    for (unsigned int i = 0; i < threads; i++)
+    {
+      threads_.push_back(new boost::thread(Worker, this));
+    }
+  }
+
+
+  void SeriesPrefetcher::Stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+    }
+
+    taskAvailable_.notify_all();
+
+    for (size_t i = 0; i < threads_.size(); i++)
+    {
+      if (threads_[i]->joinable())
+      {
+        threads_[i]->join();
+      }
+
+      delete threads_[i];
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    threads_.clear();
+    queues_.clear();
+    clients_.clear();
+    pending_.clear();
+    running_.clear();
+    deleted_.clear();
+    ClearInternal();
+    depth_ = 0;
+    maxSize_ = 0;
+  }
+
+
+  bool SeriesPrefetcher::IsEnabled()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return !threads_.empty();
+  }
+
+
+  std::string SeriesPrefetcher::GetClient(const OrthancPluginHttpRequest* request)
+  {
+    std::string value;
+
+    if (LookupHttpHeader(value, request, "x-forwarded-for") &&
+        !value.empty())
+    {
+      // The first address is the one of the originating client
+      return "ip:" + boost::algorithm::trim_copy(value.substr(0, value.find(',')));
+    }
+    else if (LookupHttpHeader(value, request, "authorization"))
+    {
+      // The credentials themselves are not kept in memory
+      return "auth:" + boost::lexical_cast<std::string>(boost::hash<std::string>()(value));
+    }
+    else
+    {
+      return "";  // The anonymous clients share the same queue
+    }
+  }
+
+
+  void SeriesPrefetcher::SignalSeries(const std::string& client,
+                                      const std::string& seriesId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (!threads_.empty())
+    {
+      ScheduleInternal(client, seriesId, "");
+    }
+  }
+
+
+  void SeriesPrefetcher::SignalInstance(const std::string& client,
+                                        const std::string& seriesId,
+                                        const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (!threads_.empty())
+    {
+      ScheduleInternal(client, seriesId, instanceId);
+    }
+  }
+
+
+  bool SeriesPrefetcher::Lookup(Content& content,
+                                const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    // Downloading the same file concurrently would only slow down
+    // the storage area
+    while (running_.find(instanceId) != running_.end())
+    {
+      downloadFinished_.wait(lock);
+    }
+
+    Files::const_iterator found = files_.find(instanceId);
+    if (found == files_.end())
+    {
+      // The caller downloads the file by itself: Cancel its prefetching
+      pending_.erase(instanceId);
+      misses_++;
+      return false;
+    }
+    else
+    {
+      index_.MakeMostRecent(instanceId);
+      content = found->second;
+      hits_++;
+      return true;
+    }
+  }
+
+
+  void SeriesPrefetcher::SignalChange(OrthancPluginChangeType changeType,
+                                      OrthancPluginResourceType resourceType,
+                                      const char* resourceId)
+  {
+    if (resourceType == OrthancPluginResourceType_Instance &&
+        changeType == OrthancPluginChangeType_Deleted)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      RemoveInternal(resourceId);
+      pending_.erase(resourceId);
+
+      if (running_.find(resourceId) != running_.end())
+      {
+        // The download will be dropped once finished
+        deleted_.insert(resourceId);
+      }
+    }
+    else if (resourceType == OrthancPluginResourceType_Series &&
+             (changeType == OrthancPluginChangeType_Deleted ||
+              changeType == OrthancPluginChangeType_StableSeries))
+    {
+      // The instances of the series have changed: List them again
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (seriesIndex_.Contains(resourceId))
+      {
+        seriesIndex_.Invalidate(resourceId);
+        series_.erase(resourceId);
+      }
+    }
+  }
+
+
+  void SeriesPrefetcher::Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    ClearInternal();
+  }
+
+
+  void SeriesPrefetcher::GetStatistics(Json::Value& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target = Json::objectValue;
+    target["Enabled"] = !threads_.empty();
+    target["Threads"] = static_cast<unsigned int>(threads_.size());
+    target["Depth"] = depth_;
+    target["MaximumSize"] = static_cast<Json::UInt64>(maxSize_);
+    target["CurrentSize"] = static_cast<Json::UInt64>(currentSize_);
+    target["Count"] = static_cast<Json::UInt64>(files_.size());
+    target["Pending"] = static_cast<Json::UInt64>(pending_.size());
+    target["Clients"] = static_cast<Json::UInt64>(queues_.size());
+    target["Prefetched"] = static_cast<Json::UInt64>(prefetched_);
+    target["Hits"] = static_cast<Json::UInt64>(hits_);
+    target["Misses"] = static_cast<Json::UInt64>(misses_);
+  }
+
+
+  void GetPrefetchStatistics(OrthancPluginRestOutput* output,
+                             const char* url,
+                             const OrthancPluginHttpRequest* request)
+  {
+    OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+    if (request->method == OrthancPluginHttpMethod_Get)
+    {
+      Json::Value statistics;
+      SeriesPrefetcher::GetInstance().GetStatistics(statistics);
+
+      std::string answer = statistics.toStyledString();
+      OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+    }
+    else if (request->method == OrthancPluginHttpMethod_Delete)
+    {
+      SeriesPrefetcher::GetInstance().Clear();
+
+      std::string answer = "{}";
+      OrthancPlugins::MeasuredAnswerBuffer(context, output, answer.c_str(), answer.size(), "application/json");
+    }
+    else
+    {
+      OrthancPluginSendMethodNotAllowed(context, output, "GET,DELETE");
+    }
+  }
+}
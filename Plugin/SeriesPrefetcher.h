@@ -0,0 +1,162 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <Core/Cache/LeastRecentlyUsedIndex.h>
+
+#include <orthanc/OrthancCPlugin.h>
+#include <json/value.h>
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+namespace OrthancPlugins
+{
+  // Viewers nearly always follow the metadata of a series, or its
+  // first frame, by RetrieveFrames on each of its instances, in
+  // order. This prefetcher downloads the next instances of the series
+  // in background into a bounded memory cache, in which RetrieveFrames
+  // looks for the DICOM file before asking the Orthanc core. The
+  // clients are served in round-robin order, so that one client
+  // scrolling through a large series does not delay the others.
+  class SeriesPrefetcher : public boost::noncopyable
+  {
+  public:
+    typedef boost::shared_ptr<const std::string>  Content;
+
+  private:
+    struct Task
+    {
+      std::string  seriesId_;    // Non-empty to list the instances of this series
+      std::string  instanceId_;  // Instance to download, or instance after which the listed series is prefetched
+    };
+
+    typedef std::map<std::string, std::deque<Task> >               Queues;  // Client -> pending tasks
+    typedef std::map<std::string, std::vector<std::string> >       Series;  // Series -> ordered instances
+    typedef std::map<std::string, Content>                         Files;
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, size_t>   Index;   // The payload is the size
+
+    boost::mutex                  mutex_;
+    boost::condition_variable     taskAvailable_;
+    boost::condition_variable     downloadFinished_;
+    std::vector<boost::thread*>   threads_;
+    bool                          done_;
+    unsigned int                  depth_;
+    size_t                        maxSize_;
+    size_t                        currentSize_;
+    Queues                        queues_;
+    std::deque<std::string>       clients_;   // Round-robin order of the clients with pending tasks
+    std::set<std::string>         pending_;   // Instances that are queued or being downloaded
+    std::set<std::string>         running_;   // Instances that are being downloaded
+    std::set<std::string>         deleted_;   // Instances that were deleted while being downloaded
+    Series                        series_;
+    Orthanc::LeastRecentlyUsedIndex<std::string>  seriesIndex_;
+    Files                         files_;
+    Index                         index_;
+    uint64_t                      hits_;
+    uint64_t                      misses_;
+    uint64_t                      prefetched_;
+
+    void EnqueueInternal(const std::string& client,
+                         const Task& task);
+
+    void ScheduleInternal(const std::string& client,
+                          const std::string& seriesId,
+                          const std::string& instanceId);
+
+    void RemoveInternal(const std::string& instanceId);
+
+    void ClearInternal();
+
+    // Returns "false" if no task is pending
+    bool DequeueInternal(std::string& client,
+                         Task& task);
+
+    void ListSeries(std::vector<std::string>& instances,
+                    const std::string& seriesId);
+
+    void Download(const std::string& instanceId);
+
+    static void Worker(SeriesPrefetcher* that);
+
+    SeriesPrefetcher() :  // Forbidden (singleton pattern)
+      done_(false),
+      depth_(0),
+      maxSize_(0),
+      currentSize_(0),
+      hits_(0),
+      misses_(0),
+      prefetched_(0)
+    {
+    }
+
+  public:
+    static SeriesPrefetcher& GetInstance();
+
+    // "depth" is the number of instances that are prefetched after
+    // the accessed one, and "maxSize" bounds the memory of the cache
+    void Start(unsigned int threads,
+               unsigned int depth,
+               size_t maxSize);
+
+    void Stop();
+
+    bool IsEnabled();
+
+    // The SDK does not give the IP address of the client to the REST
+    // callbacks: The clients are distinguished by their HTTP headers
+    static std::string GetClient(const OrthancPluginHttpRequest* request);
+
+    // Prefetches the first instances of the series
+    void SignalSeries(const std::string& client,
+                      const std::string& seriesId);
+
+    // Prefetches the instances that follow this one in the series
+    void SignalInstance(const std::string& client,
+                        const std::string& seriesId,
+                        const std::string& instanceId);
+
+    // Waits for the instance if it is being downloaded
+    bool Lookup(Content& content,
+                const std::string& instanceId);
+
+    // Called from the Orthanc change callback: Must not use the REST API
+    void SignalChange(OrthancPluginChangeType changeType,
+                      OrthancPluginResourceType resourceType,
+                      const char* resourceId);
+
+    void Clear();
+
+    void GetStatistics(Json::Value& target);
+  };
+
+
+  void GetPrefetchStatistics(OrthancPluginRestOutput* output,
+                             const char* url,
+                             const OrthancPluginHttpRequest* request);
+}
@@ -24,9 +24,13 @@
 
 #include "Configuration.h"
 #include "Dicom.h"
+#include "Metrics.h"
+#include "ParallelPipeline.h"
 
 #include <Core/Toolbox.h>
 
+#include <list>
+#include <memory>
 #include <stdexcept>
 
 
@@ -56,6 +60,256 @@ static void SetSequenceTag(gdcm::DataSet& dataset,
 
 
 
+namespace
+{
+  // Storage of one instance of the STOW-RS request, in a worker of
+  // the pipeline. Only the header of the instance is parsed, up to
+  // the SeriesInstanceUID, to report its UIDs.
+  class StoreInstanceJob : public OrthancPlugins::ParallelPipeline::IJob
+  {
+  private:
+    OrthancPluginContext*          context_;
+    OrthancPlugins::MultipartItem  part_;
+    const std::string&             expectedStudy_;
+    std::string                    studyInstanceUid_;
+    std::string                    seriesInstanceUid_;
+    std::string                    sopClassUid_;
+    std::string                    sopInstanceUid_;
+    bool                           isDiscarded_;
+    bool                           isStored_;
+
+  public:
+    StoreInstanceJob(OrthancPluginContext* context,
+                     const OrthancPlugins::MultipartItem& part,
+                     const std::string& expectedStudy) :
+      context_(context),
+      part_(part),
+      expectedStudy_(expectedStudy),
+      isDiscarded_(false),
+      isStored_(false)
+    {
+    }
+
+    virtual void Execute()
+    {
+      {
+        OrthancPlugins::ParsedDicomFile dicom(part_, OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID);
+        studyInstanceUid_ = dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID, "", true);
+        seriesInstanceUid_ = dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID, "", true);
+        sopClassUid_ = dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_SOP_CLASS_UID, "", true);
+        sopInstanceUid_ = dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_SOP_INSTANCE_UID, "", true);
+      }
+
+      if (!expectedStudy_.empty() &&
+          studyInstanceUid_ != expectedStudy_)
+      {
+        isDiscarded_ = true;
+      }
+      else
+      {
+        OrthancPlugins::MemoryBuffer tmp(context_);
+        isStored_ = OrthancPlugins::MeasuredRestApiPost(tmp, "/instances", part_.data_, part_.size_, false);
+
+        if (isStored_)
+        {
+          OrthancPlugins::Metrics::SignalInstances(1);
+        }
+      }
+    }
+
+    const std::string& GetStudyInstanceUid() const
+    {
+      return studyInstanceUid_;
+    }
+
+    const std::string& GetSeriesInstanceUid() const
+    {
+      return seriesInstanceUid_;
+    }
+
+    const std::string& GetSopClassUid() const
+    {
+      return sopClassUid_;
+    }
+
+    const std::string& GetSopInstanceUid() const
+    {
+      return sopInstanceUid_;
+    }
+
+    bool IsDiscarded() const
+    {
+      return isDiscarded_;
+    }
+
+    bool IsStored() const
+    {
+      return isStored_;
+    }
+  };
+
+
+  // Each instance is stored as soon as its part is delimited in the
+  // multipart body: Directly by the parser if "StowRsThreads" is
+  // zero, or concurrently by the pipeline otherwise. The answer is
+  // assembled in the order of the parts.
+  class StowHandler : public OrthancPlugins::IMultipartHandler
+  {
+  private:
+    typedef std::list<OrthancPlugins::ParallelPipeline::IJob*>  Jobs;
+
+    OrthancPluginContext*             context_;
+    const std::string&                expectedStudy_;
+    bool                              isUnsupportedPart_;
+    bool                              isSequential_;
+    Jobs                              executed_;  // Only used in the sequential mode
+    OrthancPlugins::ParallelPipeline  pipeline_;
+
+    OrthancPlugins::ParallelPipeline::IJob* DequeueJob()
+    {
+      if (isSequential_)
+      {
+        if (executed_.empty())
+        {
+          return NULL;
+        }
+        else
+        {
+          OrthancPlugins::ParallelPipeline::IJob* job = executed_.front();
+          executed_.pop_front();
+          return job;
+        }
+      }
+      else
+      {
+        return pipeline_.Dequeue();
+      }
+    }
+
+  public:
+    StowHandler(OrthancPluginContext* context,
+                const std::string& expectedStudy,
+                size_t countThreads) :
+      context_(context),
+      expectedStudy_(expectedStudy),
+      isUnsupportedPart_(false),
+      isSequential_(countThreads == 0),
+      pipeline_(countThreads, 2 * countThreads)
+    {
+    }
+
+    ~StowHandler()
+    {
+      for (Jobs::iterator it = executed_.begin(); it != executed_.end(); ++it)
+      {
+        delete *it;
+      }
+    }
+
+    virtual bool HandlePart(const OrthancPlugins::MultipartItem& part)
+    {
+      OrthancPlugins::Configuration::LogInfo("Detected multipart item with content type \"" + 
+                                             part.contentType_ + "\" of size " + 
+                                             boost::lexical_cast<std::string>(part.size_));
+
+      if (!part.contentType_.empty() &&
+          part.contentType_ != "application/dicom")
+      {
+        OrthancPlugins::Configuration::LogError("The STOW-RS request contains a part that is not "
+                                                "\"application/dicom\" (it is: \"" + part.contentType_ + "\")");
+        isUnsupportedPart_ = true;
+        return false;
+      }
+
+      std::auto_ptr<StoreInstanceJob> job(new StoreInstanceJob(context_, part, expectedStudy_));
+
+      if (isSequential_)
+      {
+        job->Execute();
+        executed_.push_back(job.release());
+      }
+      else
+      {
+        pipeline_.Add(job.release());
+      }
+
+      return true;
+    }
+
+    bool IsUnsupportedPart() const
+    {
+      return isUnsupportedPart_;
+    }
+
+    // Waits for all the parts to be stored
+    void GetResult(gdcm::DataSet& result,
+                   const std::string& wadoBase)
+    {
+      bool isFirst = true;
+      gdcm::SmartPointer<gdcm::SequenceOfItems> success = new gdcm::SequenceOfItems();
+      gdcm::SmartPointer<gdcm::SequenceOfItems> failed = new gdcm::SequenceOfItems();
+
+      for (;;)
+      {
+        std::auto_ptr<OrthancPlugins::ParallelPipeline::IJob> tmp(DequeueJob());
+        if (tmp.get() == NULL)
+        {
+          break;
+        }
+
+        const StoreInstanceJob& job = dynamic_cast<const StoreInstanceJob&>(*tmp);
+
+        gdcm::Item item;
+        item.SetVLToUndefined();
+        gdcm::DataSet &status = item.GetNestedDataSet();
+
+        SetTag(status, OrthancPlugins::DICOM_TAG_REFERENCED_SOP_CLASS_UID, gdcm::VR::UI, job.GetSopClassUid());
+        SetTag(status, OrthancPlugins::DICOM_TAG_REFERENCED_SOP_INSTANCE_UID, gdcm::VR::UI, job.GetSopInstanceUid());
+
+        if (job.IsDiscarded())
+        {
+          OrthancPlugins::Configuration::LogInfo("STOW-RS request restricted to study [" + expectedStudy_ + 
+                                                 "]: Ignoring instance from study [" + job.GetStudyInstanceUid() + "]");
+
+          SetTag(status, OrthancPlugins::DICOM_TAG_WARNING_REASON, gdcm::VR::US, "B006");  // Elements discarded
+          success->AddItem(item);      
+        }
+        else
+        {
+          if (isFirst)
+          {
+            std::string url = wadoBase + "studies/" + job.GetStudyInstanceUid();
+            SetTag(result, OrthancPlugins::DICOM_TAG_RETRIEVE_URL, gdcm::VR::UT, url);
+            isFirst = false;
+          }
+
+          if (job.IsStored())
+          {
+            std::string url = (wadoBase + 
+                               "studies/" + job.GetStudyInstanceUid() +
+                               "/series/" + job.GetSeriesInstanceUid() +
+                               "/instances/" + job.GetSopInstanceUid());
+
+            SetTag(status, OrthancPlugins::DICOM_TAG_RETRIEVE_URL, gdcm::VR::UT, url);
+            success->AddItem(item);
+          }
+          else
+          {
+            OrthancPlugins::Configuration::LogError("Orthanc was unable to store instance through STOW-RS request");
+            SetTag(status, OrthancPlugins::DICOM_TAG_FAILURE_REASON, gdcm::VR::US, "0110");  // Processing failure
+            failed->AddItem(item);
+          }
+        }
+      }
+
+      SetSequenceTag(result, OrthancPlugins::DICOM_TAG_FAILED_SOP_SEQUENCE, failed);
+      SetSequenceTag(result, OrthancPlugins::DICOM_TAG_REFERENCED_SOP_SEQUENCE, success);
+    }
+  };
+}
+
+
+
 bool IsXmlExpected(const OrthancPluginHttpRequest* request)
 {
   std::string accept;
@@ -151,88 +405,19 @@ void StowCallback(OrthancPluginRestOutput* output,
   }
 
 
-  bool isFirst = true;
-  gdcm::DataSet result;
-  gdcm::SmartPointer<gdcm::SequenceOfItems> success = new gdcm::SequenceOfItems();
-  gdcm::SmartPointer<gdcm::SequenceOfItems> failed = new gdcm::SequenceOfItems();
-  
-  std::vector<OrthancPlugins::MultipartItem> items;
-  OrthancPlugins::ParseMultipartBody(items, context, request->body, request->bodySize, boundary);
+  StowHandler handler(context, expectedStudy,
+                      OrthancPlugins::Configuration::GetUnsignedIntegerValue("StowRsThreads", 0));
+  OrthancPlugins::ParseMultipartBody(handler, context, request->body, request->bodySize, boundary);
 
-  for (size_t i = 0; i < items.size(); i++)
-  {
-    OrthancPlugins::Configuration::LogInfo("Detected multipart item with content type \"" + 
-                                           items[i].contentType_ + "\" of size " + 
-                                           boost::lexical_cast<std::string>(items[i].size_));
-  }  
+  // The parts preceding an unsupported part are stored anyway
+  gdcm::DataSet result;
+  handler.GetResult(result, wadoBase);
 
-  for (size_t i = 0; i < items.size(); i++)
+  if (handler.IsUnsupportedPart())
   {
-    if (!items[i].contentType_.empty() &&
-        items[i].contentType_ != "application/dicom")
-    {
-      OrthancPlugins::Configuration::LogError("The STOW-RS request contains a part that is not "
-                                              "\"application/dicom\" (it is: \"" + items[i].contentType_ + "\")");
-      OrthancPluginSendHttpStatusCode(context, output, 415 /* Unsupported media type */);
-      return;
-    }
-
-    OrthancPlugins::ParsedDicomFile dicom(items[i]);
-
-    std::string studyInstanceUid = dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_STUDY_INSTANCE_UID, "", true);
-    std::string sopClassUid = dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_SOP_CLASS_UID, "", true);
-    std::string sopInstanceUid = dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_SOP_INSTANCE_UID, "", true);
-
-    gdcm::Item item;
-    item.SetVLToUndefined();
-    gdcm::DataSet &status = item.GetNestedDataSet();
-
-    SetTag(status, OrthancPlugins::DICOM_TAG_REFERENCED_SOP_CLASS_UID, gdcm::VR::UI, sopClassUid);
-    SetTag(status, OrthancPlugins::DICOM_TAG_REFERENCED_SOP_INSTANCE_UID, gdcm::VR::UI, sopInstanceUid);
-
-    if (!expectedStudy.empty() &&
-        studyInstanceUid != expectedStudy)
-    {
-      OrthancPlugins::Configuration::LogInfo("STOW-RS request restricted to study [" + expectedStudy + 
-                                             "]: Ignoring instance from study [" + studyInstanceUid + "]");
-
-      SetTag(status, OrthancPlugins::DICOM_TAG_WARNING_REASON, gdcm::VR::US, "B006");  // Elements discarded
-      success->AddItem(item);      
-    }
-    else
-    {
-      if (isFirst)
-      {
-        std::string url = wadoBase + "studies/" + studyInstanceUid;
-        SetTag(result, OrthancPlugins::DICOM_TAG_RETRIEVE_URL, gdcm::VR::UT, url);
-        isFirst = false;
-      }
-
-      OrthancPlugins::MemoryBuffer tmp(context);
-      bool ok = tmp.RestApiPost("/instances", items[i].data_, items[i].size_, false);
-      tmp.Clear();
-
-      if (ok)
-      {
-        std::string url = (wadoBase + 
-                           "studies/" + studyInstanceUid +
-                           "/series/" + dicom.GetRawTagWithDefault(OrthancPlugins::DICOM_TAG_SERIES_INSTANCE_UID, "", true) +
-                           "/instances/" + sopInstanceUid);
-
-        SetTag(status, OrthancPlugins::DICOM_TAG_RETRIEVE_URL, gdcm::VR::UT, url);
-        success->AddItem(item);
-      }
-      else
-      {
-        OrthancPlugins::Configuration::LogError("Orthanc was unable to store instance through STOW-RS request");
-        SetTag(status, OrthancPlugins::DICOM_TAG_FAILURE_REASON, gdcm::VR::US, "0110");  // Processing failure
-        failed->AddItem(item);
-      }
-    }
+    OrthancPluginSendHttpStatusCode(context, output, 415 /* Unsupported media type */);
+    return;
   }
 
-  SetSequenceTag(result, OrthancPlugins::DICOM_TAG_FAILED_SOP_SEQUENCE, failed);
-  SetSequenceTag(result, OrthancPlugins::DICOM_TAG_REFERENCED_SOP_SEQUENCE, success);
-
-  OrthancPlugins::AnswerDicom(context, output, wadoBase, *dictionary_, result, isXml, false);
+  OrthancPlugins::AnswerDicom(context, output, request, wadoBase, *dictionary_, result, isXml, false);
 }
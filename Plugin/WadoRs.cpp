@@ -24,9 +24,15 @@
 #include "Configuration.h"
 #include "Dicom.h"
 #include "DicomResults.h"
+#include "IdentifiersCache.h"
+#include "MetadataCache.h"
+#include "Metrics.h"
+#include "ParallelPipeline.h"
+#include "SeriesPrefetcher.h"
 
 #include <Core/Toolbox.h>
 
+#include <algorithm>
 #include <memory>
 
 static bool AcceptMultipartDicom(const OrthancPluginHttpRequest* request)
@@ -177,13 +183,118 @@ static bool AcceptBulkData(const OrthancPluginHttpRequest* request)
 }
 
 
+namespace
+{
+  // Download of one DICOM instance, in a worker of the pipeline
+  class ReadInstanceJob : public OrthancPlugins::ParallelPipeline::IJob
+  {
+  private:
+    std::string                  uri_;
+    OrthancPlugins::MemoryBuffer content_;
+    bool                         success_;
+
+  public:
+    ReadInstanceJob(OrthancPluginContext* context,
+                    const std::string& instanceId) :
+      uri_("/instances/" + instanceId + "/file"),
+      content_(context),
+      success_(false)
+    {
+    }
+
+    virtual void Execute()
+    {
+      success_ = OrthancPlugins::MeasuredRestApiGet(content_, uri_, false);
+    }
+
+    bool IsSuccess() const
+    {
+      return success_;
+    }
+
+    const OrthancPlugins::MemoryBuffer& GetContent() const
+    {
+      return content_;
+    }
+  };
+
+
+  // Generation of the metadata of one DICOM instance, in a worker of
+  // the pipeline. This is the same output as "DicomResults::Add()".
+  class MetadataJob : public OrthancPlugins::ParallelPipeline::IJob
+  {
+  private:
+    OrthancPluginContext*  context_;
+    std::string            instanceId_;
+    const std::string&     wadoBase_;
+    bool                   isXml_;
+    bool                   useCache_;
+    bool                   success_;
+    std::string            item_;
+
+  public:
+    MetadataJob(OrthancPluginContext* context,
+                const std::string& instanceId,
+                const std::string& wadoBase,
+                bool isXml,
+                bool useCache) :
+      context_(context),
+      instanceId_(instanceId),
+      wadoBase_(wadoBase),
+      isXml_(isXml),
+      useCache_(useCache),
+      success_(false)
+    {
+    }
+
+    virtual void Execute()
+    {
+      if (useCache_)
+      {
+        success_ = OrthancPlugins::MetadataCache::GetInstance().GetInstanceMetadata(item_, instanceId_, wadoBase_);
+      }
+      else
+      {
+        OrthancPlugins::MemoryBuffer content(context_);
+        if (OrthancPlugins::MeasuredRestApiGet(content, "/instances/" + instanceId_ + "/file", false))
+        {
+          // The pixel data is only reported through its bulk data URI
+          OrthancPlugins::ParsedDicomFile dicom(content, OrthancPlugins::DICOM_TAG_PIXEL_DATA);
+          OrthancPlugins::GenerateSingleDicomAnswer(item_, wadoBase_, *dictionary_,
+                                                    dicom.GetDataSet(), isXml_, true);
+          success_ = true;
+        }
+      }
+    }
+
+    bool IsSuccess() const
+    {
+      return success_;
+    }
+
+    const std::string& GetItem() const
+    {
+      return item_;
+    }
+  };
+}
+
+
+static size_t GetPrefetchThreads(size_t countInstances)
+{
+  // No worker thread is needed to answer one single instance
+  size_t threads = OrthancPlugins::Configuration::GetUnsignedIntegerValue("WadoRsPrefetchThreads", 4);
+  return (countInstances <= 1 ? 0 : std::min(threads, countInstances));
+}
+
+
 static void AnswerListOfDicomInstances(OrthancPluginRestOutput* output,
                                        const std::string& resource)
 {
   OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
 
   Json::Value instances;
-  if (!OrthancPlugins::RestApiGet(instances, context, resource + "/instances", false))
+  if (!OrthancPlugins::MeasuredRestApiGet(instances, context, resource + "/instances", false))
   {
     // Internal error
     OrthancPluginSendHttpStatusCode(context, output, 400);
@@ -194,16 +305,34 @@ static void AnswerListOfDicomInstances(OrthancPluginRestOutput* output,
   {
     throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
   }
+
+  // The next instances are downloaded while the current one is sent
+  const size_t threads = GetPrefetchThreads(instances.size());
+  OrthancPlugins::ParallelPipeline pipeline(threads, 2 * threads);
   
   for (Json::Value::ArrayIndex i = 0; i < instances.size(); i++)
   {
-    std::string uri = "/instances/" + instances[i]["ID"].asString() + "/file";
+    pipeline.Add(new ReadInstanceJob(context, instances[i]["ID"].asString()));
+  }
 
-    OrthancPlugins::MemoryBuffer dicom(context);
-    if (dicom.RestApiGet(uri, false) &&
-        OrthancPluginSendMultipartItem(context, output, dicom.GetData(), dicom.GetSize()) != 0)
+  for (;;)
+  {
+    std::auto_ptr<OrthancPlugins::ParallelPipeline::IJob> job(pipeline.Dequeue());
+    if (job.get() == NULL)
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      break;
+    }
+
+    const ReadInstanceJob& instance = dynamic_cast<const ReadInstanceJob&>(*job);
+    if (instance.IsSuccess())
+    {
+      if (OrthancPlugins::MeasuredSendMultipartItem(context, output, instance.GetContent().GetData(),
+                                         instance.GetContent().GetSize()) != 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      OrthancPlugins::Metrics::SignalInstances(1);
     }
   }
 }
@@ -218,50 +347,66 @@ static void AnswerMetadata(OrthancPluginRestOutput* output,
 {
   OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
 
-  std::list<std::string> files;
+  std::list<std::string> instances;
   if (isInstance)
   {
-    files.push_back(resource + "/file");
+    instances.push_back(resource.substr(std::string("/instances/").size()));
   }
   else
   {
-    Json::Value instances;
-    if (!OrthancPlugins::RestApiGet(instances, context, resource + "/instances", false))
+    Json::Value children;
+    if (!OrthancPlugins::MeasuredRestApiGet(children, context, resource + "/instances", false))
     {
       // Internal error
       OrthancPluginSendHttpStatusCode(context, output, 400);
       return;
     }
 
-    for (Json::Value::ArrayIndex i = 0; i < instances.size(); i++)
+    for (Json::Value::ArrayIndex i = 0; i < children.size(); i++)
     {
-      files.push_back("/instances/" + instances[i]["ID"].asString() + "/file");
+      instances.push_back(children[i]["ID"].asString());
     }
   }
 
   const std::string wadoBase = OrthancPlugins::Configuration::GetBaseUrl(request);
   OrthancPlugins::DicomResults results(context, output, wadoBase, *dictionary_, isXml, true);
+
+  // The pre-computed metadata is only available in DICOM+JSON
+  const bool useCache = (!isXml && OrthancPlugins::MetadataCache::GetInstance().IsEnabled());
+
+  const size_t threads = GetPrefetchThreads(instances.size());
+  OrthancPlugins::ParallelPipeline pipeline(threads, 2 * threads);
   
   for (std::list<std::string>::const_iterator
-         it = files.begin(); it != files.end(); ++it)
+         it = instances.begin(); it != instances.end(); ++it)
   {
-    OrthancPlugins::MemoryBuffer content(context);
-    if (content.RestApiGet(*it, false))
+    pipeline.Add(new MetadataJob(context, *it, wadoBase, isXml, useCache));
+  }
+
+  for (;;)
+  {
+    std::auto_ptr<OrthancPlugins::ParallelPipeline::IJob> job(pipeline.Dequeue());
+    if (job.get() == NULL)
+    {
+      break;
+    }
+
+    const MetadataJob& metadata = dynamic_cast<const MetadataJob&>(*job);
+    if (metadata.IsSuccess())
     {
-      OrthancPlugins::ParsedDicomFile dicom(content);
-      results.Add(dicom.GetFile());
+      results.AddSerialized(metadata.GetItem());
     }
   }
 
-  results.Answer();
+  results.Answer(request);
 }
 
 
 
 
-static bool LocateStudy(OrthancPluginRestOutput* output,
-                        std::string& uri,
-                        const OrthancPluginHttpRequest* request)
+bool LocateStudy(OrthancPluginRestOutput* output,
+                 std::string& uri,
+                 const OrthancPluginHttpRequest* request)
 {
   OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
 
@@ -271,29 +416,22 @@ static bool LocateStudy(OrthancPluginRestOutput* output,
     return false;
   }
 
-  std::string id;
-
+  OrthancPlugins::IdentifiersCache::Study study;
+  if (!OrthancPlugins::IdentifiersCache::GetInstance().LocateStudy(study, request->groups[0]))
   {
-    char* tmp = OrthancPluginLookupStudy(context, request->groups[0]);
-    if (tmp == NULL)
-    {
-      OrthancPlugins::Configuration::LogError("Accessing an inexistent study with WADO-RS: " + std::string(request->groups[0]));
-      OrthancPluginSendHttpStatusCode(context, output, 404);
-      return false;
-    }
-
-    id.assign(tmp);
-    OrthancPluginFreeString(context, tmp);
+    OrthancPlugins::Configuration::LogError("Accessing an inexistent study with WADO-RS: " + std::string(request->groups[0]));
+    OrthancPluginSendHttpStatusCode(context, output, 404);
+    return false;
   }
   
-  uri = "/studies/" + id;
+  uri = "/studies/" + study.studyId_;
   return true;
 }
 
 
-static bool LocateSeries(OrthancPluginRestOutput* output,
-                         std::string& uri,
-                         const OrthancPluginHttpRequest* request)
+bool LocateSeries(OrthancPluginRestOutput* output,
+                  std::string& uri,
+                  const OrthancPluginHttpRequest* request)
 {
   OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
 
@@ -303,29 +441,15 @@ static bool LocateSeries(OrthancPluginRestOutput* output,
     return false;
   }
 
-  std::string id;
-
-  {
-    char* tmp = OrthancPluginLookupSeries(context, request->groups[1]);
-    if (tmp == NULL)
-    {
-      OrthancPlugins::Configuration::LogError("Accessing an inexistent series with WADO-RS: " + std::string(request->groups[1]));
-      OrthancPluginSendHttpStatusCode(context, output, 404);
-      return false;
-    }
-
-    id.assign(tmp);
-    OrthancPluginFreeString(context, tmp);
-  }
-  
-  Json::Value study;
-  if (!OrthancPlugins::RestApiGet(study, context, "/series/" + id + "/study", false))
+  OrthancPlugins::IdentifiersCache::Series series;
+  if (!OrthancPlugins::IdentifiersCache::GetInstance().LocateSeries(series, request->groups[1]))
   {
+    OrthancPlugins::Configuration::LogError("Accessing an inexistent series with WADO-RS: " + std::string(request->groups[1]));
     OrthancPluginSendHttpStatusCode(context, output, 404);
     return false;
   }
-
-  if (study["MainDicomTags"]["StudyInstanceUID"].asString() != std::string(request->groups[0]))
+  
+  if (series.studyUid_ != std::string(request->groups[0]))
   {
     OrthancPlugins::Configuration::LogError("No series " + std::string(request->groups[1]) + 
                                             " in study " + std::string(request->groups[0]));
@@ -333,7 +457,7 @@ static bool LocateSeries(OrthancPluginRestOutput* output,
     return false;
   }
   
-  uri = "/series/" + id;
+  uri = "/series/" + series.seriesId_;
   return true;
 }
 
@@ -350,32 +474,17 @@ bool LocateInstance(OrthancPluginRestOutput* output,
     return false;
   }
 
-  std::string id;
-
-  {
-    char* tmp = OrthancPluginLookupInstance(context, request->groups[2]);
-    if (tmp == NULL)
-    {
-      OrthancPlugins::Configuration::LogError("Accessing an inexistent instance with WADO-RS: " + 
-                                              std::string(request->groups[2]));
-      OrthancPluginSendHttpStatusCode(context, output, 404);
-      return false;
-    }
-
-    id.assign(tmp);
-    OrthancPluginFreeString(context, tmp);
-  }
-  
-  Json::Value study, series;
-  if (!OrthancPlugins::RestApiGet(series, context, "/instances/" + id + "/series", false) ||
-      !OrthancPlugins::RestApiGet(study, context, "/instances/" + id + "/study", false))
+  OrthancPlugins::IdentifiersCache::Instance instance;
+  if (!OrthancPlugins::IdentifiersCache::GetInstance().LocateInstance(instance, request->groups[2]))
   {
+    OrthancPlugins::Configuration::LogError("Accessing an inexistent instance with WADO-RS: " + 
+                                            std::string(request->groups[2]));
     OrthancPluginSendHttpStatusCode(context, output, 404);
     return false;
   }
-
-  if (study["MainDicomTags"]["StudyInstanceUID"].asString() != std::string(request->groups[0]) ||
-      series["MainDicomTags"]["SeriesInstanceUID"].asString() != std::string(request->groups[1]))
+  
+  if (instance.studyUid_ != std::string(request->groups[0]) ||
+      instance.seriesUid_ != std::string(request->groups[1]))
   {
     OrthancPlugins::Configuration::LogError("No instance " + std::string(request->groups[2]) + 
                                             " in study " + std::string(request->groups[0]) + " or " +
@@ -384,7 +493,7 @@ bool LocateInstance(OrthancPluginRestOutput* output,
     return false;
   }
 
-  uri = "/instances/" + id;
+  uri = "/instances/" + instance.instanceId_;
   return true;
 }
 
@@ -449,10 +558,14 @@ void RetrieveDicomInstance(OrthancPluginRestOutput* output,
       }
 
       OrthancPlugins::MemoryBuffer dicom(context);
-      if (dicom.RestApiGet(uri + "/file", false) &&
-          OrthancPluginSendMultipartItem(context, output, dicom.GetData(), dicom.GetSize()) != 0)
+      if (OrthancPlugins::MeasuredRestApiGet(dicom, uri + "/file", false))
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+        if (OrthancPlugins::MeasuredSendMultipartItem(context, output, dicom.GetData(), dicom.GetSize()) != 0)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+        }
+
+        OrthancPlugins::Metrics::SignalInstances(1);
       }
     }
   }
@@ -494,6 +607,10 @@ void RetrieveSeriesMetadata(OrthancPluginRestOutput* output,
     std::string uri;
     if (LocateSeries(output, uri, request))
     {
+      // The frames of the series are likely to be retrieved next
+      OrthancPlugins::SeriesPrefetcher::GetInstance().SignalSeries(
+        OrthancPlugins::SeriesPrefetcher::GetClient(request), uri.substr(uri.rfind('/') + 1));
+
       AnswerMetadata(output, request, uri, false, isXml);
     }
   }
@@ -607,19 +724,33 @@ void RetrieveBulkData(OrthancPluginRestOutput* output,
   std::string uri;
   OrthancPlugins::MemoryBuffer content(context);
   if (LocateInstance(output, uri, request) &&
-      content.RestApiGet(uri + "/file", false))
+      OrthancPlugins::MeasuredRestApiGet(content, uri + "/file", false))
   {
-    OrthancPlugins::ParsedDicomFile dicom(content);
-
     std::vector<std::string> path;
     Orthanc::Toolbox::TokenizeString(path, request->groups[3], '/');
+
+    // The pixel data and the elements after it are only read if needed
+    gdcm::Tag first;
+    std::auto_ptr<OrthancPlugins::ParsedDicomFile> parsed;
+    if (!path.empty() &&
+        ParseBulkTag(first, path[0]) &&
+        first < OrthancPlugins::DICOM_TAG_PIXEL_DATA)
+    {
+      parsed.reset(new OrthancPlugins::ParsedDicomFile(content, OrthancPlugins::DICOM_TAG_PIXEL_DATA));
+    }
+    else
+    {
+      parsed.reset(new OrthancPlugins::ParsedDicomFile(content));
+    }
+
+    const OrthancPlugins::ParsedDicomFile& dicom = *parsed;
       
     std::string result;
     if (path.size() % 2 == 1 &&
         ExploreBulkData(result, path, 0, dicom.GetDataSet()))
     {
       if (OrthancPluginStartMultipartAnswer(context, output, "related", "application/octet-stream") != 0 ||
-          OrthancPluginSendMultipartItem(context, output, result.c_str(), result.size()) != 0)
+          OrthancPlugins::MeasuredSendMultipartItem(context, output, result.c_str(), result.size()) != 0)
       {
         throw Orthanc::OrthancException(Orthanc::ErrorCode_Plugin);
       }
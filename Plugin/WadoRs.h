@@ -22,12 +22,27 @@
 #pragma once
 
 #include "Configuration.h"
+#include "Rendering.h"
 
+#include <list>
+
+
+bool LocateStudy(OrthancPluginRestOutput* output,
+                 std::string& uri,
+                 const OrthancPluginHttpRequest* request);
+
+bool LocateSeries(OrthancPluginRestOutput* output,
+                  std::string& uri,
+                  const OrthancPluginHttpRequest* request);
 
 bool LocateInstance(OrthancPluginRestOutput* output,
                     std::string& uri,
                     const OrthancPluginHttpRequest* request);
 
+// Parse the 1-based list of frames in "request->groups[3]" into 0-based indices
+void ParseFrameList(std::list<unsigned int>& frames,
+                    const OrthancPluginHttpRequest* request);
+
 void RetrieveDicomStudy(OrthancPluginRestOutput* output,
                         const char* url,
                         const OrthancPluginHttpRequest* request);
@@ -59,3 +74,32 @@ void RetrieveBulkData(OrthancPluginRestOutput* output,
 void RetrieveFrames(OrthancPluginRestOutput* output,
                     const char* url,
                     const OrthancPluginHttpRequest* request);
+
+// Store the location of the frames of each instance as an attachment
+void EnableFrameIndex(unsigned int attachment);
+
+// Render one frame of an instance, going through the cache of the rendered images
+bool RenderInstanceFrame(std::string& target,
+                         const std::string& instanceId,
+                         unsigned int frame,
+                         const OrthancPlugins::RenderingParameters& parameters);
+
+void RetrieveInstanceRendered(OrthancPluginRestOutput* output,
+                              const char* url,
+                              const OrthancPluginHttpRequest* request);
+
+void RetrieveFramesRendered(OrthancPluginRestOutput* output,
+                            const char* url,
+                            const OrthancPluginHttpRequest* request);
+
+void RetrieveStudyThumbnail(OrthancPluginRestOutput* output,
+                            const char* url,
+                            const OrthancPluginHttpRequest* request);
+
+void RetrieveSeriesThumbnail(OrthancPluginRestOutput* output,
+                             const char* url,
+                             const OrthancPluginHttpRequest* request);
+
+void RetrieveInstanceThumbnail(OrthancPluginRestOutput* output,
+                               const char* url,
+                               const OrthancPluginHttpRequest* request);
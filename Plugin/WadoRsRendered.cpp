@@ -0,0 +1,383 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "WadoRs.h"
+
+#include "Metrics.h"
+#include "Plugin.h"
+#include "RenderedCache.h"
+
+#include <Core/Toolbox.h>
+
+#include <memory>
+#include <boost/lexical_cast.hpp>
+
+
+static bool ParseUnsignedList(std::vector<unsigned int>& target,
+                              const std::string& source)
+{
+  std::vector<std::string> tokens;
+  Orthanc::Toolbox::TokenizeString(tokens, source, ',');
+
+  target.resize(tokens.size());
+
+  try
+  {
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+      target[i] = boost::lexical_cast<unsigned int>(Orthanc::Toolbox::StripSpaces(tokens[i]));
+    }
+
+    return true;
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    return false;
+  }
+}
+
+
+static void ParseRenderingParameters(OrthancPlugins::RenderingParameters& parameters,
+                                     const OrthancPluginHttpRequest* request,
+                                     bool isThumbnail)
+{
+  std::string accept;
+  if (OrthancPlugins::LookupHttpHeader(accept, request, "accept"))
+  {
+    Orthanc::Toolbox::ToLowerCase(accept);
+  }
+
+  bool hasViewport = false;
+
+  for (uint32_t i = 0; i < request->getCount; i++)
+  {
+    std::string key(request->getKeys[i]);
+    std::string value(request->getValues[i]);
+
+    if (key == "accept")
+    {
+      accept = value;
+      Orthanc::Toolbox::ToLowerCase(accept);
+    }
+    else if (key == "quality")
+    {
+      std::vector<unsigned int> quality;
+      if (!ParseUnsignedList(quality, value) ||
+          quality.size() != 1)
+      {
+        OrthancPlugins::Configuration::LogError("WADO-RS: Bad value for the quality: " + value);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest);
+      }
+
+      parameters.SetQuality(quality[0]);
+    }
+    else if (key == "viewport")
+    {
+      // Cropping the source image ("sx,sy,sw,sh") is not supported
+      std::vector<unsigned int> viewport;
+      if (!ParseUnsignedList(viewport, value) ||
+          viewport.size() != 2)
+      {
+        OrthancPlugins::Configuration::LogError("WADO-RS: Unsupported viewport (must be \"vw,vh\"): " + value);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest);
+      }
+
+      parameters.SetViewport(viewport[0], viewport[1]);
+      hasViewport = true;
+    }
+    else if (key == "window")
+    {
+      std::vector<std::string> tokens;
+      Orthanc::Toolbox::TokenizeString(tokens, value, ',');
+
+      try
+      {
+        if ((tokens.size() != 2 && tokens.size() != 3) ||
+            (tokens.size() == 3 && Orthanc::Toolbox::StripSpaces(tokens[2]) != "linear"))
+        {
+          throw boost::bad_lexical_cast();
+        }
+
+        parameters.SetWindowing(boost::lexical_cast<float>(Orthanc::Toolbox::StripSpaces(tokens[0])),
+                                boost::lexical_cast<float>(Orthanc::Toolbox::StripSpaces(tokens[1])));
+      }
+      catch (boost::bad_lexical_cast&)
+      {
+        OrthancPlugins::Configuration::LogError("WADO-RS: Unsupported window (must be \"center,width[,linear]\"): " + value);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest);
+      }
+    }
+  }
+
+  // JPEG is the default
+  parameters.SetPng(accept.find("image/png") != std::string::npos &&
+                    accept.find("image/jpeg") == std::string::npos);
+
+  if (isThumbnail &&
+      !hasViewport)
+  {
+    unsigned int size = OrthancPlugins::Configuration::GetUnsignedIntegerValue("ThumbnailSize", 128);
+    if (size != 0)
+    {
+      parameters.SetViewport(size, size);
+    }
+  }
+}
+
+
+// The DICOM file is only downloaded on the first cache miss, then
+// kept in "dicom" to render the next frames of the same instance
+static bool RenderFrameFromCache(std::string& target,
+                                 std::auto_ptr<OrthancPlugins::MemoryBuffer>& dicom,
+                                 const std::string& instanceId,
+                                 unsigned int frame,
+                                 const OrthancPlugins::RenderingParameters& parameters)
+{
+  const std::string key = parameters.GetKey();
+
+  if (OrthancPlugins::RenderedCache::GetInstance().Lookup(target, instanceId, frame, key))
+  {
+    return true;
+  }
+
+  if (dicom.get() == NULL)
+  {
+    std::auto_ptr<OrthancPlugins::MemoryBuffer> buffer(new OrthancPlugins::MemoryBuffer(OrthancPlugins::Configuration::GetContext()));
+    if (!OrthancPlugins::MeasuredRestApiGet(*buffer, "/instances/" + instanceId + "/file", false))
+    {
+      return false;
+    }
+
+    dicom = buffer;
+  }
+
+  OrthancPlugins::RenderFrame(target, *dictionary_, dicom->GetData(), dicom->GetSize(), frame, parameters);
+  OrthancPlugins::RenderedCache::GetInstance().Store(instanceId, frame, key, target);
+
+  return true;
+}
+
+
+bool RenderInstanceFrame(std::string& target,
+                         const std::string& instanceId,
+                         unsigned int frame,
+                         const OrthancPlugins::RenderingParameters& parameters)
+{
+  std::auto_ptr<OrthancPlugins::MemoryBuffer> dicom;
+  return RenderFrameFromCache(target, dicom, instanceId, frame, parameters);
+}
+
+
+static void AnswerRenderedFrame(OrthancPluginRestOutput* output,
+                                const std::string& instanceId,
+                                unsigned int frame,
+                                const OrthancPlugins::RenderingParameters& parameters)
+{
+  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+  std::string image;
+  if (RenderInstanceFrame(image, instanceId, frame, parameters))
+  {
+    OrthancPlugins::MeasuredAnswerBuffer(context, output, image.c_str(), image.size(), parameters.GetMimeType());
+  }
+  else
+  {
+    OrthancPluginSendHttpStatusCode(context, output, 404);
+  }
+}
+
+
+// Choose the instance that represents a series, among the instances
+// of an Orthanc resource, using the lowest index in the series
+static bool LookupRepresentativeInstance(std::string& instanceId,
+                                         const std::string& uri)
+{
+  Json::Value instances;
+  if (!OrthancPlugins::MeasuredRestApiGet(instances, OrthancPlugins::Configuration::GetContext(), uri + "/instances", false) ||
+      instances.type() != Json::arrayValue ||
+      instances.size() == 0)
+  {
+    return false;
+  }
+
+  Json::Value::ArrayIndex best = 0;
+  for (Json::Value::ArrayIndex i = 1; i < instances.size(); i++)
+  {
+    if (instances[i].isMember("IndexInSeries") &&
+        instances[i]["IndexInSeries"].isInt() &&
+        (!instances[best].isMember("IndexInSeries") ||
+         !instances[best]["IndexInSeries"].isInt() ||
+         instances[i]["IndexInSeries"].asInt() < instances[best]["IndexInSeries"].asInt()))
+    {
+      best = i;
+    }
+  }
+
+  if (!instances[best].isMember("ID") ||
+      instances[best]["ID"].type() != Json::stringValue)
+  {
+    return false;
+  }
+
+  instanceId = instances[best]["ID"].asString();
+  return true;
+}
+
+
+void RetrieveInstanceRendered(OrthancPluginRestOutput* output,
+                              const char* url,
+                              const OrthancPluginHttpRequest* request)
+{
+  std::string uri;
+  if (LocateInstance(output, uri, request))
+  {
+    OrthancPlugins::RenderingParameters parameters;
+    ParseRenderingParameters(parameters, request, false);
+
+    // The identifier of the instance is the last component of its URI
+    AnswerRenderedFrame(output, uri.substr(uri.rfind('/') + 1), 0, parameters);
+  }
+}
+
+
+void RetrieveFramesRendered(OrthancPluginRestOutput* output,
+                            const char* url,
+                            const OrthancPluginHttpRequest* request)
+{
+  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
+
+  std::list<unsigned int> frames;
+  ParseFrameList(frames, request);
+
+  std::string uri;
+  if (!LocateInstance(output, uri, request))
+  {
+    return;
+  }
+
+  OrthancPlugins::RenderingParameters parameters;
+  ParseRenderingParameters(parameters, request, false);
+
+  const std::string instanceId = uri.substr(uri.rfind('/') + 1);
+
+  if (frames.size() == 1)
+  {
+    AnswerRenderedFrame(output, instanceId, frames.front(), parameters);
+    return;
+  }
+  
+  if (frames.empty())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest);
+  }
+
+  if (OrthancPluginStartMultipartAnswer(context, output, "related", parameters.GetMimeType()) != OrthancPluginErrorCode_Success)
+  {
+    return;
+  }
+
+  // The DICOM file is downloaded once for all the frames of the request
+  std::auto_ptr<OrthancPlugins::MemoryBuffer> dicom;
+
+  for (std::list<unsigned int>::const_iterator 
+         frame = frames.begin(); frame != frames.end(); ++frame)
+  {
+    std::string image;
+    if (!RenderFrameFromCache(image, dicom, instanceId, *frame, parameters) ||
+        OrthancPlugins::MeasuredSendMultipartItem(context, output, image.c_str(), image.size()) != OrthancPluginErrorCode_Success)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_Plugin);
+    }
+  }
+}
+
+
+void RetrieveStudyThumbnail(OrthancPluginRestOutput* output,
+                            const char* url,
+                            const OrthancPluginHttpRequest* request)
+{
+  std::string uri;
+  if (!LocateStudy(output, uri, request))
+  {
+    return;
+  }
+
+  OrthancPlugins::RenderingParameters parameters;
+  ParseRenderingParameters(parameters, request, true);
+
+  // The thumbnail of a study is that of its first series
+  Json::Value series;
+  std::string instanceId;
+  if (OrthancPlugins::MeasuredRestApiGet(series, OrthancPlugins::Configuration::GetContext(), uri, false) &&
+      series.type() == Json::objectValue &&
+      series.isMember("Series") &&
+      series["Series"].type() == Json::arrayValue &&
+      series["Series"].size() > 0 &&
+      LookupRepresentativeInstance(instanceId, "/series/" + series["Series"][0].asString()))
+  {
+    AnswerRenderedFrame(output, instanceId, 0, parameters);
+  }
+  else
+  {
+    OrthancPluginSendHttpStatusCode(OrthancPlugins::Configuration::GetContext(), output, 404);
+  }
+}
+
+
+void RetrieveSeriesThumbnail(OrthancPluginRestOutput* output,
+                             const char* url,
+                             const OrthancPluginHttpRequest* request)
+{
+  std::string uri;
+  if (!LocateSeries(output, uri, request))
+  {
+    return;
+  }
+
+  OrthancPlugins::RenderingParameters parameters;
+  ParseRenderingParameters(parameters, request, true);
+
+  std::string instanceId;
+  if (LookupRepresentativeInstance(instanceId, uri))
+  {
+    AnswerRenderedFrame(output, instanceId, 0, parameters);
+  }
+  else
+  {
+    OrthancPluginSendHttpStatusCode(OrthancPlugins::Configuration::GetContext(), output, 404);
+  }
+}
+
+
+void RetrieveInstanceThumbnail(OrthancPluginRestOutput* output,
+                               const char* url,
+                               const OrthancPluginHttpRequest* request)
+{
+  std::string uri;
+  if (LocateInstance(output, uri, request))
+  {
+    OrthancPlugins::RenderingParameters parameters;
+    ParseRenderingParameters(parameters, request, true);
+
+    AnswerRenderedFrame(output, uri.substr(uri.rfind('/') + 1), 0, parameters);
+  }
+}
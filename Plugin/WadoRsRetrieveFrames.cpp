@@ -22,19 +22,34 @@
 #include "WadoRs.h"
 
 #include "Dicom.h"
+#include "FrameCache.h"
+#include "FrameIndex.h"
+#include "IdentifiersCache.h"
+#include "Metrics.h"
 #include "Plugin.h"
+#include "SeriesPrefetcher.h"
+#include "WorkerPool.h"
 
 #include <Core/Toolbox.h>
 
+#include <algorithm>
 #include <memory>
 #include <list>
-#include <gdcmImageReader.h>
-#include <gdcmImageWriter.h>
+#include <map>
+#include <gdcmFragment.h>
+#include <gdcmImage.h>
 #include <gdcmImageChangeTransferSyntax.h>
+#include <gdcmPhotometricInterpretation.h>
+#include <gdcmPixelFormat.h>
+#include <gdcmSequenceOfFragments.h>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/lexical_cast.hpp>
 
 
+// Attachment containing the frame index of the instances (empty if disabled)
+static std::string frameIndexAttachment_;
+
+
 static void TokenizeAndNormalize(std::vector<std::string>& tokens,
                                  const std::string& source,
                                  char separator)
@@ -234,8 +249,8 @@ static gdcm::TransferSyntax ParseTransferSyntax(const OrthancPluginHttpRequest*
 }
 
 
-static void ParseFrameList(std::list<unsigned int>& frames,
-                           const OrthancPluginHttpRequest* request)
+void ParseFrameList(std::list<unsigned int>& frames,
+                    const OrthancPluginHttpRequest* request)
 {
   frames.clear();
 
@@ -317,8 +332,7 @@ static const char* GetMimeType(const gdcm::TransferSyntax& syntax)
 
 
 static void AnswerSingleFrame(OrthancPluginRestOutput* output,
-                              const OrthancPluginHttpRequest* request,
-                              const OrthancPlugins::ParsedDicomFile& dicom,
+                              const std::string& wadoUrl,
                               const char* frame,
                               size_t size,
                               unsigned int frameIndex)
@@ -326,12 +340,12 @@ static void AnswerSingleFrame(OrthancPluginRestOutput* output,
   OrthancPluginErrorCode error;
 
 #if HAS_SEND_MULTIPART_ITEM_2 == 1
-  std::string location = dicom.GetWadoUrl(request) + "frames/" + boost::lexical_cast<std::string>(frameIndex + 1);
+  std::string location = wadoUrl + "frames/" + boost::lexical_cast<std::string>(frameIndex + 1);
   const char *keys[] = { "Content-Location" };
   const char *values[] = { location.c_str() };
-  error = OrthancPluginSendMultipartItem2(OrthancPlugins::Configuration::GetContext(), output, frame, size, 1, keys, values);
+  error = OrthancPlugins::MeasuredSendMultipartItem2(OrthancPlugins::Configuration::GetContext(), output, frame, size, 1, keys, values);
 #else
-  error = OrthancPluginSendMultipartItem(OrthancPlugins::Configuration::GetContext(), output, frame, size);
+  error = OrthancPlugins::MeasuredSendMultipartItem(OrthancPlugins::Configuration::GetContext(), output, frame, size);
 #endif
 
   if (error != OrthancPluginErrorCode_Success)
@@ -342,116 +356,501 @@ static void AnswerSingleFrame(OrthancPluginRestOutput* output,
 
 
 
-static bool AnswerFrames(OrthancPluginRestOutput* output,
-                         const OrthancPluginHttpRequest* request,
-                         const OrthancPlugins::ParsedDicomFile& dicom,
-                         const gdcm::TransferSyntax& syntax,
-                         std::list<unsigned int>& frames)
+namespace
 {
-  if (!dicom.GetDataSet().FindDataElement(OrthancPlugins::DICOM_TAG_PIXEL_DATA))
+  // Access to the frames of one instance, whatever their origin
+  class IFrameSource : public boost::noncopyable
   {
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageFormat);
-  }
+  public:
+    virtual ~IFrameSource()
+    {
+    }
 
-  const gdcm::DataElement& pixelData = dicom.GetDataSet().GetDataElement(OrthancPlugins::DICOM_TAG_PIXEL_DATA);
-  const gdcm::SequenceOfFragments* fragments = pixelData.GetSequenceOfFragments();
+    virtual unsigned int GetFramesCount() const = 0;
+
+    // The returned buffer is only valid until the next call
+    virtual void GetFrame(const char*& data,
+                          size_t& size,
+                          unsigned int frame) = 0;
+  };
 
-  if (OrthancPluginStartMultipartAnswer(OrthancPlugins::Configuration::GetContext(), 
-                                        output, "related", GetMimeType(syntax)) != OrthancPluginErrorCode_Success)
-  {
-    return false;
-  }
 
-  if (fragments == NULL)
+  // Frames of an instance that was parsed by GDCM
+  class ParsedFrames : public IFrameSource
   {
-    // Single-fragment image
+  private:
+    const gdcm::DataElement&          pixelData_;
+    const gdcm::SequenceOfFragments*  fragments_;
+    size_t                            frameSize_;      // For single-fragment images
+    unsigned int                      countFrames_;
+    std::vector<size_t>               firstFragment_;  // For multi-fragment images
+    std::string                       buffer_;
+
+    static const gdcm::DataElement& GetPixelData(const OrthancPlugins::ParsedDicomFile& dicom)
+    {
+      if (!dicom.GetDataSet().FindDataElement(OrthancPlugins::DICOM_TAG_PIXEL_DATA))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageFormat);
+      }
+
+      return dicom.GetDataSet().GetDataElement(OrthancPlugins::DICOM_TAG_PIXEL_DATA);
+    }
+
+  public:
+    explicit ParsedFrames(const OrthancPlugins::ParsedDicomFile& dicom) :
+      pixelData_(GetPixelData(dicom)),
+      fragments_(pixelData_.GetSequenceOfFragments()),
+      frameSize_(0),
+      countFrames_(0)
+    {
+      if (fragments_ == NULL)
+      {
+        // Single-fragment image
+
+        if (pixelData_.GetByteValue() == NULL)
+        {
+          OrthancPlugins::Configuration::LogError("Image was not properly decoded");
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);      
+        }
+
+        int width, height, bits, samplesPerPixel;
+
+        if (!dicom.GetIntegerTag(height, *dictionary_, OrthancPlugins::DICOM_TAG_ROWS) ||
+            !dicom.GetIntegerTag(width, *dictionary_, OrthancPlugins::DICOM_TAG_COLUMNS) ||
+            !dicom.GetIntegerTag(bits, *dictionary_, OrthancPlugins::DICOM_TAG_BITS_ALLOCATED) || 
+            !dicom.GetIntegerTag(samplesPerPixel, *dictionary_, OrthancPlugins::DICOM_TAG_SAMPLES_PER_PIXEL))
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+
+        frameSize_ = height * width * bits * samplesPerPixel / 8;
+    
+        if (frameSize_ == 0 ||
+            pixelData_.GetByteValue()->GetLength() % frameSize_ != 0)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);      
+        }
+
+        countFrames_ = pixelData_.GetByteValue()->GetLength() / frameSize_;
+      }
+      else
+      {
+        // Multi-fragment image, whose fragments are grouped into frames
+        // using the Basic Offset Table, or the JPEG markers if it is empty
+
+        int countFrames = 1;
+        if (dicom.GetDataSet().FindDataElement(OrthancPlugins::DICOM_TAG_NUMBER_OF_FRAMES) &&
+            !dicom.GetIntegerTag(countFrames, *dictionary_, OrthancPlugins::DICOM_TAG_NUMBER_OF_FRAMES))
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+
+        if (countFrames <= 0 ||
+            !OrthancPlugins::FrameIndex::GroupFragments(firstFragment_, *fragments_, countFrames))
+        {
+          OrthancPlugins::Configuration::LogError("Cannot determine the fragments of the " +
+                                                  boost::lexical_cast<std::string>(countFrames) +
+                                                  " frames of an image with " +
+                                                  boost::lexical_cast<std::string>(fragments_->GetNumberOfFragments()) +
+                                                  " fragments");
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+
+        countFrames_ = static_cast<unsigned int>(countFrames);
+      }
+    }
+
+    virtual unsigned int GetFramesCount() const
+    {
+      return countFrames_;
+    }
 
-    if (pixelData.GetByteValue() == NULL)
+    virtual void GetFrame(const char*& data,
+                          size_t& size,
+                          unsigned int frame)
     {
-      OrthancPlugins::Configuration::LogError("Image was not properly decoded");
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);      
+      if (frame >= countFrames_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      if (fragments_ == NULL)
+      {
+        data = pixelData_.GetByteValue()->GetPointer() + frame * frameSize_;
+        size = frameSize_;
+        return;
+      }
+
+      const size_t start = firstFragment_[frame];
+      const size_t end = firstFragment_[frame + 1];
+
+      if (end == start + 1)
+      {
+        // Frame made of one single fragment: No copy
+        const gdcm::ByteValue* value = fragments_->GetFragment(start).GetByteValue();
+        if (value == NULL)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+
+        data = value->GetPointer();
+        size = value->GetLength();
+      }
+      else
+      {
+        buffer_.clear();
+
+        for (size_t i = start; i < end; i++)
+        {
+          const gdcm::ByteValue* value = fragments_->GetFragment(i).GetByteValue();
+          if (value != NULL)
+          {
+            buffer_.append(value->GetPointer(), value->GetLength());
+          }
+        }
+
+        data = buffer_.c_str();
+        size = buffer_.size();
+      }
     }
+  };
 
-    int width, height, bits, samplesPerPixel;
 
-    if (!dicom.GetIntegerTag(height, *dictionary_, OrthancPlugins::DICOM_TAG_ROWS) ||
-        !dicom.GetIntegerTag(width, *dictionary_, OrthancPlugins::DICOM_TAG_COLUMNS) ||
-        !dicom.GetIntegerTag(bits, *dictionary_, OrthancPlugins::DICOM_TAG_BITS_ALLOCATED) || 
-        !dicom.GetIntegerTag(samplesPerPixel, *dictionary_, OrthancPlugins::DICOM_TAG_SAMPLES_PER_PIXEL))
+  // Frames of an instance whose location is given by its frame index
+  class IndexedFrames : public IFrameSource
+  {
+  private:
+    const OrthancPlugins::FrameIndex&  index_;
+    const char*                        data_;
+    size_t                             size_;
+    std::string                        buffer_;
+
+  public:
+    IndexedFrames(const OrthancPlugins::FrameIndex& index,
+                  const char* data,
+                  size_t size) :
+      index_(index),
+      data_(data),
+      size_(size)
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
     }
 
-    size_t frameSize = height * width * bits * samplesPerPixel / 8;
-    
-    if (pixelData.GetByteValue()->GetLength() % frameSize != 0)
+    virtual unsigned int GetFramesCount() const
+    {
+      return index_.GetFramesCount();
+    }
+
+    virtual void GetFrame(const char*& data,
+                          size_t& size,
+                          unsigned int frame)
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);      
+      index_.GetFrame(data, size, buffer_, data_, size_, frame);
     }
+  };
 
-    size_t framesCount = pixelData.GetByteValue()->GetLength() / frameSize;
 
-    if (frames.empty())
+  // Transcoded frames that were read from the cache of the frames
+  class CachedFrames : public IFrameSource
+  {
+  private:
+    std::map<unsigned int, std::string>  frames_;
+
+  public:
+    bool Load(const std::string& instanceId,
+              const std::string& transferSyntax,
+              const std::list<unsigned int>& frames)
     {
-      // If no frame is provided, return all the frames (this is an extension)
-      for (size_t i = 0; i < framesCount; i++)
+      for (std::list<unsigned int>::const_iterator 
+             frame = frames.begin(); frame != frames.end(); ++frame)
       {
-        frames.push_back(i);
+        if (frames_.find(*frame) == frames_.end() &&
+            !OrthancPlugins::FrameCache::GetInstance().Lookup(frames_[*frame], instanceId, *frame, transferSyntax))
+        {
+          return false;
+        }
       }
+
+      return true;
     }
 
-    const char* buffer = pixelData.GetByteValue()->GetPointer();
-    assert(sizeof(char) == 1);
+    virtual unsigned int GetFramesCount() const
+    {
+      // The cached frames were checked upon their transcoding
+      return frames_.empty() ? 0 : frames_.rbegin()->first + 1;
+    }
 
-    for (std::list<unsigned int>::const_iterator 
-           frame = frames.begin(); frame != frames.end(); ++frame)
+    virtual void GetFrame(const char*& data,
+                          size_t& size,
+                          unsigned int frame)
     {
-      if (*frame >= framesCount)
+      std::map<unsigned int, std::string>::const_iterator found = frames_.find(frame);
+      if (found == frames_.end())
       {
-        OrthancPlugins::Configuration::LogError("Trying to access frame number " + boost::lexical_cast<std::string>(*frame + 1) + 
-                                                " of an image with " + boost::lexical_cast<std::string>(framesCount) + " frames");
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
       }
-      else
+
+      data = found->second.c_str();
+      size = found->second.size();
+    }
+  };
+
+
+  // Conversion of the transfer syntax of one single frame, which
+  // avoids decoding the frames that were not requested
+  class FrameTranscoder : public boost::noncopyable
+  {
+  private:
+    gdcm::TransferSyntax             sourceSyntax_;
+    gdcm::TransferSyntax             targetSyntax_;
+    unsigned int                     width_;
+    unsigned int                     height_;
+    gdcm::PixelFormat                format_;
+    gdcm::PhotometricInterpretation  photometric_;
+    unsigned int                     planarConfiguration_;
+
+    static unsigned int GetUnsignedTag(const OrthancPlugins::ParsedDicomFile& header,
+                                       const gdcm::Tag& tag,
+                                       int defaultValue)
+    {
+      int value = defaultValue;
+
+      if (header.GetDataSet().FindDataElement(tag) &&
+          !header.GetIntegerTag(value, *dictionary_, tag))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+
+      if (value < 0)
       {
-        const char* p = buffer + (*frame) * frameSize;
-        AnswerSingleFrame(output, request, dicom, p, frameSize, *frame);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
       }
+
+      return static_cast<unsigned int>(value);
     }
-  }
-  else
-  {
-    // Multi-fragment image, we assume that each fragment corresponds to one frame
 
-    if (frames.empty())
+  public:
+    // The Pixel Data of "header" is not used, so that the header
+    // might come from a partial parsing
+    FrameTranscoder(const OrthancPlugins::ParsedDicomFile& header,
+                    const gdcm::TransferSyntax& sourceSyntax,
+                    const gdcm::TransferSyntax& targetSyntax) :
+      sourceSyntax_(sourceSyntax),
+      targetSyntax_(targetSyntax),
+      width_(GetUnsignedTag(header, OrthancPlugins::DICOM_TAG_COLUMNS, 0)),
+      height_(GetUnsignedTag(header, OrthancPlugins::DICOM_TAG_ROWS, 0)),
+      planarConfiguration_(GetUnsignedTag(header, OrthancPlugins::DICOM_TAG_PLANAR_CONFIGURATION, 0))
     {
-      // If no frame is provided, return all the frames (this is an extension)
-      for (size_t i = 0; i < fragments->GetNumberOfFragments(); i++)
+      const unsigned int bitsAllocated = GetUnsignedTag(header, OrthancPlugins::DICOM_TAG_BITS_ALLOCATED, 0);
+      const unsigned int bitsStored = GetUnsignedTag(header, OrthancPlugins::DICOM_TAG_BITS_STORED, bitsAllocated);
+
+      format_ = gdcm::PixelFormat(
+        GetUnsignedTag(header, OrthancPlugins::DICOM_TAG_SAMPLES_PER_PIXEL, 1),
+        bitsAllocated, bitsStored,
+        GetUnsignedTag(header, OrthancPlugins::DICOM_TAG_HIGH_BIT, bitsStored - 1),
+        GetUnsignedTag(header, OrthancPlugins::DICOM_TAG_PIXEL_REPRESENTATION, 0));
+
+      std::string photometric;
+      if (!header.GetDataSet().FindDataElement(OrthancPlugins::DICOM_TAG_PHOTOMETRIC_INTERPRETATION) ||
+          !header.GetStringTag(photometric, *dictionary_, OrthancPlugins::DICOM_TAG_PHOTOMETRIC_INTERPRETATION, true))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+
+      photometric_ = gdcm::PhotometricInterpretation::GetPIType(photometric.c_str());
+
+      if (width_ == 0 ||
+          height_ == 0 ||
+          bitsAllocated == 0 ||
+          photometric_.GetType() == gdcm::PhotometricInterpretation::UNKNOWN)
       {
-        frames.push_back(i);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
       }
     }
 
-    for (std::list<unsigned int>::const_iterator 
-           frame = frames.begin(); frame != frames.end(); ++frame)
+    // Can be called concurrently from several threads
+    void Transcode(std::string& target,
+                   const char* frame,
+                   size_t size) const
     {
-      if (*frame >= fragments->GetNumberOfFragments())
+      OrthancPlugins::Metrics::StageTimer timer(OrthancPlugins::Metrics::Stage_Transcode);
+
+      gdcm::DataElement pixelData(OrthancPlugins::DICOM_TAG_PIXEL_DATA);
+
+      if (sourceSyntax_.IsEncapsulated())
       {
-        // TODO A frame is not a fragment, looks like a bug
-        OrthancPlugins::Configuration::LogError("Trying to access frame number " + 
-                                                boost::lexical_cast<std::string>(*frame + 1) + 
-                                                " of an image with " + 
-                                                boost::lexical_cast<std::string>(fragments->GetNumberOfFragments()) + 
-                                                " frames");
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        gdcm::Fragment fragment;
+        fragment.SetByteValue(frame, static_cast<uint32_t>(size));
+
+        gdcm::SmartPointer<gdcm::SequenceOfFragments> fragments = new gdcm::SequenceOfFragments;
+        fragments->AddFragment(fragment);
+
+        pixelData.SetValue(*fragments);
+        pixelData.SetVLToUndefined();
       }
       else
       {
-        AnswerSingleFrame(output, request, dicom,
-                          fragments->GetFragment(*frame).GetByteValue()->GetPointer(),
-                          fragments->GetFragment(*frame).GetByteValue()->GetLength(), *frame);
+        pixelData.SetByteValue(frame, static_cast<uint32_t>(size));
       }
+
+      gdcm::Image image;
+      image.SetNumberOfDimensions(2);
+      image.SetDimension(0, width_);
+      image.SetDimension(1, height_);
+      image.SetPixelFormat(format_);
+      image.SetPhotometricInterpretation(photometric_);
+      image.SetPlanarConfiguration(planarConfiguration_);
+      image.SetTransferSyntax(sourceSyntax_);
+      image.SetDataElement(pixelData);
+
+      gdcm::ImageChangeTransferSyntax change;
+      change.SetTransferSyntax(targetSyntax_);
+      change.SetInput(image);
+
+      if (!change.Change())
+      {
+        OrthancPlugins::Configuration::LogError("Cannot change the transfer syntax of the frame");
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      const gdcm::DataElement& result = change.GetOutput().GetDataElement();
+
+      if (result.GetByteValue() != NULL)
+      {
+        target.assign(result.GetByteValue()->GetPointer(), result.GetByteValue()->GetLength());
+      }
+      else if (result.GetSequenceOfFragments() != NULL)
+      {
+        // A single frame was encoded: Concatenate all its fragments
+        const gdcm::SequenceOfFragments& fragments = *result.GetSequenceOfFragments();
+
+        target.clear();
+        for (unsigned int i = 0; i < fragments.GetNumberOfFragments(); i++)
+        {
+          const gdcm::ByteValue* value = fragments.GetFragment(i).GetByteValue();
+          if (value != NULL)
+          {
+            target.append(value->GetPointer(), value->GetLength());
+          }
+        }
+      }
+      else
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+    }
+  };
+
+
+  // Transcoding of one frame by the shared pool of workers, going
+  // through the cache of the frames if it is enabled
+  class TranscodeFrameJob : public OrthancPlugins::WorkerPool::IJob
+  {
+  private:
+    const FrameTranscoder&  transcoder_;
+    const std::string&      instanceId_;
+    const std::string&      targetSyntax_;
+    bool                    useCache_;
+    unsigned int            frame_;
+    std::string             source_;
+    std::string             target_;
+
+  public:
+    // The source frame is copied, as "IFrameSource" is not thread-safe
+    TranscodeFrameJob(const FrameTranscoder& transcoder,
+                      const std::string& instanceId,
+                      const std::string& targetSyntax,
+                      bool useCache,
+                      unsigned int frame,
+                      const char* data,
+                      size_t size) :
+      transcoder_(transcoder),
+      instanceId_(instanceId),
+      targetSyntax_(targetSyntax),
+      useCache_(useCache),
+      frame_(frame),
+      source_(data, size)
+    {
+    }
+
+    virtual void Execute()
+    {
+      if (!useCache_ ||
+          !OrthancPlugins::FrameCache::GetInstance().Lookup(target_, instanceId_, frame_, targetSyntax_))
+      {
+        transcoder_.Transcode(target_, source_.c_str(), source_.size());
+
+        if (useCache_)
+        {
+          OrthancPlugins::FrameCache::GetInstance().Store(instanceId_, frame_, targetSyntax_,
+                                                          target_.c_str(), target_.size());
+        }
+      }
+
+      // Release the memory as soon as possible
+      std::string().swap(source_);
+    }
+
+    unsigned int GetFrame() const
+    {
+      return frame_;
+    }
+
+    const std::string& GetTarget() const
+    {
+      return target_;
     }
+  };
+}
+
+
+
+static void CheckFrameList(std::list<unsigned int>& frames,
+                           unsigned int countFrames)
+{
+  if (frames.empty())
+  {
+    // If no frame is provided, return all the frames (this is an extension)
+    for (unsigned int i = 0; i < countFrames; i++)
+    {
+      frames.push_back(i);
+    }
+  }
+
+  for (std::list<unsigned int>::const_iterator 
+         frame = frames.begin(); frame != frames.end(); ++frame)
+  {
+    if (*frame >= countFrames)
+    {
+      OrthancPlugins::Configuration::LogError("Trying to access frame number " + boost::lexical_cast<std::string>(*frame + 1) + 
+                                              " of an image with " + boost::lexical_cast<std::string>(countFrames) + " frames");
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+}
+
+
+
+static bool AnswerFrames(OrthancPluginRestOutput* output,
+                         const std::string& wadoUrl,
+                         IFrameSource& source,
+                         const gdcm::TransferSyntax& syntax,
+                         std::list<unsigned int>& frames)
+{
+  CheckFrameList(frames, source.GetFramesCount());
+
+  if (OrthancPluginStartMultipartAnswer(OrthancPlugins::Configuration::GetContext(), 
+                                        output, "related", GetMimeType(syntax)) != OrthancPluginErrorCode_Success)
+  {
+    return false;
+  }
+
+  for (std::list<unsigned int>::const_iterator 
+         frame = frames.begin(); frame != frames.end(); ++frame)
+  {
+    const char* data = NULL;
+    size_t size = 0;
+    source.GetFrame(data, size, *frame);
+    AnswerSingleFrame(output, wadoUrl, data, size, *frame);
   }
 
   return true;
@@ -459,6 +858,115 @@ static bool AnswerFrames(OrthancPluginRestOutput* output,
 
 
 
+static bool AnswerTranscodedFrames(OrthancPluginRestOutput* output,
+                                   const std::string& wadoUrl,
+                                   IFrameSource& source,
+                                   const FrameTranscoder& transcoder,
+                                   const std::string& instanceId,
+                                   const gdcm::TransferSyntax& targetSyntax,
+                                   bool useCache,
+                                   std::list<unsigned int>& frames)
+{
+  CheckFrameList(frames, source.GetFramesCount());
+
+  if (OrthancPluginStartMultipartAnswer(OrthancPlugins::Configuration::GetContext(), 
+                                        output, "related", GetMimeType(targetSyntax)) != OrthancPluginErrorCode_Success)
+  {
+    return false;
+  }
+
+  const std::string targetUid = targetSyntax.GetString();
+
+  // The frames are decoded by the pool of workers that is shared by
+  // all the requests, and sent in the order of the frame list
+  OrthancPlugins::WorkerPool& pool = OrthancPlugins::WorkerPool::GetInstance();
+  const size_t lookahead = std::max(static_cast<size_t>(1), 2 * pool.GetThreadsCount());
+  OrthancPlugins::WorkerPool::Batch batch(pool, lookahead);
+
+  // The jobs, which copy their source frame, are only created as the
+  // answer is sent, so that at most "lookahead" frames are copied
+  std::list<unsigned int>::const_iterator next = frames.begin();
+  size_t pending = 0;
+
+  for (;;)
+  {
+    while (next != frames.end() &&
+           pending < lookahead)
+    {
+      const char* data = NULL;
+      size_t size = 0;
+      source.GetFrame(data, size, *next);
+      batch.Add(new TranscodeFrameJob(transcoder, instanceId, targetUid, useCache, *next, data, size));
+      ++next;
+      pending++;
+    }
+
+    std::auto_ptr<OrthancPlugins::WorkerPool::IJob> job(batch.Dequeue());
+    if (job.get() == NULL)
+    {
+      return true;
+    }
+
+    pending--;
+
+    const TranscodeFrameJob& transcoded = dynamic_cast<const TranscodeFrameJob&>(*job);
+    AnswerSingleFrame(output, wadoUrl, transcoded.GetTarget().c_str(),
+                      transcoded.GetTarget().size(), transcoded.GetFrame());
+  }
+}
+
+
+
+static bool IsCompatibleSyntax(const gdcm::TransferSyntax& source,
+                               const gdcm::TransferSyntax& target)
+{
+  return (source == target ||
+          (target == gdcm::TransferSyntax::ImplicitVRLittleEndian &&
+           source == gdcm::TransferSyntax::ExplicitVRLittleEndian));
+}
+
+
+
+static bool LoadFrameIndex(OrthancPlugins::FrameIndex& index,
+                           const std::string& uri)
+{
+  OrthancPlugins::MemoryBuffer attachment(OrthancPlugins::Configuration::GetContext());
+  return (OrthancPlugins::MeasuredRestApiGet(attachment, uri + "/attachments/" + frameIndexAttachment_ + "/data", false) &&
+          index.Unserialize(std::string(attachment.GetData(), attachment.GetSize())));
+}
+
+
+static void StoreFrameIndex(const OrthancPlugins::FrameIndex& index,
+                            const std::string& uri)
+{
+  std::string body;
+  index.Serialize(body);
+
+  OrthancPlugins::MemoryBuffer answer(OrthancPlugins::Configuration::GetContext());
+  if (!OrthancPlugins::MeasuredRestApiPut(answer, uri + "/attachments/" + frameIndexAttachment_, body, false))
+  {
+    OrthancPlugins::Configuration::LogWarning("Cannot store the frame index of " + uri);
+  }
+}
+
+
+void EnableFrameIndex(unsigned int attachment)
+{
+  // Cf. "IsUserContentType()" in the Orthanc core
+  if (attachment < 1024 ||
+      attachment > 65535)
+  {
+    OrthancPlugins::Configuration::LogError("The attachment for the frame index must be "
+                                            "between 1024 and 65535: " +
+                                            boost::lexical_cast<std::string>(attachment));
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  frameIndexAttachment_ = boost::lexical_cast<std::string>(attachment);
+}
+
+
+
 void RetrieveFrames(OrthancPluginRestOutput* output,
                     const char* url,
                     const OrthancPluginHttpRequest* request)
@@ -470,97 +978,190 @@ void RetrieveFrames(OrthancPluginRestOutput* output,
   std::list<unsigned int> frames;
   ParseFrameList(frames, request);
 
-  Json::Value header;
   std::string uri;
-  OrthancPlugins::MemoryBuffer content(context);
-  if (LocateInstance(output, uri, request) &&
-      content.RestApiGet(uri + "/file", false) &&
-      OrthancPlugins::RestApiGet(header, context, uri + "/header?simplify", false))
+  if (!LocateInstance(output, uri, request))
   {
-    {
-      std::string s = "DICOMweb RetrieveFrames on " + uri + ", frames: ";
-      for (std::list<unsigned int>::const_iterator 
-             frame = frames.begin(); frame != frames.end(); ++frame)
-      {
-        s += boost::lexical_cast<std::string>(*frame + 1) + " ";
-      }
+    return;
+  }
 
-      OrthancPlugins::Configuration::LogInfo(s);
+  {
+    std::string s = "DICOMweb RetrieveFrames on " + uri + ", frames: ";
+    for (std::list<unsigned int>::const_iterator 
+           frame = frames.begin(); frame != frames.end(); ++frame)
+    {
+      s += boost::lexical_cast<std::string>(*frame + 1) + " ";
     }
 
-    std::auto_ptr<OrthancPlugins::ParsedDicomFile> source;
+    OrthancPlugins::Configuration::LogInfo(s);
+  }
+
+  // The identifier of the instance is the last component of its URI
+  const std::string instanceId = uri.substr(uri.rfind('/') + 1);
+
+  OrthancPlugins::SeriesPrefetcher& prefetcher = OrthancPlugins::SeriesPrefetcher::GetInstance();
+  const bool usePrefetcher = prefetcher.IsEnabled();
+
+  if (usePrefetcher)
+  {
+    // Warm up the cache with the next instances of the series
+    OrthancPlugins::IdentifiersCache::Instance instance;
+    if (OrthancPlugins::IdentifiersCache::GetInstance().LocateInstance(instance, request->groups[2]))
+    {
+      prefetcher.SignalInstance(OrthancPlugins::SeriesPrefetcher::GetClient(request),
+                                instance.seriesId_, instanceId);
+    }
+  }
 
-    gdcm::TransferSyntax sourceSyntax;
+  // "LocateInstance()" has checked the study and the series
+  const std::string wadoUrl = OrthancPlugins::Configuration::GetWadoUrl(
+    OrthancPlugins::Configuration::GetBaseUrl(request),
+    request->groups[0], request->groups[1], request->groups[2]);
+
+  /**
+   * The frame index gives the transfer syntax and the location of
+   * the frames, which avoids parsing the DICOM file. The plugin SDK
+   * cannot read a range of an attachment, so the full file is still
+   * downloaded from the Orthanc core.
+   **/
+  OrthancPlugins::FrameIndex index;
+  bool hasIndex = (!frameIndexAttachment_.empty() &&
+                   LoadFrameIndex(index, uri));
+
+  gdcm::TransferSyntax sourceSyntax;
+  bool hasSourceSyntax = false;
+
+  if (hasIndex)
+  {
+    sourceSyntax = gdcm::TransferSyntax::GetTSType(index.GetTransferSyntax().c_str());
+    hasSourceSyntax = true;
+  }
+  else
+  {
+    Json::Value header;
+    if (!OrthancPlugins::MeasuredRestApiGet(header, context, uri + "/header?simplify", false))
+    {
+      return;
+    }
 
     if (header.type() == Json::objectValue &&
         header.isMember("TransferSyntaxUID"))
     {
       sourceSyntax = gdcm::TransferSyntax::GetTSType(header["TransferSyntaxUID"].asCString());
+      hasSourceSyntax = true;
     }
-    else
+  }
+
+  const std::string targetUid = targetSyntax.GetString();
+  const bool useCache = OrthancPlugins::FrameCache::GetInstance().IsEnabled();
+
+  if (useCache &&
+      hasSourceSyntax &&
+      !IsCompatibleSyntax(sourceSyntax, targetSyntax))
+  {
+    if (frames.empty() &&
+        hasIndex)
     {
-      source.reset(new OrthancPlugins::ParsedDicomFile(content));
-      sourceSyntax = source->GetFile().GetHeader().GetDataSetTransferSyntax();
+      CheckFrameList(frames, index.GetFramesCount());
     }
 
-    if (sourceSyntax == targetSyntax ||
-        (targetSyntax == gdcm::TransferSyntax::ImplicitVRLittleEndian &&
-         sourceSyntax == gdcm::TransferSyntax::ExplicitVRLittleEndian))
+    // Serve the transcoded frames from the cache, if all of them are
+    // available, without even downloading the DICOM file
+    CachedFrames cached;
+    if (!frames.empty() &&
+        cached.Load(instanceId, targetUid, frames))
     {
-      // No need to change the transfer syntax
+      AnswerFrames(output, wadoUrl, cached, targetSyntax, frames);
+      return;
+    }
+  }
 
-      if (source.get() == NULL)
-      {
-        source.reset(new OrthancPlugins::ParsedDicomFile(content));
-      }
+  OrthancPlugins::MemoryBuffer content(context);
+  OrthancPlugins::SeriesPrefetcher::Content prefetched;
 
-      AnswerFrames(output, request, *source, targetSyntax, frames);
+  if (usePrefetcher &&
+      prefetcher.Lookup(prefetched, instanceId))
+  {
+    // The DICOM file was prefetched in background
+  }
+  else if (!OrthancPlugins::MeasuredRestApiGet(content, uri + "/file", false))
+  {
+    return;
+  }
+
+  const char* data = (prefetched.get() != NULL ? prefetched->c_str() : content.GetData());
+  const size_t size = (prefetched.get() != NULL ? prefetched->size() : content.GetSize());
+
+  if (!frameIndexAttachment_.empty() &&
+      !hasIndex &&
+      index.Compute(*dictionary_, data, size))
+  {
+    // Not computed yet, or stored with a former version of the plugin
+    StoreFrameIndex(index, uri);
+    hasIndex = true;
+  }
+
+  std::auto_ptr<OrthancPlugins::ParsedDicomFile> source;
+
+  if (!hasSourceSyntax)
+  {
+    source.reset(new OrthancPlugins::ParsedDicomFile(data, size));
+    sourceSyntax = source->GetFile().GetHeader().GetDataSetTransferSyntax();
+  }
+
+  if (IsCompatibleSyntax(sourceSyntax, targetSyntax))
+  {
+    // No need to change the transfer syntax
+
+    if (hasIndex)
+    {
+      IndexedFrames indexed(index, data, size);
+      AnswerFrames(output, wadoUrl, indexed, targetSyntax, frames);
     }
     else
     {
-      // Need to convert the transfer syntax
-
+      if (source.get() == NULL)
       {
-        OrthancPlugins::Configuration::LogInfo("DICOMweb RetrieveFrames: Transcoding " + uri + 
-                                               " from transfer syntax " + std::string(sourceSyntax.GetString()) + 
-                                               " to " + std::string(targetSyntax.GetString()));
+        source.reset(new OrthancPlugins::ParsedDicomFile(data, size));
       }
 
-      gdcm::ImageChangeTransferSyntax change;
-      change.SetTransferSyntax(targetSyntax);
-
-      // TODO Avoid this unnecessary memcpy by defining a stream over the MemoryBuffer
-      std::string dicom(content.GetData(), content.GetData() + content.GetSize());
-      std::stringstream stream(dicom);
+      ParsedFrames parsed(*source);
+      AnswerFrames(output, wadoUrl, parsed, targetSyntax, frames);
+    }
+  }
+  else
+  {
+    // Need to convert the transfer syntax
 
-      gdcm::ImageReader reader;
-      reader.SetStream(stream);
-      if (!reader.Read())
-      {
-        OrthancPlugins::Configuration::LogError("Cannot decode the image");
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
-      }
+    {
+      OrthancPlugins::Configuration::LogInfo("DICOMweb RetrieveFrames: Transcoding " + uri + 
+                                             " from transfer syntax " + std::string(sourceSyntax.GetString()) + 
+                                             " to " + std::string(targetSyntax.GetString()));
+    }
 
-      change.SetInput(reader.GetImage());
-      if (!change.Change())
-      {
-        OrthancPlugins::Configuration::LogError("Cannot change the transfer syntax of the image");
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
-      }
+    std::auto_ptr<IFrameSource> frameSource;
+    std::auto_ptr<OrthancPlugins::ParsedDicomFile> header;
 
-      gdcm::ImageWriter writer;
-      writer.SetImage(change.GetOutput());
-      writer.SetFile(reader.GetFile());
-      
-      std::stringstream ss;
-      writer.SetStream(ss);
-      if (!writer.Write())
+    if (hasIndex)
+    {
+      // Only parse the header to get the format of the pixels
+      frameSource.reset(new IndexedFrames(index, data, size));
+      header.reset(new OrthancPlugins::ParsedDicomFile(data, size, OrthancPlugins::DICOM_TAG_PIXEL_DATA));
+    }
+    else
+    {
+      if (source.get() == NULL)
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory);
+        source.reset(new OrthancPlugins::ParsedDicomFile(data, size));
       }
 
-      OrthancPlugins::ParsedDicomFile transcoded(ss.str());
-      AnswerFrames(output, request, transcoded, targetSyntax, frames);
+      frameSource.reset(new ParsedFrames(*source));
     }
-  }    
+
+    FrameTranscoder transcoder(header.get() != NULL ? *header : *source, sourceSyntax, targetSyntax);
+
+    // Only the requested frames are decoded, and each of them is sent
+    // as soon as it is transcoded
+    AnswerTranscodedFrames(output, wadoUrl, *frameSource, transcoder,
+                           instanceId, targetSyntax, useCache, frames);
+  }
 }
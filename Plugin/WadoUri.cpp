@@ -20,40 +20,21 @@
 
 
 #include "WadoUri.h"
+#include "Metrics.h"
 #include "Plugin.h"
 
 #include "Configuration.h"
+#include "IdentifiersCache.h"
+#include "WadoRs.h"
 
 #include <string>
-
-
-static bool MapWadoToOrthancIdentifier(std::string& orthanc,
-                                       char* (*func) (OrthancPluginContext*, const char*),
-                                       const std::string& dicom)
-{
-  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
-
-  char* tmp = func(context, dicom.c_str());
-
-  if (tmp)
-  {
-    orthanc = tmp;
-    OrthancPluginFreeString(context, tmp);
-    return true;
-  }
-  else
-  {
-    return false;
-  }
-}
+#include <boost/lexical_cast.hpp>
 
 
 static bool LocateInstance(std::string& instance,
                            std::string& contentType,
                            const OrthancPluginHttpRequest* request)
 {
-  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
-
   std::string requestType, studyUid, seriesUid, objectUid;
 
   for (uint32_t i = 0; i < request->getCount; i++)
@@ -95,55 +76,32 @@ static bool LocateInstance(std::string& instance,
     return false;
   }
 
-  if (!MapWadoToOrthancIdentifier(instance, OrthancPluginLookupInstance, objectUid))
+  OrthancPlugins::IdentifiersCache::Instance located;
+  if (!OrthancPlugins::IdentifiersCache::GetInstance().LocateInstance(located, objectUid))
   {
     OrthancPlugins::Configuration::LogError("WADO-URI: No such SOPInstanceUID in Orthanc: \"" + objectUid + "\"");
     return false;
   }
 
+  instance = located.instanceId_;
+
   /**
    * Below are only sanity checks to ensure that the possibly provided
    * "seriesUID" and "studyUID" match that of the provided instance.
    **/
 
-  if (!seriesUid.empty())
+  if (!seriesUid.empty() &&
+      located.seriesUid_ != seriesUid)
   {
-    std::string series;
-    if (!MapWadoToOrthancIdentifier(series, OrthancPluginLookupSeries, seriesUid))
-    {
-      OrthancPlugins::Configuration::LogError("WADO-URI: No such SeriesInstanceUID in Orthanc: \"" + seriesUid + "\"");
-      return false;
-    }
-    else
-    {
-      Json::Value info;
-      if (!OrthancPlugins::RestApiGet(info, context, "/instances/" + instance + "/series", false) ||
-          info["MainDicomTags"]["SeriesInstanceUID"] != seriesUid)
-      {
-        OrthancPlugins::Configuration::LogError("WADO-URI: Instance " + objectUid + " does not belong to series " + seriesUid);
-        return false;
-      }
-    }
+    OrthancPlugins::Configuration::LogError("WADO-URI: Instance " + objectUid + " does not belong to series " + seriesUid);
+    return false;
   }
   
-  if (!studyUid.empty())
+  if (!studyUid.empty() &&
+      located.studyUid_ != studyUid)
   {
-    std::string study;
-    if (!MapWadoToOrthancIdentifier(study, OrthancPluginLookupStudy, studyUid))
-    {
-      OrthancPlugins::Configuration::LogError("WADO-URI: No such StudyInstanceUID in Orthanc: \"" + studyUid + "\"");
-      return false;
-    }
-    else
-    {
-      Json::Value info;
-      if (!OrthancPlugins::RestApiGet(info, context, "/instances/" + instance + "/study", false) ||
-          info["MainDicomTags"]["StudyInstanceUID"] != studyUid)
-      {
-        OrthancPlugins::Configuration::LogError("WADO-URI: Instance " + objectUid + " does not belong to study " + studyUid);
-        return false;
-      }
-    }
+    OrthancPlugins::Configuration::LogError("WADO-URI: Instance " + objectUid + " does not belong to study " + studyUid);
+    return false;
   }
   
   return true;
@@ -158,9 +116,9 @@ static void AnswerDicom(OrthancPluginRestOutput* output,
   std::string uri = "/instances/" + instance + "/file";
 
   OrthancPlugins::MemoryBuffer dicom(context);
-  if (dicom.RestApiGet(uri, false))
+  if (OrthancPlugins::MeasuredRestApiGet(dicom, uri, false))
   {
-    OrthancPluginAnswerBuffer(context, output, 
+    OrthancPlugins::MeasuredAnswerBuffer(context, output, 
                               dicom.GetData(), dicom.GetSize(), "application/dicom");
   }
   else
@@ -171,56 +129,112 @@ static void AnswerDicom(OrthancPluginRestOutput* output,
 }
 
 
-static bool RetrievePngPreview(OrthancPlugins::MemoryBuffer& png,
-                               const std::string& instance)
+static unsigned int GetUnsignedArgument(const std::string& key,
+                                        const std::string& value)
 {
-  std::string uri = "/instances/" + instance + "/preview";
-
-  if (png.RestApiGet(uri, true))
+  try
   {
-    return true;
+    return boost::lexical_cast<unsigned int>(value);
   }
-  else
+  catch (boost::bad_lexical_cast&)
   {
-    OrthancPlugins::Configuration::LogError("WADO-URI: Unable to generate a preview image for " + uri);
-    return false;
+    OrthancPlugins::Configuration::LogError("WADO-URI: Bad value for \"" + key + "\": " + value);
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest);
   }
 }
 
 
-static void AnswerPngPreview(OrthancPluginRestOutput* output,
-                             const std::string& instance)
+static float GetFloatArgument(const std::string& key,
+                              const std::string& value)
 {
-  OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
-
-  OrthancPlugins::MemoryBuffer png(context);
-  if (RetrievePngPreview(png, instance))
+  try
   {
-    OrthancPluginAnswerBuffer(context, output, 
-                              png.GetData(), png.GetSize(), "image/png");
+    return boost::lexical_cast<float>(value);
   }
-  else
+  catch (boost::bad_lexical_cast&)
   {
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_Plugin);
+    OrthancPlugins::Configuration::LogError("WADO-URI: Bad value for \"" + key + "\": " + value);
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest);
   }
 }
 
 
-static void AnswerJpegPreview(OrthancPluginRestOutput* output,
-                              const std::string& instance)
+static void AnswerRendered(OrthancPluginRestOutput* output,
+                           const std::string& instance,
+                           const OrthancPluginHttpRequest* request,
+                           bool isPng)
 {
+  OrthancPlugins::RenderingParameters parameters;
+  parameters.SetPng(isPng);
+
+  unsigned int rows = 0, columns = 0, frame = 0;
+  std::string windowCenter, windowWidth;
+
+  for (uint32_t i = 0; i < request->getCount; i++)
+  {
+    std::string key(request->getKeys[i]);
+    std::string value(request->getValues[i]);
+
+    if (key == "rows")
+    {
+      rows = GetUnsignedArgument(key, value);
+    }
+    else if (key == "columns")
+    {
+      columns = GetUnsignedArgument(key, value);
+    }
+    else if (key == "imageQuality" &&
+             !isPng)
+    {
+      parameters.SetQuality(GetUnsignedArgument(key, value));
+    }
+    else if (key == "frameNumber")
+    {
+      frame = GetUnsignedArgument(key, value);
+      if (frame == 0)
+      {
+        OrthancPlugins::Configuration::LogError("WADO-URI: Invalid frame number (must be > 0): " + value);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      frame -= 1;
+    }
+    else if (key == "windowCenter")
+    {
+      windowCenter = value;
+    }
+    else if (key == "windowWidth")
+    {
+      windowWidth = value;
+    }
+  }
+
+  // "rows" and "columns" are upper bounds on the size of the image
+  if (rows != 0 ||
+      columns != 0)
+  {
+    parameters.SetViewport(columns, rows);
+  }
+
+  if (!windowCenter.empty() &&
+      !windowWidth.empty())
+  {
+    parameters.SetWindowing(GetFloatArgument("windowCenter", windowCenter),
+                            GetFloatArgument("windowWidth", windowWidth));
+  }
+
   OrthancPluginContext* context = OrthancPlugins::Configuration::GetContext();
 
-  // Retrieve the preview in the PNG format
-  OrthancPlugins::MemoryBuffer png(context);
-  if (!RetrievePngPreview(png, instance))
+  std::string image;
+  if (RenderInstanceFrame(image, instance, frame, parameters))
   {
+    OrthancPlugins::MeasuredAnswerBuffer(context, output, image.c_str(), image.size(), parameters.GetMimeType());
+  }
+  else
+  {
+    OrthancPlugins::Configuration::LogError("WADO-URI: Unable to render instance " + instance);
     throw Orthanc::OrthancException(Orthanc::ErrorCode_Plugin);
   }
-  
-  OrthancPlugins::OrthancImage image(context);
-  image.UncompressPngImage(png.GetData(), png.GetSize());
-  image.AnswerJpegImage(output, 90 /* quality */);
 }
 
 
@@ -247,12 +261,12 @@ void WadoUriCallback(OrthancPluginRestOutput* output,
   }
   else if (contentType == "image/png")
   {
-    AnswerPngPreview(output, instance);
+    AnswerRendered(output, instance, request, true);
   }
   else if (contentType == "image/jpeg" ||
            contentType == "image/jpg")
   {
-    AnswerJpegPreview(output, instance);
+    AnswerRendered(output, instance, request, false);
   }
   else
   {
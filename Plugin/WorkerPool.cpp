@@ -0,0 +1,290 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "WorkerPool.h"
+
+#include <Core/OrthancException.h>
+
+#include <memory>
+
+namespace OrthancPlugins
+{
+  void WorkerPool::Batch::SubmitInternal()
+  {
+    // The mutex of the pool must be locked by the caller
+    bool submitted = false;
+
+    while (nextSubmitted_ < jobs_.size() &&
+           nextSubmitted_ < nextConsumed_ + lookahead_)
+    {
+      Task task;
+      task.batch_ = this;
+      task.index_ = nextSubmitted_++;
+      pool_.queue_.push_back(task);
+      submitted = true;
+    }
+
+    if (submitted)
+    {
+      pool_.taskAvailable_.notify_all();
+    }
+  }
+
+
+  WorkerPool::Batch::Batch(WorkerPool& pool,
+                           size_t lookahead) :
+    pool_(pool),
+    request_(Metrics::GetCurrentRequest()),
+    lookahead_(lookahead == 0 ? 1 : lookahead),
+    nextSubmitted_(0),
+    nextConsumed_(0),
+    running_(0)
+  {
+    boost::mutex::scoped_lock lock(pool_.mutex_);
+    sequential_ = pool_.threads_.empty();
+  }
+
+
+  WorkerPool::Batch::~Batch()
+  {
+    {
+      boost::mutex::scoped_lock lock(pool_.mutex_);
+
+      // Cancel the jobs of this batch that are still queued
+      std::deque<Task> queue;
+      for (std::deque<Task>::const_iterator it = pool_.queue_.begin(); it != pool_.queue_.end(); ++it)
+      {
+        if (it->batch_ != this)
+        {
+          queue.push_back(*it);
+        }
+      }
+
+      pool_.queue_.swap(queue);
+
+      // Wait for the running jobs, as they belong to this batch
+      while (running_ > 0)
+      {
+        pool_.taskFinished_.wait(lock);
+      }
+    }
+
+    // The jobs that were not consumed are still owned by the batch
+    for (size_t i = nextConsumed_; i < jobs_.size(); i++)
+    {
+      delete jobs_[i];
+    }
+  }
+
+
+  void WorkerPool::Batch::Add(IJob* job)
+  {
+    if (job == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+    }
+
+    boost::mutex::scoped_lock lock(pool_.mutex_);
+    jobs_.push_back(job);
+    status_.push_back(Status_Pending);
+    errors_.push_back(Orthanc::ErrorCode_Success);
+
+    if (!sequential_)
+    {
+      SubmitInternal();
+    }
+  }
+
+
+  WorkerPool::IJob* WorkerPool::Batch::Dequeue()
+  {
+    std::auto_ptr<IJob> job;
+    Orthanc::ErrorCode error;
+
+    {
+      boost::mutex::scoped_lock lock(pool_.mutex_);
+
+      if (nextConsumed_ == jobs_.size())
+      {
+        return NULL;
+      }
+
+      if (sequential_)
+      {
+        // Sequential mode: Execute the job in the calling thread
+        job.reset(jobs_[nextConsumed_]);
+        nextConsumed_++;
+        nextSubmitted_ = nextConsumed_;
+        lock.unlock();
+
+        job->Execute();
+        return job.release();
+      }
+
+      while (!pool_.done_ &&
+             (status_[nextConsumed_] == Status_Pending ||
+              status_[nextConsumed_] == Status_Running))
+      {
+        pool_.taskFinished_.wait(lock);
+      }
+
+      if (status_[nextConsumed_] == Status_Pending ||
+          status_[nextConsumed_] == Status_Running)
+      {
+        // The pool was stopped before the job could be executed
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+
+      job.reset(jobs_[nextConsumed_]);
+      error = errors_[nextConsumed_];
+      nextConsumed_++;
+
+      // One slot has been released in the lookahead window
+      SubmitInternal();
+    }
+
+    if (error != Orthanc::ErrorCode_Success)
+    {
+      throw Orthanc::OrthancException(error);
+    }
+
+    return job.release();
+  }
+
+
+  void WorkerPool::Worker(WorkerPool* that)
+  {
+    for (;;)
+    {
+      Task task;
+      IJob* job = NULL;
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        while (!that->done_ &&
+               that->queue_.empty())
+        {
+          that->taskAvailable_.wait(lock);
+        }
+
+        if (that->done_)
+        {
+          return;
+        }
+
+        task = that->queue_.front();
+        that->queue_.pop_front();
+
+        job = task.batch_->jobs_[task.index_];
+        task.batch_->status_[task.index_] = Batch::Status_Running;
+        task.batch_->running_++;
+      }
+
+      Batch::Status status = Batch::Status_Success;
+      Orthanc::ErrorCode error = Orthanc::ErrorCode_Success;
+
+      try
+      {
+        Metrics::Scope scope(task.batch_->request_);
+        job->Execute();
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        status = Batch::Status_Failure;
+        error = e.GetErrorCode();
+      }
+      catch (...)
+      {
+        status = Batch::Status_Failure;
+        error = Orthanc::ErrorCode_InternalError;
+      }
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+        task.batch_->status_[task.index_] = status;
+        task.batch_->errors_[task.index_] = error;
+        task.batch_->running_--;
+      }
+
+      that->taskFinished_.notify_all();
+    }
+  }
+
+
+  WorkerPool& WorkerPool::GetInstance()
+  {
+    static WorkerPool singleton;
+    return singleton;
+  }
+
+
+  void WorkerPool::Start(size_t countThreads)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (!threads_.empty())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    done_ = false;
+
+    threads_.resize(countThreads);
+    for (size_t i = 0; i < countThreads; i++)
+    {
+      threads_[i] = new boost::thread(Worker, this);
+    }
+  }
+
+
+  void WorkerPool::Stop()
+  {
+    std::vector<boost::thread*> threads;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+      threads.swap(threads_);
+    }
+
+    taskAvailable_.notify_all();
+    taskFinished_.notify_all();
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+      if (threads[i]->joinable())
+      {
+        threads[i]->join();
+      }
+
+      delete threads[i];
+    }
+  }
+
+
+  size_t WorkerPool::GetThreadsCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return threads_.size();
+  }
+}
@@ -0,0 +1,117 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "ParallelPipeline.h"
+
+#include <deque>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+namespace OrthancPlugins
+{
+  // Pool of threads that is shared by all the HTTP requests, so that
+  // concurrent requests do not start more threads than configured.
+  // Each request submits its jobs through a "Batch", whose results
+  // are consumed in the order of submission. The jobs of the
+  // different batches are executed in first-come first-served order.
+  class WorkerPool : public boost::noncopyable
+  {
+  public:
+    typedef ParallelPipeline::IJob  IJob;
+
+    class Batch : public boost::noncopyable
+    {
+      friend class WorkerPool;
+
+    private:
+      enum Status
+      {
+        Status_Pending,
+        Status_Running,
+        Status_Success,
+        Status_Failure
+      };
+
+      WorkerPool&                      pool_;
+      Metrics::Request*                request_;  // The measures of the jobs are added to this request
+      bool                             sequential_;
+      size_t                           lookahead_;
+      std::vector<IJob*>               jobs_;
+      std::vector<Status>              status_;
+      std::vector<Orthanc::ErrorCode>  errors_;
+      size_t                           nextSubmitted_;
+      size_t                           nextConsumed_;
+      size_t                           running_;
+
+      void SubmitInternal();
+
+    public:
+      // At most "lookahead" jobs of this batch are queued in the pool,
+      // or executed but not consumed yet, which bounds the memory usage.
+      // If the pool has no thread, the jobs are executed sequentially
+      // by the consumer.
+      Batch(WorkerPool& pool,
+            size_t lookahead);
+
+      ~Batch();
+
+      // Takes the ownership of the job
+      void Add(IJob* job);
+
+      // Same semantics as "ParallelPipeline::Dequeue()"
+      IJob* Dequeue();
+    };
+
+  private:
+    struct Task
+    {
+      Batch*  batch_;
+      size_t  index_;
+    };
+
+    boost::mutex                 mutex_;
+    boost::condition_variable    taskAvailable_;
+    boost::condition_variable    taskFinished_;
+    std::deque<Task>             queue_;
+    std::vector<boost::thread*>  threads_;
+    bool                         done_;
+
+    static void Worker(WorkerPool* that);
+
+    WorkerPool() :  // Forbidden (singleton pattern)
+      done_(false)
+    {
+    }
+
+  public:
+    static WorkerPool& GetInstance();
+
+    void Start(size_t countThreads);
+
+    void Stop();
+
+    size_t GetThreadsCount();
+  };
+}
@@ -0,0 +1,115 @@
+#!/usr/bin/python
+
+# Orthanc - A Lightweight, RESTful DICOM Store
+# Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+# Department, University Hospital of Liege, Belgium
+# Copyright (C) 2017-2018 Osimis S.A., Belgium
+#
+# This program is free software: you can redistribute it and/or
+# modify it under the terms of the GNU Affero General Public License
+# as published by the Free Software Foundation, either version 3 of
+# the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Affero General Public License for more details.
+# 
+# You should have received a copy of the GNU Affero General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+
+# Load driver replaying QIDO-RS, WADO-RS metadata and WADO-RS frames
+# requests against a running Orthanc server with the DICOMweb
+# plugin. The latency statistics are printed as JSON.
+
+import json
+import sys
+import threading
+import time
+import requests
+
+if len(sys.argv) < 2 or len(sys.argv) > 4:
+    print('Usage: %s <Root> [Threads] [Requests per thread]' % sys.argv[0])
+    print('')
+    print('Example: %s http://localhost:8042/dicom-web/ 4 50' % sys.argv[0])
+    sys.exit(-1)
+
+ROOT = sys.argv[1].rstrip('/')
+THREADS = int(sys.argv[2]) if len(sys.argv) >= 3 else 4
+COUNT = int(sys.argv[3]) if len(sys.argv) >= 4 else 50
+
+def GetValue(item, tag):
+    return item[tag]['Value'][0]
+
+# Collect the instances that will be accessed by the load driver
+instances = []
+for study in requests.get('%s/studies' % ROOT).json():
+    uid = GetValue(study, '0020000D')
+    for series in requests.get('%s/studies/%s/series' % (ROOT, uid)).json():
+        for instance in requests.get('%s/studies/%s/series/%s/instances' % (ROOT, uid, GetValue(series, '0020000E'))).json():
+            instances.append((uid, GetValue(series, '0020000E'), GetValue(instance, '00080018')))
+
+if len(instances) == 0:
+    print('No instance is stored in the server')
+    sys.exit(-1)
+
+SCENARIOS = {
+    'QIDO-RS' : lambda uids: '%s/studies?StudyInstanceUID=%s' % (ROOT, uids[0]),
+    'Metadata' : lambda uids: '%s/studies/%s/series/%s/metadata' % (ROOT, uids[0], uids[1]),
+    'Frames' : lambda uids: '%s/studies/%s/series/%s/instances/%s/frames/1' % ((ROOT, ) + uids),
+}
+
+lock = threading.Lock()
+latencies = {}
+errors = {}
+
+def Worker(thread):
+    session = requests.Session()
+    for i in range(COUNT):
+        instance = instances[(thread * COUNT + i) % len(instances)]
+        for (name, scenario) in SCENARIOS.items():
+            start = time.time()
+            r = session.get(scenario(instance))
+            elapsed = time.time() - start
+            with lock:
+                if r.status_code == 200:
+                    latencies.setdefault(name, []).append(elapsed)
+                else:
+                    errors[name] = errors.get(name, 0) + 1
+
+start = time.time()
+threads = [ threading.Thread(target = Worker, args = (i, )) for i in range(THREADS) ]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+duration = time.time() - start
+
+def Quantile(values, q):
+    return values[min(len(values) - 1, int(q * len(values)))]
+
+result = {
+    'Threads' : THREADS,
+    'RequestsPerThread' : COUNT,
+    'DurationSeconds' : duration,
+    'Scenarios' : [],
+}
+
+for name in sorted(SCENARIOS.keys()):
+    values = sorted(latencies.get(name, []))
+    scenario = {
+        'Name' : name,
+        'Count' : len(values),
+        'Errors' : errors.get(name, 0),
+        'ThroughputPerSecond' : len(values) / duration,
+    }
+    if len(values) > 0:
+        scenario['MeanSeconds'] = sum(values) / len(values)
+        scenario['MedianSeconds'] = Quantile(values, 0.5)
+        scenario['P95Seconds'] = Quantile(values, 0.95)
+        scenario['P99Seconds'] = Quantile(values, 0.99)
+        scenario['MaxSeconds'] = values[-1]
+    result['Scenarios'].append(scenario)
+
+print(json.dumps(result, indent = 2))
@@ -0,0 +1,785 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2018 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+/**
+ * Micro-benchmarks of the hot paths of the DICOMweb plugin, run over
+ * synthetic datasets. The results are written as JSON, so that they
+ * can be compared between versions. Usage:
+ *
+ *   DicomWebBenchmarks [--iterations=N] [--elements=N] [--items=N]
+ *                      [--frames=N] [--parts=N] [--part-size=N]
+ *                      [--resources=N] [--fields=N] [--output=file]
+ **/
+
+#include <gdcmDataSet.h>
+#include <gdcmDicts.h>
+#include <gdcmGlobal.h>
+#include <gdcmItem.h>
+#include <gdcmSequenceOfItems.h>
+#include <gdcmWriter.h>
+
+#include "../Plugin/Configuration.h"
+#include "../Plugin/Dicom.h"
+#include "../Plugin/DictionaryTable.h"
+#include "../Plugin/FrameIndex.h"
+#include "../Plugin/ModuleMatcher.h"
+#include "../Plugin/PatternMatcher.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/lexical_cast.hpp>
+
+using namespace OrthancPlugins;
+
+OrthancPluginContext* context_ = NULL;
+
+
+namespace
+{
+  struct Parameters
+  {
+    unsigned int  iterations_;
+    unsigned int  elements_;   // Number of string elements in the synthetic dataset
+    unsigned int  items_;      // Number of items of the synthetic sequence
+    unsigned int  frames_;     // Number of 256x256 frames of the synthetic instance
+    unsigned int  parts_;      // Number of parts of the synthetic multipart body
+    unsigned int  partSize_;   // Size of each part, in bytes
+    unsigned int  resources_;  // Number of resources matched by QIDO-RS
+    unsigned int  fields_;     // Number of fields included in the QIDO-RS answers
+
+    Parameters() :
+      iterations_(20),
+      elements_(500),
+      items_(50),
+      frames_(100),
+      parts_(100),
+      partSize_(512 * 1024),
+      resources_(100),
+      fields_(20)
+    {
+    }
+  };
+
+
+  // Minimal replacement for the Orthanc core, that only provides the
+  // services that are used outside of the REST API: The logs are
+  // discarded, and the configuration is empty
+  OrthancPluginErrorCode InvokeService(OrthancPluginContext* context,
+                                       _OrthancPluginService service,
+                                       const void* params)
+  {
+    switch (service)
+    {
+      case _OrthancPluginService_LogInfo:
+      case _OrthancPluginService_LogWarning:
+      case _OrthancPluginService_LogError:
+        return OrthancPluginErrorCode_Success;
+
+      case _OrthancPluginService_GetConfiguration:
+      {
+        const _OrthancPluginRetrieveDynamicString& p =
+          *reinterpret_cast<const _OrthancPluginRetrieveDynamicString*>(params);
+        *p.result = strdup("{}");
+        return (*p.result == NULL ? OrthancPluginErrorCode_NotEnoughMemory : OrthancPluginErrorCode_Success);
+      }
+
+      default:
+        return OrthancPluginErrorCode_NotImplemented;
+    }
+  }
+
+
+  void FreeBuffer(void* buffer)
+  {
+    free(buffer);
+  }
+
+
+  class IBenchmark : public boost::noncopyable
+  {
+  public:
+    virtual ~IBenchmark()
+    {
+    }
+
+    virtual const char* GetName() const = 0;
+
+    // Returns the number of bytes that were processed
+    virtual size_t Run() = 0;
+  };
+
+
+  void AddStringElement(gdcm::DataSet& target,
+                        const gdcm::Tag& tag,
+                        const gdcm::VR& vr,
+                        const std::string& value)
+  {
+    gdcm::DataElement element(tag);
+    element.SetVR(vr);
+
+    // The values of even length are padded as required by DICOM
+    std::string padded = value;
+    if (padded.size() % 2 != 0)
+    {
+      padded.push_back(vr == gdcm::VR::UI ? '\0' : ' ');
+    }
+
+    element.SetByteValue(padded.c_str(), static_cast<uint32_t>(padded.size()));
+    target.Insert(element);
+  }
+
+
+  void AddUnsignedShortElement(gdcm::DataSet& target,
+                               const gdcm::Tag& tag,
+                               uint16_t value)
+  {
+    const char bytes[2] = {
+      static_cast<char>(value & 0xff),
+      static_cast<char>(value >> 8)
+    };
+
+    gdcm::DataElement element(tag);
+    element.SetVR(gdcm::VR::US);
+    element.SetByteValue(bytes, 2);
+    target.Insert(element);
+  }
+
+
+  // Secondary capture instance with "elements" private string
+  // elements, a sequence of "items" items, and "frames" frames of
+  // 256x256 pixels on 8 bits (possibly none)
+  void CreateDataset(gdcm::DataSet& target,
+                     const Parameters& parameters,
+                     unsigned int frames)
+  {
+    AddStringElement(target, gdcm::Tag(0x0008, 0x0016), gdcm::VR::UI, "1.2.840.10008.5.1.4.1.1.7");
+    AddStringElement(target, gdcm::Tag(0x0008, 0x0018), gdcm::VR::UI, "1.2.3.4.5.6.7");
+    AddStringElement(target, gdcm::Tag(0x0008, 0x0060), gdcm::VR::CS, "OT");
+    AddStringElement(target, gdcm::Tag(0x0010, 0x0010), gdcm::VR::PN, "BENCHMARK^PATIENT");
+    AddStringElement(target, gdcm::Tag(0x0010, 0x0020), gdcm::VR::LO, "BENCHMARK");
+    AddStringElement(target, gdcm::Tag(0x0020, 0x000d), gdcm::VR::UI, "1.2.3.4");
+    AddStringElement(target, gdcm::Tag(0x0020, 0x000e), gdcm::VR::UI, "1.2.3.4.5");
+
+    // Private elements, by blocks of 256 elements per odd group
+    for (unsigned int i = 0; i < parameters.elements_; i++)
+    {
+      const uint16_t group = static_cast<uint16_t>(0x0011 + 2 * (i / 256));
+      if (i % 256 == 0)
+      {
+        AddStringElement(target, gdcm::Tag(group, 0x0010), gdcm::VR::LO, "BENCHMARK");
+      }
+
+      AddStringElement(target, gdcm::Tag(group, static_cast<uint16_t>(0x1000 + i % 256)), gdcm::VR::LO,
+                       "Value " + boost::lexical_cast<std::string>(i));
+    }
+
+    if (parameters.items_ != 0)
+    {
+      // Referenced Series Sequence
+      gdcm::SmartPointer<gdcm::SequenceOfItems> sequence = new gdcm::SequenceOfItems;
+      sequence->SetLengthToUndefined();
+
+      for (unsigned int i = 0; i < parameters.items_; i++)
+      {
+        gdcm::Item item;
+        item.SetVLToUndefined();
+        AddStringElement(item.GetNestedDataSet(), gdcm::Tag(0x0020, 0x000e), gdcm::VR::UI,
+                         "1.2.3.4.5." + boost::lexical_cast<std::string>(i));
+        sequence->AddItem(item);
+      }
+
+      gdcm::DataElement element(gdcm::Tag(0x0008, 0x1115));
+      element.SetVR(gdcm::VR::SQ);
+      element.SetValue(*sequence);
+      element.SetVLToUndefined();
+      target.Insert(element);
+    }
+
+    if (frames != 0)
+    {
+      static const uint16_t SIZE = 256;
+
+      AddStringElement(target, gdcm::Tag(0x0028, 0x0004), gdcm::VR::CS, "MONOCHROME2");
+      AddStringElement(target, gdcm::Tag(0x0028, 0x0008), gdcm::VR::IS, boost::lexical_cast<std::string>(frames));
+      AddUnsignedShortElement(target, gdcm::Tag(0x0028, 0x0002), 1);  // Samples per Pixel
+      AddUnsignedShortElement(target, gdcm::Tag(0x0028, 0x0010), SIZE);  // Rows
+      AddUnsignedShortElement(target, gdcm::Tag(0x0028, 0x0011), SIZE);  // Columns
+      AddUnsignedShortElement(target, gdcm::Tag(0x0028, 0x0100), 8);  // Bits Allocated
+      AddUnsignedShortElement(target, gdcm::Tag(0x0028, 0x0101), 8);  // Bits Stored
+      AddUnsignedShortElement(target, gdcm::Tag(0x0028, 0x0102), 7);  // High Bit
+      AddUnsignedShortElement(target, gdcm::Tag(0x0028, 0x0103), 0);  // Pixel Representation
+
+      std::string pixels(static_cast<size_t>(frames) * SIZE * SIZE, '\0');
+      for (size_t i = 0; i < pixels.size(); i++)
+      {
+        pixels[i] = static_cast<char>(i % 251);
+      }
+
+      gdcm::DataElement element(DICOM_TAG_PIXEL_DATA);
+      element.SetVR(gdcm::VR::OB);
+      element.SetByteValue(pixels.c_str(), static_cast<uint32_t>(pixels.size()));
+      target.Insert(element);
+    }
+  }
+
+
+  void WriteDicomFile(std::string& target,
+                      const gdcm::DataSet& dataset)
+  {
+    std::ostringstream stream;
+
+    gdcm::Writer writer;
+    writer.SetStream(stream);
+    writer.GetFile().SetDataSet(dataset);
+    writer.GetFile().GetHeader().SetDataSetTransferSyntax(gdcm::TransferSyntax::ExplicitVRLittleEndian);
+    writer.SetCheckFileMetaInformation(true);
+
+    if (!writer.Write())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    target = stream.str();
+  }
+
+
+  class MultipartBenchmark : public IBenchmark
+  {
+  private:
+    class Handler : public IMultipartHandler
+    {
+    public:
+      size_t  count_;
+
+      Handler() : count_(0)
+      {
+      }
+
+      virtual bool HandlePart(const MultipartItem& item)
+      {
+        count_++;
+        return true;
+      }
+    };
+
+    std::string  boundary_;
+    std::string  body_;
+    size_t       parts_;
+
+  public:
+    explicit MultipartBenchmark(const Parameters& parameters) :
+      boundary_("0b4c4a4c-5e0f-4b34-a9e6-dbd6b3c1b5a9"),
+      parts_(parameters.parts_)
+    {
+      std::string part(parameters.partSize_, '\0');
+      for (size_t i = 0; i < part.size(); i++)
+      {
+        part[i] = static_cast<char>(i % 253);
+      }
+
+      for (size_t i = 0; i < parts_; i++)
+      {
+        body_ += ("--" + boundary_ + "\r\n"
+                  "Content-Type: application/dicom\r\n"
+                  "Content-Length: " + boost::lexical_cast<std::string>(part.size()) + "\r\n\r\n");
+        body_ += part;
+        body_ += "\r\n";
+      }
+
+      body_ += "--" + boundary_ + "--\r\n";
+    }
+
+    virtual const char* GetName() const
+    {
+      return "ParseMultipartBody";
+    }
+
+    virtual size_t Run()
+    {
+      Handler handler;
+      ParseMultipartBody(handler, NULL, body_.c_str(), body_.size(), boundary_);
+
+      if (handler.count_ != parts_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      return body_.size();
+    }
+  };
+
+
+  class PatternMatcherBenchmark : public IBenchmark
+  {
+  private:
+    PatternMatcher  matcher_;
+    std::string     buffer_;
+
+  public:
+    explicit PatternMatcherBenchmark(const Parameters& parameters) :
+      matcher_("\r\n--0b4c4a4c-5e0f-4b34-a9e6-dbd6b3c1b5a9")
+    {
+      buffer_.resize(static_cast<size_t>(parameters.parts_) * parameters.partSize_);
+      for (size_t i = 0; i < buffer_.size(); i++)
+      {
+        buffer_[i] = static_cast<char>(i % 253);
+      }
+
+      buffer_ += matcher_.GetPattern();
+    }
+
+    virtual const char* GetName() const
+    {
+      return "PatternMatcher";
+    }
+
+    virtual size_t Run()
+    {
+      const char* end = buffer_.c_str() + buffer_.size();
+      if (matcher_.Find(buffer_.c_str(), end) != end - matcher_.GetPattern().size())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      return buffer_.size();
+    }
+  };
+
+
+  // Parsing of the arguments of a QIDO-RS request, then extraction of
+  // the returned fields from the Orthanc JSON of each resource
+  class ModuleMatcherBenchmark : public IBenchmark
+  {
+  private:
+    const gdcm::Dict&         dictionary_;
+    std::vector<std::string>  keys_;
+    std::vector<std::string>  values_;
+    std::vector<Json::Value>  resources_;
+    size_t                    size_;
+
+    static void AddTag(Json::Value& target,
+                       const gdcm::Tag& tag,
+                       const std::string& value)
+    {
+      Json::Value item = Json::objectValue;
+      item["Name"] = "";
+      item["Type"] = "String";
+      item["Value"] = value;
+      target[FormatOrthancTag(tag)] = item;
+    }
+
+  public:
+    ModuleMatcherBenchmark(const gdcm::Dict& dictionary,
+                           const Parameters& parameters) :
+      dictionary_(dictionary),
+      size_(0)
+    {
+      keys_.push_back("PatientName");
+      values_.push_back("BENCHMARK*");
+      keys_.push_back("Modality");
+      values_.push_back("OT");
+
+      // The included fields are the first private elements
+      const unsigned int countFields = std::min(parameters.fields_, parameters.elements_);
+      for (unsigned int i = 0; i < countFields; i++)
+      {
+        char tag[16];
+        sprintf(tag, "%04X%04X", 0x0011 + 2 * (i / 256), 0x1000 + i % 256);
+        keys_.push_back("includefield");
+        values_.push_back(tag);
+      }
+
+      Json::FastWriter writer;
+      resources_.resize(parameters.resources_);
+
+      for (size_t i = 0; i < resources_.size(); i++)
+      {
+        const std::string suffix = boost::lexical_cast<std::string>(i);
+
+        Json::Value& resource = resources_[i];
+        resource = Json::objectValue;
+        AddTag(resource, gdcm::Tag(0x0008, 0x0016), "1.2.840.10008.5.1.4.1.1.7");
+        AddTag(resource, gdcm::Tag(0x0008, 0x0018), "1.2.3.4.5.6." + suffix);
+        AddTag(resource, gdcm::Tag(0x0008, 0x0060), "OT");
+        AddTag(resource, gdcm::Tag(0x0010, 0x0010), "BENCHMARK^PATIENT");
+        AddTag(resource, gdcm::Tag(0x0010, 0x0020), "BENCHMARK");
+        AddTag(resource, gdcm::Tag(0x0020, 0x000d), "1.2.3.4");
+        AddTag(resource, gdcm::Tag(0x0020, 0x000e), "1.2.3.4.5");
+        AddTag(resource, gdcm::Tag(0x0020, 0x0013), suffix);
+
+        for (unsigned int j = 0; j < parameters.elements_; j++)
+        {
+          AddTag(resource, gdcm::Tag(0x0011 + 2 * (j / 256), 0x1000 + j % 256),
+                 "Value " + boost::lexical_cast<std::string>(j));
+        }
+
+        size_ += writer.write(resource).size();
+      }
+    }
+
+    virtual const char* GetName() const
+    {
+      return "ModuleMatcher";
+    }
+
+    virtual size_t Run()
+    {
+      std::vector<const char*> keys(keys_.size()), values(values_.size());
+      for (size_t i = 0; i < keys_.size(); i++)
+      {
+        keys[i] = keys_[i].c_str();
+        values[i] = values_[i].c_str();
+      }
+
+      OrthancPluginHttpRequest request;
+      memset(&request, 0, sizeof(request));
+      request.method = OrthancPluginHttpMethod_Get;
+      request.getCount = static_cast<uint32_t>(keys.size());
+      request.getKeys = keys.empty() ? NULL : &keys[0];
+      request.getValues = values.empty() ? NULL : &values[0];
+
+      ModuleMatcher matcher(dictionary_, &request);
+
+      for (size_t i = 0; i < resources_.size(); i++)
+      {
+        Json::Value fields;
+        matcher.ExtractFields(fields, resources_[i], "http://localhost/dicom-web/", QueryLevel_Instance);
+
+        if (fields.size() < keys_.size())
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+      }
+
+      return size_;
+    }
+  };
+
+
+  class AnswerBenchmark : public IBenchmark
+  {
+  private:
+    const gdcm::Dict&  dictionary_;
+    gdcm::DataSet      dataset_;
+    bool               isXml_;
+
+  public:
+    AnswerBenchmark(const gdcm::Dict& dictionary,
+                    const Parameters& parameters,
+                    bool isXml) :
+      dictionary_(dictionary),
+      isXml_(isXml)
+    {
+      CreateDataset(dataset_, parameters, 0);
+    }
+
+    virtual const char* GetName() const
+    {
+      return isXml_ ? "GenerateSingleDicomAnswer (XML)" : "GenerateSingleDicomAnswer (JSON)";
+    }
+
+    virtual size_t Run()
+    {
+      std::string answer;
+      GenerateSingleDicomAnswer(answer, "http://localhost/dicom-web/", dictionary_, dataset_, isXml_, true);
+      return answer.size();
+    }
+  };
+
+
+  class ParseBenchmark : public IBenchmark
+  {
+  private:
+    std::string  dicom_;
+
+  public:
+    explicit ParseBenchmark(const Parameters& parameters)
+    {
+      gdcm::DataSet dataset;
+      CreateDataset(dataset, parameters, parameters.frames_);
+      WriteDicomFile(dicom_, dataset);
+    }
+
+    virtual const char* GetName() const
+    {
+      return "ParsedDicomFile";
+    }
+
+    virtual size_t Run()
+    {
+      ParsedDicomFile dicom(dicom_);
+      return dicom_.size();
+    }
+  };
+
+
+  class FramesBenchmark : public IBenchmark
+  {
+  private:
+    const gdcm::Dict&  dictionary_;
+    std::string        dicom_;
+
+  public:
+    FramesBenchmark(const gdcm::Dict& dictionary,
+                    const Parameters& parameters) :
+      dictionary_(dictionary)
+    {
+      gdcm::DataSet dataset;
+      CreateDataset(dataset, parameters, std::max(1u, parameters.frames_));
+      WriteDicomFile(dicom_, dataset);
+    }
+
+    virtual const char* GetName() const
+    {
+      return "FrameIndex";
+    }
+
+    // Locates the frames in the instance, then extracts all of them
+    virtual size_t Run()
+    {
+      FrameIndex index;
+      if (!index.Compute(dictionary_, dicom_.c_str(), dicom_.size()))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      size_t total = 0;
+      std::string buffer;
+
+      for (size_t i = 0; i < index.GetFramesCount(); i++)
+      {
+        const char* data = NULL;
+        size_t size = 0;
+        index.GetFrame(data, size, buffer, dicom_.c_str(), dicom_.size(), i);
+        total += size;
+      }
+
+      return total;
+    }
+  };
+
+
+  void RunBenchmark(Json::Value& target,
+                    IBenchmark& benchmark,
+                    unsigned int iterations)
+  {
+    std::vector<double> durations;
+    durations.reserve(iterations);
+
+    size_t bytes = benchmark.Run();  // Warm-up
+
+    for (unsigned int i = 0; i < iterations; i++)
+    {
+      boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+      bytes = benchmark.Run();
+      boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - start;
+      durations.push_back(static_cast<double>(elapsed.total_microseconds()) / 1000000.0);
+    }
+
+    std::sort(durations.begin(), durations.end());
+
+    double sum = 0;
+    for (size_t i = 0; i < durations.size(); i++)
+    {
+      sum += durations[i];
+    }
+
+    Json::Value result = Json::objectValue;
+    result["Name"] = benchmark.GetName();
+    result["Iterations"] = iterations;
+    result["Bytes"] = static_cast<Json::UInt64>(bytes);
+
+    if (!durations.empty())
+    {
+      const double median = durations[durations.size() / 2];
+      result["MinSeconds"] = durations.front();
+      result["MedianSeconds"] = median;
+      result["MeanSeconds"] = sum / static_cast<double>(durations.size());
+      result["MaxSeconds"] = durations.back();
+
+      if (median > 0)
+      {
+        result["MegabytesPerSecond"] = static_cast<double>(bytes) / median / (1024.0 * 1024.0);
+      }
+    }
+
+    std::cerr << benchmark.GetName() << ": " << result["MedianSeconds"].asDouble() << " s" << std::endl;
+    target.append(result);
+  }
+
+
+  bool ParseArguments(Parameters& parameters,
+                      std::string& output,
+                      int argc,
+                      char** argv)
+  {
+    std::map<std::string, unsigned int*> options;
+    options["--iterations"] = &parameters.iterations_;
+    options["--elements"] = &parameters.elements_;
+    options["--items"] = &parameters.items_;
+    options["--frames"] = &parameters.frames_;
+    options["--parts"] = &parameters.parts_;
+    options["--part-size"] = &parameters.partSize_;
+    options["--resources"] = &parameters.resources_;
+    options["--fields"] = &parameters.fields_;
+
+    for (int i = 1; i < argc; i++)
+    {
+      const std::string argument(argv[i]);
+      const size_t equal = argument.find('=');
+
+      if (equal == std::string::npos)
+      {
+        return false;
+      }
+
+      const std::string key = argument.substr(0, equal);
+      const std::string value = argument.substr(equal + 1);
+
+      if (key == "--output")
+      {
+        output = value;
+        continue;
+      }
+
+      std::map<std::string, unsigned int*>::iterator found = options.find(key);
+      if (found == options.end())
+      {
+        return false;
+      }
+
+      try
+      {
+        *found->second = boost::lexical_cast<unsigned int>(value);
+      }
+      catch (boost::bad_lexical_cast&)
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+}
+
+
+int main(int argc, char** argv)
+{
+  Parameters parameters;
+  std::string output;
+
+  if (!ParseArguments(parameters, output, argc, argv))
+  {
+    std::cerr << "Usage: " << argv[0] << " [--iterations=N] [--elements=N] [--items=N] [--frames=N] "
+              << "[--parts=N] [--part-size=N] [--resources=N] [--fields=N] [--output=file]" << std::endl;
+    return -1;
+  }
+
+  try
+  {
+    OrthancPluginContext context;
+    context.pluginsManager = NULL;
+    context.orthancVersion = "mainline";
+    context.Free = FreeBuffer;
+    context.InvokeService = InvokeService;
+    Configuration::Initialize(&context);
+
+    const gdcm::Dict& dictionary = gdcm::Global::GetInstance().GetDicts().GetPublicDict();
+    DictionaryTable::GetInstance().Setup(dictionary);
+
+    Json::Value results = Json::objectValue;
+    results["Version"] = ORTHANC_DICOM_WEB_VERSION;
+    results["Parameters"]["Iterations"] = parameters.iterations_;
+    results["Parameters"]["Elements"] = parameters.elements_;
+    results["Parameters"]["Items"] = parameters.items_;
+    results["Parameters"]["Frames"] = parameters.frames_;
+    results["Parameters"]["Parts"] = parameters.parts_;
+    results["Parameters"]["PartSize"] = parameters.partSize_;
+    results["Parameters"]["Resources"] = parameters.resources_;
+    results["Parameters"]["Fields"] = parameters.fields_;
+    results["Benchmarks"] = Json::arrayValue;
+
+    {
+      MultipartBenchmark benchmark(parameters);
+      RunBenchmark(results["Benchmarks"], benchmark, parameters.iterations_);
+    }
+
+    {
+      PatternMatcherBenchmark benchmark(parameters);
+      RunBenchmark(results["Benchmarks"], benchmark, parameters.iterations_);
+    }
+
+    {
+      ModuleMatcherBenchmark benchmark(dictionary, parameters);
+      RunBenchmark(results["Benchmarks"], benchmark, parameters.iterations_);
+    }
+
+    {
+      AnswerBenchmark benchmark(dictionary, parameters, false);
+      RunBenchmark(results["Benchmarks"], benchmark, parameters.iterations_);
+    }
+
+    {
+      AnswerBenchmark benchmark(dictionary, parameters, true);
+      RunBenchmark(results["Benchmarks"], benchmark, parameters.iterations_);
+    }
+
+    {
+      ParseBenchmark benchmark(parameters);
+      RunBenchmark(results["Benchmarks"], benchmark, parameters.iterations_);
+    }
+
+    {
+      FramesBenchmark benchmark(dictionary, parameters);
+      RunBenchmark(results["Benchmarks"], benchmark, parameters.iterations_);
+    }
+
+    const std::string json = results.toStyledString();
+
+    if (output.empty())
+    {
+      std::cout << json;
+    }
+    else
+    {
+      std::ofstream f(output.c_str());
+      f << json;
+      if (!f.good())
+      {
+        std::cerr << "Cannot write to file: " << output << std::endl;
+        return -1;
+      }
+    }
+
+    return 0;
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    std::cerr << "Error in the benchmarks: " << e.What() << std::endl;
+    return -1;
+  }
+}
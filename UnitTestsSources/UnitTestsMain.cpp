@@ -21,9 +21,22 @@
 
 #include <gtest/gtest.h>
 #include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <cstring>
+#include <gdcmGlobal.h>
 
 #include "../Plugin/Configuration.h"
+#include "../Plugin/Dicom.h"
+#include "../Plugin/DictionaryTable.h"
+#include "../Plugin/FrameIndex.h"
+#include "../Plugin/HttpCompression.h"
+#include "../Plugin/MemoryBudget.h"
+#include "../Plugin/Metrics.h"
+#include "../Plugin/ParallelPipeline.h"
+#include "../Plugin/PatternMatcher.h"
 #include "../Plugin/Plugin.h"
+#include "../Plugin/Rendering.h"
+#include "../Plugin/WorkerPool.h"
 
 using namespace OrthancPlugins;
 
@@ -60,6 +73,657 @@ TEST(ContentType, Parse)
 }
 
 
+TEST(MemoryStreamBuffer, Seek)
+{
+  const std::string s = "0123456789";
+
+  MemoryStreamBuffer buffer(s.c_str(), s.size());
+  std::istream stream(&buffer);
+
+  char c[4];
+  ASSERT_TRUE(stream.read(c, 4));
+  ASSERT_EQ("0123", std::string(c, 4));
+  ASSERT_EQ(4, stream.tellg());
+
+  ASSERT_TRUE(stream.seekg(-2, std::ios_base::end));
+  ASSERT_EQ(8, stream.tellg());
+  ASSERT_EQ('8', stream.get());
+
+  ASSERT_TRUE(stream.seekg(1, std::ios_base::beg));
+  ASSERT_TRUE(stream.seekg(2, std::ios_base::cur));
+  ASSERT_EQ('3', stream.get());
+
+  ASSERT_FALSE(stream.seekg(11, std::ios_base::beg));
+  stream.clear();
+
+  ASSERT_TRUE(stream.seekg(9));
+  ASSERT_EQ('9', stream.get());
+  ASSERT_EQ(std::char_traits<char>::eof(), stream.get());
+  ASSERT_TRUE(stream.eof());
+}
+
+
+TEST(PatternMatcher, Find)
+{
+  const std::string s = "abracadabra";
+  const char* start = s.c_str();
+  const char* end = start + s.size();
+
+  PatternMatcher a("abra");
+  ASSERT_EQ(start, a.Find(start, end));
+  ASSERT_EQ(start + 7, a.Find(start + 1, end));
+  ASSERT_TRUE(a.Find(start + 8, end) == NULL);
+  ASSERT_TRUE(a.IsAt(start + 7, end));
+  ASSERT_FALSE(a.IsAt(start + 8, end));
+
+  PatternMatcher b("cad");
+  ASSERT_EQ(start + 4, b.Find(start, end));
+  ASSERT_TRUE(b.Find(start, start + 6) == NULL);
+
+  PatternMatcher c("a");
+  ASSERT_EQ(start + 3, c.Find(start + 1, end));
+
+  ASSERT_THROW(PatternMatcher(""), Orthanc::OrthancException);
+}
+
+
+TEST(Multipart, Parse)
+{
+  // The boundary contains characters that are special in regular
+  // expressions, and the first part contains "\r\n\r\n"
+  const std::string boundary = "a+b(c)?";
+  const std::string body = ("preamble\r\n--" + boundary + "\r\n"
+                            "Content-Type: application/dicom\r\n\r\n"
+                            "hello\r\n\r\nworld\r\n--" + boundary + "\r\n"
+                            "Content-Length: 6\r\n\r\n"
+                            "--a+b(\r\n--" + boundary + "--\r\n");
+
+  std::vector<MultipartItem> items;
+  ParseMultipartBody(items, NULL, body.c_str(), body.size(), boundary);
+
+  ASSERT_EQ(2u, items.size());
+  ASSERT_EQ("application/dicom", items[0].contentType_);
+  ASSERT_EQ("hello\r\n\r\nworld", std::string(items[0].data_, items[0].size_));
+  ASSERT_EQ("application/octet-stream", items[1].contentType_);
+  ASSERT_EQ("--a+b(", std::string(items[1].data_, items[1].size_));
+
+  // Wrong Content-Length
+  const std::string bad = ("--" + boundary + "\r\nContent-Length: 5\r\n\r\n"
+                           "hello!\r\n--" + boundary + "--");
+  ASSERT_THROW(ParseMultipartBody(items, NULL, bad.c_str(), bad.size(), boundary),
+               Orthanc::OrthancException);
+
+  ParseMultipartBody(items, NULL, "nothing", 7, boundary);
+  ASSERT_EQ(0u, items.size());
+}
+
+
+TEST(Multipart, Benchmark)
+{
+  const std::string boundary = "0123456789abcdef";
+  const size_t countParts = 64;
+  const size_t partSize = 1024 * 1024;
+
+  // The parts are filled with fragments of the separator
+  std::string part;
+  part.reserve(partSize);
+  while (part.size() < partSize)
+  {
+    part += "\r\n--01234567\r\n\r\n";
+  }
+
+  std::string body;
+  for (size_t i = 0; i < countParts; i++)
+  {
+    body += "--" + boundary + "\r\nContent-Type: application/dicom\r\n\r\n" + part + "\r\n";
+  }
+  body += "--" + boundary + "--";
+
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  std::vector<MultipartItem> items;
+  ParseMultipartBody(items, NULL, body.c_str(), body.size(), boundary);
+
+  boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - start;
+
+  ASSERT_EQ(countParts, items.size());
+  for (size_t i = 0; i < countParts; i++)
+  {
+    ASSERT_EQ(part.size(), items[i].size_);
+  }
+
+  printf("Parsing a multipart body of %d MB: %d ms\n",
+         static_cast<int>(body.size() / (1024 * 1024)),
+         static_cast<int>(elapsed.total_milliseconds()));
+}
+
+
+namespace
+{
+  class SquareJob : public ParallelPipeline::IJob
+  {
+  private:
+    int  value_;
+
+  public:
+    explicit SquareJob(int value) :
+      value_(value)
+    {
+    }
+
+    virtual void Execute()
+    {
+      if (value_ < 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      // Make the first jobs last longer than the next ones
+      boost::this_thread::sleep(boost::posix_time::milliseconds(value_ < 5 ? 5 - value_ : 0));
+      value_ = value_ * value_;
+    }
+
+    int GetValue() const
+    {
+      return value_;
+    }
+  };
+}
+
+
+TEST(ParallelPipeline, Order)
+{
+  for (size_t threads = 0; threads <= 4; threads++)
+  {
+    ParallelPipeline pipeline(threads, 3);
+
+    for (int i = 0; i < 20; i++)
+    {
+      pipeline.Add(new SquareJob(i));
+    }
+
+    for (int i = 0; i < 20; i++)
+    {
+      std::auto_ptr<ParallelPipeline::IJob> job(pipeline.Dequeue());
+      ASSERT_TRUE(job.get() != NULL);
+      ASSERT_EQ(i * i, dynamic_cast<SquareJob&>(*job).GetValue());
+    }
+
+    ASSERT_TRUE(pipeline.Dequeue() == NULL);
+  }
+
+  {
+    ParallelPipeline pipeline(2, 2);
+    pipeline.Add(new SquareJob(2));
+    pipeline.Add(new SquareJob(-1));
+    pipeline.Add(new SquareJob(3));
+
+    std::auto_ptr<ParallelPipeline::IJob> job(pipeline.Dequeue());
+    ASSERT_EQ(4, dynamic_cast<SquareJob&>(*job).GetValue());
+    ASSERT_THROW(pipeline.Dequeue(), Orthanc::OrthancException);
+
+    job.reset(pipeline.Dequeue());
+    ASSERT_EQ(9, dynamic_cast<SquareJob&>(*job).GetValue());
+  }
+}
+
+
+TEST(WorkerPool, Order)
+{
+  WorkerPool& pool = WorkerPool::GetInstance();
+
+  for (size_t threads = 0; threads <= 4; threads += 2)
+  {
+    pool.Start(threads);
+
+    {
+      // Two interleaved batches share the same threads
+      WorkerPool::Batch batch1(pool, 3);
+      WorkerPool::Batch batch2(pool, 1);
+
+      for (int i = 0; i < 20; i++)
+      {
+        batch1.Add(new SquareJob(i));
+        batch2.Add(new SquareJob(i + 1));
+      }
+
+      for (int i = 0; i < 20; i++)
+      {
+        std::auto_ptr<WorkerPool::IJob> job(batch1.Dequeue());
+        ASSERT_TRUE(job.get() != NULL);
+        ASSERT_EQ(i * i, dynamic_cast<SquareJob&>(*job).GetValue());
+
+        job.reset(batch2.Dequeue());
+        ASSERT_TRUE(job.get() != NULL);
+        ASSERT_EQ((i + 1) * (i + 1), dynamic_cast<SquareJob&>(*job).GetValue());
+      }
+
+      ASSERT_TRUE(batch1.Dequeue() == NULL);
+      ASSERT_TRUE(batch2.Dequeue() == NULL);
+    }
+
+    {
+      WorkerPool::Batch batch(pool, 2);
+      batch.Add(new SquareJob(2));
+      batch.Add(new SquareJob(-1));
+      batch.Add(new SquareJob(3));
+      batch.Add(new SquareJob(4));
+
+      std::auto_ptr<WorkerPool::IJob> job(batch.Dequeue());
+      ASSERT_EQ(4, dynamic_cast<SquareJob&>(*job).GetValue());
+      ASSERT_THROW(batch.Dequeue(), Orthanc::OrthancException);
+
+      // The batch is destroyed while jobs are pending
+    }
+
+    pool.Stop();
+  }
+}
+
+
+TEST(MemoryBudget, Reservation)
+{
+  MemoryBudget budget(100);
+
+  {
+    MemoryBudget::Reservation a(budget, 60);
+    ASSERT_EQ(60u, budget.GetUsedSize());
+
+    {
+      MemoryBudget::Reservation b(budget, 40);
+      ASSERT_EQ(100u, budget.GetUsedSize());
+    }
+
+    ASSERT_EQ(60u, budget.GetUsedSize());
+  }
+
+  ASSERT_EQ(0u, budget.GetUsedSize());
+
+  {
+    // Larger than the budget, but granted as no other reservation is active
+    MemoryBudget::Reservation a(budget, 1000);
+    ASSERT_EQ(1000u, budget.GetUsedSize());
+  }
+
+  ASSERT_EQ(0u, budget.GetUsedSize());
+}
+
+
+TEST(Metrics, Histogram)
+{
+  static const double BOUNDS[] = { 1, 2, 4 };
+  MetricsHistogram h(BOUNDS, 3);
+  ASSERT_DOUBLE_EQ(0, h.EstimateQuantile(0.5));
+
+  for (int i = 0; i < 50; i++)
+  {
+    h.Add(0.5);
+    h.Add(1.5);
+  }
+
+  ASSERT_EQ(100u, h.GetCount());
+  ASSERT_DOUBLE_EQ(1, h.EstimateQuantile(0.5));
+  ASSERT_DOUBLE_EQ(1.9, h.EstimateQuantile(0.95));
+
+  h.Add(100);
+  ASSERT_DOUBLE_EQ(4, h.EstimateQuantile(1));
+
+  std::string s;
+  h.Format(s, "test", "a=\"b\"");
+  ASSERT_EQ("test_bucket{a=\"b\",le=\"1\"} 50\n"
+            "test_bucket{a=\"b\",le=\"2\"} 100\n"
+            "test_bucket{a=\"b\",le=\"4\"} 100\n"
+            "test_bucket{a=\"b\",le=\"+Inf\"} 101\n"
+            "test_sum{a=\"b\"} 200\n"
+            "test_count{a=\"b\"} 101\n", s);
+
+  ASSERT_EQ("/dicom-web/studies/*/series/*/bulk/*",
+            Metrics::GetRouteLabel("/dicom-web/studies/([^/]*)/series/([^/]*)/bulk/(.*)"));
+}
+
+
+TEST(Metrics, Routes)
+{
+  MetricsRoutes routes;
+  routes.Register("/dicom-web/instances");
+  routes.Register("/dicom-web/studies/([^/]*)/instances");
+  routes.Register("/dicom-web/studies/([^/]*)/series/([^/]*)/instances");
+  routes.Register("/dicom-web/servers/([^/]*)/stow");
+
+  OrthancPluginHttpRequest request;
+  memset(&request, 0, sizeof(request));
+
+  request.groupsCount = 0;
+  ASSERT_EQ("/dicom-web/instances", routes.GetLabel("/dicom-web/instances", &request));
+
+  request.groupsCount = 2;
+  ASSERT_EQ("/dicom-web/studies/*/series/*/instances",
+            routes.GetLabel("/dicom-web/studies/a/series/b/instances", &request));
+
+  // Two patterns with one group: The regular expressions are used
+  request.groupsCount = 1;
+  ASSERT_EQ("/dicom-web/studies/*/instances", routes.GetLabel("/dicom-web/studies/a/instances", &request));
+  ASSERT_EQ("/dicom-web/servers/*/stow", routes.GetLabel("/dicom-web/servers/a/stow", &request));
+}
+
+
+TEST(Rendering, Size)
+{
+  unsigned int w, h;
+  ComputeRenderedSize(w, h, 512, 256, 0, 0);   ASSERT_EQ(512u, w);  ASSERT_EQ(256u, h);
+  ComputeRenderedSize(w, h, 512, 256, 128, 128);   ASSERT_EQ(128u, w);  ASSERT_EQ(64u, h);
+  ComputeRenderedSize(w, h, 256, 512, 128, 128);   ASSERT_EQ(64u, w);  ASSERT_EQ(128u, h);
+  ComputeRenderedSize(w, h, 100, 100, 200, 50);   ASSERT_EQ(50u, w);  ASSERT_EQ(50u, h);
+  ComputeRenderedSize(w, h, 512, 256, 0, 64);   ASSERT_EQ(128u, w);  ASSERT_EQ(64u, h);
+  ComputeRenderedSize(w, h, 512, 256, 64, 0);   ASSERT_EQ(64u, w);  ASSERT_EQ(32u, h);
+  ComputeRenderedSize(w, h, 1000, 1, 10, 10);   ASSERT_EQ(10u, w);  ASSERT_EQ(1u, h);
+
+  RenderingParameters parameters;
+  ASSERT_FALSE(parameters.IsPng());
+  ASSERT_EQ(90u, parameters.GetQuality());
+  ASSERT_THROW(parameters.SetQuality(0), Orthanc::OrthancException);
+  ASSERT_THROW(parameters.SetQuality(101), Orthanc::OrthancException);
+  ASSERT_THROW(parameters.SetViewport(0, 0), Orthanc::OrthancException);
+  ASSERT_THROW(parameters.SetWindowing(100, 0), Orthanc::OrthancException);
+
+  std::string key = parameters.GetKey();
+  parameters.SetViewport(128, 128);
+  ASSERT_NE(key, parameters.GetKey());
+  key = parameters.GetKey();
+  parameters.SetWindowing(40, 400);
+  ASSERT_NE(key, parameters.GetKey());
+}
+
+
+TEST(Rendering, Resize)
+{
+  // 4x2 grayscale image with a pitch of 5 bytes
+  const uint8_t source[] = {
+    0, 10, 20, 30, 255,
+    40, 50, 60, 70, 255
+  };
+
+  std::vector<uint8_t> target;
+  ResizeImage(target, 2, 1, source, 4, 2, 5, 1);
+  ASSERT_EQ(2u, target.size());
+  ASSERT_EQ(25, target[0]);  // (0 + 10 + 40 + 50) / 4
+  ASSERT_EQ(45, target[1]);  // (20 + 30 + 60 + 70) / 4
+
+  ResizeImage(target, 8, 2, source, 4, 2, 5, 1);
+  ASSERT_EQ(16u, target.size());
+  ASSERT_EQ(0, target[0]);
+  ASSERT_EQ(0, target[1]);
+  ASSERT_EQ(10, target[2]);
+  ASSERT_EQ(70, target[15]);
+
+  // 2x1 RGB image, reduced to one pixel
+  const uint8_t rgb[] = { 10, 20, 30, 30, 40, 51 };
+  ResizeImage(target, 1, 1, rgb, 2, 1, 6, 3);
+  ASSERT_EQ(3u, target.size());
+  ASSERT_EQ(20, target[0]);
+  ASSERT_EQ(30, target[1]);
+  ASSERT_EQ(41, target[2]);  // Rounded
+}
+
+
+TEST(DicomWebWriter, Serialize)
+{
+  const gdcm::Dict& dictionary = gdcm::Global::GetInstance().GetDicts().GetPublicDict();
+
+  gdcm::DataSet dataset;
+
+  {
+    gdcm::DataElement element(gdcm::Tag(0x0008, 0x0060));
+    element.SetVR(gdcm::VR::CS);
+    element.SetByteValue("MR", 2);
+    dataset.Insert(element);
+  }
+
+  {
+    gdcm::DataElement element(gdcm::Tag(0x0010, 0x0010));
+    element.SetVR(gdcm::VR::PN);
+    element.SetByteValue("A\"B<&>", 6);
+    dataset.Insert(element);
+  }
+
+  {
+    gdcm::DataElement element(gdcm::Tag(0x7fe0, 0x0010));
+    element.SetVR(gdcm::VR::OB);
+    element.SetByteValue("\0\0", 2);
+    dataset.Insert(element);
+  }
+
+  std::string s;
+  OrthancPlugins::DicomWebWriter json(dictionary, false);
+  json.Write(s, "", dataset, false);
+  ASSERT_EQ("{\"00080060\":{\"Value\":[\"MR\"],\"vr\":\"CS\"},"
+            "\"00100010\":{\"Value\":[\"A\\\"B<&>\"],\"vr\":\"PN\"},"
+            "\"7FE00010\":{\"vr\":\"OB\"}}\n", s);
+
+  s.clear();
+  OrthancPlugins::DicomWebWriter xml(dictionary, true);
+  xml.Write(s, "", dataset, false);
+  ASSERT_EQ(0u, s.find("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<NativeDicomModel "));
+  ASSERT_NE(std::string::npos, s.find("  <DicomAttribute tag=\"00080060\" vr=\"CS\" keyword=\"Modality\">\n"
+                                      "    <Value number=\"1\">MR</Value>\n"
+                                      "  </DicomAttribute>\n"
+                                      "  <DicomAttribute tag=\"00100010\" vr=\"PN\" keyword=\"PatientName\">\n"
+                                      "    <Value number=\"1\">A\"B&lt;&amp;&gt;</Value>\n"
+                                      "  </DicomAttribute>\n"
+                                      "  <DicomAttribute tag=\"7FE00010\" vr=\"OB\" keyword=\"PixelData\" />\n"
+                                      "</NativeDicomModel>\n"));
+}
+
+
+TEST(HttpCompression, AcceptEncoding)
+{
+  typedef OrthancPlugins::HttpCompression  C;
+
+  ASSERT_EQ(C::Encoding_Identity, C::ParseAcceptEncoding(""));
+  ASSERT_EQ(C::Encoding_Identity, C::ParseAcceptEncoding("identity, br"));
+  ASSERT_EQ(C::Encoding_Gzip, C::ParseAcceptEncoding("gzip, deflate"));
+  ASSERT_EQ(C::Encoding_Gzip, C::ParseAcceptEncoding("deflate, GZIP"));
+  ASSERT_EQ(C::Encoding_Gzip, C::ParseAcceptEncoding("*"));
+  ASSERT_EQ(C::Encoding_Deflate, C::ParseAcceptEncoding("deflate"));
+  ASSERT_EQ(C::Encoding_Deflate, C::ParseAcceptEncoding("gzip;q=0.5, deflate"));
+  ASSERT_EQ(C::Encoding_Deflate, C::ParseAcceptEncoding("gzip ; q=0, deflate;q=0.1"));
+  ASSERT_EQ(C::Encoding_Identity, C::ParseAcceptEncoding("gzip;q=0, deflate;q=0"));
+}
+
+
+TEST(DictionaryTable, Lookup)
+{
+  using namespace OrthancPlugins;
+
+  const gdcm::Dict& dictionary = gdcm::Global::GetInstance().GetDicts().GetPublicDict();
+
+  const gdcm::Tag tags[] = {
+    gdcm::Tag(0x0010, 0x0010),  // PatientName
+    gdcm::Tag(0x0008, 0x1110),  // ReferencedStudySequence
+    gdcm::Tag(0x0008, 0x1190),  // RetrieveURL
+    gdcm::Tag(0x7fe0, 0x0010),  // PixelData
+    gdcm::Tag(0x0009, 0x1001)   // Private tag
+  };
+
+  const size_t count = sizeof(tags) / sizeof(gdcm::Tag);
+
+  // Results that are directly obtained from GDCM
+  std::vector<std::string> vr, keyword;
+  std::vector<bool> sequence;
+  for (size_t i = 0; i < count; i++)
+  {
+    bool isSequence;
+    vr.push_back(GetVRName(isSequence, dictionary, tags[i]));
+    sequence.push_back(isSequence);
+
+    const char* s = GetKeyword(dictionary, tags[i]);
+    keyword.push_back(s == NULL ? "" : s);
+  }
+
+  ASSERT_EQ("PN", vr[0]);
+  ASSERT_EQ("SQ", vr[1]);
+  ASSERT_TRUE(sequence[1]);
+  ASSERT_EQ("OB", vr[3]);
+  ASSERT_EQ("PatientName", keyword[0]);
+  ASSERT_EQ("RetrieveURL", keyword[2]);
+  ASSERT_EQ("", keyword[4]);
+
+  DictionaryTable& table = DictionaryTable::GetInstance();
+  table.Setup(dictionary);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    bool isSequence;
+    ASSERT_EQ(vr[i], GetVRName(isSequence, dictionary, tags[i]));
+    ASSERT_EQ(sequence[i], isSequence);
+
+    const char* s = GetKeyword(dictionary, tags[i]);
+    ASSERT_EQ(keyword[i], (s == NULL ? "" : s));
+  }
+
+  const DictionaryTable::Entry* entry = table.Lookup(dictionary, tags[0]);
+  ASSERT_TRUE(entry != NULL);
+  ASSERT_STREQ("00100010", entry->dicomWebKey_);
+  ASSERT_STREQ("0010,0010", entry->orthancKey_);
+  ASSERT_TRUE(table.Lookup(dictionary, tags[4]) == NULL);
+
+  gdcm::Tag tag;
+  ASSERT_TRUE(table.LookupKeyword(tag, dictionary, "StudyInstanceUID"));
+  ASSERT_EQ(gdcm::Tag(0x0020, 0x000d), tag);
+  ASSERT_FALSE(table.LookupKeyword(tag, dictionary, "Nope"));
+  ASSERT_EQ(gdcm::Tag(0x0010, 0x0010), ParseTag(dictionary, "PatientName"));
+
+  char key[10];
+  DictionaryTable::FormatOrthancKey(key, gdcm::Tag(0x7fe0, 0x0010));
+  ASSERT_STREQ("7fe0,0010", key);
+  ASSERT_EQ("7FE00010", FormatTag(gdcm::Tag(0x7fe0, 0x0010)));
+}
+
+
+TEST(FrameIndex, GroupFragments)
+{
+  const std::string zeros(40, '\0');
+
+  std::vector<size_t> first;
+  std::vector<uint32_t> table;
+  std::vector<const char*> data(4, zeros.c_str());
+  std::vector<size_t> sizes;
+  sizes.push_back(10);
+  sizes.push_back(20);
+  sizes.push_back(30);
+  sizes.push_back(40);
+
+  // Empty Basic Offset Table
+  ASSERT_TRUE(FrameIndex::GroupFragments(first, table, data, sizes, 1));
+  ASSERT_EQ(2u, first.size());
+  ASSERT_EQ(0u, first[0]);
+  ASSERT_EQ(4u, first[1]);
+
+  ASSERT_TRUE(FrameIndex::GroupFragments(first, table, data, sizes, 4));
+  ASSERT_EQ(5u, first.size());
+  ASSERT_EQ(2u, first[2]);
+  ASSERT_EQ(4u, first[4]);
+
+  ASSERT_FALSE(FrameIndex::GroupFragments(first, table, data, sizes, 2));
+  ASSERT_FALSE(FrameIndex::GroupFragments(first, table, data, sizes, 5));
+
+  // Two frames, made of fragments (0, 1) and (2, 3)
+  table.push_back(0);
+  table.push_back(8 + 10 + 8 + 20);
+  ASSERT_TRUE(FrameIndex::GroupFragments(first, table, data, sizes, 2));
+  ASSERT_EQ(3u, first.size());
+  ASSERT_EQ(0u, first[0]);
+  ASSERT_EQ(2u, first[1]);
+  ASSERT_EQ(4u, first[2]);
+
+  ASSERT_FALSE(FrameIndex::GroupFragments(first, table, data, sizes, 3));
+
+  // Offset that is not on an item boundary
+  table[1] = 8 + 10 + 4;
+  ASSERT_FALSE(FrameIndex::GroupFragments(first, table, data, sizes, 2));
+
+  // Offset after the last fragment
+  table[1] = 1000;
+  ASSERT_FALSE(FrameIndex::GroupFragments(first, table, data, sizes, 2));
+
+  // Empty table, frames delimited by the JPEG markers: Two frames,
+  // made of fragments (0, 1, 2) and (3)
+  const std::string start("\xff\xd8\x01\x02");
+  const std::string middle("\x03\xff\xd9\x04");
+  const std::string end("\x05\x06\xff\xd9");
+  const std::string padded("\x07\xff\xd9\x00");
+  data[0] = start.c_str();
+  data[1] = middle.c_str();
+  data[2] = padded.c_str();
+  data[3] = start.c_str();
+  sizes.assign(4, 4);
+  table.clear();
+
+  ASSERT_TRUE(FrameIndex::GroupFragments(first, table, data, sizes, 2));
+  ASSERT_EQ(3u, first.size());
+  ASSERT_EQ(0u, first[0]);
+  ASSERT_EQ(3u, first[1]);
+  ASSERT_EQ(4u, first[2]);
+
+  ASSERT_FALSE(FrameIndex::GroupFragments(first, table, data, sizes, 3));
+
+  // JPEG 2000 codestreams, made of fragments (0), (1, 2) and (3)
+  const std::string j2k("\xff\x4f\xff\x51");
+  data[0] = end.c_str();
+  data[1] = j2k.c_str();
+  data[2] = end.c_str();
+  data[3] = j2k.c_str();
+  ASSERT_TRUE(FrameIndex::GroupFragments(first, table, data, sizes, 3));
+  ASSERT_EQ(4u, first.size());
+  ASSERT_EQ(1u, first[1]);
+  ASSERT_EQ(3u, first[2]);
+}
+
+
+TEST(FrameIndex, Serialization)
+{
+  const std::string s = ("DICOMweb-frames-1\n"
+                         "1.2.840.10008.1.2.4.90\n"
+                         "100 10\n"
+                         "118 20 146 30\n");
+
+  FrameIndex index;
+  ASSERT_TRUE(index.Unserialize(s));
+  ASSERT_EQ("1.2.840.10008.1.2.4.90", index.GetTransferSyntax());
+  ASSERT_EQ(2u, index.GetFramesCount());
+
+  std::string dicom(200, '\0');
+  for (size_t i = 0; i < dicom.size(); i++)
+  {
+    dicom[i] = static_cast<char>(i);
+  }
+
+  const char* data = NULL;
+  size_t size = 0;
+  std::string buffer;
+  index.GetFrame(data, size, buffer, dicom.c_str(), dicom.size(), 0);
+  ASSERT_EQ(10u, size);
+  ASSERT_EQ(dicom.c_str() + 100, data);  // No copy
+
+  index.GetFrame(data, size, buffer, dicom.c_str(), dicom.size(), 1);
+  ASSERT_EQ(50u, size);
+  ASSERT_EQ(dicom.substr(118, 20) + dicom.substr(146, 30), std::string(data, size));
+
+  ASSERT_THROW(index.GetFrame(data, size, buffer, dicom.c_str(), dicom.size(), 2), Orthanc::OrthancException);
+  ASSERT_THROW(index.GetFrame(data, size, buffer, dicom.c_str(), 150, 1), Orthanc::OrthancException);
+
+  std::string t;
+  index.Serialize(t);
+  ASSERT_EQ(s, t);
+
+  ASSERT_FALSE(index.Unserialize("DICOMweb-frames-0\n1.2.840.10008.1.2\n0 10\n"));
+  ASSERT_FALSE(index.Unserialize("DICOMweb-frames-1\n1.2.840.10008.1.2\n0 10 4\n"));
+  ASSERT_FALSE(index.Unserialize("DICOMweb-frames-1\n1.2.840.10008.1.2\n\n"));
+  ASSERT_FALSE(index.Unserialize("DICOMweb-frames-1\n1.2.840.10008.1.2\n"));
+  ASSERT_EQ(0u, index.GetFramesCount());
+}
+
+
 int main(int argc, char **argv)
 {
   ::testing::InitGoogleTest(&argc, argv);